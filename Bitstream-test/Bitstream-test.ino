@@ -32,7 +32,7 @@ int y = 0;
 unsigned long errorCount = 0;
 
 
-void BitStreamHandler(unsigned long incomingBits)
+void BitStreamHandler(unsigned long incomingBits, byte bitCount)
 {
     //noInterrupts();   // disable interrupts here, but shouldn't affect next dcc pulse, since this will be right after one
     bits = incomingBits;
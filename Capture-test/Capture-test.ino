@@ -0,0 +1,66 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// Streams the DCC edge timestamps from the capture ISR over serial, in the CaptureEncoder format,
+// for decoding on a host with capture-decode. Nothing else is written to the port, so it can be
+// saved straight to a file, eg on Linux:
+//
+//    stty -F /dev/ttyACM0 500000 raw -echo
+//    cat /dev/ttyACM0 > capture.dcc
+//
+// The edges average under two bytes each, about 30 KB/s on a busy track, which needs the faster
+// baud rate. If the port can't keep up, the timestamp queue overruns and the capture marks the gap.
+
+
+#include "Bitstream.h"
+#include "CaptureEncoder.h"
+
+// global stuff
+BitStream bitStream;
+CaptureEncoder encoder;
+
+
+// encodes the timestamps from the queue, and writes them to the serial port
+struct SerialRecorder
+{
+    byte code[CaptureEncoder::MAX_CODE_SIZE];
+
+    void Timestamp(uint16_t Count) { Serial.write(code, encoder.Edge(Count, code)); }
+    void Overrun() { Serial.write(code, encoder.Gap(code)); }
+};
+
+SerialRecorder recorder;
+
+
+void setup()
+{
+    Serial.begin(500000);
+
+    byte header[CaptureEncoder::HEADER_SIZE];
+    Serial.write(header, encoder.Header(header));
+
+    bitStream.Resume();
+}
+
+
+void loop()
+{
+    bitStream.RecordTimestamps(recorder);
+}
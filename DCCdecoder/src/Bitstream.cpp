@@ -19,15 +19,35 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "Bitstream.h"
+#include "TableGen.h"
+#include "Profiler.h"
+
+
+// the capture interrupt handlers
+PROFILE_PROBE(profileCapture, "capture");
+
 
 // define/initialize static vars
-boolean BitStream::lastPinState = 0;
-SimpleQueue BitStream::simpleQueue;
+BitStream *volatile BitStream::channels[BITSTREAM_CHANNELS];
+
+BitStream::BitStream(byte Channel) : channel(Channel)
+{
+	if (channel == 0)
+	{
+		pinMode(HWirqPin, INPUT_PULLUP);
+		pinMode(ICRPin, INPUT_PULLUP);
+	}
+	else if (channel == 1)
+	{
+		pinMode(HWirq2Pin, INPUT_PULLUP);
+	}
+}
+
 
-BitStream::BitStream()
+// make sure the ISR no longer refers to this object
+BitStream::~BitStream()
 {
-	pinMode(HWirqPin, INPUT_PULLUP);
-	pinMode(ICRPin, INPUT_PULLUP);
+	Suspend();
 }
 
 
@@ -45,18 +65,47 @@ void BitStream::SetErrorHandler(ErrorHandler Handler)
 }
 
 
+// set the number of bits to collect before performing the data full callback
+void BitStream::SetFlushBits(byte Bits)
+{
+	flushBits = (Bits < 1) ? 1 : ((Bits > maxBits) ? maxBits : Bits);
+}
+
+
+// check if another bitstream is at the same point in decoding. the queue and capture aren't compared.
+bool BitStream::SameState(const BitStream &Other) const
+{
+	return state == Other.state && lastInterruptCount == Other.lastInterruptCount &&
+		bitErrorCount == Other.bitErrorCount && maxBitErrors == Other.maxBitErrors &&
+		queueSize == Other.queueSize && flushBits == Other.flushBits && bitData == Other.bitData;
+}
+
+
+// get the timestamp queue statistics
+const SimpleQueue::Statistics &BitStream::GetQueueStatistics() const
+{
+	return simpleQueue.GetStatistics();
+}
+
+
+// clear the timestamp queue statistics
+void BitStream::ResetQueueStatistics()
+{
+	simpleQueue.ResetStatistics();
+}
+
+
 // suspend processing of interrupts
 void BitStream::Suspend()
 {
 	noInterrupts();
 
-	stateFunctionPointer = 0;
+	state = STATE_SUSPENDED;
+	DisableCapture();
 
-#if defined(TIMER1_ICR_0PS) || defined(TIMER1_ICR_8PS)
-	TIMSK1 = 0;                                             // disable input capture interrupt
-#else
-	detachInterrupt(digitalPinToInterrupt(HWirqPin));   // disable the h/w interrupt
-#endif
+	// remove this object from its channel
+	if (channel < BITSTREAM_CHANNELS && Registered(channel) == this)
+		Register(channel, 0);
 
 	interrupts();
 }
@@ -70,50 +119,56 @@ void BitStream::Resume()
 	// initialize the outgoing queue
 	queueSize = 0;
 	bitData = 0;
+	flushBits = maxBits;
 
 	// set the startup state
 	simpleQueue.Reset();    // reset the queue of DCC timestamps
-	stateFunctionPointer = &BitStream::StateStartup;
+	state = STATE_STARTUP;
 
-#if defined(TIMER1_HW_0PS)
-	TCCR1A = 0;    // reset the registers initially
-	TCCR1B = 0;
-	TCCR1C = 0;
-	TCNT1 = 0;
-	TIMSK1 = 0;
-	TCCR1B |= (1 << 0);   // set CS10 bit for no prescaler (0.0625 us resolution, overflow every 4 ms)
-	attachInterrupt(digitalPinToInterrupt(HWirqPin), GetTimestamp, CHANGE);   // enable h/w interrupt
-#endif
-#if defined(TIMER1_HW_8PS)
-	TCCR1A = 0;    // reset the registers initially
-	TCCR1B = 0;
-	TCCR1C = 0;
-	TCNT1 = 0;
-	TIMSK1 = 0;
-	TCCR1B |= (1 << 1);   // set CS11 bit for 8 prescaler (0.5 us resolution, overflow every 32 ms)
-	attachInterrupt(digitalPinToInterrupt(HWirqPin), GetTimestamp, CHANGE);   // enable h/w interrupt
-#endif
-#if defined(TIMER1_ICR_0PS)
-	TCCR1A = 0;    // reset the registers initially
-	TCCR1B = 0;
+	// the timer is shared by the channels, leave it running if another channel is using it
+	if (!TimerInUse())
+		TimerSetup();
+
+	// register this object for its channel's ISR, and enable the capture
+	if (channel < BITSTREAM_CHANNELS)
+	{
+		Register(channel, this);
+		EnableCapture();
+	}
+
+	interrupts();
+}
+
+
+// check if another channel is using the timer
+bool BitStream::TimerInUse()
+{
+	for (byte i = 0; i < BITSTREAM_CHANNELS; i++)
+	{
+		BitStream *const bitStream = Registered(i);
+		if (bitStream && bitStream != this)
+			return true;
+	}
+	return false;
+}
+
+
+// configure the timer used for the timestamps
+void BitStream::TimerSetup()
+{
+	// timer1 is shared with the servo driver (see SharedServo), which uses the output compare
+	// interrupt. the count and the other interrupt enables are left alone, so its pulses carry on.
+#if defined(TIMER1_HW_0PS) || defined(TIMER1_ICR_0PS)
+	TCCR1A = 0;    // normal mode, counting freely
+	TCCR1B = (1 << 0);   // set CS10 bit for no prescaler (0.0625 us resolution, overflow every 4 ms), without stopping the count
 	TCCR1C = 0;
-	TCNT1 = 0;
-	TIMSK1 = 0;
-	TCCR1B |= (1 << 0);  // set CS10 bit for no prescaler (0.0625 us resolution, overflow every 4 ms)
-	TCCR1B |= (1 << 6);  // set input capture edge select bit for rising
-	TCCR1B |= (1 << 7);  // set input capture noise canceler
-	TIMSK1 |= (1 << 5);  // enable input capture interrupt
+	TIMSK1 &= ~(1 << 5);  // clear the input capture interrupt enable
 #endif
-#if defined(TIMER1_ICR_8PS)
-	TCCR1A = 0;    // reset the registers initially
-	TCCR1B = 0;
+#if defined(TIMER1_HW_8PS) || defined(TIMER1_ICR_8PS)
+	TCCR1A = 0;    // normal mode, counting freely
+	TCCR1B = (1 << 1);   // set CS11 bit for 8 prescaler (0.5 us resolution, overflow every 32 ms), without stopping the count
 	TCCR1C = 0;
-	TCNT1 = 0;
-	TIMSK1 = 0;
-	TCCR1B |= (1 << 1);   // set CS11 bit for 8 prescaler (0.5 us resolution, overflow every 32 ms)
-	TCCR1B |= (1 << 6);  // set input capture edge select bit for rising
-	TCCR1B |= (1 << 7);  // set input capture noise canceler
-	TIMSK1 |= (1 << 5);  // enable input capture interrupt
+	TIMSK1 &= ~(1 << 5);  // clear the input capture interrupt enable
 #endif
 #if defined(TIMER2_HW_8PS)
 	TCCR2A = 0;
@@ -121,7 +176,6 @@ void BitStream::Resume()
 	TCNT2 = 0;
 	TIMSK2 = 0;
 	TCCR2B |= (1 << 1);  	// set CS21 bit for 8 prescaler (0.5 us resolution, overflow every 127.5 us)
-	attachInterrupt(digitalPinToInterrupt(HWirqPin), GetTimestamp, CHANGE);   // enable h/w interrupt
 #endif
 #if defined(TIMER2_HW_32PS)
 	TCCR2A = 0;
@@ -130,184 +184,119 @@ void BitStream::Resume()
 	TIMSK2 = 0;
 	TCCR2B |= (1 << 0); // set CS20 and CS21 bits for 32 prescaler (2.0 us resolution, overflow every 0.5 ms)
 	TCCR2B |= (1 << 1);
-	attachInterrupt(digitalPinToInterrupt(HWirqPin), GetTimestamp, CHANGE);   // enable h/w interrupt
 #endif
 #if defined(TIMER_ARM_HW_8PS)
 	ArmTimerSetup();
-	attachInterrupt(digitalPinToInterrupt(HWirqPin), GetTimestamp, CHANGE);   // enable h/w interrupt
 #endif
-
-
-	interrupts();
 }
 
 
-// initialize state and get the value for the first half bit
-void BitStream::StateStartup()
+// enable the interrupt for this object's channel. channels above 1 have no hardware, and are
+// only fed through Capture.
+void BitStream::EnableCapture()
 {
-	// check for valid half bit and use it to initialize lastHalfBit
-	// this effectively ignores any initial bit errors during startup, etc.
-	if (isOne || isZero)
+#if defined(TIMER1_ICR_0PS) || defined(TIMER1_ICR_8PS)
+	if (channel == 0)
 	{
-		// initialize state vars
-		endOfBit = false;
-		bitErrorCount = 0;
-
-		// set half bit and begin loooking for transition
-		lastHalfBit = isOne;
-		stateFunctionPointer = &BitStream::StateSeek;
+		TCCR1B |= (1 << 6);  // set input capture edge select bit for rising
+		TCCR1B |= (1 << 7);  // set input capture noise canceler
+		TIMSK1 |= (1 << 5);  // enable input capture interrupt
+		return;
 	}
+#endif
+
+	if (channel == 0)
+		attachInterrupt(digitalPinToInterrupt(HWirqPin), GetTimestamp<0>, CHANGE);   // enable h/w interrupt
+	else if (channel == 1)
+		attachInterrupt(digitalPinToInterrupt(HWirq2Pin), GetTimestamp<1>, CHANGE);
 }
 
 
-// find the first 1/0 or 0/1 transition, after initializing lastHalfBit
-void BitStream::StateSeek()
+// disable the interrupt for this object's channel
+void BitStream::DisableCapture()
 {
-	// check for valid half bit
-	if (isOne || isZero)
-	{
-		// check for transition from previous to current half bits
-		if (isOne != lastHalfBit)
-		{
-			endOfBit = true;   // transitioned from 1 to 0 or vice versa, so the next half bit is the bit end
-			stateFunctionPointer = &BitStream::StateNormal;
-		}
-
-		// save the last half bit
-		lastHalfBit = isOne;
-	}
-	else
+#if defined(TIMER1_ICR_0PS) || defined(TIMER1_ICR_8PS)
+	if (channel == 0)
 	{
-		// error occurred looking for transition, go back to startup
-		stateFunctionPointer = &BitStream::StateStartup;
+		TIMSK1 &= ~(1 << 5);                                // disable input capture interrupt only
+		return;
 	}
+#endif
+
+	if (channel == 0)
+		detachInterrupt(digitalPinToInterrupt(HWirqPin));    // disable the h/w interrupt
+	else if (channel == 1)
+		detachInterrupt(digitalPinToInterrupt(HWirq2Pin));
 }
 
 
-// normal processing for half bits
-void BitStream::StateNormal()
+// classify a bucket of the period by the shortest period it contains
+constexpr byte BitStream::ClassifyHalfBit(uint16_t Bucket)
 {
-	// check for valid half bit
-	if (isOne || isZero)
-	{
-		// now we have validated we have a 1 or 0, so isOne represents our current half bit
-
-		// check if the current and previous half bits match
-		if (isOne == lastHalfBit)
-		{
-			if (endOfBit)             // is this the ending half bit?
-			{
-				QueuePut(isOne);      // add the bit to the queue
-				endOfBit = false;
-				bitErrorCount = 0;    // reset error count after full valid bit
-			}
-			else
-			{
-				endOfBit = true;      // this wasn't the ending half bit, so the next one will be
-			}
-		}
-		else
-		{
-			endOfBit = true;   // transitioned from 1 to 0 or vice versa, so the next half bit is the bit end
-		}
-
-		// save the last half bit
-		lastHalfBit = isOne;
-	}
-	else
-	{
-		HandleError();    // didn't get a valid 1 or 0, process the error
-	}
+	return ((Bucket << HALF_BIT_SHIFT) < timeOneMin) ? HALF_BIT_LOW :
+		((Bucket << HALF_BIT_SHIFT) <= timeOneMax) ? HALF_BIT_ONE :
+		((Bucket << HALF_BIT_SHIFT) < timeZeroMin) ? HALF_BIT_MID :
+		((Bucket << HALF_BIT_SHIFT) <= timeZeroMax) ? HALF_BIT_ZERO :
+		HALF_BIT_HIGH;
 }
 
 
-// handle errors that occur during normal processing
-void BitStream::HandleError()
+// combine the next state and action into a transition table entry
+constexpr byte BitStream::Entry(byte State, byte Action)
 {
-	// classify the error
-	byte errorNum = 0;
-	if (period < timeOneMin) errorNum = ERR_INVALID_HALF_BIT_LOW;
-	if ((period > timeOneMax) && (period < timeZeroMin)) errorNum = ERR_INVALID_HALF_BIT_MID;
-	if (period > timeZeroMax) errorNum = ERR_INVALID_HALF_BIT_HIGH;
-
-	// callback error handler
-	if (errorHandler)
-		errorHandler(errorNum);
-
-	bitErrorCount++;        // increment error count
-	if (bitErrorCount > maxBitErrors)
-	{
-		// exceeded max bit errors, go back to startup state
-		stateFunctionPointer = &BitStream::StateStartup;
-
-		// callback error handler
-		if (errorHandler)
-			errorHandler(ERR_SEQUENTIAL_ERROR_LIMIT);
-	}
+	return State | (Action << ACTION_SHIFT);
 }
 
 
-// process the queued DCC timestamps to see if they represent a one or a zero.
-void BitStream::ProcessTimestamps()
+// transition on a valid half bit
+constexpr byte BitStream::ValidTransition(byte State, byte HalfBit)
 {
-#ifdef _DEBUG
-	// generate debugging pulses on scope to monitor simpleQueue size.
-	for (int i = 0; i < simpleQueue.Size(); i++)
-	{
-		HW_DEBUG_PULSE_18();
-	}
-#endif // DEBUG
-
-	while (simpleQueue.Size() > 0)
-	{
-		// get the current timestamp to check
-		currentCount = simpleQueue.Get();
-
-		// get the period between the current and last timestamps
-		period = currentCount - lastInterruptCount;
+	// startup: initialize the last half bit and the error count, and begin looking for a transition
+	// seek: a transition from 1 to 0 or vice versa means the next half bit is the bit end, so we are synced
+	// normal: a matching pair of half bits at the bit end is a full bit, otherwise the next half bit is the end
+	return (State == STATE_SUSPENDED) ? Entry(STATE_SUSPENDED, ACTION_NONE) :
+		(State == STATE_STARTUP) ? Entry(STATE_SEEK | HalfBit, ACTION_RESET_ERRORS) :
+		((State & 0x01) != HalfBit) ? Entry(STATE_NORMAL | STATE_END_OF_BIT | HalfBit, ACTION_NONE) :
+		(State < STATE_NORMAL) ? Entry(STATE_SEEK | HalfBit, ACTION_NONE) :
+		(State & STATE_END_OF_BIT) ? Entry(STATE_NORMAL | HalfBit, ACTION_BIT_ZERO + HalfBit) :
+		Entry(STATE_NORMAL | STATE_END_OF_BIT | HalfBit, ACTION_NONE);
+}
 
-		// TODO: why doesn't ARM subtraction overflow work like AVR above
-		#if defined(TIMER_ARM_HW_8PS)
-		if (currentCount < lastInterruptCount)
-			period = currentCount + (0xFFFF - lastInterruptCount);   // make sure we get the right period on overflow on ARM
-		#endif
 
-		// does the period give a 1 or a 0?
-		isOne = (period >= timeOneMin && period <= timeOneMax);
-		isZero = (period >= timeZeroMin && period <= timeZeroMax);
+// transition on an invalid half bit
+constexpr byte BitStream::InvalidTransition(byte State)
+{
+	// errors before the bitstream is synced go back to startup, errors after are handled
+	return (State == STATE_SUSPENDED) ? Entry(STATE_SUSPENDED, ACTION_NONE) :
+		(State < STATE_NORMAL) ? Entry(STATE_STARTUP, ACTION_NONE) :
+		Entry(State, ACTION_ERROR);
+}
 
-		// perform the current state function
-		if (stateFunctionPointer)
-			(*this.*stateFunctionPointer)();
 
-		// save the time of the last interrupt
-		lastInterruptCount = currentCount;
-	}
+// transition table entry for an index of state * 8 + half bit class
+constexpr byte BitStream::Transition(byte Index)
+{
+	return ((Index & 0x07) > HALF_BIT_HIGH) ? Entry(Index >> 3, ACTION_NONE) :
+		((Index & 0x07) <= HALF_BIT_ONE) ? ValidTransition(Index >> 3, Index & 0x07) :
+		InvalidTransition(Index >> 3);
 }
 
 
-// add a bit to the queue, performing callback and reset if full
-void BitStream::QueuePut(boolean newBit)
-{
-	// method executes in ~2 us, unless we are at max queue size, which adds ~3us.
+// the tables are generated by the compiler and stored in flash
+const byte BitStream::halfBitTable[HALF_BIT_BUCKETS] PROGMEM = { TABLE_GEN_128(ClassifyHalfBit, 0) };
+const byte BitStream::transitionTable[64] PROGMEM = { TABLE_GEN_64(Transition, 0) };
 
-	// shift the previous bits left and add the new bit
-	bitData = (bitData << 1) + newBit;    // approx 1.5 us
 
-	// perform callback and reset if queue is full
-	// this adds about 3us when we hit it
-	queueSize++;
-	if (queueSize > maxBitIndex)
-	{
-		if (dataFullHandler)
-			dataFullHandler(bitData);
-		queueSize = 0;
-		bitData = 0;
-	}
+// process the queued DCC timestamps, with the bits and errors going to the event handlers
+void BitStream::ProcessTimestamps()
+{
+	CallbackSink sink = { dataFullHandler, errorHandler };
+	ProcessTimestamps(sink);
 }
 
 
 // get pulse timings using hardware interrupt
+template <byte Channel>
 void BitStream::GetTimestamp()    // static
 {
 	// get the timer count before we do anything else
@@ -322,32 +311,38 @@ void BitStream::GetTimestamp()    // static
 	//const unsigned int count = TC->COUNT.reg;
 	const unsigned int count = ((TcCount16*)TC3)->COUNT.reg;
 #endif
+	PROFILE_SCOPE(profileCapture);
 
 	// timestamp assignment complete ~3 us after DCC state change
 
+	// find the object registered for this channel
+	BitStream *const bitStream = Registered(Channel);
+	if (!bitStream) return;
+
 	// check pinstate for change (TODO: why are there spurious IRQs here?
 	#if !defined(TIMER_ARM_HW_8PS)
-	const boolean pinState = HW_IRQ_PORT();                 // this takes ~0.2 us
-	if (pinState == lastPinState) return;
-	lastPinState = pinState;
+	const boolean pinState = (Channel == 0) ? HW_IRQ_PORT() : HW_IRQ2_PORT();    // this takes ~0.2 us
+	if (pinState == bitStream->lastPinState) return;
+	bitStream->lastPinState = pinState;
 	#endif
 	
 	// add the timestamp to the queue
-	simpleQueue.Put(count);
+	bitStream->simpleQueue.Put(count);
 
 	// 2.5 microseconds, with pin state check, to add new timestamp to queue
 }
 
 
-// get pulse timings using input capture register
+// get pulse timings using input capture register, for channel 0
 // TODO: use portable ISR macro so we don't have to ifdef this for compilation on arm
 #if defined(TIMER1_ICR_0PS) || defined(TIMER1_ICR_8PS)
 ISR(TIMER1_CAPT_vect)        // static, global
 {
 	const unsigned int capture = ICR1;    // store the capture register before we do anything else
+	PROFILE_SCOPE(profileCapture);
 	TCCR1B ^= 0x40;                 // toggle the edge select bit,  (1<<6) = 0x40
 
-	BitStream::simpleQueue.Put(capture);      // add the value in the input capture register to the queue
+	BitStream::Capture(0, capture);      // add the value in the input capture register to the channel's queue
 }
 #endif
 
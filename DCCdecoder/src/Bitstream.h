@@ -37,9 +37,15 @@ is performed to provide the data.
 Example usage:
 
 	BitStream bitStream;                                // create the bitstream object
+	BitStream bitStream2{ 1 };                          // a second bitstream, on channel 1 (pin 3)
 	bitStream.Resume();                                 // start the bitstream capture
 	bitStream.Suspend();                                // stop the bitstream capture
 	bitStream.ProcessTimeStamps();					    // process any DCC timestamps in the queue
+	bitStream.ProcessTimestamps(sink);                  // or pass the bits and errors directly to a sink object
+	bitStream.ReplayTimestamp(count, sink);             // decode a recorded timer count, without the capture
+	bitStream.RecordTimestamps(recorder);               // pass the raw timer counts to a recorder instead
+	bitStream.SetFlushBits(10);                         // perform the next callback after 10 bits
+	bitStream.GetQueueStatistics().dropped;             // number of timestamps lost to queue overruns
 
 Details:
 
@@ -69,16 +75,74 @@ checking is performed on each half bit. If a half bit does not fall within the v
 bit errors, another callback is triggered and processing reverts to the startup state. The bit error
 count is reset after each complete bit.
 
+The timestamps are copied from the queue to a local buffer in bulk, a queue full at a time, and then
+processed from the buffer. This keeps the access to the shared queue short, and clears a backlog after
+a stall in the main loop in one tight loop.
+
+The timestamp queue drops new timestamps when it is full, rather than overwriting old ones. When this
+happens the missing edges break the pairing of half bits, so an error callback is made and processing
+reverts to the startup state to resync. The timestamps that were queued before the overrun are
+processed first, since the gap follows them. The bits held for the callback are then discarded and
+the flush size goes back to its maximum, so no bits from before the gap are joined to those after it.
+The packet builder the bits go to should start again from the preamble too (DCCdecoder does this).
+
+To keep the cost per timestamp low, both the half bit classification and the state machine are
+table driven, with the tables generated at compile time and stored in flash. The period is scaled
+down to a bucket of roughly 1 us (the shift depends on the timer selection), and the bucket indexes
+a table giving the half bit class: 0, 1, or an error below, between, or above the valid ranges.
+Each bucket is classified by the shortest period it contains, so the upper limits for a 0 and a 1
+are effectively extended by up to one bucket (less than 1 us with timer1, 1.3 us on ARM). The state
+and class then index a transition table, whose entry holds the next state and the action to take
+(none, reset the error count, output a 0 or 1, or handle an error). The normal state carries the
+last half bit and the end of bit flag in its low bits, so a single lookup replaces the separate
+state functions and flags.
+
 Suspend/Resume methods allow starting, stopping, or resetting the bitstream capture, depending
 on outside factors (for example, during times when the signal may be degraded, or when other higher
 priority processing needs to take place). The input capture or hardware interrupt is disabled when
-suspended, and enabled when resumed. The timer is configured in the Resume method, so that it can be
-used for other purposes (e.g. servo) when the bitstream capture is suspended.
+suspended, and enabled when resumed. The timer is configured in the Resume method. Timer1 is left
+running freely, and only the capture interrupt enable is changed, so the servo driver of the turnout
+libraries (SharedServo) can use its output compare interrupt at the same time, and the bitstream need
+not be suspended while the servos move.
 
 The output queue is an unsigned long, into which 32 bits are stored as they are received. The queue is
 shifted left each time a bit is added, so the bits are stored left to right in the order in which
 the are received. After 32 bits have been stored, a callback is triggered, and the queue is reset.
 
+For lower latency, the number of bits to collect before the callback can be reduced with
+SetFlushBits. The callback then receives the bits right aligned in the unsigned long, along with the
+number of bits. A packet builder can use this to have the bits delivered as soon as the end of a
+packet is possible, rather than waiting up to 32 bit times (3.7 to 6.4 ms) for the queue to fill.
+
+The bits and errors can also be passed to a sink object given to the template ProcessTimestamps, in
+place of the callbacks. The sink is any class with the methods BitsReady(unsigned long BitData, byte
+BitCount) and BitError(byte ErrorCode). Its type is a template parameter, so the calls are made
+directly, and the compiler can inline the next stage of processing into the timestamp loop rather
+than calling it through a function pointer for every block of bits. The callback version wraps the
+function pointers in a sink, so both versions share the same code.
+
+Each BitStream object has its own timestamp queue and state, so several may run at once, for example
+to decode two DCC inputs on one board. The interrupt service routines are shared, so each object is
+given a channel number, and the ISR for a channel finds its object in a small registration table.
+The object is registered for its channel by Resume, and removed by Suspend. Channel 0 uses the
+capture configured below (the input capture register, or the hardware interrupt on pin 2), and
+channel 1 the hardware interrupt on pin 3, timestamped from the same timer. The timer is only set up
+by Resume if no other channel is using it. A host build may define BITSTREAM_CHANNELS to have more
+channels, and deliver timestamps to them by calling Capture directly, as the ISRs do.
+
+Recorded timestamps (timer counts, as the ISRs store them) can be decoded offline with
+ReplayTimestamp, which runs a single timestamp through the state machine, bypassing the capture and
+the queue. This needs no channel or timer, so any number of BitStream objects may decode recordings
+at once, for example one per thread on a host. A suspended bitstream starts from the startup state,
+and finds the bit phase from the recording, just as it does from the signal after a Resume.
+ReplayOverrun marks a point in the recording where timestamps were lost, and resyncs as an overrun
+of the queue does. The recording itself can be made with RecordTimestamps, which drains the queue
+like ProcessTimestamps, but passes each timer count to a recorder object (with the method
+Timestamp(uint16_t Count), and Overrun() where timestamps were dropped) instead of decoding it.
+SameState compares the decoding state of two bitstreams (the state machine, the last timestamp, and
+the bits collected so far), so that a decoder started part way through a recording can be checked
+against one that has run from the start.
+
 */
 
 
@@ -97,6 +161,7 @@ the are received. After 32 bits have been stored, a callback is triggered, and t
 
 // defines for direct port access and hardware debugging pulses
 #define HW_IRQ_PORT() PIND & 0x04                                                       // direct access h/w port pin 2
+#define HW_IRQ2_PORT() PIND & 0x08                                                      // direct access h/w port pin 3
 
 // make sure pinmode is set to output for pins 18 and 19 to use these
 #define HW_DEBUG_PULSE_18() { PORTC = PORTC | (1 << 4); PORTC = PORTC & ~(1 << 4); }    // pulse pin 18
@@ -113,8 +178,14 @@ enum : byte
 	ERR_INVALID_HALF_BIT_MID = 3,
 	ERR_INVALID_HALF_BIT_HIGH = 4,
 	ERR_SEQUENTIAL_ERROR_LIMIT = 10,
+	ERR_QUEUE_OVERRUN = 11,
 };
 
+// number of bitstream channels, each with its own ISR. the hardware supports two.
+#if !defined(BITSTREAM_CHANNELS)
+#define BITSTREAM_CHANNELS 2
+#endif
+
 // set the timer/prescaler combination to use
 #if !defined(ADAFRUIT_METRO_M0_EXPRESS)
 //#define TIMER1_HW_0PS    // use timer1 hardware irq with no prescaler
@@ -151,36 +222,59 @@ enum : byte
 
 // TODO: convert these to enums, make sure data types are right
 // set clock scale factor based on prescaler (number of clock ticks per microsecond)
+// and the shift that scales a period to a bucket of the half bit classification table
 #if defined(TIMER1_HW_0PS) || defined(TIMER1_ICR_0PS)
 enum : uint16_t { CLOCK_SCALE_FACTOR = 16U };   // no prescaler at 16 Mhz gives a 0.0625 us interval
+enum : byte { HALF_BIT_SHIFT = 4 };             // 1 us buckets
 #endif
 
 #if defined(TIMER1_HW_8PS) || defined(TIMER1_ICR_8PS) || defined(TIMER2_HW_8PS)
 enum : uint16_t { CLOCK_SCALE_FACTOR = 2U };    // 8 prescaler at 16 Mhz gives a 0.5 us interval
+enum : byte { HALF_BIT_SHIFT = 1 };             // 1 us buckets
 #endif
 
 #if defined(TIMER2_HW_32PS)
 #define CLOCK_SCALE_FACTOR 0.5F  // 32 prescaler at 16 Mhz gives a 2.0 us interval
+enum : byte { HALF_BIT_SHIFT = 0 };             // 2 us buckets
 #endif
 
 #if defined(TIMER_ARM_HW_8PS)
 enum : uint16_t { CLOCK_SCALE_FACTOR = 6U };   // 8 prescaler at 48 MHz gives a 0.167 us interval
+enum : byte { HALF_BIT_SHIFT = 3 };            // 1.33 us buckets
+#endif
+
+// timer width and prescaler, which are recorded in captures of the timestamps (see CaptureEncoder)
+#if defined(TIMER1_HW_0PS) || defined(TIMER1_ICR_0PS)
+enum : byte { TIMER_BITS = 16, TIMER_PRESCALER = 1 };
+#endif
+#if defined(TIMER1_HW_8PS) || defined(TIMER1_ICR_8PS) || defined(TIMER_ARM_HW_8PS)
+enum : byte { TIMER_BITS = 16, TIMER_PRESCALER = 8 };
+#endif
+#if defined(TIMER2_HW_8PS)
+enum : byte { TIMER_BITS = 8, TIMER_PRESCALER = 8 };
+#endif
+#if defined(TIMER2_HW_32PS)
+enum : byte { TIMER_BITS = 8, TIMER_PRESCALER = 32 };
 #endif
 
 
 class BitStream
 {
 public:
-	typedef void(*DataFullHandler)(unsigned long BitData);
+	typedef void(*DataFullHandler)(unsigned long BitData, byte BitCount);
 	typedef void(*ErrorHandler)(byte ErrorCode);
 
-	// create the bitstream object
-	BitStream();
+	// create the bitstream object, for a capture channel
+	explicit BitStream(byte Channel = 0);
+	~BitStream();
 
 	// configure the callback handlers
 	void SetDataFullHandler(DataFullHandler Handler);
 	void SetErrorHandler(ErrorHandler Handler);
 
+	// set the number of bits to collect before the data full callback (1 to 32)
+	void SetFlushBits(byte Bits);
+
 	// suspend or resume the bitstream capture
 	void Suspend();
 	void Resume();
@@ -188,41 +282,78 @@ public:
 	// process the raw timestamp queue
 	void ProcessTimestamps();
 
-	static SimpleQueue simpleQueue;         // queue for the DCC timestamps
+	// process the raw timestamp queue, passing the bits and errors to a sink object
+	template <typename Sink> void ProcessTimestamps(Sink &sink);
+
+	// process a recorded timestamp directly, without the capture or the queue
+	template <typename Sink> void ReplayTimestamp(uint16_t Count, Sink &sink);
+	template <typename Sink> void ReplayOverrun(Sink &sink);
+
+	// pass the raw timestamps from the queue to a recorder object, rather than decoding them
+	template <typename Recorder> void RecordTimestamps(Recorder &recorder);
+
+	// check if another bitstream is at the same point in decoding, so it will give the same bits from here
+	bool SameState(const BitStream &Other) const;
+
+	// timestamp queue statistics (overruns, max depth, depth histogram)
+	const SimpleQueue::Statistics &GetQueueStatistics() const;
+	void ResetQueueStatistics();
+
+	// queue a timestamp for a channel, called from the capture ISRs
+	static void Capture(byte Channel, uint16_t Count)
+	{
+		BitStream *const bitStream = Registered(Channel);
+		if (bitStream)
+			bitStream->simpleQueue.Put(Count);
+	}
 
 private:
 	// Hardware assignments
 	enum : byte
 	{
 		HWirqPin = 2,
+		HWirq2Pin = 3,          // channel 1
 		ICRPin = 8,
 	};
 
-	// state pointer and functions
-	typedef void(BitStream::*StateFunctionPointer)();
-	StateFunctionPointer stateFunctionPointer = 0;
-	void StateStartup();
-	void StateSeek();
-	void StateNormal();
-	void HandleError();
+	// the channel and its ISR registration
+	byte channel;                                       // capture channel for this object
+	static BitStream *volatile channels[BITSTREAM_CHANNELS];    // the registered object for each channel's ISR
+	SimpleQueue simpleQueue;                            // queue for the DCC timestamps
+	bool TimerInUse();
+
+	// read and update the registration table. on AVR the updates are made with interrupts off. on
+	// other targets (or a host build where threads stand in for the ISRs) atomic accesses are used.
+	static BitStream *Registered(byte Channel)
+	{
+#if defined(__AVR__)
+		return channels[Channel];
+#else
+		return __atomic_load_n(&channels[Channel], __ATOMIC_ACQUIRE);
+#endif
+	}
+
+	static void Register(byte Channel, BitStream *Object)
+	{
+#if defined(__AVR__)
+		channels[Channel] = Object;
+#else
+		__atomic_store_n(&channels[Channel], Object, __ATOMIC_RELEASE);
+#endif
+	}
+	void TimerSetup();
+	void EnableCapture();
+	void DisableCapture();
 
-	// declare these as byte for 8 bit timers, unsigned int for 16 bit timers
+	// declare this as byte for 8 bit timers, uint16_t for 16 bit timers, so that the period
+	// calculation wraps correctly on timer overflow regardless of the size of int
 	#if defined (TIMER1_HW_0PS) || defined(TIMER1_ICR_0PS) || defined(TIMER1_HW_8PS) || defined(TIMER1_ICR_8PS) || defined(TIMER_ARM_HW_8PS)
-	unsigned int currentCount = 0;          // timer count for the last pulse
-	unsigned int period = 0;                // period of the current pulse
-	unsigned int lastInterruptCount = 0;    // Timer1 count at the last interrupt
+	typedef uint16_t TimerCount;
 	#endif
 	#if defined(TIMER2_HW_8PS) || defined(TIMER2_HW_32PS)
-	byte currentCount = 0;          // timer count for the last pulse
-	byte period = 0;                // period of the current pulse
-	byte lastInterruptCount = 0;    // Timer1 count at the last interrupt
+	typedef byte TimerCount;
 	#endif
-
-		// bitstream capture vars
-	boolean isOne = false;                  // pulse is within the limits for a 1
-	boolean isZero = false;                 // pulse is within the limits for a 0
-	boolean lastHalfBit = 0;                // the last half bit captured
-	boolean endOfBit = false;               // second half-bit indicator
+	TimerCount lastInterruptCount = 0;      // timer count at the last interrupt
 
 	// DCC microsecond 0 & 1 timings
 	enum : uint16_t
@@ -233,24 +364,250 @@ private:
 		timeZeroMax = DCC_DEFAULT_ZERO_MAX * CLOCK_SCALE_FACTOR,
 	};
 
+	// half bit classes, the error classes match the error codes
+	enum : byte
+	{
+		HALF_BIT_ZERO = 0,
+		HALF_BIT_ONE = 1,
+		HALF_BIT_LOW = ERR_INVALID_HALF_BIT_LOW,
+		HALF_BIT_MID = ERR_INVALID_HALF_BIT_MID,
+		HALF_BIT_HIGH = ERR_INVALID_HALF_BIT_HIGH,
+		HALF_BIT_BUCKETS = 128,                 // size of the classification table
+	};
+
+	// states, the normal state holds the end of bit flag and the last half bit in the low bits
+	enum : byte
+	{
+		STATE_SUSPENDED = 0,
+		STATE_STARTUP = 1,
+		STATE_SEEK = 2,                         // seeking a transition, last half bit in bit 0
+		STATE_NORMAL = 4,                       // synced, last half bit in bit 0
+		STATE_END_OF_BIT = 2,                   // flag in the normal state for the second half bit
+		STATE_MASK = 0x07,
+	};
+
+	// actions in the transition table, stored above the next state
+	enum : byte
+	{
+		ACTION_NONE = 0,
+		ACTION_RESET_ERRORS = 1,
+		ACTION_BIT_ZERO = 2,
+		ACTION_BIT_ONE = 3,
+		ACTION_ERROR = 4,
+		ACTION_SHIFT = 3,
+	};
+
+	// state machine tables and their compile time generators
+	byte state = STATE_SUSPENDED;           // current state
+	static const byte halfBitTable[HALF_BIT_BUCKETS];
+	static const byte transitionTable[64];
+	static constexpr byte ClassifyHalfBit(uint16_t Bucket);
+	static constexpr byte Entry(byte State, byte Action);
+	static constexpr byte ValidTransition(byte State, byte HalfBit);
+	static constexpr byte InvalidTransition(byte State);
+	static constexpr byte Transition(byte Index);
+	template <typename Sink> void ProcessTimestamp(TimerCount Count, Sink &sink);
+	template <typename Sink> void HandleError(byte ErrorCode, Sink &sink);
+	template <typename Sink> void HandleOverrun(Sink &sink);
+
 	// Event handlers
 	DataFullHandler dataFullHandler = 0;    // handler for the data full event
 	ErrorHandler errorHandler = 0;          // handler for errors
 
+	// sink that passes the bits and errors to the event handlers
+	struct CallbackSink
+	{
+		DataFullHandler dataFullHandler;
+		ErrorHandler errorHandler;
+
+		void BitsReady(unsigned long BitData, byte BitCount) { if (dataFullHandler) dataFullHandler(BitData, BitCount); }
+		void BitError(byte ErrorCode) { if (errorHandler) errorHandler(ErrorCode); }
+	};
+
 	// Interrupt and error variables
 	byte bitErrorCount = 0;                 // current number of sequential bit errors
 	byte maxBitErrors = 5;                  // max number of bit errors before we revert to startup state
-	static boolean lastPinState;            // last state of the IRQ pin
+	boolean lastPinState = 0;               // last state of the IRQ pin
 
 	// Output queue structure
-	enum : byte { maxBitIndex = 31 };            // 32 bits total to store in unsigned long
+	enum : byte { maxBits = 32 };           // 32 bits total to store in unsigned long
 	byte queueSize = 0;                     // current size of the queue
+	byte flushBits = maxBits;               // queue size at which the callback is performed
 	unsigned long bitData = 0;              // stores the bitstream
 
 	// private methods
-	void QueuePut(boolean newBit);          // adds a bit to the queue
-	static void GetTimestamp();		        // get and queue the timestamp from a hw interrupt
+	template <typename Sink> void QueuePut(boolean newBit, Sink &sink);    // adds a bit to the queue
+	template <byte Channel> static void GetTimestamp();    // get and queue the timestamp from a hw interrupt
 	void ArmTimerSetup();
 };
 
+
+// handle errors that occur during normal processing
+template <typename Sink>
+void BitStream::HandleError(byte ErrorCode, Sink &sink)
+{
+	// callback error handler
+	sink.BitError(ErrorCode);
+
+	bitErrorCount++;        // increment error count
+	if (bitErrorCount > maxBitErrors)
+	{
+		// exceeded max bit errors, go back to startup state
+		state = STATE_STARTUP;
+
+		// callback error handler
+		sink.BitError(ERR_SEQUENTIAL_ERROR_LIMIT);
+	}
+}
+
+
+// handle timestamps that were dropped because the queue was full
+template <typename Sink>
+void BitStream::HandleOverrun(Sink &sink)
+{
+	// the missing edges leave us out of sync, go back to startup state
+	if (state != STATE_SUSPENDED)
+		state = STATE_STARTUP;
+
+	// drop the bits from before the gap, so they aren't joined to those after it
+	queueSize = 0;
+	bitData = 0;
+	flushBits = maxBits;
+
+	// callback error handler
+	sink.BitError(ERR_QUEUE_OVERRUN);
+}
+
+
+// process a single timestamp
+template <typename Sink>
+inline void BitStream::ProcessTimestamp(TimerCount Count, Sink &sink)
+{
+	// get the period since the last timestamp (wraps correctly on timer overflow)
+	const TimerCount period = Count - lastInterruptCount;
+	lastInterruptCount = Count;
+
+	// does the period give a 1 or a 0?
+	const TimerCount bucket = period >> HALF_BIT_SHIFT;
+	const byte halfBit = pgm_read_byte(&halfBitTable[(bucket < HALF_BIT_BUCKETS) ? bucket : HALF_BIT_BUCKETS - 1]);
+
+	// look up the next state and the action for this half bit
+	const byte entry = pgm_read_byte(&transitionTable[(state << 3) | halfBit]);
+	state = entry & STATE_MASK;
+
+	switch (entry >> ACTION_SHIFT)
+	{
+	case ACTION_NONE:
+		break;
+	case ACTION_RESET_ERRORS:
+		bitErrorCount = 0;
+		break;
+	case ACTION_BIT_ZERO:
+	case ACTION_BIT_ONE:
+		QueuePut(entry & (1 << ACTION_SHIFT), sink);    // the low bit of the action is the bit value
+		bitErrorCount = 0;                              // reset error count after full valid bit
+		break;
+	case ACTION_ERROR:
+		HandleError(halfBit, sink);                     // didn't get a valid 1 or 0, process the error
+		break;
+	}
+}
+
+
+// process the queued DCC timestamps to see if they represent a one or a zero.
+template <typename Sink>
+void BitStream::ProcessTimestamps(Sink &sink)
+{
+#ifdef _DEBUG
+	// generate debugging pulses on scope to monitor simpleQueue size.
+	for (int i = 0; i < simpleQueue.Size(); i++)
+	{
+		HW_DEBUG_PULSE_18();
+	}
+#endif // DEBUG
+
+	// drain the queue into a local buffer, a queue full at a time
+	uint16_t timestamps[SimpleQueue::queueSize];
+
+	// if timestamps were dropped, the gap follows the timestamps now in the queue
+	if (simpleQueue.Overrun())
+	{
+		const byte count = simpleQueue.Get(timestamps, SimpleQueue::queueSize);
+		for (byte i = 0; i < count; i++)
+			ProcessTimestamp(timestamps[i], sink);
+		HandleOverrun(sink);
+	}
+
+	// repeat until empty, since more timestamps may arrive while we process them
+	byte count;
+	while ((count = simpleQueue.Get(timestamps, SimpleQueue::queueSize)) > 0)
+	{
+		for (byte i = 0; i < count; i++)
+			ProcessTimestamp(timestamps[i], sink);
+	}
+}
+
+
+// process a recorded timestamp, starting from the startup state if suspended
+template <typename Sink>
+inline void BitStream::ReplayTimestamp(uint16_t Count, Sink &sink)
+{
+	if (state == STATE_SUSPENDED)
+		state = STATE_STARTUP;
+
+	ProcessTimestamp(Count, sink);
+}
+
+
+// process a point in a recording where timestamps were lost
+template <typename Sink>
+inline void BitStream::ReplayOverrun(Sink &sink)
+{
+	HandleOverrun(sink);
+}
+
+
+// pass the queued timestamps to a recorder, in the order they arrived
+template <typename Recorder>
+void BitStream::RecordTimestamps(Recorder &recorder)
+{
+	uint16_t timestamps[SimpleQueue::queueSize];
+
+	// if timestamps were dropped, the gap follows the timestamps now in the queue
+	if (simpleQueue.Overrun())
+	{
+		const byte count = simpleQueue.Get(timestamps, SimpleQueue::queueSize);
+		for (byte i = 0; i < count; i++)
+			recorder.Timestamp(timestamps[i]);
+		recorder.Overrun();
+	}
+
+	byte count;
+	while ((count = simpleQueue.Get(timestamps, SimpleQueue::queueSize)) > 0)
+	{
+		for (byte i = 0; i < count; i++)
+			recorder.Timestamp(timestamps[i]);
+	}
+}
+
+
+// add a bit to the queue, passing the bits to the sink and resetting if full
+template <typename Sink>
+inline void BitStream::QueuePut(boolean newBit, Sink &sink)
+{
+	// method executes in ~2 us, unless we are at max queue size, which adds ~3us.
+
+	// shift the previous bits left and add the new bit
+	bitData = (bitData << 1) + newBit;    // approx 1.5 us
+
+	// pass the bits on and reset if queue is full
+	queueSize++;
+	if (queueSize >= flushBits)
+	{
+		sink.BitsReady(bitData, queueSize);
+		queueSize = 0;
+		bitData = 0;
+	}
+}
+
 #endif
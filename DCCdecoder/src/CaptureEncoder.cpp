@@ -0,0 +1,104 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "CaptureEncoder.h"
+
+
+CaptureEncoder::CaptureEncoder()
+{
+}
+
+
+// write the header, and start a new stream
+byte CaptureEncoder::Header(byte *Buffer)
+{
+	const uint32_t timerHz = (uint32_t)(CLOCK_SCALE_FACTOR * 1000000UL);
+
+	Buffer[0] = 'D';
+	Buffer[1] = 'C';
+	Buffer[2] = 'C';
+	Buffer[3] = 'T';
+	Buffer[4] = VERSION;
+	Buffer[5] = TIMER_BITS;
+	Buffer[6] = TIMER_PRESCALER;
+	Buffer[7] = 0;
+	Buffer[8] = (byte)timerHz;
+	Buffer[9] = (byte)(timerHz >> 8);
+	Buffer[10] = (byte)(timerHz >> 16);
+	Buffer[11] = (byte)(timerHz >> 24);
+	Buffer[12] = lowByte(BLOCK_EDGES);
+	Buffer[13] = highByte(BLOCK_EDGES);
+	Buffer[14] = 0;
+	Buffer[15] = 0;
+
+	// the first edge starts a block
+	blockEdges = 0;
+	return HEADER_SIZE;
+}
+
+
+// encode an edge by the change in its period from the last edge
+byte CaptureEncoder::Edge(uint16_t Count, byte *Buffer)
+{
+	const uint16_t period = (TIMER_BITS == 8) ? (byte)(Count - lastCount) : (uint16_t)(Count - lastCount);
+	lastCount = Count;
+
+	// each block starts with the timer count, so it can be decoded without the blocks before it
+	if (blockEdges == 0)
+	{
+		blockEdges = BLOCK_EDGES - 1;
+		lastPeriod = 0;
+		Buffer[0] = CODE_COUNT;
+		Buffer[1] = lowByte(Count);
+		Buffer[2] = highByte(Count);
+		return 3;
+	}
+	blockEdges--;
+
+	// the change wraps the same way when it is added back to the period
+	const int16_t change = (int16_t)(period - lastPeriod);
+	lastPeriod = period;
+
+	if (change >= -64 && change < 64)
+	{
+		Buffer[0] = change & CODE_CHANGE_MAX;
+		return 1;
+	}
+
+	if (change >= -8192 && change < 8192)
+	{
+		Buffer[0] = CODE_CHANGE_14 | ((change >> 8) & 0x3F);
+		Buffer[1] = lowByte(change);
+		return 2;
+	}
+
+	Buffer[0] = CODE_PERIOD;
+	Buffer[1] = lowByte(period);
+	Buffer[2] = highByte(period);
+	return 3;
+}
+
+
+// mark a point where timestamps were lost
+byte CaptureEncoder::Gap(byte *Buffer)
+{
+	Buffer[0] = CODE_GAP;
+	return 1;
+}
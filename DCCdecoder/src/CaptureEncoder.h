@@ -0,0 +1,134 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+DCC capture encoder
+
+A class that encodes the DCC edge timestamps into a compact binary capture format, for streaming
+from the decoder and for analysis on a host.
+
+Summary:
+
+Each timestamp taken from the queue (the timer count at a signal edge) is encoded in one to three
+bytes, by the change in the period since the previous edge. Most edges take one byte, so a capture
+can be streamed over serial at the full edge rate without text formatting, and stored compactly.
+The same encoder is used by the host tools to write captures, so the format is defined in one place.
+
+Example usage:
+
+	CaptureEncoder encoder;                                 // create the encoder
+	byte header[CaptureEncoder::HEADER_SIZE];
+	Serial.write(header, encoder.Header(header));           // the header starts the stream
+	byte code[CaptureEncoder::MAX_CODE_SIZE];               // buffer for one code
+	Serial.write(code, encoder.Edge(count, code));          // encode the timer count of an edge
+	Serial.write(code, encoder.Gap(code));                  // mark a point where timestamps were lost
+
+Details:
+
+A capture starts with a 16 byte header, followed by the edge codes. All multi-byte values are little
+endian. The header is:
+
+	bytes 0-3     "DCCT"
+	byte 4        format version, 1
+	byte 5        timer width in bits (TIMER_BITS, 8 or 16)
+	byte 6        timer prescaler (TIMER_PRESCALER)
+	byte 7        reserved, 0
+	bytes 8-11    timer counts per second (CLOCK_SCALE_FACTOR million)
+	bytes 12-13   edges per block (BLOCK_EDGES)
+	bytes 14-15   reserved, 0
+
+The period of an edge is its timer count less the count of the edge before, wrapped to the width of
+the timer. The two half bits of a DCC bit have the same period, and runs of 1's or 0's repeat it, so
+the change in the period from one edge to the next is usually small. Each edge is one of these codes:
+
+	0x00-0x7F             period change of -64 to 63 counts (7 bit two's complement)
+	0x80-0xBF, 1 byte     period change of -8192 to 8191 counts (14 bit two's complement, high
+	                      6 bits in the first byte)
+	0xFE, 2 bytes         the timer count of the edge. the period change of the next edge is
+	                      from a period of 0.
+	0xFF, 2 bytes         the period of the edge
+
+And between edges:
+
+	0xFD                  timestamps were lost here (the queue overran)
+
+The codes 0xC0-0xFC are reserved. With the 16 MHz timer and no prescaler, a period change of up to
+4 us takes one byte, so on a clean signal only the changes between a 1 and a 0 take two.
+
+The edges are grouped into blocks of BLOCK_EDGES. The first edge of each block is given by its timer
+count, so decoding can start at any block without the edges before it. A host tool that keeps a
+table of the block offsets in the file can therefore go straight to any part of a long capture, or
+divide it between threads. The table is not part of the stream, since the decoder can't go back to
+write it; host tools append it to the file as an index (see the host simulator's CaptureFile).
+
+*/
+
+#ifndef _CAPTUREENCODER_h
+#define _CAPTUREENCODER_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "Bitstream.h"
+
+
+class CaptureEncoder
+{
+public:
+	// edge codes
+	enum : byte
+	{
+		CODE_CHANGE_MAX = 0x7F,     // 0x00-0x7F, 7 bit period change
+		CODE_CHANGE_14 = 0x80,      // 0x80-0xBF, 14 bit period change, with the next byte
+		CODE_GAP = 0xFD,            // timestamps were lost
+		CODE_COUNT = 0xFE,          // timer count follows, 2 bytes
+		CODE_PERIOD = 0xFF,         // period follows, 2 bytes
+	};
+
+	// format constants
+	enum : byte
+	{
+		VERSION = 1,
+		HEADER_SIZE = 16,
+		MAX_CODE_SIZE = 3,          // the longest edge code
+	};
+
+	enum : uint16_t { BLOCK_EDGES = 4096 };
+
+	CaptureEncoder();
+
+	// write the header to the buffer, and start a new stream. returns the number of bytes.
+	byte Header(byte *Buffer);
+
+	// encode the timer count of an edge, or a gap, into the buffer. returns the number of bytes.
+	byte Edge(uint16_t Count, byte *Buffer);
+	byte Gap(byte *Buffer);
+
+private:
+	uint16_t lastCount = 0;         // timer count of the last edge
+	uint16_t lastPeriod = 0;        // period of the last edge
+	uint16_t blockEdges = 0;        // edges left in the current block, 0 to start a new one
+};
+
+#endif
@@ -19,103 +19,101 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "DCCdecoder.h"
+#include "TableGen.h"
+
+
+// the stages of the pipeline: draining the queue, building packets from the bits, and decoding
+// packets. each includes the stages after it.
+PROFILE_PROBE(profileQueue, "queue");
+PROFILE_PROBE(profileBits, "bits");
+PROFILE_PROBE(profilePacket, "packet");
 
-// static pointer for callbacks
-DCCdecoder* DCCdecoder::currentInstance = 0;
 
 // Constructors
 
 DCCdecoder::DCCdecoder()
 {
-	// pointer for callback functions
-	currentInstance = this;
-	
-    // packet vars
-	for (byte i = 0; i < PACKET_LEN_MAX; i++)
-		packet[i] = 0;
-
-	// set callbacks for the bitstream capture
-	bitStream.SetDataFullHandler(WrapperBitStream);
-	bitStream.SetErrorHandler(WrapperBitStreamError);
-
-	// set callbacks for the packet builder
-	dccPacket.SetPacketCompleteHandler(WrapperDCCPacket);
-	dccPacket.SetPacketErrorHandler(WrapperDCCPacketError);
+	// the bitstream and packet builder pass their data through a pipeline sink, see ProcessTimeStamps
+
+	// address matching for the default settings
+	MapAddresses();
 }
 
-DCCdecoder::DCCdecoder(DecoderSettings settings) : DCCdecoder()
+DCCdecoder::DCCdecoder(DecoderSettings settings, byte channel) : bitStream(channel)
 {
-	decoderSettings = settings;
+	UpdateSettings(settings);
 }
 
 bool DCCdecoder::SetAddress(uint16_t address)
 {
 	decoderSettings.baseAddress = address;
+	MapAddresses();
+	return true;
+}
+
+// answer a range of consecutive output addresses, starting at the given address
+bool DCCdecoder::SetAddressRange(uint16_t address, byte count)
+{
+	if (count < 1 || count > MAX_ADDRESSES) return false;
+
+	decoderSettings.baseAddress = address;
+	decoderSettings.addressMask = (count == MAX_ADDRESSES) ? 0xFFFFFFFFUL : (1UL << count) - 1;
+	MapAddresses();
 	return true;
 }
 
 bool DCCdecoder::UpdateSettings(DecoderSettings settings)
 {
 	decoderSettings = settings;
+	MapAddresses();
 	return true;
 }
 
 
+// Address matching  ==========================================================================
+
+// work out the address map and board range from the settings, so the per packet checks are quick
+void DCCdecoder::MapAddresses()
+{
+	const uint32_t mask = decoderSettings.addressMask;
+	byte highest = 0;
+	for (byte i = 0; i < MAX_ADDRESSES; i++)
+		if (mask & (1UL << i)) highest = i;
+
+	for (byte i = 0; i < MAX_ADDRESSES / 8; i++)
+		addressMap[i] = (byte)(mask >> (i * 8));
+
+	// output addresses 1-4 are on board 0, 5-8 on board 1, and so on
+	firstBoard = ((int)decoderSettings.baseAddress - 1) >> 2;
+	lastBoard = ((int)decoderSettings.baseAddress + highest - 1) >> 2;
+}
+
+
+
 // Set callback handlers  ==========================================================
 
-void DCCdecoder::SetBaselineControlPacketHandler(BasicControlHandler handler) { basicControlHandler = handler; }
-void DCCdecoder::SetBasicAccessoryDecoderPacketHandler(BasicAccHandler handler) { basicAccHandler = handler; }
-void DCCdecoder::SetBasicAccessoryPomPacketHandler(AccPomHandler handler) { basicAccPomHandler = handler; }
-void DCCdecoder::SetLegacyAccessoryPomPacketHandler(AccPomHandler handler) { legacyAccPomHandler = handler; }
-void DCCdecoder::SetExtendedAccessoryDecoderPacketHandler(ExtendedAccHandler handler) { extendedAccHandler = handler; }
-void DCCdecoder::SetExtendedAccessoryPomPacketHandler(AccPomHandler handler) { extAccPomHandler = handler; }
-void DCCdecoder::SetIdlePacketHandler(IdleResetHandler handler) { idleHandler = handler; }
-void DCCdecoder::SetResetPacketHandler(IdleResetHandler handler) { resetHandler = handler; }
+void DCCdecoder::SetBaselineControlPacketHandler(BasicControlHandler handler) { callbacks.basicControlHandler = handler; }
+void DCCdecoder::SetBasicAccessoryDecoderPacketHandler(BasicAccHandler handler) { callbacks.basicAccHandler = handler; }
+void DCCdecoder::SetBasicAccessoryPomPacketHandler(AccPomHandler handler) { callbacks.basicAccPomHandler = handler; }
+void DCCdecoder::SetLegacyAccessoryPomPacketHandler(AccPomHandler handler) { callbacks.legacyAccPomHandler = handler; }
+void DCCdecoder::SetExtendedAccessoryDecoderPacketHandler(ExtendedAccHandler handler) { callbacks.extendedAccHandler = handler; }
+void DCCdecoder::SetExtendedAccessoryPomPacketHandler(AccPomHandler handler) { callbacks.extAccPomHandler = handler; }
+void DCCdecoder::SetIdlePacketHandler(IdleResetHandler handler) { callbacks.idleHandler = handler; }
+void DCCdecoder::SetResetPacketHandler(IdleResetHandler handler) { callbacks.resetHandler = handler; }
 
-void DCCdecoder::SetBitstreamErrorHandler(BitstreamErrorHandler handler) { bitstreamErrorHandler = handler; }
-void DCCdecoder::SetBitstreamMaxErrorHandler(BitstreamErrorHandler handler) { bitstreamMaxErrorHandler = handler; }
-void DCCdecoder::SetPacketErrorHandler(PacketErrorHandler handler) { packetErrorHandler = handler; }
-void DCCdecoder::SetPacketMaxErrorHandler(PacketErrorHandler handler) { packetMaxErrorHandler = handler; }
-void DCCdecoder::SetDecodingErrorHandler(DecodingErrorHandler handler) { decodingErrorHandler = handler; }
+void DCCdecoder::SetBitstreamErrorHandler(BitstreamErrorHandler handler) { callbacks.bitstreamErrorHandler = handler; }
+void DCCdecoder::SetBitstreamMaxErrorHandler(BitstreamErrorHandler handler) { callbacks.bitstreamMaxErrorHandler = handler; }
+void DCCdecoder::SetPacketErrorHandler(PacketErrorHandler handler) { callbacks.packetErrorHandler = handler; }
+void DCCdecoder::SetPacketMaxErrorHandler(PacketErrorHandler handler) { callbacks.packetMaxErrorHandler = handler; }
+void DCCdecoder::SetDecodingErrorHandler(DecodingErrorHandler handler) { callbacks.decodingErrorHandler = handler; }
 
 
 // Bitstream control  ==========================================================================
 
+// process the timestamps in the bitstream, with packets and errors going to the callbacks
 void DCCdecoder::ProcessTimeStamps()
 {
-	// process the timestamps in the bitstream
-	bitStream.ProcessTimestamps();
-
-	// check/reset error counts
-	const unsigned long currentMillis = millis();
-	if (currentMillis - lastMillis > 1000)
-	{
-		
-#ifdef _DEBUG
-		Serial.print("Bit Error Count: ");
-		Serial.print(bitErrorCount, DEC);
-		Serial.print("     Packet Error Count: ");
-		Serial.println(packetErrorCount, DEC);
-#endif
-
-		// check bit errors and raise event if necessary
-		if ((bitErrorCount > maxBitErrors) && bitstreamMaxErrorHandler) bitstreamMaxErrorHandler(lastBitError);
-
-		// if we see repeated packet errors, reset bitstream capture
-		if (packetErrorCount > maxPacketErrors)
-		{
-			// assume we lost sync on the bitstream, reset the bitstream capture
-			bitStream.Suspend();
-			bitStream.Resume();
-
-			// raise max packet error event
-			if (packetMaxErrorHandler) packetMaxErrorHandler(lastPacketError);
-		}
-
-		lastMillis = currentMillis;
-		bitErrorCount = 0;
-		packetErrorCount = 0;
-	}
+	ProcessTimeStamps(callbacks);
 }
 
 void DCCdecoder::SuspendBitstream()
@@ -125,270 +123,147 @@ void DCCdecoder::SuspendBitstream()
 
 void DCCdecoder::ResumeBitstream()
 {
-	// reset error counts
+	// reset error counts, the telemetry carries on
 	bitErrorCount = 0;
 	packetErrorCount = 0;
 	lastMillis = 0;
 
+	// start the packet builder afresh with the bitstream
 	bitStream.Resume();
+	dccPacket.Resync();
 }
 
-
-
-// Packet processing   =========================================================================
-
-// process an incoming packet
-// we assume this is a valid, checksummed packet, for example from DCCpacket class
-void DCCdecoder::ProcessPacket(byte *packetData, byte size)
+const SimpleQueue::Statistics &DCCdecoder::GetQueueStatistics() const
 {
-	// assign params to class vars
-    packetSize = size;
-    for (byte i=0; i<packetSize; i++)
-        packet[i] = packetData[i];
-
-    // Determine the basic packet type - loop through packet specs and check against current packet
-    byte i = 0;
-    bool packetIdentified = false;
-
-	while (i < numPacketTypes && !packetIdentified)
-	{
-		if ((packet[0] & packetSpec[i].specMask) == packetSpec[i].specAns)
-			packetIdentified = true;
-		i++;
-	}
-
-    // assign the packet type we identified
-    if (packetIdentified)
-    {
-        packetType = packetSpec[i - 1].packetType;
-    }
-    else    // exit with error if we can't identify the packet
-    {
-        if (decodingErrorHandler)
-            decodingErrorHandler(DCC_ERR_UNKNOWN_PACKET);
-        return;
-    }
-
-    // Process the packet depending on its type
-    switch (packetType)
-    {
-    case IDLEPKT:
-        ProcessIdlePacket();
-        break;
-    case BROADCAST:
-        ProcessBroadcastPacket();
-        break;
-    case LOCO_SHORT:
-        //ProcessShortLocoPacket();
-        break;
-    case LOCO_LONG:
-        //ProcessLongLocoPacket();
-        break;
-    case ACCBROADCAST:
-        ProcessAccBroadcastPacket();
-        break;
-    case ACCESSORY:
-        ProcessAccPacket();
-        break;
-    }
+	return bitStream.GetQueueStatistics();
 }
 
-
-
-// Process an idle packet
-void DCCdecoder::ProcessIdlePacket()
+void DCCdecoder::ResetQueueStatistics()
 {
-    if(idleHandler)
-        (idleHandler)(packetSize,packet);
+	bitStream.ResetQueueStatistics();
 }
 
-
-// Process a broadcast packet
-void DCCdecoder::ProcessBroadcastPacket()
+byte DCCdecoder::GetRepeatTableCount()
 {
-    //  reset packet
-    if (packet[1] == 0x00)
-    {
-        if(resetHandler)
-            (resetHandler)(packetSize,packet);
-    }
-
-    //  broadcast stop packet
-    if ((packet[1] & 0xCE) == 0x40)
-    {
-        // TODO: handle broadcast stop here
-    }
-
-    // general broadcast packet
-    // TODO: handle general broadcast packet here
+	return dccPacket.RepeatTableCount();
 }
 
 
-// Process a loco packet with a short address
-void DCCdecoder::ProcessShortLocoPacket() {}
-
-
-// Process a loco packet with a long address
-void DCCdecoder::ProcessLongLocoPacket() { }
-
+// Telemetry   ==========================================================================
 
-// Process an accessory broadcast packet
-void DCCdecoder::ProcessAccBroadcastPacket()
+// clear the counters, and the queue statistics the peak depth comes from
+void DCCdecoder::ResetTelemetry()
 {
-    // TODO: Do we want separate callbacks for these, as opposed to returning 0 address?
-
-    // basic acc packet
-    if ((packet[1] & 0xF0) == 0x80)
-    {
-        if (basicAccHandler)
-            basicAccHandler(0, 0, (packet[1] & 0x08)>>3, (packet[1] & 0x01));
-        return;
-    }
-
-    // extended acc packet
-    if ((packet[1] & 0xFF) == 0x07)
-    {
-        if (extendedAccHandler)
-            extendedAccHandler(0, 0, packet[2] & 0x1F);
-        return;
-    }
-
-    // we got here somehow with an incorrectly identified packet
-    if (decodingErrorHandler)
-        decodingErrorHandler(DCC_ERR_UNKNOWN_PACKET);
+	telemetry = Telemetry();
+	bitStream.ResetQueueStatistics();
 }
 
 
-// Process an accessory packet
-void DCCdecoder::ProcessAccPacket()
+// write the counters to Serial as one line of comma separated values, in the order of the Telemetry struct
+void DCCdecoder::PrintTelemetry()
 {
-    // combine packet bytes for comparison against packet specs
-	const uint16_t comp = ((uint16_t)packet[1] << 8) | packet[2];
-
-    // loop through packet specs and check against current packet to identify it
-    byte i = 0;
-    bool packetIdentified = false;
-	while (i < numAccPacketTypes && !packetIdentified)
+	const Count counters[] =
 	{
-		if ((comp & accPacketSpec[i].specMask) == accPacketSpec[i].specAns)
-			packetIdentified = true;
-		i++;
+		telemetry.bitErrorsLow, telemetry.bitErrorsMid, telemetry.bitErrorsHigh,
+		telemetry.packetsTooLong, telemetry.packetsTooShort, telemetry.checksumErrors, telemetry.historyOverflows,
+		telemetry.idlePackets, telemetry.broadcastPackets, telemetry.locoPackets, telemetry.accessoryPackets,
+		telemetry.pomPackets, telemetry.addressedPackets, telemetry.resyncs, telemetry.queuePeak,
+	};
+
+	Serial.print('T');
+	for (byte i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+	{
+		Serial.print(',');
+		Serial.print((unsigned long)counters[i], DEC);
 	}
-
-    // assign the packet type we identified
-    AccPacketType accType;
-    if (packetIdentified)
-    {
-        accType = accPacketSpec[i - 1].accPacketType;
-    }
-    else    // exit with error if we can't identify the packet
-    {
-        if (decodingErrorHandler)
-            decodingErrorHandler(DCC_ERR_UNKNOWN_PACKET);
-        return;
-    }
-
-    // Ged board and output addresses
-    int hiAddr = (~packet[1] & 0x70) << 2;
-    int lowAddr = packet[0] & 0x3F;
-    int boardAddress = (hiAddr | lowAddr) - 1;
-
-    int outAddr = (packet[1] & 0x06) >> 1;
-    int outputAddress = ((boardAddress << 2) | outAddr) + 1;
-    if (accType == LEGACYPOM) outputAddress = (boardAddress << 2) + 1;
-
-    // process the packet types
-    boolean isPacketForThisAddress = (outputAddress == decoderSettings.baseAddress);   // TODO: implememnt multiple address support
-    if (isPacketForThisAddress || decoderSettings.returnAllPackets)
-    {
-        switch (accType)
-        {
-        case BASIC:
-            if (basicAccHandler)
-                // Call BasicAccHandler                             Activate bit     last data bit of packet 2
-                basicAccHandler(boardAddress, outputAddress, (packet[1] & 0x08)>>3, (packet[1] & 0x01));
-            break;
-        case EXTENDED:
-            if (extendedAccHandler)
-                // Call ExtAccHandler                               data bits
-                extendedAccHandler(boardAddress, outputAddress, packet[2] & 0x1F);
-            break;
-        case BASICPOM:
-            if (basicAccPomHandler)
-            {
-                byte instType = (packet[2] & 0x0C)>>2;   // instruction type
-                int cv = ((packet[2] & 0x03) << 8) + packet[3] + 1;   // cv 10 bit address, add one for zero index
-                byte data = packet[4];
-
-                // Call Basic Acc Pom Handler
-                basicAccPomHandler(boardAddress, outputAddress, instType, cv, data);
-            }
-            break;
-        case EXTENDEDPOM:
-            if (extAccPomHandler)
-            {
-                byte instType = (packet[2] & 0x0C)>>2;   // instruction type
-                int cv = ((packet[2] & 0x03) << 8) + packet[3] + 1;   // cv 10 bit address, add one for zero index
-                byte data = packet[4];
-
-                // Call Ext Acc Pom Handler
-                extAccPomHandler(boardAddress, outputAddress, instType, cv, data);
-            }
-            break;
-        case LEGACYPOM:
-            if (legacyAccPomHandler)
-            {
-                byte instType = 0;   // no instruction type for legacy packets
-                int cv = ((packet[1] & 0x03) << 8) + packet[2] + 1;   // cv 10 bit address, add one for zero index
-                byte data = packet[3];
-
-                // Call Legacy Acc Pom Handler
-                legacyAccPomHandler(boardAddress, outputAddress, instType, cv, data);
-            }
-            break;
-
-        }    // end switch
-    }     // end if
+	Serial.println();
 }
 
 
-void DCCdecoder::BitStreamError(byte errorCode)
+
+// Packet type tables   =========================================================================
+
+// the packet type for a first packet byte
+constexpr byte DCCdecoder::PacketTypeOf(byte First)
 {
-	bitErrorCount++;
-	lastBitError = errorCode;
-	if (bitstreamErrorHandler) bitstreamErrorHandler(errorCode);
+	return (First == 0xFF) ? IDLEPKT :
+		((First & 0xC0) == 0xC0) ? LOCO_LONG :
+		(First == 0xBF) ? ACCBROADCAST :
+		((First & 0xC0) == 0x80) ? ACCESSORY :
+		(First == 0x00) ? BROADCAST :
+		LOCO_SHORT;
 }
 
-void DCCdecoder::PacketError(byte errorCode)
+
+// the accessory packet type for a table index, made up of the bits given by AccTableIndex
+constexpr byte DCCdecoder::AccPacketTypeOf(byte Index)
 {
-	packetErrorCount++;
-	lastPacketError = errorCode;
-	if (packetErrorHandler) packetErrorHandler(errorCode);
+	// the basic packet types have bit 7 of the second byte set. the extended packet types have bit 3
+	// of the second byte clear and bit 0 set, and are distinguished by the top bits of the third byte
+	return (Index & 0x80) ? (((Index & 0x0F) == 0x0E) ? BASICPOM : BASIC) :
+		((Index & 0x50) == 0x10) ? (((Index & 0x0F) == 0x0E) ? EXTENDEDPOM : ((Index & 0x0F) <= 0x01) ? EXTENDED : ACC_UNKNOWN) :
+		((Index & 0x60) == 0x60) ? LEGACYPOM :
+		ACC_UNKNOWN;
 }
 
 
-// wrappers for callbacks in bitstream and packet objects ===================================================
+// the tables are generated by the compiler and stored in flash
+const byte DCCdecoder::packetTypeTable[256] PROGMEM = { TABLE_GEN_256(PacketTypeOf, 0) };
+const byte DCCdecoder::accPacketTypeTable[256] PROGMEM = { TABLE_GEN_256(AccPacketTypeOf, 0) };
 
-// this is called from the bitstream capture when there are 32 bits to process.
-void DCCdecoder::WrapperBitStream(unsigned long incomingBits)
-{
-	currentInstance->dccPacket.ProcessIncomingBits(incomingBits);
-}
 
-void DCCdecoder::WrapperBitStreamError(byte errorCode)
-{
-	currentInstance->BitStreamError(errorCode);
-}
 
+// Packet processing   =========================================================================
 
-// this is called by the packet builder when a complete packet is ready, to kick off the actual decoding
-void DCCdecoder::WrapperDCCPacket(byte *packetData, byte size)
+// decide from the first bytes of an incoming packet whether it could be of interest, so that packets
+// for other decoders can be dropped by the packet builder before they are complete
+FilterResult DCCdecoder::FilterPacket(byte *packetData, byte byteCount, bool wantIdle)
 {
-	// kick off the packet processor
-	currentInstance->ProcessPacket(packetData, size);
-}
+	const byte type = pgm_read_byte(&packetTypeTable[packetData[0]]);
 
-void DCCdecoder::WrapperDCCPacketError(byte errorCode)
-{
-	currentInstance->PacketError(errorCode);
+	// count the packets on the track by type, the first time the filter sees each one
+	if (byteCount == 1)
+	{
+		switch (type)
+		{
+		case IDLEPKT: Tally(telemetry.idlePackets); break;
+		case BROADCAST: Tally(telemetry.broadcastPackets); break;
+		case LOCO_SHORT:
+		case LOCO_LONG: Tally(telemetry.locoPackets); break;
+		default: Tally(telemetry.accessoryPackets); break;
+		}
+	}
+
+	switch (type)
+	{
+	case IDLEPKT:
+		// idle packets are only needed if there is a handler for them
+		return wantIdle ? FILTER_ACCEPT : FILTER_REJECT;
+	case BROADCAST:
+	case ACCBROADCAST:
+		// broadcast packets are for everyone
+		return FILTER_ACCEPT;
+	case ACCESSORY:
+		// check the board address once we have the second byte
+		if (decoderSettings.returnAllPackets)
+			return FILTER_ACCEPT;
+		if (byteCount < 2)
+			return FILTER_MORE;
+		{
+			const int hiAddr = (~packetData[1] & 0x70) << 2;
+			const int boardAddress = (hiAddr | (packetData[0] & 0x3F)) - 1;
+			return (boardAddress >= firstBoard && boardAddress <= lastBoard) ? FILTER_ACCEPT : FILTER_REJECT;
+		}
+	default:
+		// loco packets, short or long address, aren't processed yet
+		return FILTER_REJECT;
+	}
 }
+
+
+// Process a loco packet with a short address
+void DCCdecoder::ProcessShortLocoPacket() {}
+
+
+// Process a loco packet with a long address
+void DCCdecoder::ProcessLongLocoPacket() { }
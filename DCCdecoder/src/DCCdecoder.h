@@ -37,21 +37,34 @@ Example Usage:
 	DCCdecoder::DecoderSettings settings =
 	{
 		1,      // base address
-		0,      // optional addresses
-		{0,0},
+		0x01,   // address mask, bit n answers base address + n
 		true,   // return all packets
 	};
 
 	DCCdecoder dcc;                        // create an instance of the DCCdecoder
 	DCCdecoder dcc { settings };
+	DCCdecoder dcc2 { settings, 1 };       // a second decoder, on bitstream channel 1
 
 	dcc.UpdateSettings(settings);          // configure the dcc decoder
+	dcc.SetAddressRange(9, 4);             // answer output addresses 9 to 12
+	dcc.GetQueueStatistics();              // get the timestamp queue overrun and depth statistics
+	dcc.GetRepeatTableCount();             // get the number of packets held for repeat filtering
+	dcc.GetTelemetry().checksumErrors;     // read the error and traffic counters
+	dcc.PrintTelemetry();                  // or write them all to Serial
+
+	struct MyHandler : DCCdecoder::Handlers          // or pass packets directly to a handler object
+	{
+		void BasicAccPacket(int boardAddress, int outputAddress, byte activate, byte data) { ... }
+	};
+	MyHandler handler;
+	dcc.ProcessTimeStamps(handler);
 
 Details:
 
 The DCCdecoder class provides the overall management of the bitstream and packet processors. The
 bitstream object handles the raw bitstream capture, and provides data to the packet processor in 
-intervals. The packet processor performs validity checks and provides assembled packets to the
+intervals. The intervals are set by the packet processor to end at the earliest point a packet could
+be complete, so that packets are decoded as soon as their end bit arrives. The packet processor performs validity checks and provides assembled packets to the
 deocder. The deocder then examines the packets to determine the packet type and its data. A decoder
 address may be configured and stored so that only relevant packets are returned in the callbacks.
 
@@ -60,17 +73,71 @@ the queue. Packet decoding begins when the ProcessPacket is called with packet d
 inspected to determine its type, after which specific methods are called to decode it accordingly.
 Each method gets the DCC address, packet data, and any other information from the packet, and then
 performs a callback to pass the decoded data back to the calling library. Packets to addresses other
-than the configured address are ignored by default. Broadcast packets are returned with a value of 0
+than the configured addresses are ignored by default. Broadcast packets are returned with a value of 0
 in the address field. Packet data is assumed to be a valid, checksummed packet, for example from the
 DCCpacket class.
 
+A decoder may answer up to 32 output addresses, for example to drive a yard ladder or a signal bridge
+from one board. The addresses are given as a base address and a 32 bit mask, where bit n of the mask
+selects output address base + n. SetAddressRange sets a mask of consecutive addresses. The mask is
+copied to a 4 byte map when the settings change, so checking an address is an offset from the base,
+a bounds check, and a single bit test, however many addresses are configured. The range of board
+addresses the mask covers is also worked out then, for the packet filter below.
+
+Most packets on a busy layout are loco and idle packets, or packets for other accessory decoders. To
+avoid paying for the checksum, repeat filtering, and decoding of each of them, the decoder installs a
+filter on the packet builder that looks at the first packet bytes as they arrive. Loco packets are
+rejected from the first byte, as are idle packets unless there is an idle handler. Accessory packets
+are rejected from the second byte unless they are for one of this decoder's board addresses (or all
+packets are to be returned). Broadcast packets are always accepted. The full address check is still made when
+the packet is decoded.
+
 Idle, accessory, extended accessory, and broadcast packet types are supported. The basic packet type
-is determined by masking bits of the packet and conparing to the expected patterns as defined in the
-NMRA spec. Packet specs are ordered beginning with the most common, except where the expected bit
-patterns require a certain sequence. Decoding of the packet data is handled specifically for each
-packet type. Accessory packet types are further categorized in a similar manner. Basic and extended
-packets are supported, as are basic program on main, extended program on main, and legacy program on
-main.
+is determined entirely by the first packet byte, so it is looked up in a 256 entry table indexed by
+that byte. Accessory packet types are further categorized by a second 256 entry table, indexed by the
+bits of the second and third bytes that distinguish them (see AccTableIndex). Both tables are
+generated at compile time from the bit patterns in the NMRA spec, and stored in flash, so the type is
+found in constant time whatever the packet. Decoding of the packet data is handled specifically for
+each packet type. Basic and extended packets are supported, as are basic program on main, extended
+program on main, and legacy program on main.
+
+Each decoder has its own bitstream, packet builder, and state, so several may run at once. A
+decoder for a second DCC input is created with the bitstream channel for that input (see BitStream).
+
+The decoder can be used in two ways. The ProcessTimeStamps() method performs callbacks through function
+pointers set by the Set...Handler methods. Alternatively, a handler object is passed to the template
+ProcessTimeStamps, and the decoder calls its methods directly. The handler derives from
+DCCdecoder::Handlers, which has an empty method for each packet type and error, and defines the ones
+it needs. A handler that wants idle packets also defines WantsIdlePackets to return true. The handler
+type is a template parameter, as is the type of the sink that joins the bitstream, the packet builder,
+and the decoder, so each stage calls the next directly instead of through a function pointer and a
+static instance pointer. The compiler can then inline the whole decode path, and the empty handlers
+compile away along with the code that decodes their packets. Packets are decoded in place in the
+packet builder's buffer, rather than being copied at each stage. The callback version is built on the
+same code, with a handler that calls the function pointers.
+
+The decoder keeps telemetry on the signal it receives, so that the signal quality can be compared
+across the decoders on a layout. The counters run from the last ResetTelemetry, and are incremented
+as the errors and packets pass through the decoder, at the cost of an increment each. They stop at
+their maximum rather than wrap. On AVR they are 16 bits, so the telemetry takes 29 bytes of RAM
+rather than 57, and the packet counts of a busy track fill in ten minutes or so, so reset them at
+the start of a measurement. Elsewhere they are 32 bits:
+
+	bit errors           half bits too short, between a 1 and a 0, and too long
+	packet errors        too long, too short, failed checksum, and repeat table overflows
+	packets by type      idle, broadcast, loco, and accessory packets on the track, counted by their
+	                     first byte when the packet filter first sees them, so they include repeats
+	                     and packets that go on to fail (the loco and most accessory packets are
+	                     rejected there, and never completed)
+	program on main      accessory POM packets decoded, for this decoder unless all are returned
+	addressed            accessory packets decoded for one of this decoder's addresses
+	resyncs              restarts of the bitstream, after too many bit errors in a row, a queue
+	                     overrun, or too many packet errors in a second
+	queue peak           the deepest the timestamp queue has been
+
+GetTelemetry gives the counters, and PrintTelemetry writes them to Serial as one line of comma
+separated values, in the order above (starting with "T,"), to be collected from several decoders.
+The queue peak is taken from the queue statistics, so ResetTelemetry also resets those.
 
 TODO: The library currently only implements placeholders for locomotive functionality.
 
@@ -79,6 +146,7 @@ TODO: The library currently only implements placeholders for locomotive function
 
 #include "Bitstream.h"
 #include "DCCpacket.h"
+#include "Profiler.h"
 
 
 #ifndef _DCCDECODER_h
@@ -108,23 +176,82 @@ public:
 	// Basic decoder setup
 	struct DecoderSettings
 	{
-		uint16_t baseAddress;
-		byte altAddresses;
-		uint16_t altAddress[2];    // TODO: implement multiple decoder addresses
+		uint16_t baseAddress;      // first output address
+		uint32_t addressMask;      // output addresses to answer, bit n for baseAddress + n
 		bool returnAllPackets;
 	};
 
+	// telemetry counts, kept small where RAM is short. they stop at their maximum rather than wrap.
+#if defined(ARDUINO_ARCH_AVR)
+	typedef uint16_t Count;
+#else
+	typedef uint32_t Count;
+#endif
+
+	// counts of the errors and packets since the last ResetTelemetry
+	struct Telemetry
+	{
+		Count bitErrorsLow;             // ERR_INVALID_HALF_BIT_LOW
+		Count bitErrorsMid;             // ERR_INVALID_HALF_BIT_MID
+		Count bitErrorsHigh;            // ERR_INVALID_HALF_BIT_HIGH
+		Count packetsTooLong;           // ERR_PACKET_TOO_LONG
+		Count packetsTooShort;          // ERR_PACKET_TOO_SHORT
+		Count checksumErrors;           // ERR_FAILED_CHECKSUM
+		Count historyOverflows;         // ERR_EXCEEDED_HISTORY_SIZE
+		Count idlePackets;              // packets on the track, by their first byte
+		Count broadcastPackets;
+		Count locoPackets;
+		Count accessoryPackets;
+		Count pomPackets;               // accessory program on main packets decoded
+		Count addressedPackets;         // accessory packets decoded for this decoder's addresses
+		Count resyncs;                  // bitstream restarts
+		byte queuePeak;                 // the deepest the timestamp queue has been
+	};
+
+	// packet and error handlers for the template ProcessTimeStamps. derive from this and define the
+	// handlers that are needed, the rest do nothing and compile away.
+	struct Handlers
+	{
+		bool WantsIdlePackets() { return false; }
+		void IdlePacket(byte byteCount, byte *packetBytes) {}
+		void ResetPacket(byte byteCount, byte *packetBytes) {}
+		void BasicAccPacket(int boardAddress, int outputAddress, byte activate, byte data) {}
+		void BasicAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data) {}
+		void ExtendedAccPacket(int boardAddress, int outputAddress, byte data) {}
+		void ExtendedAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data) {}
+		void LegacyAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data) {}
+
+		void BitstreamError(byte ErrorCode) {}
+		void BitstreamMaxError(byte ErrorCode) {}
+		void PacketError(byte ErrorCode) {}
+		void PacketMaxError(byte ErrorCode) {}
+		void DecodingError(byte ErrorCode) {}
+	};
+
 	DCCdecoder();
-	explicit DCCdecoder(DecoderSettings settings);
+	explicit DCCdecoder(DecoderSettings settings, byte channel = 0);
 	bool SetAddress(uint16_t address);
+	bool SetAddressRange(uint16_t address, byte count);
 	bool UpdateSettings(DecoderSettings settings);
+	bool IsDecoderAddress(int outputAddress);    // is an output address one of ours
 
 	// decoder and bitstream control
 	void ProcessTimeStamps();          // call this regularly for the bitstream object to check
 									   // and process dcc timestamps in the queue
+	template <typename Handler> void ProcessTimeStamps(Handler &handler);    // or this, with a handler object
 	void SuspendBitstream();
 	void ResumeBitstream();
 
+	// timestamp queue statistics, to check the main loop keeps up with the bitstream
+	const SimpleQueue::Statistics &GetQueueStatistics() const;
+	void ResetQueueStatistics();
+	byte GetRepeatTableCount();
+
+	// signal quality and traffic counters
+	const Telemetry &GetTelemetry() const { return telemetry; }
+	void ResetTelemetry();
+	void PrintTelemetry();
+
 	// set packet and other event handlers
 	void SetIdlePacketHandler(IdleResetHandler handler);
 	void SetResetPacketHandler(IdleResetHandler handler);
@@ -149,75 +276,50 @@ private:
 		DCC_ERR_UNKNOWN_PACKET = 101,    // DCC_Decoder results/errors
 		PACKET_LEN_MIN = 3,              // Min and max valid packet lengths
 		PACKET_LEN_MAX = 6,
+		MAX_ADDRESSES = 32,              // output addresses per decoder, one per bit of the address mask
 	};
 
 	DecoderSettings decoderSettings =
 	{
 		1,      // base address
-		0,      // optional addresses
-		{0,0},
+		0x01,   // address mask
 		false,   // return all packets
 	};
 
-	// DCC packet types and identifying specs
-	enum PacketType : byte
-	{
-		IDLEPKT,
-		BROADCAST,
-		LOCO_SHORT,
-		LOCO_LONG,
-		ACCBROADCAST,
-		ACCESSORY,
-	};
-
-	struct PacketSpec
-	{
-		PacketType packetType;
-		byte specMask;
-		byte specAns;
-	};
+	// address matching, worked out from the settings
+	byte addressMap[MAX_ADDRESSES / 8];    // the address mask, a byte at a time
+	int firstBoard = 0;                    // the range of board addresses with outputs in the mask
+	int lastBoard = 0;
+	void MapAddresses();
 
-	// Order these starting with the expected most common packet types, but note dependencies
-	const PacketSpec packetSpec[6] =
+	// DCC packet types, identified by the first packet byte
+	enum PacketType : byte
 	{
-		{ IDLEPKT,       0xFF, 0xFF  },     // 11111111
-		{ LOCO_LONG,     0xC0, 0xC0  },     // 11AAAAAA    must follow IDLEPKT
-		{ ACCBROADCAST,  0xFF, 0xBF  },     // 10111111
-		{ ACCESSORY,     0xC0, 0x80  },     // 10AAAAAA    must follow ACCBROADCAST
-		{ BROADCAST,     0xFF, 0x00  },     // 00000000
-		{ LOCO_SHORT,    0x80, 0x00  },     // 0AAAAAAA    must follow BROADCAST
+		IDLEPKT,         // 11111111
+		BROADCAST,       // 00000000
+		LOCO_SHORT,      // 0AAAAAAA
+		LOCO_LONG,       // 11AAAAAA
+		ACCBROADCAST,    // 10111111
+		ACCESSORY,       // 10AAAAAA
 	};
 
-	enum : byte { numPacketTypes = sizeof(packetSpec) / sizeof(PacketSpec) };
-
-	// accessory packet types and specs
+	// accessory packet types, identified by bits of the second and third packet bytes
 	enum AccPacketType : byte
 	{
-		BASIC,
-		BASICPOM,
-		EXTENDED,
-		EXTENDEDPOM,
-		LEGACYPOM,
+		BASIC,           // 1AAACDDD
+		BASICPOM,        // 1AAACDDD 1110CCVV
+		EXTENDED,        // 0AAA0AA1 000XXXXX
+		EXTENDEDPOM,     // 0AAA0AA1 1110CCVV
+		LEGACYPOM,       // 0AAA11VV
+		ACC_UNKNOWN,
 	};
 
-	struct AccPacketSpec
-	{
-		AccPacketType accPacketType;
-		uint16_t specMask;
-		uint16_t specAns;
-	};
-
-	// Order these starting with the expected most common packet types, but note dependencies
-	const AccPacketSpec accPacketSpec[5] =
-	{
-		{ BASICPOM,    (0x80U << 8) + 0xF0, (0x80U << 8) + 0xE0 },
-		{ BASIC,       (0x80U << 8) + 0x00, (0x80U << 8) + 0x00 },   // must follow BASICPOM
-		{ EXTENDEDPOM, (0x89U << 8) + 0xF0, (0x01U << 8) + 0xE0 },
-		{ EXTENDED,    (0x89U << 8) + 0xE0, (0x01U << 8) + 0x00 },   // must follow EXTENDEDPOM
-		{ LEGACYPOM,   (0x8CU << 8) + 0x00, (0x0CU << 8) + 0x00 },
-	};
-
-	enum : byte { numAccPacketTypes = sizeof(accPacketSpec) / sizeof(AccPacketSpec) };
+	// packet type tables and their compile time generators
+	static const byte packetTypeTable[256];
+	static const byte accPacketTypeTable[256];
+	static constexpr byte PacketTypeOf(byte First);
+	static constexpr byte AccPacketTypeOf(byte Index);
+	static byte AccTableIndex(byte Second, byte Third);
 
 	// DCC bitstream and packet processors
 	BitStream bitStream;
@@ -232,53 +334,363 @@ private:
 		maxPacketErrors = 10,     // number of packet errors before bitstream reset
 	};
 	unsigned long lastMillis = 0;         // for tracking refresh interval for error counts
+	Telemetry telemetry = {};
+
+	// add one to a telemetry count, stopping at its maximum rather than wrapping
+	static void Tally(Count &Counter) { if (Counter != (Count)~(Count)0) Counter++; }
+
+	// sink joining the bitstream, packet builder, and decoder for a handler type
+	template <typename Handler> struct Pipeline;
 
 	// process an incoming packet
-	void ProcessPacket(byte *packetData, byte packetSize);
+	FilterResult FilterPacket(byte *packetData, byte byteCount, bool wantIdle);
+	template <typename Handler> void ProcessPacket(byte *packet, byte packetSize, Handler &handler);
 
 	// packet vars
-	byte packet[PACKET_LEN_MAX];          // the packet bytes
-	byte packetSize = 0;                   // the current packet size
-	PacketType packetType = IDLEPKT;        // the packet type
 	byte lastBitError;
 	byte lastPacketError;
 
 	// Packet processors
-	void ProcessIdlePacket();
-	void ProcessBroadcastPacket();
+	template <typename Handler> void ProcessIdlePacket(byte *packet, byte packetSize, Handler &handler);
+	template <typename Handler> void ProcessBroadcastPacket(byte *packet, byte packetSize, Handler &handler);
 	void ProcessShortLocoPacket();
 	void ProcessLongLocoPacket();
-	void ProcessAccBroadcastPacket();
-	void ProcessAccPacket();
-
-	// Function pointers for the library callbacks
-	IdleResetHandler idleHandler = 0;
-	IdleResetHandler resetHandler = 0;
-	BasicAccHandler	basicAccHandler = 0;
-	AccPomHandler basicAccPomHandler = 0;
-	ExtendedAccHandler extendedAccHandler = 0;
-	AccPomHandler extAccPomHandler = 0;
-	AccPomHandler legacyAccPomHandler = 0;
-	BasicControlHandler basicControlHandler = 0;
-
-	BitstreamErrorHandler bitstreamErrorHandler = 0;
-	BitstreamErrorHandler bitstreamMaxErrorHandler = 0;
-	PacketErrorHandler packetErrorHandler = 0;
-	PacketErrorHandler packetMaxErrorHandler = 0;
-	DecodingErrorHandler decodingErrorHandler = 0;
+	template <typename Handler> void ProcessAccBroadcastPacket(byte *packet, Handler &handler);
+	template <typename Handler> void ProcessAccPacket(byte *packet, Handler &handler);
+
+	// handler that performs the library callbacks through function pointers
+	struct CallbackHandlers
+	{
+		IdleResetHandler idleHandler = 0;
+		IdleResetHandler resetHandler = 0;
+		BasicAccHandler	basicAccHandler = 0;
+		AccPomHandler basicAccPomHandler = 0;
+		ExtendedAccHandler extendedAccHandler = 0;
+		AccPomHandler extAccPomHandler = 0;
+		AccPomHandler legacyAccPomHandler = 0;
+		BasicControlHandler basicControlHandler = 0;
+
+		BitstreamErrorHandler bitstreamErrorHandler = 0;
+		BitstreamErrorHandler bitstreamMaxErrorHandler = 0;
+		PacketErrorHandler packetErrorHandler = 0;
+		PacketErrorHandler packetMaxErrorHandler = 0;
+		DecodingErrorHandler decodingErrorHandler = 0;
+
+		bool WantsIdlePackets() { return idleHandler; }
+		void IdlePacket(byte byteCount, byte *packetBytes) { if (idleHandler) idleHandler(byteCount, packetBytes); }
+		void ResetPacket(byte byteCount, byte *packetBytes) { if (resetHandler) resetHandler(byteCount, packetBytes); }
+		void BasicAccPacket(int boardAddress, int outputAddress, byte activate, byte data) { if (basicAccHandler) basicAccHandler(boardAddress, outputAddress, activate, data); }
+		void BasicAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data) { if (basicAccPomHandler) basicAccPomHandler(boardAddress, outputAddress, instructionType, cv, data); }
+		void ExtendedAccPacket(int boardAddress, int outputAddress, byte data) { if (extendedAccHandler) extendedAccHandler(boardAddress, outputAddress, data); }
+		void ExtendedAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data) { if (extAccPomHandler) extAccPomHandler(boardAddress, outputAddress, instructionType, cv, data); }
+		void LegacyAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data) { if (legacyAccPomHandler) legacyAccPomHandler(boardAddress, outputAddress, instructionType, cv, data); }
+
+		void BitstreamError(byte ErrorCode) { if (bitstreamErrorHandler) bitstreamErrorHandler(ErrorCode); }
+		void BitstreamMaxError(byte ErrorCode) { if (bitstreamMaxErrorHandler) bitstreamMaxErrorHandler(ErrorCode); }
+		void PacketError(byte ErrorCode) { if (packetErrorHandler) packetErrorHandler(ErrorCode); }
+		void PacketMaxError(byte ErrorCode) { if (packetMaxErrorHandler) packetMaxErrorHandler(ErrorCode); }
+		void DecodingError(byte ErrorCode) { if (decodingErrorHandler) decodingErrorHandler(ErrorCode); }
+	};
+
+	CallbackHandlers callbacks;
 
 	// error handling for bitstream and packet processing
-	void BitStreamError(byte errorCode);
-	void PacketError(byte errorCode);
+	template <typename Handler> void BitStreamError(byte errorCode, Handler &handler);
+	template <typename Handler> void PacketError(byte errorCode, Handler &handler);
+};
+
+
+// check if an output address is one of ours
+inline bool DCCdecoder::IsDecoderAddress(int outputAddress)
+{
+	const unsigned int offset = outputAddress - decoderSettings.baseAddress;    // wraps if below the base
+	return (offset < MAX_ADDRESSES) && (addressMap[offset >> 3] & (1 << (offset & 0x07)));
+}
+
+
+// the accessory table index for the second and third packet bytes: bits 7, 3, 2, and 0 of the second
+// byte, followed by the top four bits of the third byte
+inline byte DCCdecoder::AccTableIndex(byte Second, byte Third)
+{
+	return (Second & 0x80) | ((Second & 0x0C) << 3) | ((Second & 0x01) << 4) | (Third >> 4);
+}
 
-	// pointer to allow us to access member objects from callbacks
-	static DCCdecoder* currentInstance;
 
-	// callbacks for bitstream and packet builder
-	static void WrapperBitStream(unsigned long incomingBits);
-	static void WrapperBitStreamError(byte errorCode);
-	static void WrapperDCCPacket(byte *packetData, byte size);
-	static void WrapperDCCPacketError(byte errorCode);
+// probes timing the stages of the decoder, when profiling (see Profiler)
+PROFILE_EXTERN(profileQueue);
+PROFILE_EXTERN(profileBits);
+PROFILE_EXTERN(profilePacket);
+
+
+// the sink joining the stages of the decoder. the bitstream passes bits and errors to it, and the
+// packet builder passes packets, errors, and filter calls, all of which go on to the decoder and the handler.
+template <typename Handler>
+struct DCCdecoder::Pipeline
+{
+	DCCdecoder &decoder;
+	Handler &handler;
+
+	// pass bits to the packet builder, and request the next bits at the earliest point a packet
+	// could end, so packets are decoded as soon as they arrive
+	void BitsReady(unsigned long BitData, byte BitCount)
+	{
+		PROFILE_SCOPE(profileBits);
+		decoder.dccPacket.ProcessIncomingBits(BitData, BitCount, *this);
+		decoder.bitStream.SetFlushBits(decoder.dccPacket.BitsToNextTerminator());
+	}
+
+	void BitError(byte ErrorCode) { decoder.BitStreamError(ErrorCode, handler); }
+	void PacketReady(byte *Packet, byte PacketSize)
+	{
+		PROFILE_SCOPE(profilePacket);
+		decoder.ProcessPacket(Packet, PacketSize, handler);
+	}
+
+	void PacketError(byte ErrorCode) { decoder.PacketError(ErrorCode, handler); }
+	FilterResult PacketFilter(byte *Packet, byte ByteCount) { return decoder.FilterPacket(Packet, ByteCount, handler.WantsIdlePackets()); }
 };
 
+
+// process the timestamps in the bitstream, passing packets and errors to the handler
+template <typename Handler>
+void DCCdecoder::ProcessTimeStamps(Handler &handler)
+{
+	// process the timestamps in the bitstream
+	Pipeline<Handler> pipeline = { *this, handler };
+	PROFILE_START(profileQueue);
+	bitStream.ProcessTimestamps(pipeline);
+	PROFILE_STOP(profileQueue);
+
+	const byte depth = bitStream.GetQueueStatistics().maxDepth;
+	if (depth > telemetry.queuePeak)
+		telemetry.queuePeak = depth;
+
+	// check/reset error counts
+	const unsigned long currentMillis = millis();
+	if (currentMillis - lastMillis > 1000)
+	{
+		// check bit errors and raise event if necessary
+		if (bitErrorCount > maxBitErrors) handler.BitstreamMaxError(lastBitError);
+
+		// if we see repeated packet errors, reset bitstream capture
+		if (packetErrorCount > maxPacketErrors)
+		{
+			// assume we lost sync on the bitstream, reset the bitstream capture
+			bitStream.Suspend();
+			bitStream.Resume();
+			dccPacket.Resync();
+			Tally(telemetry.resyncs);
+
+			// raise max packet error event
+			handler.PacketMaxError(lastPacketError);
+		}
+
+		lastMillis = currentMillis;
+		bitErrorCount = 0;
+		packetErrorCount = 0;
+	}
+}
+
+
+// process an incoming packet, in place in the packet builder's buffer
+// we assume this is a valid, checksummed packet, for example from DCCpacket class
+template <typename Handler>
+inline void DCCdecoder::ProcessPacket(byte *packet, byte packetSize, Handler &handler)
+{
+	// Determine the basic packet type from the first byte, every value is a valid type, and
+	// process the packet depending on its type
+	switch (pgm_read_byte(&packetTypeTable[packet[0]]))
+	{
+	case IDLEPKT:
+		ProcessIdlePacket(packet, packetSize, handler);
+		break;
+	case BROADCAST:
+		ProcessBroadcastPacket(packet, packetSize, handler);
+		break;
+	case LOCO_SHORT:
+		//ProcessShortLocoPacket();
+		break;
+	case LOCO_LONG:
+		//ProcessLongLocoPacket();
+		break;
+	case ACCBROADCAST:
+		ProcessAccBroadcastPacket(packet, handler);
+		break;
+	case ACCESSORY:
+		ProcessAccPacket(packet, handler);
+		break;
+	}
+}
+
+
+// Process an idle packet
+template <typename Handler>
+inline void DCCdecoder::ProcessIdlePacket(byte *packet, byte packetSize, Handler &handler)
+{
+	handler.IdlePacket(packetSize, packet);
+}
+
+
+// Process a broadcast packet
+template <typename Handler>
+inline void DCCdecoder::ProcessBroadcastPacket(byte *packet, byte packetSize, Handler &handler)
+{
+	//  reset packet
+	if (packet[1] == 0x00)
+		handler.ResetPacket(packetSize, packet);
+
+	//  broadcast stop packet
+	if ((packet[1] & 0xCE) == 0x40)
+	{
+		// TODO: handle broadcast stop here
+	}
+
+	// general broadcast packet
+	// TODO: handle general broadcast packet here
+}
+
+
+// Process an accessory broadcast packet
+template <typename Handler>
+inline void DCCdecoder::ProcessAccBroadcastPacket(byte *packet, Handler &handler)
+{
+	// TODO: Do we want separate callbacks for these, as opposed to returning 0 address?
+
+	// basic acc packet
+	if ((packet[1] & 0xF0) == 0x80)
+	{
+		handler.BasicAccPacket(0, 0, (packet[1] & 0x08) >> 3, (packet[1] & 0x01));
+		return;
+	}
+
+	// extended acc packet
+	if ((packet[1] & 0xFF) == 0x07)
+	{
+		handler.ExtendedAccPacket(0, 0, packet[2] & 0x1F);
+		return;
+	}
+
+	// we got here somehow with an incorrectly identified packet
+	handler.DecodingError(DCC_ERR_UNKNOWN_PACKET);
+}
+
+
+// Process an accessory packet
+template <typename Handler>
+inline void DCCdecoder::ProcessAccPacket(byte *packet, Handler &handler)
+{
+	// look up the accessory packet type from the identifying bits of the packet
+	const AccPacketType accType = (AccPacketType)pgm_read_byte(&accPacketTypeTable[AccTableIndex(packet[1], packet[2])]);
+
+	// exit with error if we can't identify the packet
+	if (accType == ACC_UNKNOWN)
+	{
+		handler.DecodingError(DCC_ERR_UNKNOWN_PACKET);
+		return;
+	}
+
+	// Ged board and output addresses
+	int hiAddr = (~packet[1] & 0x70) << 2;
+	int lowAddr = packet[0] & 0x3F;
+	int boardAddress = (hiAddr | lowAddr) - 1;
+
+	int outAddr = (packet[1] & 0x06) >> 1;
+	int outputAddress = ((boardAddress << 2) | outAddr) + 1;
+	if (accType == LEGACYPOM) outputAddress = (boardAddress << 2) + 1;
+
+	// process the packet types
+	const bool addressed = IsDecoderAddress(outputAddress);
+	if (addressed)
+		Tally(telemetry.addressedPackets);
+	if (decoderSettings.returnAllPackets || addressed)
+	{
+		switch (accType)
+		{
+		case BASIC:
+			// Call BasicAccHandler                                    Activate bit     last data bit of packet 2
+			handler.BasicAccPacket(boardAddress, outputAddress, (packet[1] & 0x08) >> 3, (packet[1] & 0x01));
+			break;
+		case EXTENDED:
+			// Call ExtAccHandler                                      data bits
+			handler.ExtendedAccPacket(boardAddress, outputAddress, packet[2] & 0x1F);
+			break;
+		case BASICPOM:
+			{
+				Tally(telemetry.pomPackets);
+				byte instType = (packet[2] & 0x0C) >> 2;   // instruction type
+				int cv = ((packet[2] & 0x03) << 8) + packet[3] + 1;   // cv 10 bit address, add one for zero index
+				byte data = packet[4];
+
+				// Call Basic Acc Pom Handler
+				handler.BasicAccPomPacket(boardAddress, outputAddress, instType, cv, data);
+			}
+			break;
+		case EXTENDEDPOM:
+			{
+				Tally(telemetry.pomPackets);
+				byte instType = (packet[2] & 0x0C) >> 2;   // instruction type
+				int cv = ((packet[2] & 0x03) << 8) + packet[3] + 1;   // cv 10 bit address, add one for zero index
+				byte data = packet[4];
+
+				// Call Ext Acc Pom Handler
+				handler.ExtendedAccPomPacket(boardAddress, outputAddress, instType, cv, data);
+			}
+			break;
+		case LEGACYPOM:
+			{
+				Tally(telemetry.pomPackets);
+				byte instType = 0;   // no instruction type for legacy packets
+				int cv = ((packet[1] & 0x03) << 8) + packet[2] + 1;   // cv 10 bit address, add one for zero index
+				byte data = packet[3];
+
+				// Call Legacy Acc Pom Handler
+				handler.LegacyAccPomPacket(boardAddress, outputAddress, instType, cv, data);
+			}
+			break;
+		default:    // unknown packets have already been rejected
+			break;
+
+		}    // end switch
+	}     // end if
+}
+
+
+template <typename Handler>
+inline void DCCdecoder::BitStreamError(byte errorCode, Handler &handler)
+{
+	bitErrorCount++;
+	lastBitError = errorCode;
+
+	switch (errorCode)
+	{
+	case ERR_INVALID_HALF_BIT_LOW: Tally(telemetry.bitErrorsLow); break;
+	case ERR_INVALID_HALF_BIT_MID: Tally(telemetry.bitErrorsMid); break;
+	case ERR_INVALID_HALF_BIT_HIGH: Tally(telemetry.bitErrorsHigh); break;
+	case ERR_SEQUENTIAL_ERROR_LIMIT: Tally(telemetry.resyncs); break;
+	case ERR_QUEUE_OVERRUN:
+		Tally(telemetry.resyncs);
+		dccPacket.Resync();    // the bitstream has dropped its bits from before the gap, and so do we
+		break;
+	}
+
+	handler.BitstreamError(errorCode);
+}
+
+template <typename Handler>
+inline void DCCdecoder::PacketError(byte errorCode, Handler &handler)
+{
+	packetErrorCount++;
+	lastPacketError = errorCode;
+
+	switch (errorCode)
+	{
+	case ERR_PACKET_TOO_LONG: Tally(telemetry.packetsTooLong); break;
+	case ERR_PACKET_TOO_SHORT: Tally(telemetry.packetsTooShort); break;
+	case ERR_FAILED_CHECKSUM: Tally(telemetry.checksumErrors); break;
+	case ERR_EXCEEDED_HISTORY_SIZE: Tally(telemetry.historyOverflows); break;
+	}
+
+	handler.PacketError(errorCode);
+}
+
 #endif
@@ -19,13 +19,16 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "DCCpacket.h"
+#include "Profiler.h"
+
+
+PROFILE_PROBE(profileRepeat, "repeat");
 
 
 // set up the packet builder
 DCCpacket::DCCpacket()
 {
-    packetLog[0].packetSize = 0;  // initialize packet history
-    packetLog[0].packetTime = 0;
+    ClearRepeatTable();    // initialize packet history
 }
 
 
@@ -50,6 +53,12 @@ void DCCpacket::SetPacketErrorHandler(PacketErrorHandler Handler)
 }
 
 
+void DCCpacket::SetPacketFilterHandler(PacketFilterHandler Handler)
+{
+    packetFilterHandler = Handler;
+}
+
+
 void DCCpacket::EnableChecksum(bool Enable)
 {
     enableChecksum = Enable;
@@ -62,230 +71,169 @@ void DCCpacket::FilterRepeatPackets(bool Filter)
 }
 
 
-// process an incoming sequence of 32 bits, stored in an unsigned long
-void DCCpacket::ProcessIncomingBits(unsigned long incomingBits)
+// process an incoming sequence of up to 32 bits, with packets and errors going to the callback handlers
+void DCCpacket::ProcessIncomingBits(unsigned long incomingBits, byte numBits)
 {
-    // We get a new set of bits from the DCC bitstream about every 5ms.
-    // It takes approx 120-140 us to process a set of bits, excluding callbacks and repeat filtering,
-    // or 150-250 us with repeat filtering enabled.
+    CallbackSink sink = { packetCompleteHandler, packetErrorHandler, packetFilterHandler };
+    ProcessIncomingBits(incomingBits, numBits, sink);
+}
 
-    dataBits = incomingBits;
 
-    // process each bit in turn
-    for (unsigned long mask = 0x80000000; mask; mask >>=1)
-    {
-        // get the current bit
-        currentBit = (dataBits & mask) ? 1 : 0;
+// the number of bits until the earliest point at which a packet could end. when the bits are
+// delivered in blocks of this size, a packet is executed as soon as its end bit is received.
+byte DCCpacket::BitsToNextTerminator()
+{
+    // the end bit follows the byte at index PACKET_LEN_MIN, or the current byte if past that
+    const byte bytesToMin = (packetIndex < PACKET_LEN_MIN) ? PACKET_LEN_MIN - packetIndex : 0;
 
-        // process depending on the state we're in
-        switch (state)
-        {
-        case READPREAMBLE:
-            ReadPreamble();
-            break;
-        case READPACKET:
-            ReadPacket();
-            break;
-        }
-    }
+    // looking for a preamble, a packet needs at least the rest of the preamble, the start bit,
+    // and the minimum number of bytes, each followed by a separator or end bit
+    const byte bits = (state == READPREAMBLE) ?
+        ((preambleBitCount < PREAMBLE_MIN) ? PREAMBLE_MIN - preambleBitCount : 0) + 1 + (PACKET_LEN_MIN + 1) * 9 :
+        bitsLeft + 1 + bytesToMin * 9;
+
+    return (bits < 32) ? bits : 32;
 }
 
 
-// look for the packet preamble. this is a series of at least 10 1's, followed by a zero.
+// a zero has ended a run of 1's. if there were enough 1's, this is the preamble and the start bit.
 void DCCpacket::ReadPreamble()
 {
-    if (currentBit == 1)     // if it's a 1, bump our count of consecutive 1's
-    {
-        preambleBitCount++;
-    }
-    else                     // if it's a 0...
-    {
-        if (preambleBitCount >= PREAMBLE_MIN)   // we have the minimum number of 1's plus the trailing zero
-        {
-            state = READPACKET;                 // begin reading the packet
-            preambleBitCount = 0;
-        }
-        else
-        {
-            preambleBitCount = 0;       // we don't have a valid preamble, start over.
-        }
-    }
+    if (preambleBitCount >= PREAMBLE_MIN)   // we have the minimum number of 1's plus the trailing zero
+        state = READPACKET;                 // begin reading the packet
+
+    preambleBitCount = 0;                   // start the count over
 }
 
 
-// assemble the packet data from the incoming bits
-void DCCpacket::ReadPacket()
+// reset packet and counter data, and start looking for next preamble.
+void DCCpacket::Reset()
 {
-    // assemble eight bits, decrementing the packet mask each time
-    if (packetMask)
-    {
-        if (currentBit == 1)    // write the current bit
-            packet[packetIndex] |= packetMask;
-
-        packetMask >>= 1;      // advance the packet mask
-    }
+    // Reset packet data
+    packet[0] = packet[1] = packet[2] = packet[3] = packet[4] = packet[5] = 0;
+    packetIndex = 0;
+    bitsLeft = 8;
+    filterPending = true;
 
-    // after 8 bits, packetMask == 0
-    // zero bit here indicates more data, 1 indicates end of packet
-    else
-    {
-        if (currentBit == 1)
-        {
-            if (packetIndex >= PACKET_LEN_MIN && packetIndex <= PACKET_LEN_MAX)
-            {
-                // we have a valid length packet with a proper ending on a 1, go
-                // process it
-                Execute();
-            }
-            else   // packet ended on a 1 but is incorrect length
-            {
-                if (packetErrorHandler && (packetIndex < PACKET_LEN_MIN)) packetErrorHandler (ERR_PACKET_TOO_SHORT);
-                if (packetErrorHandler && (packetIndex > PACKET_LEN_MIN)) packetErrorHandler (ERR_PACKET_TOO_LONG);
-                Reset();
-            }
-        }
-        else   // zero bit indicates more data
-        {
-            // advance to the next packet and reset the mask
-            packetIndex++;
-            packetMask = 0x80;
-
-            // if packet index is too high, reset
-            if (packetIndex > PACKET_LEN_MAX)
-            {
-                if (packetErrorHandler)
-                    packetErrorHandler(ERR_PACKET_TOO_LONG);
-                Reset();
-            }
-        }
-    }
+    // start looking for preamble again
+    state = READPREAMBLE;
 }
 
 
-// verify the checksum of the completed packet, check for repeat packets,
-// and then perform the callback to process it
-void DCCpacket::Execute()
+// drop the packet being built after a gap in the bits, and look for the next preamble from scratch
+void DCCpacket::Resync()
 {
-    // initialize as true so we can just skip checksum if disabled
-    bool checksumOk = true;
+    Reset();
+    preambleBitCount = 0;
+}
 
-    // verify checksum if enabled
-    if (enableChecksum)
-    {
-        byte errorDectection = packet[0] ^ packet[1];             // initial xor of address and 1st instruction byte
-        for (int i = 2; i < packetIndex; i++) 
-            errorDectection ^= packet[i];                         // xor additional instruction bytes
-        checksumOk = (errorDectection == packet[packetIndex]);
-    }
 
-    // if we pass the checksum
-    if(checksumOk)
-    {
-        // if check for repeats is enabled, and it's a repeat packet, skip the callback
-        if (!(filterRepeatPackets && IsRepeatPacket()))
-        {
-            // execute callback for complete valid packet
-            if (packetCompleteHandler)
-                packetCompleteHandler(packet, packetIndex + 1);   // return the size of the packet, not the final index
-        }
-    }
-    else   // check sum error
-    {
-        if (packetErrorHandler)
-            packetErrorHandler(ERR_FAILED_CHECKSUM);
-    }
+// count the current entries in the repeat table
+byte DCCpacket::RepeatTableCount()
+{
+    const uint16_t currentTime = millis();
+    byte count = 0;
+    for (byte i = 0; i < REPEAT_TABLE_SIZE; i++)
+        if (repeatTable[i].packetSize && (uint16_t)(currentTime - repeatTable[i].packetTime) < filterInterval)
+            count++;
+    return count;
+}
 
-    // reset and start looking for preamble again.
-    Reset();
+
+// check if another packet builder is at the same point in building a packet. the repeat table isn't compared.
+bool DCCpacket::SameState(const DCCpacket &Other) const
+{
+    return state == Other.state && preambleBitCount == Other.preambleBitCount &&
+        packetIndex == Other.packetIndex && bitsLeft == Other.bitsLeft && filterPending == Other.filterPending &&
+        enableChecksum == Other.enableChecksum && filterRepeatPackets == Other.filterRepeatPackets &&
+        memcmp(packet, Other.packet, packetIndex + 1) == 0;
 }
 
 
-// reset packet and counter data, and start looking for next preamble.
-void DCCpacket::Reset()
+// hash the packet bytes to select a slot in the repeat table
+byte DCCpacket::PacketHash()
 {
-    // Reset packet data
-    packet[0] = packet[1] = packet[2] = packet[3] = packet[4] = packet[5] = 0;
-    packetIndex = 0;
-    packetMask = 0x80;
+    // multiplying by an odd constant carries each bit of the packet up into the high bits of the hash,
+    // so the high byte is used to pick the slot
+    uint16_t hash = 0;
+    for (byte i = 0; i <= packetIndex; i++)
+        hash = (hash ^ packet[i]) * 0x9E37;
+    return hash >> 8;
+}
 
-    // start looking for preamble again
-    state = READPREAMBLE;
+
+// clear the repeat table
+void DCCpacket::ClearRepeatTable()
+{
+    for (byte i = 0; i < REPEAT_TABLE_SIZE; i++)
+        repeatTable[i].packetSize = 0;
 }
 
 
 // check for repeat packets within a certain time interval. returns true if a match is found.
-// updating of the packet history removes packets that are outside the time interval, and ensures that
-// the most common packets are at the front of the list
-bool DCCpacket::IsRepeatPacket()
+// a fixed number of slots of the repeat table are searched, and expired entries are treated as free.
+// TableFull is set if the packet had to replace a current entry.
+bool DCCpacket::IsRepeatPacket(bool &TableFull)
 {
-    // 30-60 us to process this function
+    PROFILE_SCOPE(profileRepeat);
 
     const unsigned long currentMillis = millis();
-
-    // remove packets that have timed out and compact history
-    byte newEntryCount = 0;
-    byte oldEntryCount = 0;
-    while (packetLog[oldEntryCount].packetSize > 0)
+    const uint16_t currentTime = currentMillis;
+
+    // if it's been longer than the interval since the last packet, everything in the table has expired.
+    // this also keeps old entries from reappearing when the 16 bit timestamps wrap.
+    if (currentMillis - lastFilterMillis >= filterInterval)
+        ClearRepeatTable();
+    lastFilterMillis = currentMillis;
+
+    // sweep one slot per call to clear expired entries before their timestamps can wrap
+    RepeatEntry &sweep = repeatTable[sweepIndex];
+    if ((uint16_t)(currentTime - sweep.packetTime) >= filterInterval)
+        sweep.packetSize = 0;
+    sweepIndex = (sweepIndex + 1) & (REPEAT_TABLE_SIZE - 1);
+
+    // search the slots for this packet, noting the first free one
+    const byte packetSize = packetIndex + 1;
+    const byte hash = PacketHash();
+    RepeatEntry *freeEntry = 0;
+    RepeatEntry *oldestEntry = 0;
+
+    for (byte probe = 0; probe < REPEAT_TABLE_PROBES; probe++)
     {
-        // if packet is still within the time interval, add it to compacted history
-        if (currentMillis - packetLog[oldEntryCount].packetTime < filterInterval)
+        RepeatEntry &entry = repeatTable[(hash + probe) & (REPEAT_TABLE_SIZE - 1)];
+
+        // expired or empty slots are free, but keep looking since the packet may be further on
+        if (entry.packetSize == 0 || (uint16_t)(currentTime - entry.packetTime) >= filterInterval)
         {
-            if (newEntryCount != oldEntryCount)   // avoid overhead of copying to same location
-                packetLog[newEntryCount] = packetLog[oldEntryCount];
-            newEntryCount++;
+            if (!freeEntry)
+                freeEntry = &entry;
+            continue;
         }
-        oldEntryCount++;
-    }
-
-	// hardware debug to check size of packet log
-	for (int i = 0; i < newEntryCount; i++)
-	//{
-	//	PORTC = PORTC | (1 << 4); PORTC = PORTC & ~(1 << 4);
-	//}
 
-    // set size of next entry to zero to flag end of history data
-    packetLog[newEntryCount].packetSize = 0;
-
-    // now check current packet against packet history
-    newEntryCount = 0;
-    while (packetLog[newEntryCount].packetSize > 0)
-    {
-        // check if packet matches
-        if (packetLog[newEntryCount].packetSize == packetIndex + 1)    // check size first, that's quick and easy
+        // check size first, that's quick and easy, and then each byte in turn
+        if (entry.packetSize == packetSize && memcmp(entry.packetData, packet, packetSize) == 0)
         {
-            // now check each byte in turn
-            bool matchFound = true;
-            for (int i=0; i < packetIndex + 1; i++)
-                if (packetLog[newEntryCount].packetData[i] != packet[i])
-                    matchFound = false;
-
-            // if packet matches, update timestamp on matching log entry and return true
-            if (matchFound)
-            {
-                packetLog[newEntryCount].packetTime = currentMillis;
-                return true;
-            }
+            // update timestamp on matching entry and return true
+            entry.packetTime = currentTime;
+            return true;
         }
 
-        newEntryCount++;    // continue checking with next history entry
+        if (!oldestEntry || (uint16_t)(currentTime - entry.packetTime) > (uint16_t)(currentTime - oldestEntry->packetTime))
+            oldestEntry = &entry;
     }
 
-    // packet doesn't match any entries, so it is a new packet.
-
-    // check number of entries in history log
-    if (newEntryCount < MAX_PACKET_LOG_SIZE)
-    {
-        // add the packet to the history log
-        packetLog[newEntryCount].packetSize = packetIndex + 1;
-        packetLog[newEntryCount].packetTime = currentMillis;
-        for (int i=0; i < packetIndex + 1; i++)
-            packetLog[newEntryCount].packetData[i] = packet[i];
-    }
-    else   // raise error for exceeding max history size
+    // packet doesn't match any entries, so it is a new packet. if there's no room for it, report
+    // that the table is full and replace the oldest entry, which is the one least likely to be repeated again.
+    if (!freeEntry)
     {
-        if (packetErrorHandler)
-            packetErrorHandler(ERR_EXCEEDED_HISTORY_SIZE);
+        TableFull = true;
+        freeEntry = oldestEntry;
     }
 
+    // add it to the table
+    freeEntry->packetSize = packetSize;
+    freeEntry->packetTime = currentTime;
+    memcpy(freeEntry->packetData, packet, packetSize);
+
     return false;
 }
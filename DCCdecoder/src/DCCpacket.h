@@ -27,8 +27,8 @@ A class to build and validate DCC packets from a bitstream.
 Summary:
 
 Building the DCC packets is initiated by calling the ProcessIncomingBits method, passing it a
-long int containing 32 bits from the bitstream. The bits are processed in turn, starting with
-searching for the preamble, and then progressing to building the packets. After a complete
+long int containing 32 bits from the bitstream. The bits are processed a run at a time, starting
+with searching for the preamble, and then progressing to building the packets. After a complete
 packet is built, the Execute method is called, which performs a checksum, checks for repeat
 packets, and finally performs a callback with the completed packet. Callbacks provide error
 handling in the case of incorrect packet lengths or failed checksums.
@@ -38,6 +38,10 @@ Example Usage:
 	DCCpacket dccpacket;                            // DCCpacket object, default settings
 	DCCpacket dccPacket{ true, true, 250 };         // with checksum, repeat packet filtering, and repeat interval
 	dccpacket.ProcessIncomingBits(incomingBits);    // process 32 bits of bitstream data
+	dccpacket.ProcessIncomingBits(incomingBits, 5); // process 5 bits, right aligned
+	dccpacket.BitsToNextTerminator();               // number of bits before a packet could end
+	dccpacket.SetPacketFilterHandler(Filter);       // reject unwanted packets from their first bytes
+	dccpacket.ProcessIncomingBits(bits, 5, sink);   // pass packets, errors, and filter calls to a sink object
 
 Details:
 
@@ -46,20 +50,65 @@ After finding the preamble, the state changes to READPACKET. In this state, eigh
 followed by checking the next bit to determine if the packet has ended. When a 1 bit is read here,
 indicating the end of the packet, control passes to the Execute method.
 
+Rather than stepping through the word one bit at a time, each step consumes as many bits as it can.
+In READPREAMBLE, the run of 1's at the front of the word is counted in one operation (count leading
+ones), and the run and its terminating 0 are shifted out together. In READPACKET, a data byte and the
+bit that follows it are extracted with a shift and a mask when all nine bits are in the current word.
+A byte that is split across two words is assembled from the bits at the end of one word and the start
+of the next. The results are exactly the same as processing the bits one at a time.
+
+The bits may also be streamed in smaller blocks, right aligned in the unsigned long. The
+BitsToNextTerminator method gives the number of bits until the earliest point at which the current
+packet could end, based on the preamble count, the minimum packet length, and the bits left in the
+current byte. If the bitstream delivers blocks of this size (see BitStream::SetFlushBits), a packet
+ends exactly at the end of a block, and is executed as soon as its end bit is received instead of
+waiting for a full 32 bits.
+
 The Execute method performs two optional checks on the packet. A checksum is performed per the
 DCC spec using the last data byte. If the checksum passes, the packet is then checked to determine
 if it has been repeated within a given time interval. If the packet passes both of these checks,
 a callback is performed with the completed packet. After a packet is built and executed, the Reset
-method resets the packet data and the state reverts to READPREAMBLE.
+method resets the packet data and the state reverts to READPREAMBLE. The Resync method does the same,
+and clears the preamble count, for when bits on their way to the builder have been lost (a timestamp
+queue overrun, or a restart of the bitstream), so that no packet is built from bits either side of
+the gap.
+
+An optional filter callback lets the user of the packets discard the ones it has no use for before
+they are complete, so they don't cost a checksum, a repeat check, and a callback each. The filter is
+called with the packet bytes so far, after each byte that is followed by a 0 separator, and returns
+FILTER_ACCEPT, FILTER_REJECT, or FILTER_MORE to decide after the next byte. Once it accepts, it isn't
+called again for that packet. A rejected packet is dropped and the state reverts to READPREAMBLE
+without reading the rest of it. This is safe because a packet can't contain a run of more than 8
+1's, so the remainder can't be mistaken for a preamble. Rejected packets report no errors. The
+RepeatTableCount method returns the number of current entries in the repeat table, so the effect of
+the filter on the table can be checked. SameState checks whether another packet builder is at the same
+point in building a packet, with the same settings, so that it will give the same packets from the
+same bits. The repeat tables aren't compared.
+
+In place of the callbacks, a sink object can be passed to the template ProcessIncomingBits. The sink
+is any class with the methods PacketReady(byte *Packet, byte PacketSize), PacketError(byte ErrorCode),
+and FilterResult PacketFilter(byte *Packet, byte ByteCount). Its type is a template parameter, so the
+calls are made directly and can be inlined. The packet is passed as a pointer to the builder's own
+buffer, which is valid until the call returns, so it isn't copied on the way. The callback version
+wraps the function pointers in a sink, with a missing filter accepting every packet.
 
 The IsRepeatPacket method checks for repeat packets within a certain time interval, returning true
-if a match is found. A log is maintained of recent packets. The log is updated on entry to the
-method to remove packets that are outside the specified time interval. Packets that are still within
-the time interval are moved toward the start of the log. This process not only removes old packets,
-but also ensures that commonly received packets (e.g., idle packets) are at the front of the list.
-The current packet is then checked against the list. If a match is found, the timestamp on the log
-entry is updated, and the method returns true. If the packet is not found in the list, the packet
-and its timestamp are added to the log, and the method returns false.
+if a match is found. Recent packets are kept in a fixed size, open addressed hash table, so that the
+time to check a packet doesn't depend on the number of packets in the table (which grows with the
+number of locos running). A hash of the packet bytes selects a starting slot, and a small fixed
+number of slots from there are searched for a matching packet. If a match is found, its timestamp
+is updated, and the method returns true. Otherwise the packet and its timestamp are stored in the
+first free slot of those searched, and the method returns false. If none of them are free, an error
+is raised and the packet replaces the oldest of them.
+
+Entries expire lazily. An entry whose timestamp is older than the time interval is treated as free,
+both when searching and when storing, so nothing needs to be removed or compacted. Because expired
+entries are not removed, all of the searched slots are checked for a match, rather than stopping
+at the first free one. Timestamps are stored as 16 bits of millis to save RAM. To keep old entries
+from appearing current again when the 16 bit time wraps (every 65 seconds), one slot is swept on
+each call and cleared if it has expired, and the whole table is cleared if there is a gap of more
+than the time interval between packets. The sweep covers the table in as many packets as it has slots
+(32 by default), so the time interval should be kept under 2 seconds.
 
 */
 
@@ -80,12 +129,19 @@ enum : byte
 	PACKET_LEN_MIN = 2,         // zero indexed
 	PACKET_LEN_MAX = 5,         // zero indexed
 	PREAMBLE_MIN = 10,          // minimum number of 1's to signal valid preamble
-	MAX_PACKET_LOG_SIZE = 15,   // max number of packets to check for repeats
-								// Note: the number of packets in the log is at least 1 for idle packets plus 1 for each engine
-								// with speed > 0, since the NCE sends them repeatedly. Did not seem to see anything over ~10-12
-								// in the log, even with 6 engines running and scrolling the thumbwheel.
+	REPEAT_TABLE_PROBES = 8,    // number of slots to search for a packet, starting at its hash
 };
 
+// number of packets to check for repeats, must be a power of two and at least REPEAT_TABLE_PROBES.
+// Note: the number of packets in the table is at least 1 for idle packets plus 1 for each engine with
+// speed > 0, since the NCE sends them repeatedly. Did not seem to see anything over ~10-12 with 6
+// engines running and scrolling the thumbwheel, so 32 allows for 20+ engines. A slot is 9 bytes, so
+// the table takes 288 bytes of RAM (the packet log it replaced took 165). A build short of RAM may
+// define REPEAT_TABLE_SIZE smaller, at the cost of overflows with fewer engines (see Host-sim).
+#if !defined(REPEAT_TABLE_SIZE)
+#define REPEAT_TABLE_SIZE 32
+#endif
+
 // error codes
 enum : byte
 {
@@ -95,6 +151,14 @@ enum : byte
 	ERR_EXCEEDED_HISTORY_SIZE = 4,
 };
 
+// packet filter results
+enum FilterResult : byte
+{
+	FILTER_ACCEPT,              // build and execute the packet
+	FILTER_REJECT,              // discard the packet and look for the next preamble
+	FILTER_MORE,                // call the filter again after the next packet byte
+};
+
 
 class DCCpacket
 {
@@ -102,14 +166,21 @@ class DCCpacket
 public:
 	typedef void(*PacketCompleteHandler)(byte *Packet, byte PacketSize);
 	typedef void(*PacketErrorHandler)(byte ErrorCode);
+	typedef FilterResult(*PacketFilterHandler)(byte *Packet, byte ByteCount);
 
 	DCCpacket();
 	DCCpacket(bool EnableChecksum, bool FilterRepeats, unsigned int FilterInterval);
-	void ProcessIncomingBits(unsigned long incomingBits);
+	void ProcessIncomingBits(unsigned long incomingBits, byte numBits = 32);
+	template <typename Sink> void ProcessIncomingBits(unsigned long incomingBits, byte numBits, Sink &sink);
+	byte BitsToNextTerminator();
 	void SetPacketCompleteHandler(PacketCompleteHandler Handler);
 	void SetPacketErrorHandler(PacketErrorHandler Handler);
+	void SetPacketFilterHandler(PacketFilterHandler Handler);
 	void EnableChecksum(bool Enable);
 	void FilterRepeatPackets(bool Filter);
+	byte RepeatTableCount();
+	bool SameState(const DCCpacket &Other) const;
+	void Resync();
 
 private:
 	// states
@@ -119,38 +190,215 @@ private:
 		READPACKET,
 	};
 
-	struct LogPacket
+	struct RepeatEntry
 	{
-		unsigned long packetTime;
-		byte packetSize;
+		uint16_t packetTime;                    // low 16 bits of millis when the packet was last seen
+		byte packetSize;                        // 0 for an empty slot
 		byte packetData[PACKET_LEN_MAX + 1];
 	};
 
 	// private functions
 	void ReadPreamble();
-	void ReadPacket();
-	void Execute();
+	template <typename Sink> void ReadPacket(bool EndBit, Sink &sink);
+	template <typename Sink> void Execute(Sink &sink);
 	void Reset();
-	bool IsRepeatPacket();
+	bool IsRepeatPacket(bool &TableFull);
+	static byte CountLeadingOnes(uint32_t bits);
+	byte PacketHash();
+	void ClearRepeatTable();
 
 	// callback handlers
 	PacketCompleteHandler packetCompleteHandler = 0;
 	PacketErrorHandler packetErrorHandler = 0;
+	PacketFilterHandler packetFilterHandler = 0;
+
+	// sink that passes packets, errors, and filter calls to the callback handlers
+	struct CallbackSink
+	{
+		PacketCompleteHandler packetCompleteHandler;
+		PacketErrorHandler packetErrorHandler;
+		PacketFilterHandler packetFilterHandler;
+
+		void PacketReady(byte *Packet, byte PacketSize) { if (packetCompleteHandler) packetCompleteHandler(Packet, PacketSize); }
+		void PacketError(byte ErrorCode) { if (packetErrorHandler) packetErrorHandler(ErrorCode); }
+		FilterResult PacketFilter(byte *Packet, byte ByteCount) { return packetFilterHandler ? packetFilterHandler(Packet, ByteCount) : FILTER_ACCEPT; }
+	};
 
 	// state and packet vars
-	unsigned long dataBits = 0;         // the source bit data
 	State state = READPREAMBLE;         // current processing state
 	byte packetIndex = 0;               // packet byte that we're on
-	byte packetMask = 0x80;             // mask for assigning bits to packet bytes
+	byte bitsLeft = 8;                  // data bits still to read for the current packet byte
 	byte packet[PACKET_LEN_MAX + 1];    // packet data
-	bool currentBit = 0;                // the current bit extracted from the input stream
 	byte preambleBitCount = 0;          // count of consecutive 1's we've found while looking for preamble
+	bool filterPending = true;          // the filter hasn't yet accepted the current packet
 
 	bool enableChecksum = true;                // require valid checksum in order to return packet
 	bool filterRepeatPackets = true;           // filter out repeated packets, sending only the first in the given interval
 	unsigned int filterInterval = 250;         // time period (ms) within which packets are considered repeats
-	LogPacket packetLog[MAX_PACKET_LOG_SIZE];  // history of packets to check for repeats
+	RepeatEntry repeatTable[REPEAT_TABLE_SIZE];    // recent packets to check for repeats
+	byte sweepIndex = 0;                       // next slot to check for expiry
+	unsigned long lastFilterMillis = 0;        // time of the last repeat check
 };
 
 
+// count the leading 1's in a word of bits
+inline byte DCCpacket::CountLeadingOnes(uint32_t bits)
+{
+	const uint32_t zeros = ~bits;
+	return zeros ? __builtin_clzl(zeros) - (sizeof(long) - sizeof(uint32_t)) * 8 : 32;
+}
+
+
+// process an incoming sequence of up to 32 bits, right aligned in an unsigned long
+template <typename Sink>
+void DCCpacket::ProcessIncomingBits(unsigned long incomingBits, byte numBits, Sink &sink)
+{
+	// We get a new set of 32 bits from the DCC bitstream about every 5ms, or fewer bits more often
+	// when streaming. The bits are consumed in runs rather than one at a time: a preamble is found
+	// by counting the leading 1's, and packet bytes are extracted with their separator bit by shifting.
+
+	if (numBits == 0 || numBits > 32)
+		return;
+
+	uint32_t bits = (uint32_t)incomingBits << (32 - numBits);    // the unprocessed bits, left aligned
+	byte bitCount = numBits;                                     // number of unprocessed bits
+
+	while (bitCount)
+	{
+		if (state == READPREAMBLE)
+		{
+			// count the 1's up to the next 0, bits shifted in from the right are 0
+			const byte ones = CountLeadingOnes(bits);
+			if (ones == bitCount)
+			{
+				preambleBitCount += ones;    // the rest of the word is 1's, carry on in the next word
+				return;
+			}
+
+			// consume the 1's and the following 0 (shifted in two steps, since 32 would overflow)
+			preambleBitCount += ones;
+			bits <<= ones;
+			bits <<= 1;
+			bitCount -= ones + 1;
+			ReadPreamble();
+		}
+		else if (bitsLeft == 8 && bitCount >= 9)
+		{
+			// the whole byte and its following bit are in this word
+			packet[packetIndex] = bits >> 24;
+			const bool endBit = (bits >> 23) & 0x01;
+			bits <<= 9;
+			bitCount -= 9;
+			ReadPacket(endBit, sink);
+		}
+		else if (bitsLeft)
+		{
+			// the byte spans words, assemble as many bits as this word holds.
+			// each byte is shifted 8 times in total, so the previous contents are shifted out
+			const byte count = (bitsLeft < bitCount) ? bitsLeft : bitCount;
+			packet[packetIndex] = (packet[packetIndex] << count) | (byte)(bits >> (32 - count));
+			bits <<= count;
+			bitCount -= count;
+			bitsLeft -= count;
+		}
+		else
+		{
+			// the byte is complete, and the following bit starts this word
+			const bool endBit = bits >> 31;
+			bits <<= 1;
+			bitCount--;
+			ReadPacket(endBit, sink);
+		}
+	}
+}
+
+
+// after a complete packet byte, a one bit ends the packet and a zero bit indicates more data
+template <typename Sink>
+inline void DCCpacket::ReadPacket(bool EndBit, Sink &sink)
+{
+	if (EndBit)
+	{
+		if (packetIndex >= PACKET_LEN_MIN && packetIndex <= PACKET_LEN_MAX)
+		{
+			// we have a valid length packet with a proper ending on a 1, go
+			// process it
+			Execute(sink);
+		}
+		else   // packet ended on a 1 but is incorrect length
+		{
+			if (packetIndex < PACKET_LEN_MIN) sink.PacketError(ERR_PACKET_TOO_SHORT);
+			if (packetIndex > PACKET_LEN_MIN) sink.PacketError(ERR_PACKET_TOO_LONG);
+			Reset();
+		}
+	}
+	else   // zero bit indicates more data
+	{
+		// let the filter decide if we want this packet, now that we have another byte of it
+		if (filterPending)
+		{
+			const FilterResult result = sink.PacketFilter(packet, packetIndex + 1);
+			if (result == FILTER_REJECT)
+			{
+				// drop the rest of the packet, it can't contain a preamble
+				Reset();
+				return;
+			}
+			filterPending = (result == FILTER_MORE);
+		}
+
+		// advance to the next packet byte
+		packetIndex++;
+		bitsLeft = 8;
+
+		// if packet index is too high, reset
+		if (packetIndex > PACKET_LEN_MAX)
+		{
+			sink.PacketError(ERR_PACKET_TOO_LONG);
+			Reset();
+		}
+	}
+}
+
+
+// verify the checksum of the completed packet, check for repeat packets,
+// and then pass it to the sink
+template <typename Sink>
+void DCCpacket::Execute(Sink &sink)
+{
+	// initialize as true so we can just skip checksum if disabled
+	bool checksumOk = true;
+
+	// verify checksum if enabled
+	if (enableChecksum)
+	{
+		byte errorDectection = packet[0] ^ packet[1];             // initial xor of address and 1st instruction byte
+		for (int i = 2; i < packetIndex; i++)
+			errorDectection ^= packet[i];                         // xor additional instruction bytes
+		checksumOk = (errorDectection == packet[packetIndex]);
+	}
+
+	// if we pass the checksum
+	if (checksumOk)
+	{
+		// if check for repeats is enabled, and it's a repeat packet, skip the packet
+		bool tableFull = false;
+		const bool repeat = filterRepeatPackets && IsRepeatPacket(tableFull);
+		if (tableFull)
+			sink.PacketError(ERR_EXCEEDED_HISTORY_SIZE);
+
+		// pass on the complete valid packet, in place
+		if (!repeat)
+			sink.PacketReady(packet, packetIndex + 1);   // return the size of the packet, not the final index
+	}
+	else   // check sum error
+	{
+		sink.PacketError(ERR_FAILED_CHECKSUM);
+	}
+
+	// reset and start looking for preamble again.
+	Reset();
+}
+
+
 #endif
@@ -0,0 +1,132 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "Profiler.h"
+
+#if defined(DCC_PROFILING)
+
+// the list is zero initialized before any probe is constructed, whatever the order of the files
+Profiler::Probe *Profiler::probes = 0;
+
+
+// add the probe to the end of the list, so the report follows the order of construction
+Profiler::Probe::Probe(const char *Name) : name(Name), next(0)
+{
+	StartCounter();
+	Clear();
+
+	Probe **last = &probes;
+	while (*last)
+		last = &(*last)->next;
+	*last = this;
+}
+
+
+// add the time from Start to now
+void Profiler::Probe::Record(Tick Start)
+{
+	const Tick ticks = Elapsed(Start, Now());
+
+	count++;
+	totalTicks += ticks;
+	if (ticks < minTicks) minTicks = ticks;
+	if (ticks > maxTicks) maxTicks = ticks;
+
+	Count &bucket = buckets[Bucket(ticks)];
+	if (bucket != (Count)~0)
+		bucket++;
+}
+
+
+void Profiler::Probe::Clear()
+{
+	count = 0;
+	minTicks = (Tick)~0;
+	maxTicks = 0;
+	totalTicks = 0;
+	for (byte i = 0; i < BUCKETS; i++)
+		buckets[i] = 0;
+}
+
+
+// the histogram bucket for a time, the position of its highest set bit
+byte Profiler::Bucket(Tick Ticks)
+{
+	byte bucket = 0;
+	while (Ticks >>= 1)
+		bucket++;
+	return bucket;
+}
+
+
+// start the counter if it doesn't run by itself
+void Profiler::StartCounter()
+{
+#if defined(PROFILER_DWT)
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+
+// write the counter rate, and a line for each probe
+void Profiler::Report()
+{
+	Serial.print("P,");
+	Serial.println((unsigned long)TICKS_PER_US, DEC);
+
+	for (Probe *probe = probes; probe; probe = probe->next)
+	{
+		// take a copy, so a probe recorded from an interrupt handler is consistent
+		noInterrupts();
+		Probe copy = *probe;
+		interrupts();
+
+		Serial.print("P,");
+		Serial.print(copy.name);
+		Serial.print(',');
+		Serial.print((unsigned long)copy.count, DEC);
+		Serial.print(',');
+		Serial.print((unsigned long)(copy.count ? copy.minTicks : 0), DEC);
+		Serial.print(',');
+		Serial.print((unsigned long)(copy.count ? copy.totalTicks / copy.count : 0), DEC);
+		Serial.print(',');
+		Serial.print((unsigned long)copy.maxTicks, DEC);
+		for (byte i = 0; i < BUCKETS; i++)
+		{
+			Serial.print(',');
+			Serial.print((unsigned long)copy.buckets[i], DEC);
+		}
+		Serial.println();
+	}
+}
+
+
+void Profiler::Reset()
+{
+	for (Probe *probe = probes; probe; probe = probe->next)
+	{
+		noInterrupts();
+		probe->Clear();
+		interrupts();
+	}
+}
+
+#endif
@@ -0,0 +1,245 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Profiler
+
+Probes that time the stages of the decoder and the main loop, and keep the statistics of the times.
+
+Summary:
+
+A probe is placed around a piece of code with start and stop macros, or a scope macro that stops it
+at the end of the block. Each time through, the probe reads a cycle counter at the start and the
+stop, and adds the time to its count, minimum, maximum, total, and a histogram of the times in
+powers of two. PROFILE_REPORT writes the statistics of all the probes to Serial on demand.
+
+Profiling is compiled in by defining DCC_PROFILING. Without it, the macros compile to nothing, and
+the probes take no memory or time.
+
+Example usage:
+
+	PROFILE_PROBE(updateProbe, "update");       // define a probe, at file scope
+	PROFILE_EXTERN(updateProbe);                // declare a probe defined in another file
+
+	void Update()
+	{
+		PROFILE_SCOPE(updateProbe);             // time the rest of the block
+		...
+	}
+
+	PROFILE_START(updateProbe);                 // or time part of a block
+	...
+	PROFILE_STOP(updateProbe);
+
+	PROFILE_REPORT();                           // write the statistics to Serial
+	PROFILE_RESET();                            // and start them over
+
+Details:
+
+The counter is chosen at compile time, for the board:
+
+	AVR, timer1 timestamps      TCNT1, at the timestamp timer rate (16 per us with no prescaler).
+	                            The timer is free running for the decoder, so reading it costs one
+	                            16 bit load, but times of more than one timer period (4 ms with no
+	                            prescaler) wrap.
+	AVR, timer2 timestamps      micros(), with its resolution of 4 us, since timer1 is not running.
+	SAMD51                      the DWT cycle counter, at the cpu clock.
+	SAMD21                      SysTick, at the cpu clock. SysTick counts down from its reload
+	                            value once per millisecond, so times of more than 1 ms wrap.
+	Host                        std::chrono::steady_clock, in nanoseconds.
+
+Times are in counter ticks, and Profiler::TICKS_PER_US converts them. Bucket n of the histogram holds
+the times from 2^n to 2^(n+1) - 1 ticks (bucket 0 also holds 0), with one bucket for each bit of the
+tick type, so all times have a bucket. The bucket counts stop at their maximum rather than wrap
+(65535 on AVR, where they are 16 bits to save RAM).
+
+Probes time everything between their start and stop, including any probes inside them and any
+interrupts taken meanwhile, so the time of a stage includes the stages it calls. A probe in an
+interrupt handler times just the handler. The report and reset copy or clear each probe with interrupts
+disabled, so a probe may be recorded from an interrupt handler. On the host, a probe must only be
+recorded from one thread at a time.
+
+The report is one line for the counter, then one line per probe of comma separated values, in the
+manner of the decoder telemetry:
+
+	P,<ticks per us>
+	P,<name>,<count>,<min>,<mean>,<max>,<bucket 0>,<bucket 1>,...
+
+*/
+
+#ifndef _PROFILER_h
+#define _PROFILER_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#if defined(DCC_PROFILING)
+
+#include "Bitstream.h"
+
+#if defined(ARDUINO_ARCH_AVR)
+#if defined(TIMER1_HW_0PS) || defined(TIMER1_ICR_0PS) || defined(TIMER1_HW_8PS) || defined(TIMER1_ICR_8PS)
+#define PROFILER_TIMER1
+#else
+#define PROFILER_MICROS
+#endif
+#elif defined(__SAMD51__)
+#define PROFILER_DWT
+#elif defined(ARDUINO_ARCH_SAMD)
+#define PROFILER_SYSTICK
+#elif !defined(ARDUINO)
+#define PROFILER_CHRONO
+#include <chrono>
+#else
+#define PROFILER_MICROS
+#endif
+
+
+class Profiler
+{
+public:
+	// counter ticks, the width of the counter
+#if defined(PROFILER_TIMER1)
+	typedef uint16_t Tick;
+	enum : uint16_t { TICKS_PER_US = CLOCK_SCALE_FACTOR };
+#elif defined(PROFILER_DWT) || defined(PROFILER_SYSTICK)
+	typedef uint32_t Tick;
+	enum : uint16_t { TICKS_PER_US = F_CPU / 1000000UL };
+#elif defined(PROFILER_CHRONO)
+	typedef uint32_t Tick;
+	enum : uint16_t { TICKS_PER_US = 1000 };
+#else
+	typedef uint32_t Tick;
+	enum : uint16_t { TICKS_PER_US = 1 };
+#endif
+
+	enum : byte { BUCKETS = 8 * sizeof(Tick) };
+
+	// histogram counts, kept small where RAM is short
+#if defined(ARDUINO_ARCH_AVR)
+	typedef uint16_t Count;
+#else
+	typedef uint32_t Count;
+#endif
+
+	// the statistics of one place in the code, linked into a list of all the probes
+	class Probe
+	{
+	public:
+		explicit Probe(const char *Name);
+
+		// add a time from a start tick to now
+		void Record(Tick Start);
+
+		const char *name;
+		uint32_t count;
+		Tick minTicks;
+		Tick maxTicks;
+		uint64_t totalTicks;
+		Count buckets[BUCKETS];
+		Probe *next;
+
+	private:
+		void Clear();
+		friend class Profiler;
+	};
+
+	// stops a probe at the end of its scope
+	class Scope
+	{
+	public:
+		explicit Scope(Probe &ScopeProbe) : probe(ScopeProbe), start(Now()) {}
+		~Scope() { probe.Record(start); }
+
+	private:
+		Probe &probe;
+		const Tick start;
+	};
+
+	// the current counter value
+	static Tick Now();
+
+	// the time in ticks from Start to Stop, allowing for the counter wrapping
+	static Tick Elapsed(Tick Start, Tick Stop);
+
+	// write the statistics of all the probes to Serial, or clear them
+	static void Report();
+	static void Reset();
+
+private:
+	static Probe *probes;               // the list of probes, in the order they were constructed
+
+	static void StartCounter();
+	static byte Bucket(Tick Ticks);
+};
+
+
+#if defined(PROFILER_TIMER1)
+inline Profiler::Tick Profiler::Now() { return TCNT1; }
+#elif defined(PROFILER_DWT)
+inline Profiler::Tick Profiler::Now() { return DWT->CYCCNT; }
+#elif defined(PROFILER_SYSTICK)
+inline Profiler::Tick Profiler::Now() { return SysTick->LOAD - SysTick->VAL; }    // counts up from 0 to LOAD
+#elif defined(PROFILER_CHRONO)
+inline Profiler::Tick Profiler::Now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#else
+inline Profiler::Tick Profiler::Now() { return micros(); }
+#endif
+
+
+inline Profiler::Tick Profiler::Elapsed(Tick Start, Tick Stop)
+{
+#if defined(PROFILER_SYSTICK)
+	// the counter wraps at LOAD, not at the width of the tick
+	return (Stop >= Start) ? Stop - Start : Stop + SysTick->LOAD + 1 - Start;
+#else
+	return (Tick)(Stop - Start);
+#endif
+}
+
+
+#define PROFILE_PROBE(probe, name) Profiler::Probe probe{ name }
+#define PROFILE_EXTERN(probe) extern Profiler::Probe probe
+#define PROFILE_SCOPE(probe) Profiler::Scope probe##Scope{ probe }
+#define PROFILE_START(probe) const Profiler::Tick probe##Start = Profiler::Now()
+#define PROFILE_STOP(probe) probe.Record(probe##Start)
+#define PROFILE_REPORT() Profiler::Report()
+#define PROFILE_RESET() Profiler::Reset()
+
+#else
+
+#define PROFILE_PROBE(probe, name)
+#define PROFILE_EXTERN(probe)
+#define PROFILE_SCOPE(probe)
+#define PROFILE_START(probe)
+#define PROFILE_STOP(probe)
+#define PROFILE_REPORT()
+#define PROFILE_RESET()
+
+#endif
+
+#endif
@@ -20,92 +20,133 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include "SimpleQueue.h"
 
+
 // constructor
 SimpleQueue::SimpleQueue()
 {
-	for (int i = 0; i < maxIndex + 1; i++)
+	for (byte i = 0; i < queueSize; i++)
 		values[i] = 0;
+
+	ResetStatistics();
 }
 
 
-// add an unsigned int to the queue.
-void SimpleQueue::Put(unsigned int val)
+// add a value to the queue. called by the producer (the capture ISR).
+void SimpleQueue::Put(uint16_t Value)
 {
-	// get the next index to write
-	if (writeIndex < maxIndex)
-		writeIndex++;
-	else
-		writeIndex = 0;
+	const byte currentHead = head;    // only the producer writes the head
 
-	// values in the queue wrap around but only the last ones added are meaningful
-	if (queueSize < maxIndex)
-		queueSize++;
+	// drop the value if the queue is full, rather than overwrite values that haven't been read
+	if ((byte)(currentHead - LoadAcquire(tail)) >= queueSize)
+	{
+		overrunCount = overrunCount + 1;
+		return;
+	}
 
-	values[writeIndex] = val;
+	// store the value, then publish it
+	values[currentHead & indexMask] = Value;
+	StoreRelease(head, currentHead + 1);
 }
 
 
-// get an unsigned int from the queue.
-unsigned int SimpleQueue::Get()
+// get a value from the queue, or 0 if it's empty. called by the consumer.
+uint16_t SimpleQueue::Get()
 {
-	unsigned int returnVal = 0;
+	const byte currentTail = tail;    // only the consumer writes the tail
 
-	//byte oldSREG = SREG;   // store the current irq state, then disable
-	//cli();
-	noInterrupts();
+	if (currentTail == LoadAcquire(head))
+		return 0;
+
+	// read the value, then release the slot
+	const uint16_t value = values[currentTail & indexMask];
+	StoreRelease(tail, currentTail + 1);
+	return value;
+}
 
-	// if there are items in the queue
-	if (queueSize > 0)
-	{
-		// get the next index to read
-		if (readIndex < maxIndex)
-			readIndex++;
-		else
-			readIndex = 0;
-
-		queueSize--;
-		returnVal = values[readIndex];
-	}
 
-	//SREG = oldSREG;    // restore previous irq state
-	interrupts();
-	
-	return returnVal;
+// copy up to MaxCount values from the queue to a buffer, returning the number copied.
+// called by the consumer.
+byte SimpleQueue::Get(uint16_t *Buffer, byte MaxCount)
+{
+	const byte currentTail = tail;    // only the consumer writes the tail
+	byte count = LoadAcquire(head) - currentTail;
+	RecordDepth(count);
+	if (count > MaxCount)
+		count = MaxCount;
+
+	// read the values, then release all of the slots at once
+	for (byte i = 0; i < count; i++)
+		Buffer[i] = values[(byte)(currentTail + i) & indexMask];
+	StoreRelease(tail, currentTail + count);
+	return count;
 }
 
 
-// get the current size of the queue.
+// get the number of values in the queue. called by the consumer.
 byte SimpleQueue::Size()
 {
-	byte returnVal = 0;
-
-	//byte oldSREG = SREG;   // store the current irq state, then disable
-	//cli();
-	noInterrupts();
+	return LoadAcquire(head) - tail;
+}
 
-	returnVal = queueSize;
 
-	//SREG = oldSREG;    // restore previous irq state
-	interrupts();
+// check if values were dropped because the queue was full, since the last check
+bool SimpleQueue::Overrun()
+{
+	const byte count = LoadAcquire(overrunCount);
+	if (count == lastOverrunCount)
+		return false;
 
-	return returnVal;
+	RecordOverruns(count);
+	return true;
 }
 
 
-// reset the queue size and read/write counters.
+// discard the values in the queue, and any pending overrun
 void SimpleQueue::Reset()
 {
-	//byte oldSREG = SREG;   // store the current irq state, then disable
-	//cli();
-	noInterrupts();
-	
-	queueSize = 0;
-	readIndex = 0;
-	writeIndex = 0;
-
-	for (int i = 0; i < maxIndex + 1; i++)
-		values[i] = 0;
+	StoreRelease(tail, LoadAcquire(head));
+	RecordOverruns(LoadAcquire(overrunCount));
+}
+
+
+// clear the statistics
+void SimpleQueue::ResetStatistics()
+{
+	statistics.dropped = 0;
+	statistics.maxDepth = 0;
+	for (byte i = 0; i < queueSize; i++)
+		statistics.depthHistogram[i] = 0;
+}
+
+
+// record the depth of the queue when values are drained
+void SimpleQueue::RecordDepth(byte Depth)
+{
+	if (Depth == 0)
+		return;
+
+	if (Depth > statistics.maxDepth)
+		statistics.maxDepth = Depth;
+
+	// when a bin is full, halve them all to make room, keeping the shape of the histogram
+	uint16_t &bin = statistics.depthHistogram[Depth - 1];
+	if (bin == 0xFFFF)
+	{
+		for (byte i = 0; i < queueSize; i++)
+			statistics.depthHistogram[i] >>= 1;
+	}
+	bin++;
+}
+
+
+// add the values dropped since the last check to the statistics
+void SimpleQueue::RecordOverruns(byte Overruns)
+{
+	const byte dropped = Overruns - lastOverrunCount;
+	lastOverrunCount = Overruns;
 
-	//SREG = oldSREG;    // restore previous irq state
-	interrupts();
+	const Count most = (Count)~(Count)0;
+	statistics.dropped = (statistics.dropped <= most - dropped) ? statistics.dropped + dropped : most;
+	if (dropped > 0)
+		statistics.maxDepth = queueSize;
 }
@@ -22,30 +22,68 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 Simple Queue
 
-A simple queue class for use with the BitStream library to capture interrupt timestamps for the
-DCC signal.
+A single producer, single consumer queue for use with the BitStream library to capture interrupt
+timestamps for the DCC signal.
 
 Summary:
 
-This class provides a queue of unsigned int for storing 16bit timer counts from Timer1. The Put method
-is intended to be called from an ISR, and is kept very simple to keep it quick. It increments the write
-counter, increments the queue size, and then stores the current value to the array. The Get method 
-increments the read counter, decrements the queue size, and then returns that value from the array. 
-No checking of the queuesize is performed during the put - calling libs must ensure that the queue is 
-emptied in a timely manner, for example by a process running in the main() loop.
+This class provides a ring buffer of 16 bit timer counts. The Put method is called from the capture
+ISR (the producer), and the Get and Size methods from the main loop (the consumer). The producer owns
+the head index and the consumer owns the tail index, so neither side writes to the other's data, and
+no critical sections are needed. In particular the consumer never disables interrupts, so reading the
+queue adds no latency to the capture ISR. If the queue is full, Put drops the new value and counts
+the overrun, rather than overwriting data the consumer has yet to read.
 
 Example Usage:
 
 	SimpleQueue simpleQueue;                    // create an instance of the simple queue
-	simpleQueue.Put(x);                         // add an unsigned int to the queue
+	simpleQueue.Put(x);                         // add a value to the queue (from the ISR)
 	while (simpleQueue.Size() > 0)              // get values from the queue until empty
-		unsigned int y = simpleQueue.Get();
-	simpleQueue.Reset();                        // reset the queue size and read/write counters
+		uint16_t y = simpleQueue.Get();
+	byte n = simpleQueue.Get(buffer, 16);       // or copy up to 16 values to a buffer at once
+	if (simpleQueue.Overrun())                  // check if values were dropped since the last check
+		...
+	simpleQueue.Reset();                        // discard the values in the queue
+	simpleQueue.GetStatistics().maxDepth;       // the deepest the queue has been
+	simpleQueue.ResetStatistics();              // clear the statistics
+
+Details:
+
+The queue size is a power of two, and the head and tail are free running byte counters that are
+masked to index the array. The number of entries is the difference between them, which is correct
+across wraparound of the counters, and the queue is full when the difference equals the queue size.
+This lets all of the slots be used, and avoids a shared size counter that both sides would update.
+
+Publishing order matters. The producer stores the value in the array before it advances the head,
+with a release store, and the consumer reads the head with an acquire load before it reads the
+value, so the consumer can never see a slot before its value is written. The same applies in the
+other direction for the tail, so that a slot is not reused until it has been read. On AVR, byte
+loads and stores are atomic and the core doesn't reorder memory accesses, so volatile accesses
+separated by compiler barriers are sufficient. On other targets (SAMD, or a host build where a
+thread stands in for the ISR), the compiler's atomic builtins provide the acquire/release ordering.
+
+The bulk Get copies all of the pending values (up to a maximum) to a buffer supplied by the caller.
+It reads the head once, copies the values, and then releases all of the slots with a single update
+of the tail. This lets the consumer clear a backlog in one tight loop, for example after a long
+stall in the main loop, rather than paying the call and index overhead for each value.
+
+Overruns are counted by the producer in a byte counter that only it writes. The consumer keeps a copy
+of the count it last saw, and Overrun() returns true if the count has changed since. Reset discards
+the queued values by moving the tail up to the head, so it may also be called from the consumer side
+while the producer is running.
+
+Statistics are kept by the consumer, so that the queue can be sized from field data. The number of
+values dropped is accumulated from the producer's overrun count each time Overrun() is called. The
+bulk Get records the depth of the queue each time it drains values, as a histogram and as the
+maximum depth seen. A queue that has overrun shows a depth of queueSize. The histogram counts are
+16 bits, and when one of them fills, all of them are halved, so that the histogram keeps the shape
+of the depths over a long run rather than flattening as the bins fill; the counts are relative once
+that has happened. The dropped count is 16 bits on AVR, where RAM is short, and 32 elsewhere, and
+stops at its maximum rather than wrap. The statistics take 35 bytes on AVR, and are cleared by
+ResetStatistics.
 
 */
 
-
-
 #ifndef _SIMPLEQUEUE_h
 #define _SIMPLEQUEUE_h
 
@@ -56,25 +94,76 @@ Example Usage:
 #endif
 
 
-// this value is conservatively tolerant of a ~500us delay in processing timestamps,
-// which results in about 10 entries in the queue.
-enum : byte { maxIndex = 15 };
-
-
 class SimpleQueue
 {
-	volatile unsigned int values[maxIndex + 1];
-	volatile byte queueSize = 0;
-	volatile byte writeIndex = 0;
-	byte readIndex = 0;
-
 public:
+	// this is conservatively tolerant of a ~500us delay in processing timestamps,
+	// which results in about 10 entries in the queue. must be a power of two.
+	enum : byte
+	{
+		queueSize = 16,
+		indexMask = queueSize - 1,
+	};
+
 	SimpleQueue();
-	void Put(unsigned int val);
-	unsigned int Get();
-	byte Size();
-	void Reset();
-};
+	void Put(uint16_t Value);    // producer
+	uint16_t Get();              // consumer
+	byte Get(uint16_t *Buffer, byte MaxCount);    // consumer
+	byte Size();                 // consumer
+	bool Overrun();              // consumer
+	void Reset();                // consumer
+
+	// count of dropped values, kept small where RAM is short
+#if defined(ARDUINO_ARCH_AVR)
+	typedef uint16_t Count;
+#else
+	typedef uint32_t Count;
+#endif
 
+	// queue statistics, gathered by the consumer
+	struct Statistics
+	{
+		Count dropped;                          // values dropped because the queue was full
+		byte maxDepth;                          // the most values seen in the queue when draining it
+		uint16_t depthHistogram[queueSize];     // drains at each depth, 1 to queueSize, halved when one fills
+	};
+
+	const Statistics &GetStatistics() const { return statistics; }
+	void ResetStatistics();
+
+private:
+	volatile uint16_t values[queueSize];
+	volatile byte head = 0;                 // next slot to write, written only by the producer
+	volatile byte tail = 0;                 // next slot to read, written only by the consumer
+	volatile byte overrunCount = 0;         // values dropped on a full queue, written only by the producer
+	byte lastOverrunCount = 0;              // overrun count at the last check by the consumer
+	Statistics statistics;                  // consumer statistics
+
+	void RecordDepth(byte Depth);
+	void RecordOverruns(byte Overruns);
+
+	// read an index written by the other side, before accessing the slots it covers
+	static inline byte LoadAcquire(const volatile byte &Index)
+	{
+#if defined(__AVR__)
+		const byte value = Index;
+		__asm__ __volatile__("" ::: "memory");
+		return value;
+#else
+		return __atomic_load_n(&Index, __ATOMIC_ACQUIRE);
 #endif
+	}
+
+	// publish an index, after accessing the slots it covers
+	static inline void StoreRelease(volatile byte &Index, byte Value)
+	{
+#if defined(__AVR__)
+		__asm__ __volatile__("" ::: "memory");
+		Index = Value;
+#else
+		__atomic_store_n(&Index, Value, __ATOMIC_RELEASE);
+#endif
+	}
+};
 
+#endif
@@ -0,0 +1,58 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Compile time table generation
+
+Macros to fill a constant lookup table from a constexpr generator function.
+
+Summary:
+
+The avr-gcc compiler only supports C++11, so lookup tables can't be built with loops in a constexpr
+function. Instead, these macros expand to a list of calls to a generator function, one for each
+index of the table. The generator is evaluated by the compiler, so the table is built entirely at
+compile time and can be placed in flash with PROGMEM.
+
+Example Usage:
+
+	constexpr byte Square(byte Index) { return Index * Index; }             // generator function
+	const byte squares[16] PROGMEM = { TABLE_GEN_16(Square, 0) };           // 16 entries, starting at 0
+	byte value = pgm_read_byte(&squares[4]);                                // read an entry
+
+Details:
+
+Each macro expands to f(n), f(n + 1), ... f(n + size - 1). The generator must be a constexpr
+function (or a function-like macro) taking the index, and must be visible where the table is defined.
+In C++11 a constexpr function body is a single return statement, so generators are generally written
+as a chain of conditional expressions, split into helper functions where that aids readability.
+
+*/
+
+#ifndef _TABLEGEN_h
+#define _TABLEGEN_h
+
+#define TABLE_GEN_4(f, n) f(n), f((n) + 1), f((n) + 2), f((n) + 3)
+#define TABLE_GEN_16(f, n) TABLE_GEN_4(f, n), TABLE_GEN_4(f, (n) + 4), TABLE_GEN_4(f, (n) + 8), TABLE_GEN_4(f, (n) + 12)
+#define TABLE_GEN_64(f, n) TABLE_GEN_16(f, n), TABLE_GEN_16(f, (n) + 16), TABLE_GEN_16(f, (n) + 32), TABLE_GEN_16(f, (n) + 48)
+#define TABLE_GEN_128(f, n) TABLE_GEN_64(f, n), TABLE_GEN_64(f, (n) + 64)
+#define TABLE_GEN_256(f, n) TABLE_GEN_128(f, n), TABLE_GEN_128(f, (n) + 128)
+
+#endif
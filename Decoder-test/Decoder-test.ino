@@ -96,12 +96,38 @@ void DCC_AccPomHandler(int boardAddress, int outputAddress, byte instructionType
 DCCdecoder::DecoderSettings settings =
 {
 	1,      // base address
-	0,      // optional addresses
-	{0,0},
+	0x01,   // address mask, bit n answers base address + n
 	true,   // return all packets
 };
 
 
+// Address range check  ====================================================================
+//
+// with a range of addresses set, the first and last addresses of the range are answered, and the
+// addresses either side of it aren't
+
+bool CheckAddressRange(uint16_t Base, byte Count)
+{
+	if (!dcc.SetAddressRange(Base, Count)) return false;
+
+	return !dcc.IsDecoderAddress(Base - 1) && dcc.IsDecoderAddress(Base) &&
+		dcc.IsDecoderAddress(Base + Count - 1) && !dcc.IsDecoderAddress(Base + Count);
+}
+
+
+void AddressRangeTest()
+{
+	bool passed = CheckAddressRange(1, 1) && CheckAddressRange(1, 4) && CheckAddressRange(5, 32) &&
+		CheckAddressRange(2013, 32) && CheckAddressRange(3, 7);
+
+	// and a count outside 1 to 32 is refused
+	passed = passed && !dcc.SetAddressRange(1, 0) && !dcc.SetAddressRange(1, 33);
+
+	Serial.print("address range check ");
+	Serial.println(passed ? "passed." : "FAILED.");
+}
+
+
 // Setup  =================================================================
 //
 void setup()
@@ -120,6 +146,9 @@ void setup()
 
 	Serial.begin(115200);
 
+	// check the address range before the settings are applied
+	AddressRangeTest();
+
 	dcc.UpdateSettings(settings);
 	dcc.SetBasicAccessoryDecoderPacketHandler(&DCC_AccessoryDecoderHandler);
 	dcc.SetExtendedAccessoryDecoderPacketHandler(&DCC_ExtendedAccDecoderHandler);
@@ -0,0 +1,546 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Capture Decoder
+
+Decodes a recorded DCC capture on a Linux host, splitting it into chunks that are decoded in
+parallel on all cores.
+
+Summary:
+
+A capture is a file of the timer counts of the DCC signal edges, as the capture ISR stores them in
+the timestamp queue, in the format of CaptureEncoder: host-sim --save writes one from its synthesized
+signal, and the Capture-test sketch streams one from the decoder over serial. Its timer must match
+the decoder build (CLOCK_SCALE_FACTOR counts per microsecond). The file is mapped into memory and
+read with CaptureFile, which builds the block index if the file doesn't have one, and --add-index
+saves it to the file. The edges are decoded by BitStream and DCCpacket, the same code that runs on the Arduino, with the
+checksum checked and repeat filtering off, so every packet on the track is reported. The packets
+and errors are counted by type, and optionally written to a text file with their times.
+
+Details:
+
+The capture is divided into chunks of consecutive edges, which worker threads take in turn and
+decode, each with its own BitStream and DCCpacket. A chunk owns the packets and errors completed by
+its edges. Its decoder starts a lead-in of --overlap edges before the chunk, so that by the first
+edge of the chunk the bitstream has found the bit phase (in its startup and seek states) and the
+packet builder the packet phase (from a preamble), as the decoder would have had it running through
+the whole capture. Anything reported during the lead-in is discarded. The first chunk has no lead-in,
+and starts at the beginning of the capture as a single decoder would.
+
+Each decoder also runs on past the end of its chunk, over the first --overlap edges of the next
+chunk, and keeps what it reports there along with its final state. When the chunks are merged in
+order, each chunk's decoder is compared (with the SameState methods of BitStream and DCCpacket) at
+that point with the final state of the decoder before it. If they are the same, they will decode
+the same from there, so the start of the chunk is taken from the decoder before, and the rest from
+the chunk's own decoder. If they differ, the lead-in wasn't long enough to resync (a very noisy
+stretch of signal, for example), and the rest of the chunk is decoded again in the merge, carrying
+on from the final state of the decoder before. Either way the merged packets, errors, and counts
+are exactly those of one decoder run through the whole capture, which --check confirms by doing
+just that, and reports the speedup.
+
+Where the capture marks lost timestamps, the bitstream handles them as a queue overrun, as it would
+have on the decoder.
+
+The times of the packets are rebuilt from the 16 bit counts by adding up the periods between edges,
+which wrap correctly as long as no two edges are more than one timer overflow apart (4 ms with no
+prescaler), as for the decoder itself. Each chunk adds up its own periods, and the chunk start times
+are found from these in the merge.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "WProgram.h"
+#include "Bitstream.h"
+#include "DCCpacket.h"
+#include "CaptureFile.h"
+
+
+// Settings   ==========================================================================
+
+struct DecodeSettings
+{
+	const char *input = 0;           // capture file
+	const char *output = 0;          // text file for the decoded packets and errors
+	int threads = 0;                 // worker threads, 0 for one per core
+	int chunks = 0;                  // number of chunks, 0 for several per thread
+	size_t overlap = 4096;           // lead-in edges before each chunk
+	bool check = false;              // also decode with a single decoder, and compare
+	bool addIndex = false;           // save the block index to the capture file
+};
+
+
+static void Usage()
+{
+	printf("usage: capture-decode [options] capture-file\n"
+		"  --threads N          worker threads (default one per core)\n"
+		"  --chunks N           chunks to divide the capture into (default 8 per thread)\n"
+		"  --overlap N          lead-in edges decoded before each chunk to resync (default 4096)\n"
+		"  --out FILE           write the decoded packets and errors to a text file\n"
+		"  --check              also decode with one decoder, and compare the results\n"
+		"  --add-index          add the block index to a capture file without one\n");
+}
+
+
+static bool ParseArgs(int argc, char **argv, DecodeSettings &s)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		const char *val = (i + 1 < argc) ? argv[i + 1] : 0;
+
+		if (!strcmp(arg, "--check")) { s.check = true; continue; }
+		if (!strcmp(arg, "--add-index")) { s.addIndex = true; continue; }
+		if (!strcmp(arg, "--help")) { Usage(); exit(0); }
+		if (arg[0] != '-' && !s.input) { s.input = arg; continue; }
+		if (!val) { Usage(); return false; }
+
+		if (!strcmp(arg, "--threads")) s.threads = atoi(val);
+		else if (!strcmp(arg, "--chunks")) s.chunks = atoi(val);
+		else if (!strcmp(arg, "--overlap")) s.overlap = strtoul(val, 0, 10);
+		else if (!strcmp(arg, "--out")) s.output = val;
+		else { Usage(); return false; }
+		i++;
+	}
+
+	if (!s.input || s.threads < 0 || s.chunks < 0)
+	{
+		Usage();
+		return false;
+	}
+	return true;
+}
+
+
+// open a capture, and check that it was made with the timer of this build
+static bool OpenCapture(const char *fileName, CaptureFile &capture)
+{
+	if (!capture.Open(fileName))
+		return false;
+
+	const uint32_t timerHz = (uint32_t)(CLOCK_SCALE_FACTOR * 1000000UL);
+	if (capture.TimerHz() != timerHz || capture.TimerBits() != TIMER_BITS)
+	{
+		printf("%s was captured with a %d bit timer at %lu Hz, this build decodes a %d bit timer at %lu Hz\n", fileName,
+			capture.TimerBits(), (unsigned long)capture.TimerHz(), TIMER_BITS, (unsigned long)timerHz);
+		return false;
+	}
+	return true;
+}
+
+
+// Chunk decoding   ==========================================================================
+
+// a packet or error, with the edge that completed it
+struct Event
+{
+	enum : byte { PACKET, BIT_ERROR, PACKET_ERROR };
+
+	size_t edge;                     // index of the edge that completed the packet or raised the error
+	uint64_t ticks;                  // timer counts at that edge since the start of the chunk
+	byte kind;
+	byte size;                       // packet size, or the error code
+	byte data[PACKET_LEN_MAX + 1];
+
+	bool operator==(const Event &e) const
+	{
+		return edge == e.edge && kind == e.kind && size == e.size && (kind != PACKET || memcmp(data, e.data, size) == 0);
+	}
+};
+
+
+// "channel" for a bitstream that replays a recording, which has no ISR
+enum : byte { REPLAY_CHANNEL = 0xFF };
+
+
+// a range of edges, and what was decoded from them
+struct Chunk
+{
+	size_t decodeFrom = 0;           // first edge decoded, the lead-in runs from here to begin
+	size_t begin = 0;                // the chunk owns what is completed by the edges from begin to end
+	size_t end = 0;
+	size_t syncAt = 0;               // the edge at which the decoder is checked against the previous chunk's
+	size_t decodeTo = 0;             // last edge decoded (exclusive), past the end over the start of the next chunk
+	uint64_t ticks = 0;              // timer counts from begin to end
+	uint64_t syncTicks = 0;          // timer counts from begin to syncAt
+	std::vector<Event> events;       // packets and errors completed by the chunk's edges
+	std::vector<Event> beyond;       // those completed after the end, with their times from the end
+
+	// the decoder state at syncAt, and at decodeTo (which is the next chunk's syncAt)
+	BitStream syncBits{ REPLAY_CHANNEL };
+	DCCpacket syncPacket;
+	BitStream endBits{ REPLAY_CHANNEL };
+	DCCpacket endPacket;
+};
+
+
+// passes the bits from the bitstream to the packet builder, and records the packets and errors
+struct ChunkSink
+{
+	BitStream &bitStream;
+	DCCpacket &dccPacket;
+	Chunk &chunk;
+	size_t edge;
+	uint64_t ticks;
+
+	// request the next bits at the earliest point a packet could end, as DCCdecoder does, so that
+	// each packet is completed by its end bit
+	void BitsReady(unsigned long BitData, byte BitCount)
+	{
+		dccPacket.ProcessIncomingBits(BitData, BitCount, *this);
+		bitStream.SetFlushBits(dccPacket.BitsToNextTerminator());
+	}
+
+	void BitError(byte ErrorCode) { Record(Event::BIT_ERROR, ErrorCode, 0); }
+	void PacketReady(byte *Packet, byte PacketSize) { Record(Event::PACKET, PacketSize, Packet); }
+	void PacketError(byte ErrorCode) { Record(Event::PACKET_ERROR, ErrorCode, 0); }
+	FilterResult PacketFilter(byte *Packet, byte ByteCount) { return FILTER_ACCEPT; }
+
+	// keep what happens after the lead-in, sorted by whether it belongs to this chunk
+	void Record(byte Kind, byte Size, const byte *Data)
+	{
+		if (edge < chunk.begin)
+			return;
+
+		Event event;
+		event.edge = edge;
+		event.ticks = (edge < chunk.end) ? ticks : ticks - chunk.ticks;
+		event.kind = Kind;
+		event.size = Size;
+		if (Data)
+			memcpy(event.data, Data, Size);
+		(edge < chunk.end ? chunk.events : chunk.beyond).push_back(event);
+	}
+};
+
+
+// decode the edges of a chunk from a given edge to decodeTo, with the decoder in its state at that
+// edge. the ticks are the timer counts at the edge from the start of the chunk, or 0 in the lead-in.
+static void DecodeEdges(const CaptureFile &capture, Chunk &chunk, BitStream &bitStream, DCCpacket &dccPacket,
+	size_t from, uint64_t ticks)
+{
+	ChunkSink sink = { bitStream, dccPacket, chunk, 0, 0 };
+	CaptureFile::Reader reader{ capture, from };
+	CaptureFile::Edge edge;
+
+	// in the lead-in the times are counted from its start, and then adjusted at the start of the chunk
+	uint64_t beginTicks = 0;
+	for (size_t i = from; i < chunk.decodeTo && reader.Next(edge); i++)
+	{
+		if (i > from)
+			ticks += edge.period;
+		if (i == chunk.begin)
+			beginTicks = ticks;
+		if (i == chunk.end)
+			chunk.ticks = ticks - beginTicks;
+		if (i == chunk.syncAt)
+		{
+			chunk.syncTicks = ticks - beginTicks;
+			chunk.syncBits = bitStream;
+			chunk.syncPacket = dccPacket;
+		}
+
+		sink.edge = i;
+		sink.ticks = ticks - beginTicks;
+		if (edge.gap)
+			bitStream.ReplayOverrun(sink);
+		bitStream.ReplayTimestamp(edge.count, sink);
+	}
+
+	// the last chunk runs to the last edge
+	if (chunk.end == chunk.decodeTo)
+		chunk.ticks = ticks - beginTicks;
+
+	chunk.endBits = bitStream;
+	chunk.endPacket = dccPacket;
+}
+
+
+// decode a chunk with new decoders, from the start of its lead-in to the end of its run on into the next chunk
+static void DecodeChunk(const CaptureFile &capture, Chunk &chunk)
+{
+	BitStream bitStream{ REPLAY_CHANNEL };
+	DCCpacket dccPacket{ true, false, 0 };    // checksum on, repeat filter off
+
+	chunk.events.clear();
+	chunk.beyond.clear();
+	DecodeEdges(capture, chunk, bitStream, dccPacket, chunk.decodeFrom, 0);
+}
+
+
+// decode the chunks on a number of threads, each taking the next chunk in turn
+static void DecodeChunks(const CaptureFile &capture, std::vector<Chunk> &chunks, int threadCount)
+{
+	std::atomic<size_t> next{ 0 };
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threadCount; t++)
+	{
+		threads.push_back(std::thread([&]()
+		{
+			size_t i;
+			while ((i = next++) < chunks.size())
+				DecodeChunk(capture, chunks[i]);
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+}
+
+
+// divide the capture into chunks, each with a lead-in before it and a run on after it
+static std::vector<Chunk> MakeChunks(size_t edgeCount, size_t chunkCount, size_t overlap)
+{
+	std::vector<Chunk> chunks(chunkCount);
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		Chunk &chunk = chunks[i];
+		chunk.begin = edgeCount * i / chunkCount;
+		chunk.end = edgeCount * (i + 1) / chunkCount;
+		chunk.decodeFrom = (chunk.begin > overlap) ? chunk.begin - overlap : 0;
+		chunk.decodeTo = std::min(chunk.end + overlap, edgeCount);
+		chunk.syncAt = std::min(chunk.begin + overlap, edgeCount);
+	}
+	return chunks;
+}
+
+
+// check each chunk's decoder against the decoder of the chunk before, where the one finished and the
+// other had run through the start of the chunk. if they are in the same state, they decode the same
+// from there. otherwise the chunk's lead-in wasn't long enough to resync, and the rest of the chunk
+// is decoded again from there with the previous chunk's decoder. either way, the start of the chunk
+// is taken from the previous chunk's decoder, which was in step with a decoder running from the start
+// of the capture. returns the number of chunks decoded again.
+static int MergeChunks(const CaptureFile &capture, std::vector<Chunk> &chunks)
+{
+	int redone = 0;
+	for (size_t i = 1; i < chunks.size(); i++)
+	{
+		const Chunk &previous = chunks[i - 1];
+		Chunk &chunk = chunks[i];
+
+		if (chunk.syncBits.SameState(previous.endBits) && chunk.syncPacket.SameState(previous.endPacket))
+		{
+			size_t synced = 0;
+			while (synced < chunk.events.size() && chunk.events[synced].edge < chunk.syncAt)
+				synced++;
+			chunk.events.erase(chunk.events.begin(), chunk.events.begin() + synced);
+		}
+		else
+		{
+			BitStream bitStream = previous.endBits;
+			DCCpacket dccPacket = previous.endPacket;
+			chunk.events.clear();
+			chunk.beyond.clear();
+			DecodeEdges(capture, chunk, bitStream, dccPacket, chunk.syncAt, chunk.syncTicks);
+			redone++;
+		}
+
+		chunk.events.insert(chunk.events.begin(), previous.beyond.begin(), previous.beyond.end());
+	}
+	return redone;
+}
+
+
+// Results   ==========================================================================
+
+// counts of the packets and errors by type
+struct DecodeStats
+{
+	unsigned long idle = 0;
+	unsigned long broadcast = 0;
+	unsigned long locoShort = 0;
+	unsigned long locoLong = 0;
+	unsigned long accBasic = 0;
+	unsigned long accExtended = 0;
+	unsigned long pom = 0;           // programming on main, of the loco and accessory packets
+	unsigned long bitErrors[ERR_QUEUE_OVERRUN + 1] = {};
+	unsigned long packetErrors[ERR_EXCEEDED_HISTORY_SIZE + 1] = {};
+
+	void Count(const Event &event)
+	{
+		if (event.kind == Event::BIT_ERROR)
+		{
+			bitErrors[std::min<byte>(event.size, ERR_QUEUE_OVERRUN)]++;
+			return;
+		}
+		if (event.kind == Event::PACKET_ERROR)
+		{
+			packetErrors[std::min<byte>(event.size, ERR_EXCEEDED_HISTORY_SIZE)]++;
+			return;
+		}
+
+		// the packet type from the address, and the instruction byte that follows it
+		const byte *data = event.data;
+		byte instruction;
+		if (data[0] == 0xFF) { idle++; return; }
+		if (data[0] == 0x00) { broadcast++; return; }
+		if ((data[0] & 0xC0) == 0x80)
+		{
+			(data[1] & 0x80) ? accBasic++ : accExtended++;
+			instruction = data[2];
+			if (event.size < 6) return;
+		}
+		else if ((data[0] & 0xC0) == 0xC0)
+		{
+			locoLong++;
+			instruction = data[2];
+		}
+		else
+		{
+			locoShort++;
+			instruction = data[1];
+		}
+		if ((instruction & 0xF0) == 0xE0)
+			pom++;
+	}
+
+	void Print() const
+	{
+		printf("Packets: %lu idle, %lu broadcast, %lu short address loco, %lu long address loco,\n"
+			"         %lu basic accessory, %lu extended accessory, %lu programming on main\n",
+			idle, broadcast, locoShort, locoLong, accBasic, accExtended, pom);
+		printf("Bit errors: %lu low, %lu between 0 and 1, %lu high half bits, %lu resyncs, %lu lost timestamps\n",
+			bitErrors[ERR_INVALID_HALF_BIT_LOW], bitErrors[ERR_INVALID_HALF_BIT_MID],
+			bitErrors[ERR_INVALID_HALF_BIT_HIGH], bitErrors[ERR_SEQUENTIAL_ERROR_LIMIT], bitErrors[ERR_QUEUE_OVERRUN]);
+		printf("Packet errors: %lu too long, %lu too short, %lu failed checksum\n",
+			packetErrors[ERR_PACKET_TOO_LONG], packetErrors[ERR_PACKET_TOO_SHORT], packetErrors[ERR_FAILED_CHECKSUM]);
+	}
+};
+
+
+// write a packet or error, with its time in microseconds from the start of the capture
+static void WriteEvent(FILE *file, const Event &event, uint64_t chunkTicks)
+{
+	fprintf(file, "%.1f ", (double)(chunkTicks + event.ticks) / CLOCK_SCALE_FACTOR);
+	if (event.kind == Event::PACKET)
+	{
+		for (byte i = 0; i < event.size; i++)
+			fprintf(file, " %02X", event.data[i]);
+		fputc('\n', file);
+	}
+	else
+	{
+		fprintf(file, " %s error %d\n", event.kind == Event::BIT_ERROR ? "bit" : "packet", event.size);
+	}
+}
+
+
+// count the decoded events, in order, and write them to the output file if there is one
+static bool Report(const std::vector<Chunk> &chunks, const char *output, DecodeStats &stats, uint64_t &totalTicks)
+{
+	FILE *file = 0;
+	if (output && !(file = fopen(output, "w")))
+	{
+		printf("can't write %s\n", output);
+		return false;
+	}
+
+	totalTicks = 0;
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		for (size_t e = 0; e < chunks[i].events.size(); e++)
+		{
+			stats.Count(chunks[i].events[e]);
+			if (file)
+				WriteEvent(file, chunks[i].events[e], totalTicks);
+		}
+		totalTicks += chunks[i].ticks;
+	}
+
+	if (file)
+		fclose(file);
+	return true;
+}
+
+
+// check that the chunks decoded the same as a single chunk
+static bool SameEvents(const std::vector<Chunk> &chunks, const Chunk &single)
+{
+	size_t e = 0;
+	for (size_t i = 0; i < chunks.size(); i++)
+		for (size_t c = 0; c < chunks[i].events.size(); c++, e++)
+			if (e >= single.events.size() || !(chunks[i].events[c] == single.events[e]))
+				return false;
+	return e == single.events.size();
+}
+
+
+int main(int argc, char **argv)
+{
+	DecodeSettings s;
+	if (!ParseArgs(argc, argv, s)) return 1;
+
+	CaptureFile capture;
+	if (!OpenCapture(s.input, capture)) return 1;
+	if (s.addIndex && !capture.AppendIndex(s.input)) return 1;
+	const size_t edgeCount = capture.EdgeCount();
+	if (edgeCount == 0)
+	{
+		printf("%s has no edges\n", s.input);
+		return 1;
+	}
+
+	// several chunks per thread balances the load, but each chunk should be well beyond its lead-in
+	const int threads = s.threads ? s.threads : std::max(1u, std::thread::hardware_concurrency());
+	size_t chunkCount = s.chunks ? s.chunks : threads * 8;
+	chunkCount = std::max<size_t>(1, std::min(chunkCount, edgeCount / (4 * s.overlap + 1)));
+
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+	std::vector<Chunk> chunks = MakeChunks(edgeCount, chunkCount, s.overlap);
+	DecodeChunks(capture, chunks, threads);
+	const int redone = MergeChunks(capture, chunks);
+	const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	DecodeStats stats;
+	uint64_t totalTicks;
+	if (!Report(chunks, s.output, stats, totalTicks)) return 1;
+
+	const double trackSeconds = (double)totalTicks / CLOCK_SCALE_FACTOR / 1e6;
+	printf("Capture: %zu edges, %.1f s of track time, %.2f bytes per edge%s\n", edgeCount, trackSeconds,
+		(double)capture.DataBytes() / edgeCount, capture.Indexed() ? "" : " (no index)");
+	printf("Decoded in %.3f s with %d threads, %zu chunks (%d continued from the chunk before): %.1f M edges/s, %.0fx real time\n",
+		seconds, threads, chunks.size(), redone, edgeCount / seconds / 1e6, trackSeconds / seconds);
+	stats.Print();
+
+	if (s.check)
+	{
+		std::vector<Chunk> single = MakeChunks(edgeCount, 1, s.overlap);
+		start = Clock::now();
+		DecodeChunk(capture, single[0]);
+		const double singleSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+		const bool same = SameEvents(chunks, single[0]);
+		printf("One decoder: %.3f s, %.2fx speedup on %u hardware threads, %s\n", singleSeconds, singleSeconds / seconds,
+			std::thread::hardware_concurrency(), same ? "results match" : "RESULTS DIFFER");
+		if (!same) return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,379 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "CaptureFile.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// the index entries, and the trailer that ends the index
+enum : byte
+{
+	INDEX_ENTRY_SIZE = 16,
+	INDEX_TRAILER_SIZE = 16,
+};
+
+
+static uint64_t ReadLE(const byte *Data, byte Bytes)
+{
+	uint64_t value = 0;
+	for (byte i = Bytes; i > 0; i--)
+		value = (value << 8) | Data[i - 1];
+	return value;
+}
+
+
+static void WriteLE(byte *Data, uint64_t Value, byte Bytes)
+{
+	for (byte i = 0; i < Bytes; i++)
+		Data[i] = (byte)(Value >> (8 * i));
+}
+
+
+// Reading   ==========================================================================
+
+CaptureFile::~CaptureFile()
+{
+	if (map)
+		munmap((void *)map, mapSize);
+}
+
+
+// map the file, check the header, and get the index
+bool CaptureFile::Open(const char *FileName)
+{
+	const int fd = open(FileName, O_RDONLY);
+	if (fd < 0)
+	{
+		printf("can't open %s\n", FileName);
+		return false;
+	}
+
+	struct stat status;
+	if (fstat(fd, &status) != 0 || status.st_size < CaptureEncoder::HEADER_SIZE)
+	{
+		close(fd);
+		printf("%s is not a capture file\n", FileName);
+		return false;
+	}
+
+	mapSize = status.st_size;
+	void *mapped = mmap(0, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+	{
+		printf("can't map %s\n", FileName);
+		return false;
+	}
+	map = (const byte *)mapped;
+
+	if (memcmp(map, "DCCT", 4) != 0 || map[4] != CaptureEncoder::VERSION)
+	{
+		printf("%s is not a version %d capture file\n", FileName, CaptureEncoder::VERSION);
+		return false;
+	}
+
+	timerBits = map[5];
+	timerPrescaler = map[6];
+	timerHz = ReadLE(map + 8, 4);
+	blockEdges = ReadLE(map + 12, 2);
+	if ((timerBits != 8 && timerBits != 16) || blockEdges == 0 || timerHz == 0)
+	{
+		printf("%s has an invalid header\n", FileName);
+		return false;
+	}
+
+	if (ReadIndex())
+		return true;
+
+	// the capture is scanned to build the index, a streamed capture may have been cut off part way
+	if (!BuildIndex())
+		printf("%s has an invalid code at offset %zu, reading the %zu edges before it\n", FileName, dataEnd, edgeCount);
+	return true;
+}
+
+
+// read the index at the end of the file, if it has one
+bool CaptureFile::ReadIndex()
+{
+	if (mapSize < CaptureEncoder::HEADER_SIZE + INDEX_TRAILER_SIZE)
+		return false;
+
+	const byte *trailer = map + mapSize - INDEX_TRAILER_SIZE;
+	if (memcmp(trailer + 12, "DCCI", 4) != 0)
+		return false;
+
+	// the number of blocks must match the number of edges, and fit in the file
+	const uint64_t edges = ReadLE(trailer, 8);
+	const uint64_t count = ReadLE(trailer + 8, 4);
+	const uint64_t indexSize = count * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE;
+	if (count != (edges + blockEdges - 1) / blockEdges || indexSize > mapSize - CaptureEncoder::HEADER_SIZE)
+		return false;
+
+	dataEnd = mapSize - indexSize;
+	blocks.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		const byte *entry = map + dataEnd + i * INDEX_ENTRY_SIZE;
+		blocks[i].offset = ReadLE(entry, 8);
+		blocks[i].ticks = ReadLE(entry + 8, 8);
+		if (blocks[i].offset < CaptureEncoder::HEADER_SIZE || blocks[i].offset >= dataEnd ||
+			(map[blocks[i].offset] != CaptureEncoder::CODE_COUNT && map[blocks[i].offset] != CaptureEncoder::CODE_GAP))
+		{
+			blocks.clear();
+			return false;
+		}
+	}
+
+	edgeCount = edges;
+	indexed = true;
+	return true;
+}
+
+
+// build the index by reading the whole capture. returns false if it stopped at an invalid code.
+bool CaptureFile::BuildIndex()
+{
+	dataEnd = mapSize;
+	blocks.clear();
+	edgeCount = 0;
+
+	Reader reader{ *this, 0 };
+	Edge edge;
+	uint64_t ticks = 0;
+	size_t end = reader.Offset();
+	while (reader.Next(edge))
+	{
+		if (edgeCount > 0)
+			ticks += edge.period;
+
+		// each block must start with the timer count, and takes in a gap before its first edge
+		if (edgeCount % blockEdges == 0)
+		{
+			if (map[reader.EdgeOffset()] != CaptureEncoder::CODE_COUNT)
+				break;
+			const Block block = { edge.gap ? end : reader.EdgeOffset(), ticks };
+			blocks.push_back(block);
+		}
+
+		edgeCount++;
+		end = reader.Offset();
+	}
+
+	// an incomplete code at the end is dropped, anything else is an error
+	const bool complete = (mapSize - end < CaptureEncoder::MAX_CODE_SIZE) && reader.Offset() == end;
+	dataEnd = end;
+	return complete;
+}
+
+
+// add the index to a file that doesn't have one, dropping anything after the last edge
+bool CaptureFile::AppendIndex(const char *FileName)
+{
+	if (indexed)
+		return true;
+
+	std::vector<byte> index(blocks.size() * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE);
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		WriteLE(&index[i * INDEX_ENTRY_SIZE], blocks[i].offset, 8);
+		WriteLE(&index[i * INDEX_ENTRY_SIZE + 8], blocks[i].ticks, 8);
+	}
+	byte *trailer = &index[blocks.size() * INDEX_ENTRY_SIZE];
+	WriteLE(trailer, edgeCount, 8);
+	WriteLE(trailer + 8, blocks.size(), 4);
+	memcpy(trailer + 12, "DCCI", 4);
+
+	FILE *file = 0;
+	if (truncate(FileName, dataEnd) != 0 || !(file = fopen(FileName, "ab")) ||
+		fwrite(index.data(), 1, index.size(), file) != index.size() || fclose(file) != 0)
+	{
+		printf("can't add the index to %s\n", FileName);
+		return false;
+	}
+
+	indexed = true;
+	return true;
+}
+
+
+// start reading at the block that holds the first edge, and read up to the edge
+CaptureFile::Reader::Reader(const CaptureFile &File, size_t FirstEdge) :
+	map(File.map), data(File.map + CaptureEncoder::HEADER_SIZE), end(File.map + File.dataEnd),
+	mask(File.timerBits == 8 ? 0xFF : 0xFFFF)
+{
+	const size_t block = FirstEdge / File.blockEdges;
+	size_t skip = FirstEdge;
+	if (block < File.blocks.size())
+	{
+		data = File.map + File.blocks[block].offset;
+		skip -= block * File.blockEdges;
+	}
+
+	Edge edge;
+	while (skip > 0 && Next(edge))
+		skip--;
+}
+
+
+// decode the next edge. returns false at the end of the capture, or at an invalid code.
+bool CaptureFile::Reader::Next(Edge &edge)
+{
+	edge.gap = false;
+
+	while (data < end)
+	{
+		const byte code = data[0];
+		uint16_t period;
+
+		if (code <= CaptureEncoder::CODE_CHANGE_MAX)
+		{
+			const int change = (code & 0x40) ? code - 0x80 : code;
+			period = (lastPeriod + change) & mask;
+			lastPeriod = period;
+			edgeOffset = data - map;
+			data += 1;
+		}
+		else if (code < CaptureEncoder::CODE_CHANGE_14 + 0x40)
+		{
+			if (end - data < 2) return false;
+			const int bits = ((code & 0x3F) << 8) | data[1];
+			const int change = (bits & 0x2000) ? bits - 0x4000 : bits;
+			period = (lastPeriod + change) & mask;
+			lastPeriod = period;
+			edgeOffset = data - map;
+			data += 2;
+		}
+		else if (code == CaptureEncoder::CODE_GAP)
+		{
+			edge.gap = true;
+			data += 1;
+			continue;
+		}
+		else if (code == CaptureEncoder::CODE_COUNT)
+		{
+			if (end - data < 3) return false;
+			const uint16_t count = data[1] | (data[2] << 8);
+			period = (count - lastCount) & mask;
+			lastPeriod = 0;
+			edgeOffset = data - map;
+			data += 3;
+		}
+		else if (code == CaptureEncoder::CODE_PERIOD)
+		{
+			if (end - data < 3) return false;
+			period = (data[1] | (data[2] << 8)) & mask;
+			lastPeriod = period;
+			edgeOffset = data - map;
+			data += 3;
+		}
+		else
+		{
+			return false;
+		}
+
+		lastCount = (lastCount + period) & mask;
+		edge.count = lastCount;
+		edge.period = period;
+		return true;
+	}
+	return false;
+}
+
+
+// Writing   ==========================================================================
+
+CaptureWriter::~CaptureWriter()
+{
+	if (file)
+		fclose(file);
+}
+
+
+// create the file and write the header
+bool CaptureWriter::Open(const char *FileName)
+{
+	file = fopen(FileName, "wb");
+	if (!file)
+	{
+		printf("can't write %s\n", FileName);
+		return false;
+	}
+
+	byte header[CaptureEncoder::HEADER_SIZE];
+	offset = fwrite(header, 1, encoder.Header(header), file);
+	return true;
+}
+
+
+// add an edge, noting the start of each block for the index
+void CaptureWriter::Edge(uint16_t Count)
+{
+	if (edgeCount > 0)
+		ticks += (TIMER_BITS == 8) ? (byte)(Count - lastCount) : (uint16_t)(Count - lastCount);
+	lastCount = Count;
+
+	if (edgeCount % CaptureEncoder::BLOCK_EDGES == 0)
+	{
+		const CaptureFile::Block block = { gap ? gapOffset : offset, ticks };
+		blocks.push_back(block);
+	}
+	edgeCount++;
+	gap = false;
+
+	byte code[CaptureEncoder::MAX_CODE_SIZE];
+	offset += fwrite(code, 1, encoder.Edge(Count, code), file);
+}
+
+
+void CaptureWriter::Gap()
+{
+	if (!gap)
+		gapOffset = offset;
+	gap = true;
+
+	byte code[CaptureEncoder::MAX_CODE_SIZE];
+	offset += fwrite(code, 1, encoder.Gap(code), file);
+}
+
+
+// write the index and close the file
+bool CaptureWriter::Close()
+{
+	std::vector<byte> index(blocks.size() * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE);
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		WriteLE(&index[i * INDEX_ENTRY_SIZE], blocks[i].offset, 8);
+		WriteLE(&index[i * INDEX_ENTRY_SIZE + 8], blocks[i].ticks, 8);
+	}
+	byte *trailer = &index[blocks.size() * INDEX_ENTRY_SIZE];
+	WriteLE(trailer, edgeCount, 8);
+	WriteLE(trailer + 8, blocks.size(), 4);
+	memcpy(trailer + 12, "DCCI", 4);
+
+	const bool written = fwrite(index.data(), 1, index.size(), file) == index.size() && !ferror(file);
+	const bool closed = fclose(file) == 0;
+	file = 0;
+	return written && closed;
+}
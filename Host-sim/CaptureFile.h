@@ -0,0 +1,179 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+DCC Capture Files
+
+Classes to read and write captures of the DCC edge timestamps on a Linux host, in the format
+defined by CaptureEncoder.
+
+Summary:
+
+CaptureWriter writes a capture file with the same encoder the decoder uses to stream a capture,
+followed by an index of the blocks. CaptureFile maps a capture into memory, and a Reader decodes
+the edges from any point in it, going straight to the block that holds the edge.
+
+Example usage:
+
+	CaptureWriter writer;
+	writer.Open("capture.dcc");                     // write the header
+	writer.Edge(count);                             // add the timer count of each edge
+	writer.Gap();                                   // mark lost timestamps
+	writer.Close();                                 // write the index
+
+	CaptureFile capture;
+	capture.Open("capture.dcc");                    // map the file and read or build the index
+	CaptureFile::Reader reader{ capture, 100000 };  // read from the 100000th edge
+	reader.Next(edge);                              // the count, period, and any gap before the next edge
+
+Details:
+
+The index follows the edge codes at the end of the file. It holds an entry for each block, of 16
+bytes: the offset of the block in the file (of the code for its first edge, or of the gap marker
+before it), and the timer counts from the first edge of the capture to the first edge of the block.
+After the entries come the number of edges (8 bytes), the number of blocks (4 bytes), and "DCCI".
+All values are little endian.
+
+A capture streamed from the decoder has no index, since it is written as it is made. When a file
+without an index is opened, the index is built by decoding the whole capture once, which also
+drops an incomplete code at the end (from stopping the stream part way through an edge).
+AppendIndex adds the index to the file, so it is ready the next time.
+
+The file is mapped read only, so a capture of any size opens at once, and threads can read their
+parts of it at the same time, each with its own Reader.
+
+*/
+
+#ifndef _CAPTUREFILE_h
+#define _CAPTUREFILE_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+#include "WProgram.h"
+#include "CaptureEncoder.h"
+
+
+class CaptureFile
+{
+public:
+	// the start of a block, and the timer counts from the start of the capture to its first edge
+	struct Block
+	{
+		uint64_t offset;
+		uint64_t ticks;
+	};
+
+	// an edge read from the capture
+	struct Edge
+	{
+		uint16_t count;         // timer count
+		uint16_t period;        // timer counts since the edge before
+		bool gap;               // timestamps were lost before this edge
+	};
+
+	// reads the edges of a capture, from a given edge on
+	class Reader
+	{
+	public:
+		Reader(const CaptureFile &File, size_t FirstEdge);
+		bool Next(Edge &edge);
+
+		// the offsets in the file of the next code, and of the code for the last edge read
+		size_t Offset() const { return data - map; }
+		size_t EdgeOffset() const { return edgeOffset; }
+
+	private:
+		const byte *map;
+		const byte *data;
+		const byte *end;
+		uint16_t mask;
+		size_t edgeOffset = 0;
+		uint16_t lastCount = 0;
+		uint16_t lastPeriod = 0;
+	};
+
+	CaptureFile() {}
+	~CaptureFile();
+	CaptureFile(const CaptureFile &) = delete;
+	CaptureFile &operator=(const CaptureFile &) = delete;
+
+	// map the file, and read or build its index. prints the reason and returns false if it can't.
+	bool Open(const char *FileName);
+	bool AppendIndex(const char *FileName);
+
+	// the header fields, and the size of the capture
+	uint32_t TimerHz() const { return timerHz; }
+	byte TimerBits() const { return timerBits; }
+	byte TimerPrescaler() const { return timerPrescaler; }
+	size_t BlockEdges() const { return blockEdges; }
+	size_t EdgeCount() const { return edgeCount; }
+	size_t DataBytes() const { return dataEnd - CaptureEncoder::HEADER_SIZE; }
+	bool Indexed() const { return indexed; }
+	const std::vector<Block> &Blocks() const { return blocks; }
+
+private:
+	const byte *map = 0;
+	size_t mapSize = 0;
+	size_t dataEnd = 0;                 // end of the edge codes, and start of the index if there is one
+	uint32_t timerHz = 0;
+	byte timerBits = 0;
+	byte timerPrescaler = 0;
+	size_t blockEdges = 0;
+	size_t edgeCount = 0;
+	bool indexed = false;               // the index was read from the file
+	std::vector<Block> blocks;
+
+	bool ReadIndex();
+	bool BuildIndex();
+};
+
+
+class CaptureWriter
+{
+public:
+	CaptureWriter() {}
+	~CaptureWriter();
+	CaptureWriter(const CaptureWriter &) = delete;
+	CaptureWriter &operator=(const CaptureWriter &) = delete;
+
+	bool Open(const char *FileName);
+	void Edge(uint16_t Count);
+	void Gap();
+	bool Close();
+
+	size_t EdgeCount() const { return edgeCount; }
+	uint64_t Bytes() const { return offset; }
+
+private:
+	FILE *file = 0;
+	CaptureEncoder encoder;
+	uint64_t offset = 0;                // bytes written
+	uint64_t ticks = 0;                 // timer counts from the first edge
+	uint16_t lastCount = 0;
+	size_t edgeCount = 0;
+	bool gap = false;                   // a gap marker was written since the last edge
+	uint64_t gapOffset = 0;             // and where
+	std::vector<CaptureFile::Block> blocks;
+};
+
+#endif
@@ -0,0 +1,100 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Reference DCC Packet Builder
+
+A frozen copy of the original bit at a time DCCpacket class, for differential testing.
+
+Summary:
+
+DCCpacket assembles packets a word at a time. This copy of the original implementation, which walks
+the incoming bits one at a time through its state machine, is kept so that the simulator can feed
+the same bitstream to both and check that they produce exactly the same packets and errors. It
+should not be changed, other than to keep it compiling.
+
+*/
+
+#ifndef _DCCPACKETREF_h
+#define _DCCPACKETREF_h
+
+#include "DCCpacket.h"
+
+
+enum : byte { MAX_PACKET_LOG_SIZE = 15 };    // max number of packets to check for repeats
+
+class DCCpacketRef
+{
+
+public:
+	typedef void(*PacketCompleteHandler)(byte *Packet, byte PacketSize);
+	typedef void(*PacketErrorHandler)(byte ErrorCode);
+
+	DCCpacketRef();
+	DCCpacketRef(bool EnableChecksum, bool FilterRepeats, unsigned int FilterInterval);
+	void ProcessIncomingBits(unsigned long incomingBits);
+	void SetPacketCompleteHandler(PacketCompleteHandler Handler);
+	void SetPacketErrorHandler(PacketErrorHandler Handler);
+	void EnableChecksum(bool Enable);
+	void FilterRepeatPackets(bool Filter);
+
+private:
+	// states
+	enum State : byte
+	{
+		READPREAMBLE,
+		READPACKET,
+	};
+
+	struct LogPacket
+	{
+		unsigned long packetTime;
+		byte packetSize;
+		byte packetData[PACKET_LEN_MAX + 1];
+	};
+
+	// private functions
+	void ReadPreamble();
+	void ReadPacket();
+	void Execute();
+	void Reset();
+	bool IsRepeatPacket();
+
+	// callback handlers
+	PacketCompleteHandler packetCompleteHandler = 0;
+	PacketErrorHandler packetErrorHandler = 0;
+
+	// state and packet vars
+	unsigned long dataBits = 0;         // the source bit data
+	State state = READPREAMBLE;         // current processing state
+	byte packetIndex = 0;               // packet byte that we're on
+	byte packetMask = 0x80;             // mask for assigning bits to packet bytes
+	byte packet[PACKET_LEN_MAX + 1];    // packet data
+	bool currentBit = 0;                // the current bit extracted from the input stream
+	byte preambleBitCount = 0;          // count of consecutive 1's we've found while looking for preamble
+
+	bool enableChecksum = true;                // require valid checksum in order to return packet
+	bool filterRepeatPackets = true;           // filter out repeated packets, sending only the first in the given interval
+	unsigned int filterInterval = 250;         // time period (ms) within which packets are considered repeats
+	LogPacket packetLog[MAX_PACKET_LOG_SIZE];  // history of packets to check for repeats
+};
+
+#endif
@@ -0,0 +1,87 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/*
+
+Host EEPROM Library Shim
+
+A stand-in for the Arduino EEPROM library, so that the code that keeps state in EEPROM can be built
+and run on a Linux host.
+
+Summary:
+
+The EEPROM is an array the size of an ATmega328's, 1024 bytes, which starts erased (all 0xFF) as a
+new chip's does. As well as the library's read, write, update, get and put, it counts the writes to
+each cell, so that a test can check the wear, and Erase sets it back to new. Writes are immediate;
+on the host there is no eeprom_is_ready to wait on.
+
+*/
+
+#ifndef _EEPROM_h
+#define _EEPROM_h
+
+#include "WProgram.h"
+
+
+class EEPROMClass
+{
+public:
+	enum : uint16_t { SIZE = 1024 };
+
+	EEPROMClass() { Erase(); }
+
+	byte read(int Address) { return cells[Address]; }
+	void write(int Address, byte Value) { cells[Address] = Value; writes[Address]++; }
+
+	// as the library, only write the cell if the value differs
+	void update(int Address, byte Value) { if (cells[Address] != Value) write(Address, Value); }
+
+	uint16_t length() { return SIZE; }
+
+	template <typename T> T &get(int Address, T &Value)
+	{
+		memcpy(&Value, &cells[Address], sizeof(T));
+		return Value;
+	}
+
+	template <typename T> const T &put(int Address, const T &Value)
+	{
+		const byte *bytes = (const byte *)&Value;
+		for (size_t i = 0; i < sizeof(T); i++)
+			update(Address + i, bytes[i]);
+		return Value;
+	}
+
+	// host only: the number of times a cell has been written, and setting the whole EEPROM back to new
+	unsigned long Writes(int Address) { return writes[Address]; }
+
+	void Erase()
+	{
+		memset(cells, 0xFF, sizeof(cells));
+		memset(writes, 0, sizeof(writes));
+	}
+
+private:
+	byte cells[SIZE];
+	unsigned long writes[SIZE];
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
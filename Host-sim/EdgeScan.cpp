@@ -0,0 +1,242 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "EdgeScan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EDGESCAN_X86
+#endif
+
+
+// Scalar   ==========================================================================
+
+// one sample at a time, from a bit of each byte
+static size_t ScanBytesScalar(const byte *Data, size_t Bytes, byte Channel, uint64_t Sample, byte &level,
+	std::vector<uint64_t> &edges)
+{
+	for (size_t i = 0; i < Bytes; i++)
+	{
+		const byte bit = (Data[i] >> Channel) & 1;
+		if (bit != level)
+		{
+			edges.push_back(Sample + i);
+			level = bit;
+		}
+	}
+	return Bytes;
+}
+
+
+// one sample at a time, from each bit of each byte
+static size_t ScanBitsScalar(const byte *Data, size_t Bytes, byte Channel, uint64_t Sample, byte &level,
+	std::vector<uint64_t> &edges)
+{
+	for (size_t i = 0; i < Bytes; i++)
+	{
+		for (byte b = 0; b < 8; b++)
+		{
+			const byte bit = (Data[i] >> b) & 1;
+			if (bit != level)
+			{
+				edges.push_back(Sample + 8 * i + b);
+				level = bit;
+			}
+		}
+	}
+	return Bytes;
+}
+
+
+#ifdef EDGESCAN_X86
+
+// the edges in 64 consecutive samples, one per bit, are the bits that differ from the bit before
+static inline void MaskEdges(uint64_t Mask, uint64_t Sample, byte &level, std::vector<uint64_t> &edges)
+{
+	uint64_t changes = Mask ^ ((Mask << 1) | level);
+	level = Mask >> 63;
+	while (changes)
+	{
+		edges.push_back(Sample + __builtin_ctzll(changes));
+		changes &= changes - 1;
+	}
+}
+
+
+// 64 packed samples, first sample in the low bit
+static inline uint64_t LoadSamples(const byte *Data)
+{
+	uint64_t samples;
+	memcpy(&samples, Data, sizeof(samples));
+	return samples;
+}
+
+
+// SSE2   ==========================================================================
+
+// shift the channel bit of each byte to the top, and gather them with a movemask, 64 samples at a time
+__attribute__((target("sse2")))
+static size_t ScanBytesSSE2(const byte *Data, size_t Bytes, byte Channel, uint64_t Sample, byte &level,
+	std::vector<uint64_t> &edges)
+{
+	const __m128i shift = _mm_cvtsi32_si128(7 - Channel);
+	size_t i = 0;
+	for (; i + 64 <= Bytes; i += 64)
+	{
+		uint64_t mask = 0;
+		for (byte q = 0; q < 4; q++)
+		{
+			const __m128i samples = _mm_sll_epi16(_mm_loadu_si128((const __m128i *)(Data + i + 16 * q)), shift);
+			mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(samples) << (16 * q);
+		}
+		if (mask != -(uint64_t)level)
+			MaskEdges(mask, Sample + i, level, edges);
+	}
+	return i;
+}
+
+
+// skip 256 samples at a time while they match the level
+__attribute__((target("sse2")))
+static size_t ScanBitsSSE2(const byte *Data, size_t Bytes, byte Channel, uint64_t Sample, byte &level,
+	std::vector<uint64_t> &edges)
+{
+	size_t i = 0;
+	for (; i + 32 <= Bytes; i += 32)
+	{
+		const __m128i steady = _mm_set1_epi8(level ? -1 : 0);
+		const __m128i low = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(Data + i)), steady);
+		const __m128i high = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(Data + i + 16)), steady);
+		if (_mm_movemask_epi8(_mm_and_si128(low, high)) == 0xFFFF)
+			continue;
+
+		for (byte w = 0; w < 32; w += 8)
+			MaskEdges(LoadSamples(Data + i + w), Sample + 8 * (i + w), level, edges);
+	}
+	return i;
+}
+
+
+// AVX2   ==========================================================================
+
+__attribute__((target("avx2")))
+static size_t ScanBytesAVX2(const byte *Data, size_t Bytes, byte Channel, uint64_t Sample, byte &level,
+	std::vector<uint64_t> &edges)
+{
+	const __m128i shift = _mm_cvtsi32_si128(7 - Channel);
+	size_t i = 0;
+	for (; i + 64 <= Bytes; i += 64)
+	{
+		const __m256i low = _mm256_sll_epi16(_mm256_loadu_si256((const __m256i *)(Data + i)), shift);
+		const __m256i high = _mm256_sll_epi16(_mm256_loadu_si256((const __m256i *)(Data + i + 32)), shift);
+		const uint64_t mask = (uint32_t)_mm256_movemask_epi8(low) | ((uint64_t)(uint32_t)_mm256_movemask_epi8(high) << 32);
+		if (mask != -(uint64_t)level)
+			MaskEdges(mask, Sample + i, level, edges);
+	}
+	return i;
+}
+
+
+__attribute__((target("avx2")))
+static size_t ScanBitsAVX2(const byte *Data, size_t Bytes, byte Channel, uint64_t Sample, byte &level,
+	std::vector<uint64_t> &edges)
+{
+	size_t i = 0;
+	for (; i + 32 <= Bytes; i += 32)
+	{
+		const __m256i changes = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(Data + i)), _mm256_set1_epi8(level ? -1 : 0));
+		if (_mm256_testz_si256(changes, changes))
+			continue;
+
+		for (byte w = 0; w < 32; w += 8)
+			MaskEdges(LoadSamples(Data + i + w), Sample + 8 * (i + w), level, edges);
+	}
+	return i;
+}
+
+#endif
+
+
+// Scanner   ==========================================================================
+
+EdgeScanner::EdgeScanner(SampleFormat Format, byte Channel, ScanKernel Kernel) :
+	format(Format), channel(Channel & 7), kernel(Supported(Kernel) ? Kernel : SCAN_SCALAR)
+{
+}
+
+
+// scan as much as the kernel takes, and the rest a sample at a time
+void EdgeScanner::Scan(const byte *Data, size_t Bytes, std::vector<uint64_t> &edges)
+{
+	if (Bytes == 0)
+		return;
+
+	if (!started)
+	{
+		level = (format == SAMPLE_BITS) ? (Data[0] & 1) : ((Data[0] >> channel) & 1);
+		started = true;
+	}
+
+	typedef size_t (*Kernel)(const byte *, size_t, byte, uint64_t, byte &, std::vector<uint64_t> &);
+	Kernel scalar = (format == SAMPLE_BITS) ? ScanBitsScalar : ScanBytesScalar;
+	Kernel fast = scalar;
+#ifdef EDGESCAN_X86
+	if (kernel == SCAN_SSE2)
+		fast = (format == SAMPLE_BITS) ? ScanBitsSSE2 : ScanBytesSSE2;
+	else if (kernel == SCAN_AVX2)
+		fast = (format == SAMPLE_BITS) ? ScanBitsAVX2 : ScanBytesAVX2;
+#endif
+
+	const byte perByte = (format == SAMPLE_BITS) ? 8 : 1;
+	const size_t done = fast(Data, Bytes, channel, sample, level, edges);
+	scalar(Data + done, Bytes - done, channel, sample + done * perByte, level, edges);
+	sample += Bytes * perByte;
+}
+
+
+EdgeScanner::ScanKernel EdgeScanner::BestKernel()
+{
+	if (Supported(SCAN_AVX2)) return SCAN_AVX2;
+	if (Supported(SCAN_SSE2)) return SCAN_SSE2;
+	return SCAN_SCALAR;
+}
+
+
+bool EdgeScanner::Supported(ScanKernel Kernel)
+{
+#ifdef EDGESCAN_X86
+	if (Kernel == SCAN_SSE2) return __builtin_cpu_supports("sse2");
+	if (Kernel == SCAN_AVX2) return __builtin_cpu_supports("avx2");
+#endif
+	return Kernel == SCAN_SCALAR;
+}
+
+
+const char *EdgeScanner::KernelName(ScanKernel Kernel)
+{
+	switch (Kernel)
+	{
+	case SCAN_SSE2: return "sse2";
+	case SCAN_AVX2: return "avx2";
+	default: return "scalar";
+	}
+}
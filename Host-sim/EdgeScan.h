@@ -0,0 +1,110 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Edge Scanner
+
+Finds the edges of a signal in raw logic analyzer samples, on a Linux host.
+
+Summary:
+
+A logic analyzer samples the DCC signal at a fixed rate, so almost all of the samples just repeat
+the one before: at 24 MS/s there are 1400 to 2400 samples to each edge. The scanner finds the few
+samples where the signal changes, and gives their sample numbers. The samples may be packed one per
+bit (first sample in the low bit), or be bytes with a bit for each of 8 channels, of which one is
+the DCC signal.
+
+Example usage:
+
+	EdgeScanner scanner{ EdgeScanner::SAMPLE_BYTES, 3, EdgeScanner::BestKernel() };   // channel 3
+	scanner.Scan(data, size, edges);    // append the sample numbers of the edges in the next samples
+	scanner.Samples();                  // the samples scanned so far
+
+Details:
+
+The work is all in skipping the samples between edges, at the speed the samples can be read from
+memory. There are three kernels, which find the same edges:
+
+	SCAN_SCALAR    one sample at a time, the reference for the others
+	SCAN_SSE2      16 bytes at a time
+	SCAN_AVX2      32 bytes at a time, if the processor has it (checked at run time)
+
+The SIMD kernels gather 64 samples of the channel into a 64 bit mask, with one byte shift and one
+movemask per 16 or 32 byte samples, or take 64 packed samples as they are. A mask that matches the
+current level has no edges, and is skipped with one compare. Otherwise the edges are the bits that
+differ from the bit before (mask ^ (mask << 1 | level)), and are found with a bit scan. For packed
+samples, a whole 32 byte block is first compared against the level, so a run of 256 samples with no
+edge takes one compare.
+
+The first sample sets the level, and is not an edge. The data may be scanned in pieces of any size,
+which carry on from each other.
+
+*/
+
+#ifndef _EDGESCAN_h
+#define _EDGESCAN_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "WProgram.h"
+
+
+class EdgeScanner
+{
+public:
+	// how the samples are stored
+	enum SampleFormat : byte
+	{
+		SAMPLE_BITS,            // one sample per bit, first sample in the low bit
+		SAMPLE_BYTES,           // one sample per byte, a bit for each channel
+	};
+
+	// how the edges are found
+	enum ScanKernel : byte
+	{
+		SCAN_SCALAR,
+		SCAN_SSE2,
+		SCAN_AVX2,
+	};
+
+	EdgeScanner(SampleFormat Format, byte Channel, ScanKernel Kernel);
+
+	// find the edges in the next samples, and append their sample numbers
+	void Scan(const byte *Data, size_t Bytes, std::vector<uint64_t> &edges);
+	uint64_t Samples() const { return sample; }
+
+	// the fastest kernel this processor can run, and if it can run a given kernel
+	static ScanKernel BestKernel();
+	static bool Supported(ScanKernel Kernel);
+	static const char *KernelName(ScanKernel Kernel);
+
+private:
+	SampleFormat format;
+	byte channel;
+	ScanKernel kernel;
+	uint64_t sample = 0;        // sample number of the next sample
+	byte level = 0;             // the last sample
+	bool started = false;       // the first sample has set the level
+};
+
+#endif
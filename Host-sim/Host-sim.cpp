@@ -0,0 +1,1019 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Host DCC Simulator
+
+Runs the DCC capture pipeline on a Linux host against a synthesized track signal.
+
+Summary:
+
+A busy layout is synthesized as a list of packets (idle packets, loco speed and function packets,
+and accessory commands), which the Waveform class turns into edge timestamps. Each edge is converted
+to a Timer1 count and delivered through the input capture ISR into the SimpleQueue, exactly as on the
+Arduino. The main loop is emulated by calling ProcessTimestamps at a fixed interval of simulated
+time, so the effect of a slow loop on the timestamp queue can be studied.
+
+Two pipelines are available. The packet pipeline connects BitStream to DCCpacket with repeat
+filtering disabled, and compares the recovered packets against the injected ones. The decoder
+pipeline runs the complete DCCdecoder, and counts the accessory commands that are delivered against
+the distinct commands that were injected. With --handler, the decoder is given a handler object
+rather than callbacks, so the callback and template versions of the decode path can be compared.
+
+The processing throughput (edges per second of host time, and host cycles per edge where a cycle
+counter is available) is reported, along with the bit and packet errors seen. The latency from the
+last edge of each packet on the track to the callback that delivers it is measured in simulated
+time, for every recovered packet in the packet pipeline, and for each accessory command in the
+decoder pipeline. The packet pipeline streams bits to DCCpacket up to the next possible packet end,
+as DCCdecoder does, unless --batch is given to deliver them in blocks of 32.
+
+With --threaded, a producer thread stands in for the capture ISR, delivering the edges in real time
+(sped up by --speedup) while the main thread runs the loop processing, so the timestamp queue is
+exercised with true concurrency between the producer and the consumer.
+
+With --instances N, N decoders are run at once, each on its own bitstream channel with its own
+layout (seeded from --seed upwards) and handler. They are run one at a time and then concurrently,
+one thread each, and each decoder must deliver the same commands both ways, which shows that no
+decoder state is shared between instances.
+
+With --save, the Timer1 counts of the edges are written to a capture file (in the format of
+CaptureEncoder, with a block index) for the capture-decode tool, and nothing is decoded.
+
+The differential test (--diff) checks the DCCpacket builder against DCCpacketRef, a frozen copy of
+the original bit at a time implementation. The bitstream recovered from the signal, followed by a
+randomized bitstream of preambles, packets, and framing errors, is fed to both, and every packet and
+error they report must match exactly. The time taken per 32 bit word by each is reported.
+
+The repeat filter benchmark (--filter-bench) replays the recovered bitstream at its simulated times
+through both builders with repeat filtering enabled, and reports the time per word, the packets
+delivered, and the filter table overflows for each. The packets DCCpacket delivers are checked
+against a model of the filter (a map of each packet to the time it was last seen) applied to the
+unfiltered packets. Use it with enough locos and repeats to keep the filter busy.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HOST_CYCLES() __rdtsc()
+#else
+#define HOST_CYCLES() 0ULL
+#endif
+
+#include "WProgram.h"
+#include "Bitstream.h"
+#include "DCCpacket.h"
+#include "DCCdecoder.h"
+#include "Waveform.h"
+#include "DCCpacketRef.h"
+#include "CaptureFile.h"
+
+
+// Settings   ==========================================================================
+
+struct SimSettings
+{
+	Waveform::Settings waveform;
+	int packets = 20000;             // number of distinct packets to inject (before repeats)
+	int locos = 8;                   // number of running locos on the layout
+	bool steady = false;             // locos hold their speed and functions, rather than changing every cycle
+	int accEvery = 25;               // one accessory command per this many packets
+	unsigned long loopUs = 200;      // simulated main loop interval
+	unsigned seed = 1;
+	bool decoderMode = false;        // run the full DCCdecoder rather than BitStream + DCCpacket
+	bool handlerMode = false;        // pass the decoder a handler object rather than setting callbacks
+	int address = 0;                 // decoder output address, 0 to return all packets
+	int addresses = 1;               // number of consecutive output addresses for the decoder
+	bool bitsOnly = false;           // run BitStream alone, to time the half bit processing
+	bool diffMode = false;           // compare DCCpacket against the reference implementation
+	bool filterBench = false;        // time the repeat filters against each other
+	bool batchMode = false;          // deliver bits to DCCpacket 32 at a time, rather than streaming
+	bool threaded = false;           // deliver edges from a producer thread in real time
+	int instances = 0;               // run this many decoders at once, each on its own channel and thread
+	const char *saveFile = 0;        // write the edges to a capture file, rather than decoding them
+	double speedup = 10.0;           // real time speedup for the producer thread
+};
+
+
+static void Usage()
+{
+	printf("usage: host-sim [options]\n"
+		"  --decoder            run the full DCCdecoder instead of BitStream + DCCpacket\n"
+		"  --handler            give the decoder a handler object instead of callbacks\n"
+		"  --address N          decoder output address, 1-8 are in use (default 0, all packets)\n"
+		"  --addresses N        number of consecutive output addresses from --address (default 1)\n"
+		"  --bits-only          run BitStream alone, discarding the assembled bits\n"
+		"  --diff               compare DCCpacket against the original implementation\n"
+		"  --filter-bench       time the DCCpacket repeat filter against the original\n"
+		"  --batch              deliver bits to DCCpacket in blocks of 32 instead of streaming\n"
+		"  --threaded           deliver edges from a producer thread, in real time\n"
+		"  --speedup X          real time speedup for --threaded (default 10)\n"
+		"  --instances N        run N decoders at once, each with its own layout, channel, and thread\n"
+		"  --save FILE          write the Timer1 counts of the edges to a capture file for capture-decode\n"
+		"  --packets N          distinct packets to inject (default 20000)\n"
+		"  --locos N            running locos (default 8)\n"
+		"  --steady             locos hold their speed and functions, so their packets repeat\n"
+		"  --acc-every N        one accessory command per N packets (default 25)\n"
+		"  --repeats N          send each packet N times back to back (default 1)\n"
+		"  --preamble N         preamble bits (default 14)\n"
+		"  --one US             half bit time for a 1 (default 58)\n"
+		"  --zero US            half bit time for a 0 (default 100)\n"
+		"  --jitter US          +/- jitter per half bit (default 0)\n"
+		"  --stretch US         max zero stretch (default 0)\n"
+		"  --glitch RATE        glitch probability per half bit (default 0)\n"
+		"  --drop RATE          dropped edge probability (default 0)\n"
+		"  --loop US            main loop interval in simulated us (default 200)\n"
+		"  --seed N             random seed (default 1)\n");
+}
+
+
+static bool ParseArgs(int argc, char **argv, SimSettings &s)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		const char *val = (i + 1 < argc) ? argv[i + 1] : 0;
+
+		if (!strcmp(arg, "--decoder")) { s.decoderMode = true; continue; }
+		if (!strcmp(arg, "--handler")) { s.decoderMode = s.handlerMode = true; continue; }
+		if (!strcmp(arg, "--bits-only")) { s.bitsOnly = true; continue; }
+		if (!strcmp(arg, "--diff")) { s.diffMode = true; continue; }
+		if (!strcmp(arg, "--filter-bench")) { s.filterBench = true; continue; }
+		if (!strcmp(arg, "--steady")) { s.steady = true; continue; }
+		if (!strcmp(arg, "--batch")) { s.batchMode = true; continue; }
+		if (!strcmp(arg, "--threaded")) { s.threaded = true; continue; }
+		if (!strcmp(arg, "--help")) { Usage(); exit(0); }
+		if (!val) { Usage(); return false; }
+
+		if (!strcmp(arg, "--packets")) s.packets = atoi(val);
+		else if (!strcmp(arg, "--locos")) s.locos = atoi(val);
+		else if (!strcmp(arg, "--address")) s.address = atoi(val);
+		else if (!strcmp(arg, "--addresses")) s.addresses = atoi(val);
+		else if (!strcmp(arg, "--acc-every")) s.accEvery = atoi(val);
+		else if (!strcmp(arg, "--repeats")) s.waveform.repeats = atoi(val);
+		else if (!strcmp(arg, "--preamble")) s.waveform.preambleBits = atoi(val);
+		else if (!strcmp(arg, "--one")) s.waveform.oneHalfUs = atof(val);
+		else if (!strcmp(arg, "--zero")) s.waveform.zeroHalfUs = atof(val);
+		else if (!strcmp(arg, "--jitter")) s.waveform.jitterUs = atof(val);
+		else if (!strcmp(arg, "--stretch")) s.waveform.zeroStretchUs = atof(val);
+		else if (!strcmp(arg, "--glitch")) s.waveform.glitchRate = atof(val);
+		else if (!strcmp(arg, "--drop")) s.waveform.dropRate = atof(val);
+		else if (!strcmp(arg, "--loop")) s.loopUs = strtoul(val, 0, 10);
+		else if (!strcmp(arg, "--seed")) s.seed = strtoul(val, 0, 10);
+		else if (!strcmp(arg, "--speedup")) s.speedup = atof(val);
+		else if (!strcmp(arg, "--instances")) s.instances = atoi(val);
+		else if (!strcmp(arg, "--save")) s.saveFile = val;
+		else { Usage(); return false; }
+		i++;
+	}
+	return true;
+}
+
+
+// Layout synthesis   ==========================================================================
+
+// build a basic accessory packet for a 1-based output address
+static void AccPacket(uint8_t *data, int outputAddress, bool direction)
+{
+	const int board = ((outputAddress - 1) >> 2) + 1;
+	const int out = (outputAddress - 1) & 0x03;
+	data[0] = 0x80 | (board & 0x3F);
+	data[1] = 0x80 | ((~(board >> 6) & 0x07) << 4) | 0x08 | (out << 1) | (direction ? 1 : 0);
+}
+
+
+// a busy layout: locos cycling through speed and function packets, idles, and accessory commands
+// to a handful of turnouts, each of which alternates direction so every command is distinct
+static int BuildLayout(Waveform &waveform, const SimSettings &s)
+{
+	int accCommands = 0;
+	bool accDirection[8] = { 0 };
+
+	for (int i = 0; i < s.packets; i++)
+	{
+		uint8_t data[5];
+
+		if (s.accEvery > 0 && (i % s.accEvery) == s.accEvery - 1)
+		{
+			const int turnout = accCommands % 8;
+			accDirection[turnout] = !accDirection[turnout];
+			AccPacket(data, 1 + turnout, accDirection[turnout]);
+			waveform.AddPacket(data, 2);
+			accCommands++;
+			continue;
+		}
+
+		if (s.locos == 0 || (i % 4) == 3)
+		{
+			waveform.AddIdle();
+			continue;
+		}
+
+		const int loco = i % s.locos;
+		const int cycle = s.steady ? loco : i / s.locos;    // steady locos send the same packets every cycle
+		data[0] = 3 + loco;                              // short address
+		if ((i / s.locos) % 3 == 2)
+		{
+			data[1] = 0x80 | ((s.steady ? loco : i) & 0x1F);    // function group one
+			waveform.AddPacket(data, 2);
+		}
+		else
+		{
+			data[1] = 0x3F;                              // 128 speed step
+			data[2] = 0x80 | (cycle & 0x7F);
+			waveform.AddPacket(data, 3);
+		}
+	}
+
+	return accCommands;
+}
+
+
+// Pipeline callbacks   ==========================================================================
+
+struct RecoveredPacket
+{
+	uint8_t data[6];
+	uint8_t size;
+	unsigned long us;      // simulated time of the callback
+};
+
+static BitStream *simBitStream = 0;
+static DCCpacket *simPacket = 0;
+static bool simStreaming = true;
+static std::vector<RecoveredPacket> recovered;
+static std::vector<unsigned long> accCallbackUs;
+static std::vector<long> latencyUs;
+static unsigned long bitErrors = 0;
+static unsigned long packetErrors = 0;
+static unsigned long accCallbacks = 0;
+static unsigned long bitWords = 0;
+static unsigned long repeatTableSamples = 0;
+static unsigned long repeatTableTotal = 0;
+static unsigned long long decodeCycles = 0;    // host cycles spent in the decoder's ProcessTimeStamps
+static byte repeatTableMax = 0;
+static std::vector<unsigned long> capturedWords;
+static std::vector<unsigned long> capturedUs;
+
+static void SimBitsOnly(unsigned long bits, byte count) { bitWords++; }
+static void SimBitsCapture(unsigned long bits, byte count) { capturedWords.push_back(bits); capturedUs.push_back(micros()); }
+
+static void SimBits(unsigned long bits, byte count)
+{
+	simPacket->ProcessIncomingBits(bits, count);
+	if (simStreaming)
+		simBitStream->SetFlushBits(simPacket->BitsToNextTerminator());
+}
+static unsigned long queueOverruns = 0;
+
+static void SimBitError(byte errorCode)
+{
+	bitErrors++;
+	if (errorCode == ERR_QUEUE_OVERRUN)
+		queueOverruns++;
+}
+static void SimPacketError(byte errorCode) { packetErrors++; }
+
+static void SimPacket(byte *packet, byte size)
+{
+	RecoveredPacket p;
+	memcpy(p.data, packet, size);
+	p.size = size;
+	p.us = micros();
+	recovered.push_back(p);
+}
+
+static void SimAccPacket(int boardAddress, int outputAddress, byte activate, byte data)
+{
+	accCallbacks++;
+	accCallbackUs.push_back(micros());
+}
+
+// the same handlers for the template decoder, called directly rather than through function pointers
+struct SimHandler : DCCdecoder::Handlers
+{
+	void BasicAccPacket(int boardAddress, int outputAddress, byte activate, byte data) { SimAccPacket(boardAddress, outputAddress, activate, data); }
+	void BitstreamError(byte ErrorCode) { SimBitError(ErrorCode); }
+	void PacketError(byte ErrorCode) { SimPacketError(ErrorCode); }
+};
+
+
+// Simulation   ==========================================================================
+
+// the Timer1 count the capture register latches for an edge
+static uint16_t EdgeCount(uint64_t edgeNs)
+{
+	return (uint16_t)((edgeNs * CLOCK_SCALE_FACTOR) / 1000);
+}
+
+
+// write the Timer1 counts of the edges to a capture file
+static bool SaveCapture(const std::vector<uint64_t> &edges, const char *fileName)
+{
+	CaptureWriter writer;
+	if (!writer.Open(fileName))
+		return false;
+
+	for (size_t i = 0; i < edges.size(); i++)
+		writer.Edge(EdgeCount(edges[i]));
+
+	if (!writer.Close())
+	{
+		printf("can't write %s\n", fileName);
+		return false;
+	}
+
+	printf("Saved %zu edges to %s, %.2f bytes per edge\n", edges.size(), fileName, (double)writer.Bytes() / edges.size());
+	return true;
+}
+
+
+// deliver an edge to a bitstream channel. channel 0 goes through the input capture ISR, as on the
+// Arduino. the other channels have no hardware on the host, so the edge is passed to Capture directly,
+// as their ISRs would.
+static void DeliverEdge(uint64_t edgeNs, byte channel)
+{
+	const uint16_t count = EdgeCount(edgeNs);
+	if (channel == 0)
+	{
+		ICR1 = count;
+		TIMER1_CAPT_vect();
+	}
+	else
+	{
+		BitStream::Capture(channel, count);
+	}
+}
+
+
+// deliver all edges to a channel, running the process function at the loop interval
+template <typename ProcessFunc>
+static void RunEdges(const std::vector<uint64_t> &edges, unsigned long loopUs, ProcessFunc process, byte channel = 0)
+{
+	unsigned long nextLoop = 0;
+
+	for (size_t i = 0; i < edges.size(); i++)
+	{
+		const unsigned long edgeUs = (unsigned long)(edges[i] / 1000);
+
+		// run the main loop for any loop iterations that fall before this edge
+		while (nextLoop <= edgeUs)
+		{
+			HostSetMicros(nextLoop);
+			process();
+			nextLoop += loopUs;
+		}
+
+		// the capture register latches the timer count at the edge, then the ISR queues it
+		HostSetMicros(edgeUs);
+		DeliverEdge(edges[i], channel);
+	}
+
+	process();
+}
+
+
+// deliver the edges from a producer thread at their real times (sped up), while this thread runs the
+// process function at the loop interval, with the simulated clock following real time
+template <typename ProcessFunc>
+static void RunEdgesThreaded(const std::vector<uint64_t> &edges, unsigned long loopUs, double speedup, ProcessFunc process)
+{
+	typedef std::chrono::steady_clock Clock;
+	std::atomic<bool> done{ false };
+	const Clock::time_point start = Clock::now();
+
+	std::thread producer([&]()
+	{
+		for (size_t i = 0; i < edges.size(); i++)
+		{
+			const Clock::time_point due = start + std::chrono::nanoseconds((uint64_t)(edges[i] / speedup));
+			while (Clock::now() < due)
+				std::this_thread::yield();
+
+			DeliverEdge(edges[i], 0);
+		}
+		done.store(true, std::memory_order_release);
+	});
+
+	unsigned long nextLoop = 0;
+	while (!done.load(std::memory_order_acquire))
+	{
+		// wait for the next loop iteration in real time
+		unsigned long nowUs;
+		while ((nowUs = (unsigned long)(std::chrono::duration<double, std::micro>(Clock::now() - start).count() * speedup)) < nextLoop)
+			std::this_thread::yield();
+
+		HostSetMicros(nowUs);
+		process();
+		nextLoop = nowUs + loopUs;
+	}
+
+	producer.join();
+	process();
+}
+
+
+template <typename ProcessFunc>
+static void DeliverEdges(const std::vector<uint64_t> &edges, const SimSettings &s, ProcessFunc process)
+{
+	if (s.threaded)
+		RunEdgesThreaded(edges, s.loopUs, s.speedup, process);
+	else
+		RunEdges(edges, s.loopUs, process);
+}
+
+
+// count the recovered packets that match the injected packets, in order
+static void ComparePackets(const std::vector<Waveform::Packet> &injected, unsigned long &matched, unsigned long &spurious)
+{
+	size_t j = 0;          // first packet not yet matched
+	size_t ended = 0;      // first packet not ended by the time of the current callback
+	matched = spurious = 0;
+
+	for (size_t i = 0; i < recovered.size(); i++)
+	{
+		// a packet can only be recovered once it has ended, so the match is the latest packet with the same
+		// bytes that ended before the callback. there is no limit on how many were lost before it.
+		const RecoveredPacket &r = recovered[i];
+		while (ended < injected.size() && injected[ended].endNs / 1000 <= r.us)
+			ended++;
+
+		size_t k = ended;
+		while (k > j)
+		{
+			k--;
+			if (injected[k].size == r.size && memcmp(injected[k].data, r.data, r.size) == 0)
+				break;
+		}
+
+		if (k < ended && injected[k].size == r.size && memcmp(injected[k].data, r.data, r.size) == 0)
+		{
+			matched++;
+			latencyUs.push_back((long)(r.us - injected[k].endNs / 1000));
+			j = k + 1;
+		}
+		else
+		{
+			spurious++;
+		}
+	}
+}
+
+
+// the accessory callbacks are far enough apart to match each with the last accessory packet sent before it
+// to the decoder addresses, or to any address if the address is 0
+static void AccessoryLatency(const std::vector<Waveform::Packet> &injected, int address, int addresses)
+{
+	size_t k = 0;
+	long lastEndUs = -1;
+
+	for (size_t i = 0; i < accCallbackUs.size(); i++)
+	{
+		while (k < injected.size() && injected[k].endNs / 1000 <= accCallbackUs[i])
+		{
+			const uint8_t *data = injected[k].data;
+			const int board = ((~data[1] & 0x70) << 2) | (data[0] & 0x3F);
+			const int output = ((board - 1) << 2) + ((data[1] >> 1) & 0x03) + 1;
+			if ((data[0] & 0xC0) == 0x80 && (address == 0 || (output >= address && output < address + addresses)))
+				lastEndUs = (long)(injected[k].endNs / 1000);
+			k++;
+		}
+
+		if (lastEndUs >= 0)
+			latencyUs.push_back((long)accCallbackUs[i] - lastEndUs);
+	}
+}
+
+
+static void ReportLatency(const char *name)
+{
+	if (latencyUs.empty())
+		return;
+
+	std::vector<long> sorted = latencyUs;
+	std::sort(sorted.begin(), sorted.end());
+	double sum = 0;
+	for (size_t i = 0; i < sorted.size(); i++)
+		sum += sorted[i];
+
+	printf("%s latency, end of packet to callback (us): mean %.0f, median %ld, 99%% %ld, max %ld\n", name,
+		sum / sorted.size(), sorted[sorted.size() / 2], sorted[sorted.size() * 99 / 100], sorted.back());
+}
+
+
+// Differential test   ==========================================================================
+
+// a packet or an error reported by a packet builder, in the order reported
+struct PacketEvent
+{
+	uint8_t data[6];
+	uint8_t size;          // 0 for an error
+	uint8_t errorCode;
+	unsigned long ms;      // simulated time reported, not compared
+
+	bool operator==(const PacketEvent &other) const
+	{
+		return size == other.size && errorCode == other.errorCode && memcmp(data, other.data, size) == 0;
+	}
+};
+
+static std::vector<PacketEvent> *diffEvents = 0;
+
+static void DiffPacket(byte *packet, byte size)
+{
+	PacketEvent e = { { 0 }, size, 0, millis() };
+	memcpy(e.data, packet, size);
+	diffEvents->push_back(e);
+}
+
+static void DiffError(byte errorCode)
+{
+	PacketEvent e = { { 0 }, 0, errorCode, millis() };
+	diffEvents->push_back(e);
+}
+
+
+// a random bitstream that exercises the framing: short, long, and wrapping preambles, packets of
+// all lengths with good and bad checksums, and missing or extra separator bits
+static void RandomWords(std::vector<unsigned long> &words, size_t count, unsigned seed)
+{
+	std::mt19937 random(seed);
+	unsigned long word = 0;
+	int bitsInWord = 0;
+
+	auto addBit = [&](bool bit)
+	{
+		word = (word << 1) | bit;
+		if (++bitsInWord == 32)
+		{
+			words.push_back(word & 0xFFFFFFFFUL);
+			word = 0;
+			bitsInWord = 0;
+		}
+	};
+
+	while (words.size() < count)
+	{
+		// preamble, occasionally long enough to wrap the count
+		const int r = random() % 16;
+		const int preamble = (r == 0) ? 250 + random() % 20 : (r < 3) ? random() % 10 : 10 + random() % 12;
+		for (int i = 0; i < preamble; i++) addBit(1);
+		addBit(0);
+
+		// packet bytes, each followed by a separator that is usually right
+		const int size = 1 + random() % 7;
+		uint8_t checksum = 0;
+		for (int i = 0; i < size; i++)
+		{
+			uint8_t b = random();
+			if (i == size - 1 && random() % 2) b = checksum;
+			checksum ^= b;
+			for (int j = 7; j >= 0; j--) addBit((b >> j) & 1);
+			addBit((random() % 20 == 0) ? random() % 2 : (i == size - 1));
+		}
+	}
+}
+
+
+// run one packet builder over the words, recording what it reports and the time it takes. if the
+// times are given, the simulated clock is set to the time each word was captured.
+template <typename Builder>
+static unsigned long long RunBuilder(const std::vector<unsigned long> &words, std::vector<PacketEvent> &events,
+	bool filterRepeats = false, const std::vector<unsigned long> *us = 0)
+{
+	// the original doesn't clear the packet buffer until the first reset, so construct the builders
+	// in zeroed memory, as they would be as globals on the Arduino. the original also writes one entry
+	// past the end of its repeat log when the log is full, so leave room for that.
+	alignas(Builder) unsigned char storage[sizeof(Builder) + 32];
+	memset(storage, 0, sizeof(storage));
+	Builder &builder = *new (storage) Builder{ true, filterRepeats, 250 };
+	builder.SetPacketCompleteHandler(DiffPacket);
+	builder.SetPacketErrorHandler(DiffError);
+	events.reserve(words.size());
+	diffEvents = &events;
+
+	unsigned long long cycles = HOST_CYCLES();
+	for (size_t i = 0; i < words.size(); i++)
+	{
+		if (us) HostSetMicros((*us)[i]);
+		builder.ProcessIncomingBits(words[i]);
+	}
+	return HOST_CYCLES() - cycles;
+}
+
+
+// compare the packet builder against the reference, returns true if they match
+static bool RunDiff(const std::vector<unsigned long> &words, const char *name)
+{
+	std::vector<PacketEvent> refEvents, newEvents;
+	const unsigned long long refCycles = RunBuilder<DCCpacketRef>(words, refEvents);
+	const unsigned long long newCycles = RunBuilder<DCCpacket>(words, newEvents);
+
+	size_t i = 0;
+	while (i < refEvents.size() && i < newEvents.size() && refEvents[i] == newEvents[i])
+		i++;
+	const bool match = (i == refEvents.size() && i == newEvents.size());
+
+	printf("%s: %zu words, %zu events, %s", name, words.size(), refEvents.size(), match ? "match" : "MISMATCH");
+	if (!match)
+	{
+		printf(" at event %zu", i);
+		if (i < refEvents.size() && i < newEvents.size())
+			printf(" (reference %02X %02X size %d error %d, DCCpacket %02X %02X size %d error %d)",
+				refEvents[i].data[0], refEvents[i].data[1], refEvents[i].size, refEvents[i].errorCode,
+				newEvents[i].data[0], newEvents[i].data[1], newEvents[i].size, newEvents[i].errorCode);
+	}
+	printf("\n  host cycles/word: reference %.1f, DCCpacket %.1f\n",
+		(double)refCycles / words.size(), (double)newCycles / words.size());
+	return match;
+}
+
+
+// Repeat filter benchmark   ==========================================================================
+
+// count the packets and the filter table overflows reported
+static void CountEvents(const std::vector<PacketEvent> &events, unsigned long &packets, unsigned long &overflows)
+{
+	packets = overflows = 0;
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		if (events[i].size) packets++;
+		else if (events[i].errorCode == ERR_EXCEEDED_HISTORY_SIZE) overflows++;
+	}
+}
+
+
+// time the repeat filters on the recovered bitstream, and check the DCCpacket filter against a model.
+// returns true if the filtered packets match the model.
+static bool RunFilterBench(const std::vector<unsigned long> &words, const std::vector<unsigned long> &us)
+{
+	const unsigned int interval = 250;
+	std::vector<PacketEvent> allEvents, refAllEvents, refEvents, newEvents;
+	unsigned long long allCycles = ~0ULL, refAllCycles = ~0ULL, refCycles = ~0ULL, newCycles = ~0ULL;
+
+	// the differences are small against the cost of assembling the packets, so take the best of several runs
+	for (int run = 0; run < 5; run++)
+	{
+		allEvents.clear(); refAllEvents.clear(); refEvents.clear(); newEvents.clear();
+		allCycles = std::min(allCycles, RunBuilder<DCCpacket>(words, allEvents, false, &us));
+		refAllCycles = std::min(refAllCycles, RunBuilder<DCCpacketRef>(words, refAllEvents, false, &us));
+		refCycles = std::min(refCycles, RunBuilder<DCCpacketRef>(words, refEvents, true, &us));
+		newCycles = std::min(newCycles, RunBuilder<DCCpacket>(words, newEvents, true, &us));
+	}
+
+	// the model filter: a packet is a repeat if the same packet was seen within the interval, and
+	// every time it is seen restarts its interval
+	std::map<std::vector<uint8_t>, unsigned long> lastSeen;
+	std::vector<PacketEvent> modelEvents;
+	for (size_t i = 0; i < allEvents.size(); i++)
+	{
+		const PacketEvent &e = allEvents[i];
+		if (!e.size) continue;
+		const std::vector<uint8_t> key(e.data, e.data + e.size);
+		auto it = lastSeen.find(key);
+		const bool repeat = (it != lastSeen.end() && e.ms - it->second < interval);
+		lastSeen[key] = e.ms;
+		if (!repeat) modelEvents.push_back(e);
+	}
+
+	std::vector<PacketEvent> filteredPackets;
+	for (size_t i = 0; i < newEvents.size(); i++)
+		if (newEvents[i].size) filteredPackets.push_back(newEvents[i]);
+	const bool match = (filteredPackets == modelEvents);
+
+	unsigned long allPackets, refPackets, newPackets, allOverflows, refOverflows, newOverflows;
+	CountEvents(allEvents, allPackets, allOverflows);
+	CountEvents(refEvents, refPackets, refOverflows);
+	CountEvents(newEvents, newPackets, newOverflows);
+
+	printf("Repeat filter: %zu words, %lu packets unfiltered, %zu distinct in the model\n",
+		words.size(), allPackets, modelEvents.size());
+	printf("  reference:   %.1f host cycles/word unfiltered, %.1f filtered, %.1f host cycles/packet for the filter\n",
+		(double)refAllCycles / words.size(), (double)refCycles / words.size(), ((double)refCycles - refAllCycles) / allPackets);
+	printf("               %lu packets, %lu history overflows\n", refPackets, refOverflows);
+	printf("  DCCpacket:   %.1f host cycles/word unfiltered, %.1f filtered, %.1f host cycles/packet for the filter\n",
+		(double)allCycles / words.size(), (double)newCycles / words.size(), ((double)newCycles - allCycles) / allPackets);
+	printf("               %lu packets, %lu history overflows, %s model\n", newPackets, newOverflows, match ? "matches" : "DOES NOT MATCH");
+	return match;
+}
+
+
+// the number of injected accessory commands for the decoder's addresses. commands cycle through outputs 1 to 8.
+static int ExpectedCommands(int accCommands, const SimSettings &s)
+{
+	int expected = 0;
+	for (int output = 1; output <= 8; output++)
+		if (s.address == 0 || (output >= s.address && output < s.address + s.addresses))
+			expected += (accCommands + 8 - output) / 8;
+	return expected;
+}
+
+
+// Multiple instances   ==========================================================================
+
+// the results of one decoder instance, to compare a concurrent run against the instance run alone
+struct InstanceResult
+{
+	unsigned long commands = 0;
+	unsigned long bitErrors = 0;
+	unsigned long packetErrors = 0;
+	uint32_t digest = 2166136261u;    // FNV-1a hash of each command and its time, in order
+
+	bool operator==(const InstanceResult &r) const
+	{
+		return commands == r.commands && bitErrors == r.bitErrors && packetErrors == r.packetErrors && digest == r.digest;
+	}
+};
+
+// handler for one instance, with its own results rather than the globals the other modes use
+struct InstanceHandler : DCCdecoder::Handlers
+{
+	InstanceResult &result;
+	InstanceHandler(InstanceResult &Result) : result(Result) {}
+
+	void BasicAccPacket(int boardAddress, int outputAddress, byte activate, byte data)
+	{
+		const uint32_t values[3] = { (uint32_t)outputAddress, data, (uint32_t)micros() };
+		for (int i = 0; i < 3; i++)
+			result.digest = (result.digest ^ values[i]) * 16777619u;
+		result.commands++;
+	}
+
+	void BitstreamError(byte ErrorCode) { result.bitErrors++; }
+	void PacketError(byte ErrorCode) { result.packetErrors++; }
+};
+
+// a decoder on its own channel, with its own layout and results
+struct Instance
+{
+	std::unique_ptr<DCCdecoder> dcc;
+	std::unique_ptr<Waveform> waveform;
+	int accCommands = 0;
+	InstanceResult alone;
+	InstanceResult concurrent;
+};
+
+
+// create the decoder for an instance on its channel, and register it for the channel
+static void CreateDecoder(Instance &instance, byte channel, const SimSettings &s)
+{
+	const DCCdecoder::DecoderSettings settings = { (uint16_t)(s.address ? s.address : 1), 0x01, s.address == 0 };
+	instance.dcc.reset(new DCCdecoder(settings, channel));
+	if (s.address)
+		instance.dcc->SetAddressRange(s.address, s.addresses);
+	instance.dcc->ResumeBitstream();
+}
+
+
+// run the decoder for an instance over its edges, in the calling thread
+static void RunInstance(Instance &instance, byte channel, const SimSettings &s, InstanceResult &result)
+{
+	InstanceHandler handler{ result };
+	RunEdges(instance.waveform->Edges(), s.loopUs, [&]() { instance.dcc->ProcessTimeStamps(handler); }, channel);
+}
+
+
+// run several decoders, each with its own layout and bitstream channel, first one at a time and then
+// all at once on their own threads. every decoder must give the same results both ways.
+static int RunInstances(const SimSettings &s)
+{
+	if (s.instances > BITSTREAM_CHANNELS || (s.address && (s.addresses < 1 || s.addresses > 32)))
+	{
+		Usage();
+		return 1;
+	}
+
+	std::vector<Instance> instances(s.instances);
+	for (int i = 0; i < s.instances; i++)
+	{
+		instances[i].waveform.reset(new Waveform{ s.waveform, s.seed + i });
+		instances[i].accCommands = BuildLayout(*instances[i].waveform, s);
+	}
+
+	printf("Running %d decoders on channels 0 to %d, %zu edges each\n", s.instances, s.instances - 1,
+		instances[0].waveform->Edges().size());
+
+	// one at a time
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < s.instances; i++)
+	{
+		CreateDecoder(instances[i], (byte)i, s);
+		RunInstance(instances[i], (byte)i, s, instances[i].alone);
+		instances[i].dcc.reset();
+	}
+	const double aloneSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	// all at once, with every decoder registered before any thread starts
+	for (int i = 0; i < s.instances; i++)
+		CreateDecoder(instances[i], (byte)i, s);
+	start = Clock::now();
+	std::vector<std::thread> threads;
+	for (int i = 0; i < s.instances; i++)
+		threads.push_back(std::thread([&instances, &s, i]() { RunInstance(instances[i], (byte)i, s, instances[i].concurrent); }));
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+	const double concurrentSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	bool match = true;
+	for (int i = 0; i < s.instances; i++)
+	{
+		const Instance &instance = instances[i];
+		const bool same = (instance.alone == instance.concurrent);
+		match = match && same;
+		printf("  channel %2d: %lu / %d accessory commands, %lu bit errors, %lu packet errors, digest %08x, %s\n", i,
+			instance.concurrent.commands, ExpectedCommands(instance.accCommands, s), instance.concurrent.bitErrors,
+			instance.concurrent.packetErrors, instance.concurrent.digest, same ? "same as alone" : "DIFFERS FROM ALONE");
+		instances[i].dcc.reset();
+	}
+
+	printf("One at a time %.3f s, concurrently %.3f s (%.2fx on %u hardware threads), %s\n", aloneSeconds, concurrentSeconds,
+		aloneSeconds / concurrentSeconds, std::thread::hardware_concurrency(), match ? "results match" : "RESULTS DIFFER");
+	return match ? 0 : 1;
+}
+
+
+int main(int argc, char **argv)
+{
+	SimSettings s;
+	if (!ParseArgs(argc, argv, s)) return 1;
+
+	if (s.instances > 0)
+		return RunInstances(s);
+
+	Waveform waveform{ s.waveform, s.seed };
+	const int accCommands = BuildLayout(waveform, s);
+	const std::vector<uint64_t> &edges = waveform.Edges();
+	const std::vector<Waveform::Packet> &injected = waveform.Packets();
+
+	printf("Injected %zu packets (%d distinct accessory commands), %zu edges, %.3f s of track time\n",
+		injected.size(), accCommands, edges.size(), waveform.CurrentNs() / 1e9);
+
+	if (s.saveFile)
+		return SaveCapture(edges, s.saveFile) ? 0 : 1;
+
+	const auto wallStart = std::chrono::steady_clock::now();
+	unsigned long long cycles = HOST_CYCLES();
+	SimpleQueue::Statistics queueStats;    // copied from the bitstream before it goes out of scope
+	std::unique_ptr<DCCdecoder> decoder;   // kept for its telemetry
+
+	if (s.diffMode || s.filterBench)
+	{
+		BitStream bitStream;
+		bitStream.SetDataFullHandler(SimBitsCapture);
+		bitStream.Resume();
+		DeliverEdges(edges, s, [&]() { bitStream.ProcessTimestamps(); });
+
+		if (s.filterBench)
+			return RunFilterBench(capturedWords, capturedUs) ? 0 : 1;
+
+		std::vector<unsigned long> randomWords;
+		RandomWords(randomWords, 200000, s.seed);
+
+		const bool signalMatch = RunDiff(capturedWords, "Signal");
+		const bool randomMatch = RunDiff(randomWords, "Random");
+		return (signalMatch && randomMatch) ? 0 : 1;
+	}
+
+	if (s.decoderMode)
+	{
+		DCCdecoder::DecoderSettings settings = { (uint16_t)(s.address ? s.address : 1), 0x01, s.address == 0 };
+		decoder.reset(new DCCdecoder(settings));
+		DCCdecoder &dcc = *decoder;
+		if (s.address && !dcc.SetAddressRange(s.address, s.addresses))
+		{
+			Usage();
+			return 1;
+		}
+		dcc.SetBasicAccessoryDecoderPacketHandler(SimAccPacket);
+		dcc.SetBitstreamErrorHandler(SimBitError);
+		dcc.SetPacketErrorHandler(SimPacketError);
+		dcc.ResumeBitstream();
+
+		// sample the repeat table occupancy every 50 ms of simulated time, not every loop, to keep it
+		// out of the timing
+		unsigned long nextSampleMs = 0;
+		SimHandler handler;
+		DeliverEdges(edges, s, [&]()
+		{
+			const unsigned long long start = HOST_CYCLES();
+			if (s.handlerMode)
+				dcc.ProcessTimeStamps(handler);
+			else
+				dcc.ProcessTimeStamps();
+			decodeCycles += HOST_CYCLES() - start;
+			if (millis() >= nextSampleMs)
+			{
+				const byte count = dcc.GetRepeatTableCount();
+				repeatTableTotal += count;
+				repeatTableMax = std::max(repeatTableMax, count);
+				repeatTableSamples++;
+				nextSampleMs += 50;
+			}
+		});
+		queueStats = dcc.GetQueueStatistics();
+	}
+	else
+	{
+		BitStream bitStream;
+		DCCpacket dccPacket{ true, false, 250 };
+		simBitStream = &bitStream;
+		simPacket = &dccPacket;
+		simStreaming = !s.batchMode;
+		bitStream.SetDataFullHandler(s.bitsOnly ? SimBitsOnly : SimBits);
+		bitStream.SetErrorHandler(SimBitError);
+		dccPacket.SetPacketCompleteHandler(SimPacket);
+		dccPacket.SetPacketErrorHandler(SimPacketError);
+		bitStream.Resume();
+
+		DeliverEdges(edges, s, [&]() { bitStream.ProcessTimestamps(); });
+		queueStats = bitStream.GetQueueStatistics();
+	}
+
+	cycles = HOST_CYCLES() - cycles;
+	const double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+	printf("Processed %zu edges in %.3f s host time: %.2f M edges/s, %.1f host cycles/edge\n",
+		edges.size(), wallSeconds, edges.size() / wallSeconds / 1e6, (double)cycles / edges.size());
+	printf("Bit errors: %lu   Packet errors: %lu   Queue overruns: %lu\n", bitErrors, packetErrors, queueOverruns);
+
+	printf("Timestamp queue: %lu dropped, max depth %d, depth histogram:", (unsigned long)queueStats.dropped, queueStats.maxDepth);
+	for (int i = 0; i < SimpleQueue::queueSize; i++)
+		printf(" %u", queueStats.depthHistogram[i]);
+	printf("\n");
+
+	if (s.bitsOnly)
+	{
+		printf("Bits: %lu words of 32 bits assembled\n", bitWords);
+	}
+	else if (s.decoderMode)
+	{
+		printf("Accessory commands: %lu delivered / %d injected for this decoder\n", accCallbacks, ExpectedCommands(accCommands, s));
+		printf("Host cycles/packet: %.1f (%.1f in the decoder)   Repeat table: mean %.1f, max %d entries\n",
+			(double)cycles / injected.size(), (double)decodeCycles / injected.size(),
+			repeatTableSamples ? (double)repeatTableTotal / repeatTableSamples : 0.0, repeatTableMax);
+		AccessoryLatency(injected, s.address, s.addresses);
+		ReportLatency("Accessory");
+
+		// the decoder's own counts of the errors must match those passed to the handlers
+		const DCCdecoder::Telemetry &t = decoder->GetTelemetry();
+		const unsigned long telemetryPacketErrors = t.packetsTooLong + t.packetsTooShort + t.checksumErrors + t.historyOverflows;
+		printf("Telemetry: bit errors %lu low, %lu mid, %lu high; packet errors %lu long, %lu short, %lu checksum, %lu overflow\n"
+			"           packets %lu idle, %lu broadcast, %lu loco, %lu accessory, %lu POM, %lu addressed; %lu resyncs, queue peak %d, %s\n",
+			(unsigned long)t.bitErrorsLow, (unsigned long)t.bitErrorsMid, (unsigned long)t.bitErrorsHigh,
+			(unsigned long)t.packetsTooLong, (unsigned long)t.packetsTooShort, (unsigned long)t.checksumErrors,
+			(unsigned long)t.historyOverflows, (unsigned long)t.idlePackets, (unsigned long)t.broadcastPackets,
+			(unsigned long)t.locoPackets, (unsigned long)t.accessoryPackets, (unsigned long)t.pomPackets,
+			(unsigned long)t.addressedPackets, (unsigned long)t.resyncs, t.queuePeak,
+			telemetryPacketErrors == packetErrors ? "matches the handlers" : "DIFFERS FROM THE HANDLERS");
+		printf("Telemetry export: ");
+		fflush(stdout);
+		decoder->PrintTelemetry();
+	}
+	else
+	{
+		unsigned long matched, spurious;
+		ComparePackets(injected, matched, spurious);
+		printf("Packets: %lu recovered / %zu injected (%.2f%%), %lu missed, %lu spurious\n",
+			matched, injected.size(), 100.0 * matched / injected.size(), (unsigned long)(injected.size() - matched), spurious);
+		ReportLatency(s.batchMode ? "Packet (batch)" : "Packet (streaming)");
+	}
+
+#if defined(DCC_PROFILING)
+	// the stage timings, in host nanoseconds
+	printf("Profile:\n");
+	fflush(stdout);
+	PROFILE_REPORT();
+#endif
+
+	return 0;
+}
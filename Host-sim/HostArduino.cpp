@@ -0,0 +1,72 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+
+#include "WProgram.h"
+#include "EEPROM.h"
+
+
+// simulated clock, one per thread so parallel simulations don't share time
+static thread_local unsigned long hostMicros = 0;
+
+void HostSetMicros(unsigned long Micros) { hostMicros = Micros; }
+unsigned long millis() { return hostMicros / 1000; }
+unsigned long micros() { return hostMicros; }
+void delay(unsigned long Ms) { hostMicros += Ms * 1000; }
+
+
+// pins don't go anywhere on the host
+void pinMode(byte Pin, byte Mode) {}
+void digitalWrite(byte Pin, byte Value) {}
+int digitalRead(byte Pin) { return HIGH; }
+void analogWrite(byte Pin, int Value) {}
+void attachInterrupt(int Interrupt, void(*Handler)(), int Mode) {}
+void detachInterrupt(int Interrupt) {}
+
+long map(long Value, long FromLow, long FromHigh, long ToLow, long ToHigh)
+{
+	return (Value - FromLow) * (ToHigh - ToLow) / (FromHigh - FromLow) + ToLow;
+}
+
+
+// register stand-ins
+volatile byte TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+volatile uint16_t TCNT1, ICR1, OCR1A;
+volatile byte TCCR2A, TCCR2B, TCNT2, TIMSK2;
+volatile byte PORTB, PORTC, PORTD, PIND;
+
+
+// the EEPROM, erased to start with
+EEPROMClass EEPROM;
+
+
+// Serial writes to stdout
+HostSerial Serial;
+
+void HostSerial::begin(unsigned long Baud) {}
+size_t HostSerial::write(byte Value) { return fwrite(&Value, 1, 1, stdout); }
+size_t HostSerial::write(const byte *Buffer, size_t Size) { return fwrite(Buffer, 1, Size, stdout); }
+size_t HostSerial::print(const char *Text) { return fputs(Text, stdout) < 0 ? 0 : strlen(Text); }
+size_t HostSerial::print(char Value) { return fputc(Value, stdout) < 0 ? 0 : 1; }
+size_t HostSerial::print(long Value, int Base) { return (Base == HEX) ? printf("%lX", Value) : printf("%ld", Value); }
+size_t HostSerial::print(unsigned long Value, int Base) { return (Base == HEX) ? printf("%lX", Value) : printf("%lu", Value); }
+size_t HostSerial::print(double Value, int Digits) { return printf("%.*f", Digits, Value); }
+size_t HostSerial::println() { return fputs("\n", stdout) < 0 ? 0 : 1; }
@@ -0,0 +1,241 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/*
+
+State Journal Test
+
+Runs StateJournal (TurnoutLibs/src) on a Linux host against the EEPROM stand-in in EEPROM.h, and
+checks that the newest state is always the one recovered.
+
+Summary:
+
+Each check starts from an erased EEPROM, and a power cycle is stood in for by a new StateJournal on
+the same region, which has to find its state with Load. The region is the one the turnouts use,
+addresses 512 to 767, a ring of 128 records. The checks are:
+
+	empty       an erased region loads nothing, and the first record written is the one loaded
+	wrap        300 records with a power cycle after each, so the 8 bit sequence numbers wrap, and each
+	            state must be the newest found
+	torn        a record cut off by a power cut after its sequence byte is rejected, leaving the one
+	            before it, at every slot of the ring
+	queued      a Write while a record is still being written puts the new state in that record, and
+	            writing the state already stored costs no writes
+	capped      a region of more than 128 records only uses the first 128
+	wear        100,000 throws, each after a power cycle, with the writes to each cell counted: no cell
+	            may be written more than once per trip round the ring, and nothing outside the region
+
+The program prints a line for each check and exits with an error if any fails.
+
+*/
+
+#include <stdio.h>
+
+#include "EEPROM.h"
+#include "StateJournal.h"
+
+
+// the region of EEPROM the turnouts keep their position in
+static const uint16_t journalStart = 512;
+static const uint16_t journalEnd = 768;
+static const uint16_t journalSlots = 128;
+
+
+// write any queued record in full, as the loop does over the next few passes
+static void Flush(StateJournal &Journal)
+{
+	for (byte i = 0; i < 4; i++)
+		Journal.Update();
+}
+
+
+// power up on the region and load the newest state, or 0xFF if there is none
+static byte LoadState(uint16_t End = journalEnd)
+{
+	StateJournal journal(journalStart, End);
+	byte state;
+	return journal.Load(state) ? state : 0xFF;
+}
+
+
+static bool CheckEmpty()
+{
+	EEPROM.Erase();
+	if (LoadState() != 0xFF) return false;
+
+	// the first write to an empty journal, without a Load before it
+	StateJournal journal(journalStart, journalEnd);
+	journal.Write(3);
+	Flush(journal);
+	return LoadState() == 3;
+}
+
+
+// the sequence number is the record count, so it wraps from 255 to 0 partway round the third lap of
+// the ring. each record is read back after a power cycle and continued from there.
+static bool CheckWrap()
+{
+	EEPROM.Erase();
+	for (uint16_t n = 0; n < 300; n++)
+	{
+		StateJournal journal(journalStart, journalEnd);
+		byte state;
+		journal.Load(state);
+		journal.Write(n % 16);
+		Flush(journal);
+
+		// the record goes in the slot after the last, with the next sequence number
+		const uint16_t address = journalStart + (n % journalSlots) * 2;
+		if (EEPROM.read(address) != (byte)n) return false;
+		if (LoadState() != n % 16) return false;
+	}
+	return true;
+}
+
+
+// cut the power after the sequence byte of each record, once the ring is full so that every slot has
+// an old record in it, as it will in service
+static bool CheckTorn()
+{
+	EEPROM.Erase();
+	byte expected = 0;
+	for (uint16_t n = 0; n < journalSlots; n++)
+	{
+		StateJournal journal(journalStart, journalEnd);
+		journal.Write(expected = n % 2);
+		Flush(journal);
+	}
+
+	for (uint16_t n = 0; n < 2 * journalSlots; n++)
+	{
+		StateJournal journal(journalStart, journalEnd);
+		byte state;
+		journal.Load(state);
+		journal.Write(!state);
+		journal.Update();           // the sequence byte only
+		if (LoadState() != expected) return false;
+
+		// power back on after the cut, and this time write the record in full
+		StateJournal restarted(journalStart, journalEnd);
+		restarted.Load(state);
+		restarted.Write(!state);
+		Flush(restarted);
+		expected = !state;
+		if (LoadState() != expected) return false;
+	}
+	return true;
+}
+
+
+static bool CheckQueued()
+{
+	EEPROM.Erase();
+	StateJournal journal(journalStart, journalEnd);
+	journal.Write(1);
+	journal.Update();
+	journal.Write(2);               // replaces the state of the record being written
+	Flush(journal);
+	if (LoadState() != 2) return false;
+	if (EEPROM.read(journalStart + 2) != 0xFF) return false;    // and took no new slot
+
+	// writing the same state again writes nothing
+	unsigned long before = 0;
+	for (uint16_t a = journalStart; a < journalEnd; a++)
+		before += EEPROM.Writes(a);
+	for (byte i = 0; i < 10; i++)
+	{
+		journal.Write(2);
+		Flush(journal);
+	}
+	unsigned long after = 0;
+	for (uint16_t a = journalStart; a < journalEnd; a++)
+		after += EEPROM.Writes(a);
+	return after == before;
+}
+
+
+// a region of 256 records keeps to the first 128, for the sequence numbers to compare
+static bool CheckCapped()
+{
+	EEPROM.Erase();
+	const uint16_t end = journalStart + 4 * journalSlots;
+	for (uint16_t n = 0; n < 3 * journalSlots; n++)
+	{
+		StateJournal journal(journalStart, end);
+		journal.Write(n % 16);
+		Flush(journal);
+		if (LoadState(end) != n % 16) return false;
+	}
+	for (uint16_t a = journalEnd; a < end; a++)
+		if (EEPROM.Writes(a)) return false;
+	return true;
+}
+
+
+static bool CheckWear(unsigned long Throws, unsigned long &MaxWrites)
+{
+	EEPROM.Erase();
+	for (unsigned long n = 0; n < Throws; n++)
+	{
+		StateJournal journal(journalStart, journalEnd);
+		byte state;
+		if (journal.Load(state) != (n > 0)) return false;
+		if (n > 0 && state != (n - 1) % 2) return false;
+		journal.Write(n % 2);
+		Flush(journal);
+	}
+
+	bool ok = true;
+	MaxWrites = 0;
+	for (uint16_t a = 0; a < EEPROMClass::SIZE; a++)
+	{
+		const unsigned long writes = EEPROM.Writes(a);
+		if (writes > MaxWrites) MaxWrites = writes;
+		if (writes && (a < journalStart || a >= journalEnd)) ok = false;
+	}
+	return ok && MaxWrites <= (Throws + journalSlots - 1) / journalSlots;
+}
+
+
+static bool Report(const char *Name, bool Ok)
+{
+	printf("%-10s %s\n", Name, Ok ? "ok" : "FAILED");
+	return Ok;
+}
+
+
+int main(int argc, char **argv)
+{
+	printf("State journal in EEPROM %u to %u, %u records\n\n", journalStart, journalEnd - 1, journalSlots);
+
+	bool ok = true;
+	ok = Report("empty", CheckEmpty()) && ok;
+	ok = Report("wrap", CheckWrap()) && ok;
+	ok = Report("torn", CheckTorn()) && ok;
+	ok = Report("queued", CheckQueued()) && ok;
+	ok = Report("capped", CheckCapped()) && ok;
+
+	const unsigned long throws = 100000;
+	unsigned long maxWrites = 0;
+	ok = Report("wear", CheckWear(throws, maxWrites)) && ok;
+	printf("\n%lu throws wrote each cell at most %lu times (a single byte would take %lu)\n", throws, maxWrites,
+		throws);
+
+	return ok ? 0 : 1;
+}
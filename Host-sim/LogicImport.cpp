@@ -0,0 +1,467 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Logic Analyzer Import
+
+Turns a logic analyzer recording of the DCC signal into a capture file, on a Linux host, so it can
+be decoded by capture-decode like a capture from the decoder.
+
+Summary:
+
+The recording may be raw samples, packed one per bit (first sample in the low bit) or one per byte
+with a bit for each of 8 channels (as sigrok and most cheap analyzers write them), or a VCD file.
+The edges of the DCC signal are found in the raw samples by EdgeScanner, with SIMD kernels that run
+at about the speed the file can be read from memory, and in a VCD file from its value changes. The
+time of each edge is converted to the timer count the capture ISR would have read, and written to
+the capture with CaptureWriter, so the capture is just as if the decoder had recorded the signal.
+
+With --bench, the edges of a raw recording are found by each kernel the processor has, and the time
+and edges of each are reported, against a plain read of the file. No capture is written.
+
+Details:
+
+The file is mapped into memory and scanned in pieces, so a recording of any size takes little
+memory. The sample number (or VCD time) of each edge is scaled to timer counts exactly, with 128 bit
+arithmetic, and wrapped to the width of the timer. The resolution of the capture is that of the
+recording: at 1 MS/s the edges are only known to 1 us, which DCC tolerates, but faster is better.
+
+Where the signal doesn't change for longer than the timer takes to wrap (the track power was off,
+for example), the period can't be recorded, so the capture marks a gap there. capture-decode then
+resyncs at the next edge, as the decoder would after losing timestamps.
+
+*/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "WProgram.h"
+#include "Bitstream.h"
+#include "CaptureFile.h"
+#include "EdgeScan.h"
+
+
+// Settings   ==========================================================================
+
+enum : byte { FORMAT_BITS, FORMAT_BYTES, FORMAT_VCD, FORMAT_NONE };
+
+struct ImportSettings
+{
+	const char *input = 0;           // recording
+	const char *output = 0;          // capture file
+	byte format = FORMAT_NONE;       // FORMAT_NONE for the file extension
+	uint64_t rate = 0;               // samples per second of a raw recording
+	byte channel = 0;                // channel bit of the DCC signal in 8 bit samples
+	const char *signal = 0;          // VCD signal name, 0 for the first 1 bit signal
+	int kernel = -1;                 // edge scanner kernel, -1 for the fastest
+	bool bench = false;              // time the kernels rather than importing
+};
+
+
+static void Usage()
+{
+	printf("usage: logic-import [options] recording capture-file\n"
+		"  --format F           bits (packed 1 bit samples, first in the low bit), bytes (8 bit samples,\n"
+		"                       a bit per channel), or vcd (default vcd for .vcd files, otherwise bytes)\n"
+		"  --rate HZ            sample rate of a raw recording, eg 24000000 or 24M\n"
+		"  --channel N          channel bit of the DCC signal in 8 bit samples (default 0)\n"
+		"  --signal NAME        VCD signal of the DCC signal (default the first 1 bit signal)\n"
+		"  --kernel K           scalar, sse2 or avx2 (default the fastest the processor has)\n"
+		"  --bench              time each kernel on a raw recording, and check they find the same edges\n");
+}
+
+
+// a number, with an optional k or M
+static uint64_t ParseRate(const char *text)
+{
+	char *end;
+	const double value = strtod(text, &end);
+	if (*end == 'k' || *end == 'K') return (uint64_t)(value * 1e3);
+	if (*end == 'M' || *end == 'm') return (uint64_t)(value * 1e6);
+	return (uint64_t)value;
+}
+
+
+static bool ParseArgs(int argc, char **argv, ImportSettings &s)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		const char *val = (i + 1 < argc) ? argv[i + 1] : 0;
+
+		if (!strcmp(arg, "--bench")) { s.bench = true; continue; }
+		if (!strcmp(arg, "--help")) { Usage(); exit(0); }
+		if (arg[0] != '-' && !s.input) { s.input = arg; continue; }
+		if (arg[0] != '-' && !s.output) { s.output = arg; continue; }
+		if (!val) { Usage(); return false; }
+
+		if (!strcmp(arg, "--format"))
+		{
+			if (!strcmp(val, "bits")) s.format = FORMAT_BITS;
+			else if (!strcmp(val, "bytes")) s.format = FORMAT_BYTES;
+			else if (!strcmp(val, "vcd")) s.format = FORMAT_VCD;
+			else { Usage(); return false; }
+		}
+		else if (!strcmp(arg, "--kernel"))
+		{
+			if (!strcmp(val, "scalar")) s.kernel = EdgeScanner::SCAN_SCALAR;
+			else if (!strcmp(val, "sse2")) s.kernel = EdgeScanner::SCAN_SSE2;
+			else if (!strcmp(val, "avx2")) s.kernel = EdgeScanner::SCAN_AVX2;
+			else { Usage(); return false; }
+		}
+		else if (!strcmp(arg, "--rate")) s.rate = ParseRate(val);
+		else if (!strcmp(arg, "--channel")) s.channel = atoi(val);
+		else if (!strcmp(arg, "--signal")) s.signal = val;
+		else { Usage(); return false; }
+		i++;
+	}
+
+	if (!s.input || (!s.output && !s.bench) || s.channel > 7)
+	{
+		Usage();
+		return false;
+	}
+
+	if (s.format == FORMAT_NONE)
+	{
+		const size_t length = strlen(s.input);
+		s.format = (length > 4 && !strcasecmp(s.input + length - 4, ".vcd")) ? FORMAT_VCD : FORMAT_BYTES;
+	}
+	if (s.format != FORMAT_VCD && s.rate == 0)
+	{
+		printf("give the sample rate of a raw recording with --rate\n");
+		return false;
+	}
+	if (s.bench && s.format == FORMAT_VCD)
+	{
+		printf("--bench times the raw sample kernels, it needs a raw recording\n");
+		return false;
+	}
+	if (s.kernel >= 0 && !EdgeScanner::Supported((EdgeScanner::ScanKernel)s.kernel))
+	{
+		printf("this processor doesn't have %s\n", EdgeScanner::KernelName((EdgeScanner::ScanKernel)s.kernel));
+		return false;
+	}
+	return true;
+}
+
+
+// Recording   ==========================================================================
+
+// a read only mapping of the recording
+struct MappedFile
+{
+	const byte *data = 0;
+	size_t size = 0;
+
+	~MappedFile()
+	{
+		if (data)
+			munmap((void *)data, size);
+	}
+
+	bool Open(const char *fileName)
+	{
+		const int fd = open(fileName, O_RDONLY);
+		struct stat status;
+		if (fd < 0 || fstat(fd, &status) != 0)
+		{
+			if (fd >= 0) close(fd);
+			printf("can't open %s\n", fileName);
+			return false;
+		}
+
+		size = status.st_size;
+		void *mapped = size ? mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		close(fd);
+		if (mapped == MAP_FAILED)
+		{
+			printf("can't map %s, or it is empty\n", fileName);
+			return false;
+		}
+
+		data = (const byte *)mapped;
+		madvise(mapped, size, MADV_SEQUENTIAL);
+		return true;
+	}
+};
+
+
+// converts the times of the edges, in samples or VCD time units, to timer counts in the capture
+struct CaptureClock
+{
+	typedef unsigned __int128 uint128;
+
+	CaptureWriter &writer;
+	uint128 counts;                  // timer counts per time unit, as a fraction
+	uint128 units;
+	uint64_t lastTime = 0;
+	unsigned long gaps = 0;
+
+	CaptureClock(CaptureWriter &Writer, uint128 Counts, uint128 Units) : writer(Writer), counts(Counts), units(Units) {}
+
+	double Seconds(uint64_t Time) const { return (double)((uint128)Time * counts / units) / CLOCK_SCALE_FACTOR / 1e6; }
+
+	void Edge(uint64_t Time)
+	{
+		// the period can't be recorded if the timer wrapped more than once
+		if (writer.EdgeCount() > 0 && (uint128)(Time - lastTime) * counts / units >= (1UL << TIMER_BITS))
+		{
+			writer.Gap();
+			gaps++;
+		}
+
+		writer.Edge((uint16_t)((uint128)Time * counts / units));
+		lastTime = Time;
+	}
+};
+
+
+// find the edges of raw samples a piece at a time
+static void ImportRaw(const MappedFile &file, const ImportSettings &s, CaptureWriter &writer, double &seconds,
+	unsigned long &gaps)
+{
+	CaptureClock clock{ writer, (uint32_t)(CLOCK_SCALE_FACTOR * 1000000UL), s.rate };
+	const EdgeScanner::SampleFormat format = (s.format == FORMAT_BITS) ? EdgeScanner::SAMPLE_BITS : EdgeScanner::SAMPLE_BYTES;
+	const EdgeScanner::ScanKernel kernel = (s.kernel >= 0) ? (EdgeScanner::ScanKernel)s.kernel : EdgeScanner::BestKernel();
+	EdgeScanner scanner{ format, s.channel, kernel };
+
+	const size_t pieceSize = 1 << 20;
+	std::vector<uint64_t> edges;
+	for (size_t offset = 0; offset < file.size; offset += pieceSize)
+	{
+		edges.clear();
+		scanner.Scan(file.data + offset, std::min(pieceSize, file.size - offset), edges);
+		for (size_t i = 0; i < edges.size(); i++)
+			clock.Edge(edges[i]);
+	}
+	seconds = clock.Seconds(scanner.Samples());
+	gaps = clock.gaps;
+}
+
+
+// the time unit of a VCD file in femtoseconds, from "1ns", "10 us", etc
+static uint64_t ParseTimescale(const std::string &text)
+{
+	char *end;
+	const uint64_t value = strtoull(text.c_str(), &end, 10);
+	static const char *units[] = { "fs", "ps", "ns", "us", "ms", "s" };
+	uint64_t scale = 1;
+	for (byte i = 0; i < 6; i++, scale *= 1000)
+		if (!strcmp(end, units[i]))
+			return value * scale;
+	return 0;
+}
+
+
+// read the value changes of the DCC signal from a VCD file
+static bool ImportVCD(const MappedFile &file, const ImportSettings &s, CaptureWriter &writer, double &seconds,
+	unsigned long &gaps)
+{
+	const char *text = (const char *)file.data;
+	const char *end = text + file.size;
+	const char *next = text;
+
+	// the next token, separated by white space
+	auto Token = [&](std::string &token) -> bool
+	{
+		while (next < end && isspace((byte)*next)) next++;
+		const char *start = next;
+		while (next < end && !isspace((byte)*next)) next++;
+		token.assign(start, next);
+		return next > start;
+	};
+	auto SkipToEnd = [&]()
+	{
+		std::string token;
+		while (Token(token) && token != "$end") {}
+	};
+
+	// the header gives the time unit and the signals
+	std::string token, id, timescale;
+	while (Token(token) && token != "$enddefinitions")
+	{
+		if (token == "$timescale")
+		{
+			while (Token(token) && token != "$end")
+				timescale += token;
+		}
+		else if (token == "$var")
+		{
+			std::string type, size, code, name;
+			Token(type); Token(size); Token(code); Token(name);
+			if (id.empty() && size == "1" && (!s.signal || name == s.signal))
+				id = code;
+			SkipToEnd();
+		}
+		else if (token[0] == '$')
+		{
+			SkipToEnd();
+		}
+	}
+	SkipToEnd();
+
+	const uint64_t unitFs = ParseTimescale(timescale);
+	if (id.empty() || unitFs == 0)
+	{
+		printf("%s has no %s signal, or no timescale\n", s.input, s.signal ? s.signal : "1 bit");
+		return false;
+	}
+	CaptureClock clock{ writer, (CaptureClock::uint128)unitFs * (uint32_t)(CLOCK_SCALE_FACTOR * 1000000UL),
+		(CaptureClock::uint128)1000000000000000ULL };
+
+	// then the value changes, at the times that come before them
+	uint64_t time = 0;
+	int level = -1;
+	while (Token(token))
+	{
+		const char c = token[0];
+		if (c == '#')
+		{
+			time = strtoull(token.c_str() + 1, 0, 10);
+		}
+		else if (c == '$')
+		{
+			if (token == "$comment")
+				SkipToEnd();
+		}
+		else if (c == 'b' || c == 'B' || c == 'r' || c == 'R')
+		{
+			Token(token);               // a vector's id follows its value
+		}
+		else if ((c == '0' || c == '1') && token.compare(1, std::string::npos, id) == 0)
+		{
+			if (level >= 0 && level != c - '0')
+				clock.Edge(time);
+			level = c - '0';
+		}
+	}
+	seconds = clock.Seconds(time);
+	gaps = clock.gaps;
+	return true;
+}
+
+
+// Benchmark   ==========================================================================
+
+// time each kernel over the whole recording, and check that they find the same edges
+static bool Bench(const MappedFile &file, const ImportSettings &s)
+{
+	typedef std::chrono::steady_clock Clock;
+	const EdgeScanner::SampleFormat format = (s.format == FORMAT_BITS) ? EdgeScanner::SAMPLE_BITS : EdgeScanner::SAMPLE_BYTES;
+	const size_t pieceSize = 1 << 20;
+	const double gigabytes = file.size / 1e9;
+
+	// the time to just read the file, for comparison
+	double best = 1e9;
+	uint64_t sum = 0;
+	for (int run = 0; run < 3; run++)
+	{
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i + 8 <= file.size; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, file.data + i, 8);
+			sum ^= word;
+		}
+		best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+	}
+	printf("%-8s %8.3f s  %6.2f GB/s                      (check %llx)\n", "read", best, gigabytes / best, (unsigned long long)sum);
+
+	std::vector<uint64_t> reference;
+	bool same = true;
+	for (int k = EdgeScanner::SCAN_SCALAR; k <= EdgeScanner::SCAN_AVX2; k++)
+	{
+		const EdgeScanner::ScanKernel kernel = (EdgeScanner::ScanKernel)k;
+		if (!EdgeScanner::Supported(kernel))
+			continue;
+
+		std::vector<uint64_t> edges;
+		best = 1e9;
+		for (int run = 0; run < 3; run++)
+		{
+			edges.clear();
+			EdgeScanner scanner{ format, s.channel, kernel };
+			Clock::time_point start = Clock::now();
+			for (size_t offset = 0; offset < file.size; offset += pieceSize)
+				scanner.Scan(file.data + offset, std::min(pieceSize, file.size - offset), edges);
+			best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+		}
+
+		if (k == EdgeScanner::SCAN_SCALAR)
+			reference = edges;
+		const bool match = (edges == reference);
+		same = same && match;
+		printf("%-8s %8.3f s  %6.2f GB/s  %8.0f M samples/s  %zu edges%s\n", EdgeScanner::KernelName(kernel), best,
+			gigabytes / best, file.size * (format == EdgeScanner::SAMPLE_BITS ? 8 : 1) / best / 1e6, edges.size(),
+			match ? "" : ", EDGES DIFFER");
+	}
+	return same;
+}
+
+
+int main(int argc, char **argv)
+{
+	ImportSettings s;
+	if (!ParseArgs(argc, argv, s)) return 1;
+
+	MappedFile file;
+	if (!file.Open(s.input)) return 1;
+
+	if (s.bench)
+		return Bench(file, s) ? 0 : 1;
+
+	CaptureWriter writer;
+	if (!writer.Open(s.output)) return 1;
+
+	double seconds;
+	unsigned long gaps;
+	if (s.format == FORMAT_VCD)
+	{
+		if (!ImportVCD(file, s, writer, seconds, gaps)) return 1;
+	}
+	else
+	{
+		ImportRaw(file, s, writer, seconds, gaps);
+	}
+
+	if (!writer.Close())
+	{
+		printf("can't write %s\n", s.output);
+		return 1;
+	}
+
+	printf("Imported %zu edges from %.1f s of recording to %s, %.2f bytes per edge, %lu gaps in the signal\n",
+		writer.EdgeCount(), seconds, s.output, writer.EdgeCount() ? (double)writer.Bytes() / writer.EdgeCount() : 0.0,
+		gaps);
+	return 0;
+}
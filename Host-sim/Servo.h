@@ -0,0 +1,81 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/*
+
+Host Servo Library Shim
+
+A stand-in for the Arduino Servo library, so that TurnoutServo can be built and run on a Linux host.
+
+Summary:
+
+On other than AVR boards, SharedServo is the Servo library, and the host build takes that path. No
+pulses are sent; the servo keeps the pulse width it was last given, in microseconds, as the library
+does, so a test can read back the position after each update.
+
+*/
+
+#ifndef _SERVO_h
+#define _SERVO_h
+
+#include "WProgram.h"
+
+
+// pulse widths in us, as macros as the library has them
+#define MIN_PULSE_WIDTH 544         // at 0 degrees
+#define MAX_PULSE_WIDTH 2400        // at 180 degrees
+#define DEFAULT_PULSE_WIDTH 1500
+#define REFRESH_INTERVAL 20000      // per frame
+
+
+class Servo
+{
+public:
+	uint8_t attach(int Pin) { pin = Pin; return 0; }
+	void detach() { pin = -1; }
+	bool attached() { return pin >= 0; }
+
+	// as the library, values below the minimum pulse width are angles
+	void write(int Value)
+	{
+		if (Value < MIN_PULSE_WIDTH)
+		{
+			if (Value < 0) Value = 0;
+			if (Value > 180) Value = 180;
+			Value = MIN_PULSE_WIDTH + (long)Value * (MAX_PULSE_WIDTH - MIN_PULSE_WIDTH) / 180;
+		}
+		writeMicroseconds(Value);
+	}
+
+	void writeMicroseconds(int Value)
+	{
+		if (Value < MIN_PULSE_WIDTH) Value = MIN_PULSE_WIDTH;
+		if (Value > MAX_PULSE_WIDTH) Value = MAX_PULSE_WIDTH;
+		us = Value;
+	}
+
+	int read() { return (long)(us + 1 - MIN_PULSE_WIDTH) * 180 / (MAX_PULSE_WIDTH - MIN_PULSE_WIDTH); }
+	int readMicroseconds() { return us; }
+
+private:
+	int pin = -1;
+	int us = DEFAULT_PULSE_WIDTH;
+};
+
+#endif
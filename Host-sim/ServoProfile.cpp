@@ -0,0 +1,323 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/*
+
+Servo Profile Test
+
+Runs TurnoutServo moves on a Linux host with simulated time, and checks the trajectories of its
+motion profiles.
+
+Summary:
+
+Each motion profile (linear, trapezoidal and S-curve) is first checked on its own: the fixed point
+easing is compared at every fraction of the time against the same curve in floating point, and must
+be within a twentieth of a degree of it over the full 180 degrees of the servo, start at 0, end at
+1.0, and never go backwards. The error is reported in units of 1/0x8000 of the move. A move is then run in each direction with each
+profile, calling Update every simulated millisecond (or every --loop ms, to stand in for a busy main
+loop) and reading back the pulse width sent to the servo, in us. Each move must end exactly on the
+width of the extent, never reverse, and take its duration to within two frames, and the eased
+profiles must start and end with smaller steps than the linear profile. The program exits with an
+error if any check fails.
+
+On the host, SharedServo is the Servo library version, which runs the ramps between the steps from
+Update rather than from the frame interrupt, so the width only changes when Update is called. The
+frames are counted from the time all the same, so the moves keep their time with a slow loop, as long
+as it runs at least once a step.
+
+With --csv, the width of each profile at each millisecond of the move is written out, to plot the
+trajectories. The RAM used by a TurnoutServo is reported at the end.
+
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "TurnoutServo.h"
+
+
+struct ProfileSettings
+{
+	int from = 60;              // extents of the move, in degrees
+	int to = 120;
+	int duration = 2500;        // ms
+	int steps = 30;
+	int loop = 1;               // ms between updates
+	bool csv = false;
+};
+
+
+static const char *profileNames[] = { "linear", "trapezoid", "s-curve" };
+static const byte numProfiles = 3;
+
+
+static void Usage()
+{
+	printf("usage: servo-profile [options]\n"
+		"  --from N         low extent in degrees (default 60)\n"
+		"  --to N           high extent in degrees (default 120)\n"
+		"  --duration N     move duration in ms (default 2500)\n"
+		"  --steps N        steps in a move, 1 to 255 (default 30)\n"
+		"  --loop N         ms between updates (default 1)\n"
+		"  --csv            write the pulse width of each profile at each ms of the move\n");
+}
+
+
+static bool ParseArgs(int argc, char **argv, ProfileSettings &s)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		const char *val = (i + 1 < argc) ? argv[i + 1] : 0;
+
+		if (!strcmp(arg, "--help")) { Usage(); exit(0); }
+		if (!strcmp(arg, "--csv")) { s.csv = true; continue; }
+		if (!val) { Usage(); return false; }
+
+		if (!strcmp(arg, "--from")) s.from = atoi(val);
+		else if (!strcmp(arg, "--to")) s.to = atoi(val);
+		else if (!strcmp(arg, "--duration")) s.duration = atoi(val);
+		else if (!strcmp(arg, "--steps")) s.steps = atoi(val);
+		else if (!strcmp(arg, "--loop")) s.loop = atoi(val);
+		else { Usage(); return false; }
+		i++;
+	}
+
+	if (s.from < 0 || s.from > 180 || s.to < 0 || s.to > 180 || s.duration < 0 || s.duration > 25500 ||
+		s.steps < 1 || s.steps > 255 || s.loop < 1)
+	{
+		Usage();
+		return false;
+	}
+	return true;
+}
+
+
+// the easing curves in floating point, for a fraction of the time from 0 to 1
+static double ReferenceEase(double T, byte Profile)
+{
+	switch (Profile)
+	{
+	case TurnoutServo::TRAPEZOID:
+		if (T < 0.25) return T * T * 8 / 3;
+		if (T > 0.75) return 1 - (1 - T) * (1 - T) * 8 / 3;
+		return (T - 0.125) * 4 / 3;
+	case TurnoutServo::SCURVE:
+		return T * T * T * (10 - 15 * T + 6 * T * T);
+	default:
+		return T;
+	}
+}
+
+
+// check the fixed point easing of a profile at every fraction of the time, returning the largest
+// difference from the reference in units of 1/0x8000
+static bool CheckEase(byte Profile, double &MaxError)
+{
+	bool ok = true;
+	uint16_t last = 0;
+	MaxError = 0;
+
+	for (uint32_t t = 0; t <= 0x8000; t++)
+	{
+		const uint16_t e = TurnoutServo::Ease(t, Profile);
+		const double error = fabs(e - ReferenceEase(t / 32768.0, Profile) * 32768);
+		if (error > MaxError) MaxError = error;
+		if (e < last) ok = false;
+		last = e;
+	}
+
+	if (TurnoutServo::Ease(0, Profile) != 0 || TurnoutServo::Ease(0x8000, Profile) != 0x8000) ok = false;
+	// within a twentieth of a degree over the whole range of the servo
+	if (MaxError * 180 / 0x8000 > 0.05) ok = false;
+	return ok;
+}
+
+
+static bool moveDone;
+static void MoveDoneHandler() { moveDone = true; }
+
+
+// the pulse width of the servo at each ms of a move, and the time the move was done
+struct Trajectory
+{
+	std::vector<int> width;
+	unsigned long doneMillis = 0;
+};
+
+
+// the width the servo is sent for an angle, as TurnoutServo works it out
+static int ExtentMicros(int Angle)
+{
+	return MIN_PULSE_WIDTH + (Angle * (MAX_PULSE_WIDTH - MIN_PULSE_WIDTH) + 90) / 180;
+}
+
+
+// move a servo between the extents with a profile, from the low extent if Up is set
+static Trajectory RunMove(const ProfileSettings &s, byte Profile, bool Up)
+{
+	Trajectory trajectory;
+
+	HostSetMicros(0);
+	TurnoutServo servo(9);
+	servo.Initialize(s.from, s.to, s.duration, 0, Up ? LOW : HIGH);
+	servo.SetServoMoveDoneHandler(MoveDoneHandler);
+	servo.SetProfile(Profile, s.steps);
+	servo.StartPWM();
+
+	moveDone = false;
+	servo.Set(Up ? HIGH : LOW, LOW);
+
+	// allow for the step after the last, which ends the move
+	const unsigned long limit = 2 * s.duration + 1000;
+	for (unsigned long ms = 1; ms <= limit && !moveDone; ms++)
+	{
+		HostSetMicros(ms * 1000);
+		if (ms % s.loop == 0)
+			servo.Update(ms);
+		trajectory.width.push_back(servo.readMicroseconds());
+		trajectory.doneMillis = ms;
+	}
+
+	if (!moveDone) trajectory.doneMillis = 0;
+	return trajectory;
+}
+
+
+// check a move, and find its largest step and the sizes of its first and last steps
+static bool CheckMove(const ProfileSettings &s, const Trajectory &Move, bool Up, int &MaxStep, int &FirstStep,
+	int &LastStep)
+{
+	bool ok = true;
+	const int start = ExtentMicros(Up ? s.from : s.to);
+	const int end = ExtentMicros(Up ? s.to : s.from);
+	const int direction = (end >= start) ? 1 : -1;
+
+	MaxStep = 0;
+	FirstStep = 0;
+	LastStep = 0;
+
+	int last = start;
+	for (int width : Move.width)
+	{
+		const int step = (width - last) * direction;
+		if (step < 0) ok = false;
+		if (step > MaxStep) MaxStep = step;
+		if (step > 0)
+		{
+			if (!FirstStep) FirstStep = step;
+			LastStep = step;
+		}
+		last = width;
+	}
+
+	// it must end on the extent, within two frames of the duration (a frame to start, and up to one
+	// from rounding the duration to frames), and an update after the last frame
+	const long frame = REFRESH_INTERVAL / 1000;
+	if (Move.width.empty() || Move.width.back() != end) ok = false;
+	if (!Move.doneMillis) ok = false;
+	if (labs((long)Move.doneMillis - s.duration) > 2 * frame + s.loop) ok = false;
+
+	return ok;
+}
+
+
+int main(int argc, char **argv)
+{
+	ProfileSettings s;
+	if (!ParseArgs(argc, argv, s)) return 1;
+
+	bool ok = true;
+	Trajectory moves[numProfiles][2];
+	for (byte p = 0; p < numProfiles; p++)
+		for (byte up = 0; up < 2; up++)
+			moves[p][up] = RunMove(s, p, up);
+
+	if (s.csv)
+	{
+		printf("ms");
+		for (byte p = 0; p < numProfiles; p++)
+			printf(",%s", profileNames[p]);
+		printf("\n");
+
+		size_t length = 0;
+		for (byte p = 0; p < numProfiles; p++)
+			if (moves[p][1].width.size() > length) length = moves[p][1].width.size();
+
+		for (size_t i = 0; i < length; i++)
+		{
+			printf("%zu", i + 1);
+			for (byte p = 0; p < numProfiles; p++)
+			{
+				const std::vector<int> &width = moves[p][1].width;
+				printf(",%d", i < width.size() ? width[i] : width.back());
+			}
+			printf("\n");
+		}
+		return 0;
+	}
+
+	printf("Move %d to %d degrees (%d to %d us) in %d ms, %d steps, update every %d ms\n\n", s.from, s.to,
+		ExtentMicros(s.from), ExtentMicros(s.to), s.duration, s.steps, s.loop);
+	printf("%-10s %10s %8s %8s %8s %8s %8s  %s\n", "profile", "ease err", "up ms", "down ms", "max step", "first",
+		"last", "result");
+
+	int linearFirst = 0, linearLast = 0;
+	for (byte p = 0; p < numProfiles; p++)
+	{
+		double easeError;
+		bool profileOk = CheckEase(p, easeError);
+
+		int maxStep = 0, firstStep = 0, lastStep = 0;
+		for (byte up = 0; up < 2; up++)
+		{
+			int moveMax, moveFirst, moveLast;
+			if (!CheckMove(s, moves[p][up], up, moveMax, moveFirst, moveLast)) profileOk = false;
+			if (moveMax > maxStep) maxStep = moveMax;
+			if (moveFirst > firstStep) firstStep = moveFirst;
+			if (moveLast > lastStep) lastStep = moveLast;
+		}
+
+		// the eased profiles must start and finish no faster than the linear one, and more gently
+		// unless the move has too few steps, or too small a distance, for them to differ
+		if (p == TurnoutServo::LINEAR)
+		{
+			linearFirst = firstStep;
+			linearLast = lastStep;
+		}
+		else if (firstStep > linearFirst || lastStep > linearLast)
+			profileOk = false;
+		else if (s.steps >= 4 && linearFirst > 1 && (firstStep == linearFirst || lastStep == linearLast))
+			profileOk = false;
+
+		printf("%-10s %10.2f %8lu %8lu %8d %8d %8d  %s\n", profileNames[p], easeError, moves[p][1].doneMillis,
+			moves[p][0].doneMillis, maxStep, firstStep, lastStep, profileOk ? "ok" : "FAILED");
+		ok = ok && profileOk;
+	}
+
+	// the servo's own state, without the pulse driver it derives from
+	printf("\nRAM: TurnoutServo %zu bytes on this host, %zu of them its own motion state (the step tables it\n"
+		"replaces took 60 bytes per servo, 240 on a crossover)\n",
+		sizeof(TurnoutServo), sizeof(TurnoutServo) - sizeof(SharedServo));
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,343 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/*
+
+Servo Pulse Test
+
+Runs the AVR version of SharedServo (TurnoutLibs/src) on a Linux host, stepping timer1 itself, and
+checks the pulses it sends.
+
+Summary:
+
+SharedServo is built with ARDUINO_ARCH_AVR defined, against the timer and port register variables
+in WProgram.h. The test runs the timer: it takes the count to each compare match in turn, as OCR1A
+sets it, and calls CompareMatch there, as the interrupt would be, with TCNT1 a few us on to stand
+in for the time the interrupt takes to be taken. The pin edges are read from the port registers
+after each match, and timed at the match, so the pulses are measured in timer ticks as the servo
+would see them. Four servos are created on pins 10, 5, 9 and 12, and attached in another order. The
+checks are:
+
+	widths      each pulse is the width the servo was given, exactly to the tick
+	order       the pulses of a frame go in the order the servos were created, each starting as the
+	            one before ends, and only the attached servos have pulses
+	frame       the frames start every 20 ms exactly
+	gap         every compare is scheduled after the interrupt is taken, and those through the gap
+	            after the pulses are at most 0xC000 ticks apart, inside the 16 bit timer period
+	ramp        a ramp and the one waiting behind it move the width a frame at a time in a straight
+	            line, each ending on its width and the second starting on the next frame, with no frame
+	            held at the handoff, and a third ramp is refused while one is waiting
+	detach      a servo detached partway through its pulse has its pin set low at once, the pulses after
+	            it keep their times, and it has no more pulses; detaching the last servo stops the
+	            compare interrupt, and attaching one again starts the frames again
+
+The program prints a line for each check and exits with an error if any fails.
+
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+#include "SharedServo.h"
+
+
+static const uint32_t ticksPerUs = CLOCK_SCALE_FACTOR;         // as the servo runs the timer
+static const uint32_t frameTicks = SharedServo::REFRESH_INTERVAL * ticksPerUs;
+static const uint16_t latency = 3 * ticksPerUs;                 // from a match to the interrupt
+
+static const byte numServos = 4;
+static const byte servoPins[numServos] = { 10, 5, 9, 12 };
+static SharedServo servos[numServos];                           // slots in this order
+
+
+// a change of a servo pin, and a pulse made of two
+struct Edge
+{
+	uint32_t tick;
+	byte servo;
+	bool high;
+};
+
+struct Pulse
+{
+	uint32_t start;
+	uint32_t width;
+};
+
+
+// the simulated timer. the count is the low 16 bits of the ticks since the start.
+static uint32_t now = 0;
+static std::vector<Edge> edges;
+static uint16_t minWait = 0xFFFF;       // shortest and longest compares scheduled
+static uint16_t maxWait = 0;
+static bool pinLevel[numServos];
+
+
+static bool PinHigh(byte Servo)
+{
+	const byte pin = servoPins[Servo];
+	return (*portOutputRegister(digitalPinToPort(pin)) & digitalPinToBitMask(pin)) != 0;
+}
+
+
+// note any changes of the pins at a time
+static void Sample(uint32_t Tick)
+{
+	for (byte i = 0; i < numServos; i++)
+	{
+		const bool high = PinHigh(i);
+		if (high != pinLevel[i])
+			edges.push_back({ Tick, i, high });
+		pinLevel[i] = high;
+	}
+}
+
+
+static bool CompareEnabled() { return (TIMSK1 & (1 << OCIE1A)) != 0; }
+
+
+// run the timer on to a time, taking each compare match on the way
+static void RunTo(uint32_t Until)
+{
+	while (CompareEnabled())
+	{
+		const uint32_t match = now + (uint16_t)(OCR1A - (uint16_t)now);
+		if (match > Until) break;
+
+		TCNT1 = match + latency;
+		SharedServo::CompareMatch();
+		Sample(match);
+
+		const uint16_t wait = OCR1A - (uint16_t)match;
+		if (wait < minWait) minWait = wait;
+		if (wait > maxWait) maxWait = wait;
+		now = match + latency;
+	}
+
+	if (Until > now) now = Until;
+	TCNT1 = now;
+}
+
+
+// the pulses of a servo that start in a span of time
+static std::vector<Pulse> Pulses(byte Servo, uint32_t From, uint32_t To)
+{
+	std::vector<Pulse> pulses;
+	for (size_t i = 0; i < edges.size(); i++)
+	{
+		const Edge &e = edges[i];
+		if (e.servo != Servo || !e.high || e.tick < From || e.tick >= To) continue;
+
+		for (size_t j = i + 1; j < edges.size(); j++)
+			if (edges[j].servo == Servo)
+			{
+				pulses.push_back({ e.tick, edges[j].tick - e.tick });
+				break;
+			}
+	}
+	return pulses;
+}
+
+
+// the start of the frame after the last one seen, from the first attached servo's pulses
+static uint32_t NextFrame(byte First)
+{
+	const std::vector<Pulse> pulses = Pulses(First, 0, now);
+	return pulses.empty() ? 0 : pulses.back().start + frameTicks;
+}
+
+
+// check the frames between two times against the width in us of each servo, 0 for one detached
+static void CheckFrames(uint32_t From, uint32_t To, const uint16_t Widths[], bool &WidthsOk, bool &OrderOk,
+	bool &FrameOk)
+{
+	byte first = 0;
+	while (first < numServos && !Widths[first]) first++;
+	const std::vector<Pulse> starts = Pulses(first, From, To);
+	if (starts.size() < 2) FrameOk = false;
+
+	for (size_t f = 0; f < starts.size(); f++)
+	{
+		if (f && starts[f].start - starts[f - 1].start != frameTicks) FrameOk = false;
+
+		// each pulse starts as the one before ends
+		uint32_t cursor = starts[f].start;
+		for (byte i = 0; i < numServos; i++)
+		{
+			if (!Widths[i]) continue;
+			const std::vector<Pulse> pulse = Pulses(i, cursor, cursor + 1);
+			if (pulse.size() != 1)
+			{
+				OrderOk = false;
+				break;
+			}
+			if (pulse[0].width != Widths[i] * ticksPerUs) WidthsOk = false;
+			cursor += pulse[0].width;
+		}
+	}
+
+	// and there are no others
+	for (byte i = 0; i < numServos; i++)
+		if (Pulses(i, From, To).size() != (Widths[i] ? starts.size() : 0))
+			OrderOk = false;
+}
+
+
+static bool Report(const char *Name, bool Ok)
+{
+	printf("%-10s %s\n", Name, Ok ? "ok" : "FAILED");
+	return Ok;
+}
+
+
+// move servo 0 through two ramps, the second added while the first is in progress
+static bool CheckRamp()
+{
+	const int from = 1000, to = 2000, back = 1200;
+	const uint16_t frames = 10, backFrames = 5;
+
+	// start between frames, in the gap
+	const uint32_t start = NextFrame(0);
+	RunTo(start - 200 * ticksPerUs);
+
+	bool ok = servos[0].rampMicroseconds(to, frames) && servos[0].ramping() && !servos[0].rampWaiting();
+	ok = servos[0].rampMicroseconds(back, backFrames) && servos[0].rampWaiting() && ok;
+	ok = !servos[0].rampMicroseconds(1500, 5) && ok;
+
+	RunTo(start + (frames + backFrames + 3) * frameTicks - 1);
+	const std::vector<Pulse> pulses = Pulses(0, start, now);
+	if (pulses.size() != frames + backFrames + 3) return false;
+
+	// the first pulse is at the width the ramp starts from, and each after it moves on by a frame's step
+	// of the straight line, ending exactly on the width
+	for (size_t k = 0; k < pulses.size(); k++)
+	{
+		double line;
+		if (k <= frames)
+			line = from + (double)(to - from) * k / frames;
+		else if (k <= frames + backFrames)
+			line = to + (double)(back - to) * (k - frames) / backFrames;
+		else
+			line = back;
+
+		const double width = pulses[k].width;
+		if (fabs(width - line * ticksPerUs) > 1) ok = false;
+		if ((k == frames || k >= frames + backFrames) && pulses[k].width != (k == frames ? to : back) * ticksPerUs)
+			ok = false;
+
+		// every frame of a ramp moves, through the handoff
+		if (k && k <= frames + backFrames && pulses[k].width == pulses[k - 1].width) ok = false;
+	}
+
+	return ok && !servos[0].ramping() && servos[0].readMicroseconds() == back;
+}
+
+
+// detach a servo during its pulse, then the rest, and start again
+static bool CheckDetach(bool &WidthsOk, bool &OrderOk, bool &FrameOk)
+{
+	const uint16_t widths[numServos] = { 1000, 1500, 2000, 2400 };
+	const uint16_t after[numServos] = { 1000, 0, 2000, 2400 };
+	bool ok = true;
+
+	// set the widths again for the next frame, then detach servo 1 halfway through its pulse
+	uint32_t frame = NextFrame(0);
+	RunTo(frame - 200 * ticksPerUs);
+	servos[0].writeMicroseconds(widths[0]);
+
+	const uint32_t cut = frame + (widths[0] + widths[1] / 2) * ticksPerUs;
+	RunTo(cut);
+	if (!PinHigh(1)) ok = false;
+	servos[1].detach();
+	Sample(now);
+	if (PinHigh(1) || servos[1].attached()) ok = false;
+
+	// servo 2 starts when servo 1's pulse would have ended, and the frames go on as before without it
+	RunTo(frame + 6 * frameTicks - 1);
+	const std::vector<Pulse> next = Pulses(2, cut, frame + frameTicks);
+	if (next.size() != 1 || next[0].start != frame + (widths[0] + widths[1]) * ticksPerUs) ok = false;
+	if (Pulses(0, frame + 1, frame + frameTicks + 1).size() != 1 ||
+		Pulses(0, frame + 1, frame + frameTicks + 1)[0].start != frame + frameTicks)
+		ok = false;
+	if (!Pulses(1, cut, now).empty()) ok = false;
+	CheckFrames(frame + frameTicks, now, after, WidthsOk, OrderOk, FrameOk);
+
+	// detach the rest, the first during its pulse, and the compare interrupt stops
+	frame = NextFrame(0);
+	RunTo(frame + widths[0] / 2 * ticksPerUs);
+	for (byte i = 0; i < numServos; i++)
+		servos[i].detach();
+	Sample(now);
+	if (CompareEnabled()) ok = false;
+
+	const size_t stopped = edges.size();
+	RunTo(now + 3 * frameTicks);
+	if (edges.size() != stopped) ok = false;
+	for (byte i = 0; i < numServos; i++)
+		if (PinHigh(i)) ok = false;
+
+	// attaching again starts the frames
+	const uint32_t restart = now;
+	servos[3].attach(servoPins[3]);
+	RunTo(now + 3 * frameTicks);
+	const std::vector<Pulse> pulses = Pulses(3, restart, now);
+	if (!CompareEnabled() || pulses.size() != 3) ok = false;
+	for (const Pulse &p : pulses)
+		if (p.width != widths[3] * ticksPerUs) ok = false;
+	if (pulses.size() >= 2 && pulses[1].start - pulses[0].start != frameTicks) ok = false;
+
+	return ok;
+}
+
+
+int main(int argc, char **argv)
+{
+	printf("SharedServo on a simulated timer1 at %u ticks per us, %u servos, pins %u %u %u %u\n\n",
+		(unsigned)ticksPerUs, numServos, servoPins[0], servoPins[1], servoPins[2], servoPins[3]);
+
+	// attached out of order, the pulses still go in slot order
+	const uint16_t widths[numServos] = { 1000, 1500, 2000, 2400 };
+	for (byte i = 0; i < numServos; i++)
+		servos[i].writeMicroseconds(widths[i]);
+	const byte attachOrder[numServos] = { 2, 0, 3, 1 };
+	for (byte i : attachOrder)
+		servos[i].attach(servoPins[i]);
+
+	RunTo(10 * frameTicks);
+	bool widthsOk = true, orderOk = true, frameOk = true;
+	CheckFrames(0, now, widths, widthsOk, orderOk, frameOk);
+
+	const bool rampOk = CheckRamp();
+	const bool detachOk = CheckDetach(widthsOk, orderOk, frameOk);
+	const bool gapOk = maxWait <= 0xC000 && minWait > latency;
+
+	bool ok = true;
+	ok = Report("widths", widthsOk) && ok;
+	ok = Report("order", orderOk) && ok;
+	ok = Report("frame", frameOk) && ok;
+	ok = Report("gap", gapOk) && ok;
+	ok = Report("ramp", rampOk) && ok;
+	ok = Report("detach", detachOk) && ok;
+
+	printf("\n%zu edges in %.1f ms, compares scheduled %u to %u ticks apart\n", edges.size(),
+		now / (ticksPerUs * 1000.0), minWait, maxWait);
+
+	return ok ? 0 : 1;
+}
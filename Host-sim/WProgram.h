@@ -0,0 +1,146 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Host Arduino Shim
+
+A minimal stand-in for the Arduino core, so that the DCC decoding libraries can be built and run
+on a Linux host.
+
+Summary:
+
+The libraries include "WProgram.h" when ARDUINO is not defined. When building on the host, this
+directory is placed first on the include path, so the libraries pick up this file instead of the
+Arduino core. It provides the Arduino types and functions the libraries use, plain variables in
+place of the AVR timer and port registers, and an ISR macro that turns interrupt vectors into
+ordinary functions that the simulator can call directly. With ARDUINO_ARCH_AVR defined, the AVR
+versions of the libraries build against these, so that a test can step the timer itself.
+
+Details:
+
+Time is simulated. millis() and micros() return a clock that is set by the simulator with
+HostSetMicros(), normally to the time of the DCC edge being delivered. The clock is per thread, so
+that several simulations may run in parallel without interfering with each other.
+
+Interrupt enable/disable are compiler barriers only. The simulator delivers edges and runs the
+main loop processing from the same thread, so there is no concurrency to protect against unless
+a test explicitly creates a producer thread.
+
+*/
+
+#ifndef _WPROGRAM_h
+#define _WPROGRAM_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+enum : byte
+{
+	LOW = 0,
+	HIGH = 1,
+	INPUT = 0,
+	OUTPUT = 1,
+	INPUT_PULLUP = 2,
+	CHANGE = 1,
+	FALLING = 2,
+	RISING = 3,
+};
+
+enum : int { DEC = 10, HEX = 16, BIN = 2 };
+
+#define highByte(w) ((byte) ((w) >> 8))
+#define lowByte(w) ((byte) ((w) & 0xff))
+
+// flash storage is just ordinary memory on the host
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const byte *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+
+// simulated time
+void HostSetMicros(unsigned long Micros);
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long Ms);
+
+// pins
+void pinMode(byte Pin, byte Mode);
+void digitalWrite(byte Pin, byte Value);
+int digitalRead(byte Pin);
+void analogWrite(byte Pin, int Value);
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : -1))
+void attachInterrupt(int Interrupt, void(*Handler)(), int Mode);
+void detachInterrupt(int Interrupt);
+
+// interrupts are not preemptive on the host, so these only need to stop the compiler reordering
+#define noInterrupts() __asm__ __volatile__("" ::: "memory")
+#define interrupts() __asm__ __volatile__("" ::: "memory")
+
+// AVR timer and port registers used by the libraries
+extern volatile byte TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+extern volatile uint16_t TCNT1, ICR1, OCR1A;
+extern volatile byte TCCR2A, TCCR2B, TCNT2, TIMSK2;
+extern volatile byte PORTB, PORTC, PORTD, PIND;
+
+// and the bits of them, as the AVR headers number them
+enum : byte { CS10 = 0, CS11 = 1, CS12 = 2, OCIE1A = 1, OCF1A = 1 };
+
+// the pins of an Uno: 0 to 7 on port D, 8 to 13 on port B, and the analog pins 14 to 19 on port C
+enum : byte { PB = 2, PC = 3, PD = 4 };
+inline byte digitalPinToPort(byte Pin) { return (Pin < 8) ? PD : (Pin < 14) ? PB : PC; }
+inline byte digitalPinToBitMask(byte Pin) { return 1 << ((Pin < 8) ? Pin : (Pin < 14) ? Pin - 8 : Pin - 14); }
+inline volatile byte *portOutputRegister(byte Port) { return (Port == PD) ? &PORTD : (Port == PB) ? &PORTB : &PORTC; }
+
+long map(long Value, long FromLow, long FromHigh, long ToLow, long ToHigh);
+
+// interrupt vectors become plain functions that the simulator calls to deliver an edge, or a compare match
+#define ISR(vector) void vector()
+void TIMER1_CAPT_vect();
+void TIMER1_COMPA_vect();
+
+
+// just enough of Serial for the libraries' debug output
+class HostSerial
+{
+public:
+	void begin(unsigned long Baud);
+	size_t write(byte Value);
+	size_t write(const byte *Buffer, size_t Size);
+	size_t print(const char *Text);
+	size_t print(char Value);
+	size_t print(long Value, int Base = DEC);
+	size_t print(unsigned long Value, int Base = DEC);
+	size_t print(int Value, int Base = DEC) { return print((long)Value, Base); }
+	size_t print(unsigned int Value, int Base = DEC) { return print((unsigned long)Value, Base); }
+	size_t print(byte Value, int Base = DEC) { return print((unsigned long)Value, Base); }
+	size_t print(double Value, int Digits = 2);
+	size_t println();
+	template <typename T> size_t println(T Value) { size_t n = print(Value); return n + println(); }
+	template <typename T> size_t println(T Value, int Base) { size_t n = print(Value, Base); return n + println(); }
+};
+
+extern HostSerial Serial;
+
+#endif
@@ -0,0 +1,121 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "Waveform.h"
+
+
+Waveform::Waveform(const Settings &Config, unsigned Seed) : settings(Config), random(Seed)
+{
+	// start the track signal with an edge at time zero
+	edges.push_back(0);
+}
+
+
+// add a packet, appending the checksum and sending it the configured number of times
+void Waveform::AddPacket(const uint8_t *Data, uint8_t Size)
+{
+	Packet packet;
+	uint8_t checksum = 0;
+	for (uint8_t i = 0; i < Size; i++)
+	{
+		packet.data[i] = Data[i];
+		checksum ^= Data[i];
+	}
+	packet.data[Size] = checksum;
+	packet.size = Size + 1;
+
+	for (int i = 0; i < settings.repeats; i++)
+	{
+		SendPacket(packet.data, packet.size);
+		packet.endNs = timeNs;
+		packet.isRepeat = (i > 0);
+		packets.push_back(packet);
+	}
+}
+
+
+// add an idle packet
+void Waveform::AddIdle()
+{
+	const uint8_t idle[2] = { 0xFF, 0x00 };
+	AddPacket(idle, 2);
+}
+
+
+// convert one packet to half bits
+void Waveform::SendPacket(const uint8_t *Data, uint8_t Size)
+{
+	for (int i = 0; i < settings.preambleBits; i++)
+		AddBit(1);
+
+	for (uint8_t i = 0; i < Size; i++)
+	{
+		AddBit(0);    // start bit or data separator
+		for (uint8_t mask = 0x80; mask; mask >>= 1)
+			AddBit(Data[i] & mask);
+	}
+
+	AddBit(1);    // end bit
+}
+
+
+void Waveform::AddBit(bool Bit)
+{
+	if (Bit)
+	{
+		AddHalfBit(settings.oneHalfUs);
+		AddHalfBit(settings.oneHalfUs);
+	}
+	else
+	{
+		AddHalfBit(settings.zeroHalfUs + settings.zeroStretchUs * uniform(random));
+		AddHalfBit(settings.zeroHalfUs);
+	}
+}
+
+
+// add a half bit of the given nominal duration, applying jitter and glitches
+void Waveform::AddHalfBit(double Us)
+{
+	Us += settings.jitterUs * (2.0 * uniform(random) - 1.0);
+	const uint64_t start = timeNs;
+	const uint64_t end = start + (uint64_t)(Us * 1000.0);
+
+	// a glitch is a short pulse somewhere inside the half bit, which adds two edges
+	if (settings.glitchRate > 0.0 && uniform(random) < settings.glitchRate)
+	{
+		const uint64_t glitchNs = (uint64_t)(settings.glitchUs * 1000.0);
+		const uint64_t at = start + (uint64_t)((end - start - glitchNs) * uniform(random));
+		AddEdge(at);
+		AddEdge(at + glitchNs);
+	}
+
+	AddEdge(end);
+	timeNs = end;
+}
+
+
+void Waveform::AddEdge(uint64_t Ns)
+{
+	if (settings.dropRate > 0.0 && uniform(random) < settings.dropRate)
+		return;
+
+	edges.push_back(Ns);
+}
@@ -0,0 +1,109 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+DCC Waveform Synthesizer
+
+A class to generate the edge timestamps of a DCC track signal from a list of packets.
+
+Summary:
+
+Packets are added one at a time, and are converted to a sequence of half bits: a preamble of 1's,
+a 0 start bit, the data bytes separated by 0 bits, a checksum byte, and a final 1 end bit. The
+time of each signal transition is stored in nanoseconds. Imperfections of a real track signal can
+be added to the waveform, so that the error handling of the decoder can be exercised.
+
+Example Usage:
+
+	Waveform::Settings settings;              // nominal timings, no impairments
+	settings.jitterUs = 2.0;                  // +/- 2 us of jitter on each half bit
+	Waveform waveform{ settings, 1 };         // create the waveform with a random seed
+	waveform.AddPacket(data, 3);              // add a packet (checksum is appended)
+	waveform.Edges();                         // the edge timestamps, in ns
+
+Details:
+
+Half bit durations are nominally 58 us for a 1 and 100 us for a 0. Uniform jitter may be added to
+every half bit. Zero stretching adds a random extra time to the first half of each 0 bit, as some
+command stations do. Glitches insert a short extra pulse (two edges) at a random point within a
+half bit. Dropped edges remove an edge from the output, merging two half bits into one. Each packet
+may be repeated a number of times back to back, in the way command stations such as the NCE resend
+speed and accessory packets.
+
+The time of the final edge of each packet's end bit is recorded, so that the delay between the end
+of a packet on the track and its delivery by the decoder can be measured.
+
+*/
+
+#ifndef _WAVEFORM_h
+#define _WAVEFORM_h
+
+#include <stdint.h>
+#include <random>
+#include <vector>
+
+
+class Waveform
+{
+public:
+	struct Settings
+	{
+		double oneHalfUs = 58.0;         // half bit time for a 1
+		double zeroHalfUs = 100.0;       // half bit time for a 0
+		double jitterUs = 0.0;           // +/- uniform jitter on each half bit
+		double zeroStretchUs = 0.0;      // max extra time added to the first half of a 0
+		double glitchRate = 0.0;         // probability per half bit of a short glitch pulse
+		double glitchUs = 2.0;           // width of a glitch pulse
+		double dropRate = 0.0;           // probability per edge of the edge being lost
+		int preambleBits = 14;           // number of 1's in each preamble
+		int repeats = 1;                 // number of times each packet is sent back to back
+	};
+
+	struct Packet
+	{
+		uint8_t data[6];                 // packet bytes, including checksum
+		uint8_t size;                    // number of bytes
+		uint64_t endNs;                  // time of the last edge of the end bit
+		bool isRepeat;                   // this is a back to back resend of the previous packet
+	};
+
+	Waveform(const Settings &Config, unsigned Seed);
+	void AddPacket(const uint8_t *Data, uint8_t Size);
+	void AddIdle();
+	const std::vector<uint64_t> &Edges() const { return edges; }
+	const std::vector<Packet> &Packets() const { return packets; }
+	uint64_t CurrentNs() const { return timeNs; }
+
+private:
+	void AddBit(bool Bit);
+	void AddHalfBit(double Us);
+	void AddEdge(uint64_t Ns);
+	void SendPacket(const uint8_t *Data, uint8_t Size);
+
+	Settings settings;
+	std::mt19937 random;
+	std::uniform_real_distribution<double> uniform{ 0.0, 1.0 };
+	uint64_t timeNs = 0;                 // time of the last edge
+	std::vector<uint64_t> edges;
+	std::vector<Packet> packets;
+};
+
+#endif
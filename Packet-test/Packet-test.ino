@@ -52,9 +52,10 @@ BitStream bitStream;
 DCCpacket dccpacket(true, false, 250);
 
 
-void BitStreamHandler(unsigned long incomingBits)
+void BitStreamHandler(unsigned long incomingBits, byte bitCount)
 {
-	dccpacket.ProcessIncomingBits(incomingBits);
+	dccpacket.ProcessIncomingBits(incomingBits, bitCount);
+	bitStream.SetFlushBits(dccpacket.BitsToNextTerminator());    // stream bits up to the next possible packet end
 }
 
 
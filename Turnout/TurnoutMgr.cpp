@@ -36,14 +36,6 @@ TurnoutMgr::TurnoutMgr()
 	osStraight.SetButtonPressHandler(WrapperOSStraight);
 	osCurved.SetButtonPressHandler(WrapperOSCurved);
 
-	// configure dcc event handlers
-	dcc.SetBasicAccessoryDecoderPacketHandler(WrapperDCCAccPacket);
-	dcc.SetExtendedAccessoryDecoderPacketHandler(WrapperDCCExtPacket);
-	dcc.SetBasicAccessoryPomPacketHandler(WrapperDCCAccPomPacket);
-	dcc.SetBitstreamMaxErrorHandler(WrapperMaxBitErrors);
-	dcc.SetPacketMaxErrorHandler(WrapperMaxPacketErrors);
-	dcc.SetDecodingErrorHandler(WrapperDCCDecodingError);
-
 	// configure timer event handlers
 	errorTimer.SetTimerHandler(WrapperErrorTimer);
 	resetTimer.SetTimerHandler(WrapperResetTimer);
@@ -79,17 +71,26 @@ void TurnoutMgr::Initialize()
 // update sensors and outputs
 void TurnoutMgr::Update()
 {
+	PROFILE_SCOPE(profileUpdate);
+
+	// process any DCC interrupts that have been timestamped, passing packets to our handler
+	dcc.ProcessTimeStamps(dccHandler);
+
 	// do all the updates that TurnoutBase handles
 	TurnoutBase::Update();
 
 	// then update our sensors and servo
 	const unsigned long currentMillis = millis();
+	PROFILE_START(profileSensors);
 	osStraight.Update(currentMillis);
 	osCurved.Update(currentMillis);
+	PROFILE_STOP(profileSensors);
 
+	PROFILE_START(profileServos);
 	if (servosActive)
 		for (byte i = 0; i < numServos; i++)
 			servo[i].Update(currentMillis);
+	PROFILE_STOP(profileServos);
 
 }
 
@@ -111,6 +112,7 @@ void TurnoutMgr::InitMain()
 
 	// set led and relays, and begin bitstream capture
 	EndServoMove();
+	dcc.ResumeBitstream();
 
 #ifdef _DEBUG
 	Serial.println("TurnoutMgr init done.");
@@ -121,23 +123,22 @@ void TurnoutMgr::InitMain()
 // set the turnout to a new position
 void TurnoutMgr::BeginServoMove()
 {
-	// store new position to cv
-	cv.setCV(CV_turnoutPosition, position);
-	SaveConfig();
+	// store new position
+	SavePosition();
 
 	// set the led to indicate servo is in motion
 	led.SetLED((position == STRAIGHT) ? RgbLed::GREEN : RgbLed::RED, RgbLed::FLASH);
 
-	// stop the bitstream capture
-	dcc.SuspendBitstream();
-
 	// turn off the relays
 	relayStraight.SetPin(LOW);
 	relayCurved.SetPin(LOW);
 
-	// start pwm for current positions of all servos
+	// start pwm for current positions of all servos, with the motion profile from the cv
 	for (byte i = 0; i < numServos; i++)
+	{
+		servo[i].SetProfile(cv.getCV(CV_servoProfile));
 		servo[i].StartPWM();
+	}
 
 	// turn on servo power
 	servoPower.SetPin(HIGH);
@@ -152,6 +153,13 @@ void TurnoutMgr::BeginServoMove()
 // resume normal operation after servo motion is complete
 void TurnoutMgr::EndServoMove()
 {
+	// carry out a move requested during this one straight away, with the servos still powered
+	if (TakePendingMove())
+	{
+		BeginServoMove();
+		return;
+	}
+
 	// set the led solid for the current position
 	led.SetLED((position == STRAIGHT) ? RgbLed::GREEN : RgbLed::RED, RgbLed::ON);
 
@@ -173,9 +181,8 @@ void TurnoutMgr::EndServoMove()
 		relayCurved.SetPin(HIGH);
 	}
 
-	// resume the bitstream capture
+	// the move is done, the bitstream capture carried on throughout
 	servosActive = false;
-	dcc.ResumeBitstream();
 }
 
 
@@ -231,8 +238,10 @@ void TurnoutMgr::ButtonEventHandler(bool ButtonState)
 		// proceed only if both occupancy sensors are inactive (i.e., sensors override button press)
 		if (osStraight.SwitchState() == HIGH && osCurved.SwitchState() == HIGH)
 		{
-			// toggle from current position and set new position
-			position = (State)!position;
+			// toggle from the position we are going to, and set new position
+			const State newPos = (State)!TargetPosition();
+			if (HoldMove(newPos, LOW)) return;
+			position = newPos;
 			servoRate = LOW;
 			BeginServoMove();
 		}
@@ -252,8 +261,9 @@ void TurnoutMgr::OSStraightHandler(bool ButtonState)
 	const State newPos = (occupancySensorSwap) ? CURVED : STRAIGHT;
 
 	// check occupancy sensor state (LOW so we respond when train detected)
-	if (ButtonState == LOW && newPos != position)
+	if (ButtonState == LOW && newPos != TargetPosition())
 	{
+		if (HoldMove(newPos, HIGH)) return;
 		position = newPos;
 		servoRate = HIGH;
 		BeginServoMove();
@@ -267,8 +277,9 @@ void TurnoutMgr::OSCurvedHandler(bool ButtonState)
 	const State newPos = (occupancySensorSwap) ? STRAIGHT : CURVED;
 
 	// check occupancy sensor state (LOW so we respond when train detected)
-	if (ButtonState == LOW && newPos != position)
+	if (ButtonState == LOW && newPos != TargetPosition())
 	{
+		if (HoldMove(newPos, HIGH)) return;
 		position = newPos;
 		servoRate = HIGH;
 		BeginServoMove();
@@ -285,8 +296,8 @@ void TurnoutMgr::DCCAccCommandHandler(unsigned int Addr, unsigned int Direction)
 	State dccState = (Direction == 0) ? CURVED : STRAIGHT;
 	if (dccCommandSwap) dccState = (State)!dccState; // swap the interpretation of dcc command if needed
 
-	// if we are already in the desired position, just exit
-	if (dccState == position) return;
+	// if we are already in (or moving to) the desired position, just exit
+	if (dccState == TargetPosition()) return;
 
 #ifdef _DEBUG
 	Serial.print("Received dcc command to position ");
@@ -296,7 +307,8 @@ void TurnoutMgr::DCCAccCommandHandler(unsigned int Addr, unsigned int Direction)
 	// proceed only if both occupancy sensors are inactive (i.e., sensors override dcc command)
 	if (osStraight.SwitchState() == HIGH && osCurved.SwitchState() == HIGH)
 	{
-		// set switch state based on dcc command
+		// set switch state based on dcc command, or hold it until the current move is done
+		if (HoldMove(dccState, LOW)) return;
 		position = dccState;
 		servoRate = LOW;
 		BeginServoMove();
@@ -336,29 +348,6 @@ void TurnoutMgr::WrapperOSCurved(bool ButtonState) { currentInstance->OSCurvedHa
 void TurnoutMgr::WrapperServoMoveDone() { currentInstance->ServoMoveDoneHandler(); }
 
 
-// ========================================================================================================
-// dcc processor callback wrappers
-
-void TurnoutMgr::WrapperDCCAccPacket(int boardAddress, int outputAddress, byte activate, byte data)
-{
-	currentInstance->DCCAccCommandHandler(outputAddress, data);
-}
-
-void TurnoutMgr::WrapperDCCExtPacket(int boardAddress, int outputAddress, byte data)
-{
-	currentInstance->DCCExtCommandHandler(outputAddress, data);
-}
-
-void TurnoutMgr::WrapperDCCAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data)
-{
-	currentInstance->DCCPomHandler(outputAddress, instructionType, cv, data);
-}
-
-void TurnoutMgr::WrapperMaxBitErrors(byte errorCode) { currentInstance->TurnoutBase::MaxBitErrorHandler(); }
-void TurnoutMgr::WrapperMaxPacketErrors(byte errorCode) { currentInstance->TurnoutBase::MaxPacketErrorHandler(); }
-void TurnoutMgr::WrapperDCCDecodingError(byte errorCode) { currentInstance->TurnoutBase::DCCDecodingError(); }
-
-
 // timer callback wrappers
 void TurnoutMgr::WrapperResetTimer() { currentInstance->ResetTimerHandler(); }
 void TurnoutMgr::WrapperErrorTimer() { currentInstance->ErrorTimerHandler(); }
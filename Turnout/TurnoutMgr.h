@@ -46,7 +46,7 @@ Details:
 The InitMain method performs the major setup for the class, including setting up the DCC packet
 processor, reading the stored configuration from EEPROM (via the DCCdecoder lib), getting the stored
 position of the turnout, and configuring the servo. It calls the EndServoMove method to set the LED 
-and relays and start the bitstream capture. Event handlers are configured in the constructor.
+and relays, and then starts the bitstream capture. Event handlers are configured in the constructor.
 If a factory reset is triggered in the Initialize method, the CVs are restored to their default 
 settings, and a timer is set which then runs the InitMain method. The Initialize method should be 
 called once from the main arduino setup() function.
@@ -57,24 +57,30 @@ into a full DCC packet. It also handles millis-related updates for the LED, sens
 servo.
 
 The BeginServoMove method configures the turnout prior to beginning a servo motion. It stores the
-new position to EEPROM, starts the LED flashing, disables relays, and stops the bitstream capture.
-It then starts PWM for the servo and enables the servo power pin. It then calls the ServoMoveDoneHandler
-to perform the actual motion. After the final servo motion is complete, the EndServoMove method is
-called via the servoTimer event handler. The EndServoMove method sets the LED for the new position,
-stops the servo PWM and disables the servo power, resumes the bitstream capture, and sets the relays.
+new position to EEPROM, starts the LED flashing, and disables relays. It then starts PWM for the
+servo and enables the servo power pin. It then calls the ServoMoveDoneHandler to perform the actual
+motion. After the final servo motion is complete, the EndServoMove method is called via the
+servoTimer event handler. The EndServoMove method sets the LED for the new position, stops the servo
+PWM and disables the servo power, and sets the relays. The servo pulses share timer1
+with the bitstream capture (see SharedServo), so DCC packets are decoded throughout the move. A new
+position commanded during the move is held (see TurnoutBase), and EndServoMove starts the move to it
+straight away, with the servo still powered and the relays still off.
 
 The ButtonEventHandler, OSStraightHandler, and OSCurvedHandler respond to events from
 the button and occupancy sensors, and trigger a change in the turnout position.
 
 The DCCAccCommandHandler processes a basic accessory command, used to set the position of the
-turnout. Occupancy sensors are checked prior to setting the turnout, with an error indication given
-if they are occupied. The DCCPomHandler method processes a program on main packet. It checks for a 
-valid CV, stores the data via the DCCdecoder object, and then re-reads the basic configuration for 
-the turnout.
+turnout. It is called for every address the decoder answers (CV 47, see TurnoutBase), which are
+all aliases for the one turnout, so the address is passed along but not used. Occupancy sensors
+are checked prior to setting the turnout, with an error indication given if they are occupied.
+The DCCPomHandler method processes a program on main packet. It checks for a valid CV, stores the
+data via the DCCdecoder object, and then re-reads the basic configuration for the turnout.
 
-Event handler wrappers for the sensors, button, servo, timer, and DCC classes are static, so that
+Event handler wrappers for the sensors, button, servo, and timer classes are static, so that
 they are accessible as callbacks from those classes. An instance variable provides access to the
-instance of the turnout manager, where the actual callback handling takes place.
+instance of the turnout manager, where the actual callback handling takes place. DCC packets and errors
+are instead passed to a DCCHandler object, which the decoder calls directly (see DCCdecoder), so the
+decode path doesn't go through function pointers.
 
 */
 
@@ -135,20 +141,27 @@ private:
 	static void WrapperOSCurved(bool ButtonState);
 	static void WrapperServoMoveDone();
 
-	// DCC event handler wrappers
-	static void WrapperDCCAccPacket(int boardAddress, int outputAddress, byte activate, byte data);
-	static void WrapperDCCExtPacket(int boardAddress, int outputAddress, byte data);
-	static void WrapperDCCAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data);
-
 	// Turnout manager event handler wrappers
 	static void WrapperResetTimer();
 	static void WrapperErrorTimer();
 	static void WrapperServoTimer();
 
-	// Wrappers for events in Turnoutbase
-	static void WrapperMaxBitErrors(byte errorCode);
-	static void WrapperMaxPacketErrors(byte errorCode);
-	static void WrapperDCCDecodingError(byte errorCode);
+	// DCC packet and error handlers, passed to the decoder as a template parameter so that it calls
+	// them directly, rather than through function pointers and wrappers
+	struct DCCHandler : DCCdecoder::Handlers
+	{
+		TurnoutMgr &mgr;
+		DCCHandler(TurnoutMgr &Mgr) : mgr(Mgr) {}
+
+		void BasicAccPacket(int boardAddress, int outputAddress, byte activate, byte data) { mgr.DCCAccCommandHandler(outputAddress, data); }
+		void ExtendedAccPacket(int boardAddress, int outputAddress, byte data) { mgr.DCCExtCommandHandler(outputAddress, data); }
+		void BasicAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data) { mgr.DCCPomHandler(outputAddress, instructionType, cv, data); }
+		void BitstreamMaxError(byte errorCode) { mgr.MaxBitErrorHandler(); }
+		void PacketMaxError(byte errorCode) { mgr.MaxPacketErrorHandler(); }
+		void DecodingError(byte errorCode) { mgr.DCCDecodingError(); }
+	};
+
+	DCCHandler dccHandler{ *this };
 };
 
 
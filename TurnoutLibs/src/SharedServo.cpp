@@ -0,0 +1,381 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SharedServo.h"
+
+#if defined(ARDUINO_ARCH_AVR)
+
+// define/initialize static vars
+SharedServo *SharedServo::slots[MAX_SERVOS];
+byte SharedServo::slotCount = 0;
+byte SharedServo::attachedCount = 0;
+byte SharedServo::current = MAX_SERVOS;
+uint32_t SharedServo::frameTicks = 0;
+uint32_t SharedServo::gapLeft = 0;
+
+
+// take the next slot, with the pulse for the middle position
+SharedServo::SharedServo()
+{
+	if (slotCount < MAX_SERVOS)
+	{
+		slot = slotCount++;
+		slots[slot] = this;
+	}
+	else
+		slot = INVALID_SERVO;
+}
+
+
+// start the pulses on a pin, and the frames if this is the first servo attached
+byte SharedServo::attach(byte Pin)
+{
+	if (slot == INVALID_SERVO) return INVALID_SERVO;
+
+	pinMode(Pin, OUTPUT);
+	digitalWrite(Pin, LOW);
+
+	noInterrupts();
+	if (!isAttached)
+	{
+		port = portOutputRegister(digitalPinToPort(Pin));
+		mask = digitalPinToBitMask(Pin);
+		isAttached = true;
+		if (attachedCount++ == 0)
+			Start();
+	}
+	interrupts();
+
+	return slot;
+}
+
+
+// stop the pulses, and the frames if this was the last servo attached
+void SharedServo::detach()
+{
+	if (slot == INVALID_SERVO) return;
+
+	noInterrupts();
+	if (isAttached)
+	{
+		isAttached = false;
+		*port &= ~mask;                 // end the pulse if it is on
+		if (--attachedCount == 0)
+			TIMSK1 &= ~(1 << OCIE1A);   // disable the compare interrupt, leaving the capture interrupt alone
+	}
+	interrupts();
+}
+
+
+bool SharedServo::attached()
+{
+	return (slot != INVALID_SERVO) && isAttached;
+}
+
+
+// as the Servo library, values below the minimum pulse width are angles
+void SharedServo::write(int Value)
+{
+	if (Value < MIN_PULSE_WIDTH)
+	{
+		if (Value < 0) Value = 0;
+		if (Value > 180) Value = 180;
+		Value = map(Value, 0, 180, MIN_PULSE_WIDTH, MAX_PULSE_WIDTH);
+	}
+	writeMicroseconds(Value);
+}
+
+
+// set the width, stopping any ramps
+void SharedServo::writeMicroseconds(int Value)
+{
+	if (slot == INVALID_SERVO) return;
+
+	if (Value < MIN_PULSE_WIDTH) Value = MIN_PULSE_WIDTH;
+	if (Value > MAX_PULSE_WIDTH) Value = MAX_PULSE_WIDTH;
+
+	// the interrupt reads the width at the start of each pulse
+	const uint16_t newTicks = Value * TICKS_PER_US;
+	noInterrupts();
+	ticks = newTicks;
+	framesLeft = 0;
+	nextFrames = 0;
+	interrupts();
+}
+
+
+int SharedServo::read()
+{
+	return map(readMicroseconds() + 1, MIN_PULSE_WIDTH, MAX_PULSE_WIDTH, 0, 180);
+}
+
+
+int SharedServo::readMicroseconds()
+{
+	if (slot == INVALID_SERVO) return 0;
+
+	noInterrupts();
+	const uint16_t pulse = ticks;
+	interrupts();
+	return pulse / TICKS_PER_US;
+}
+
+
+// add a ramp to a width, to start now if there is none in progress, or when the one in progress ends
+bool SharedServo::rampMicroseconds(int Value, uint16_t Frames)
+{
+	if (slot == INVALID_SERVO) return false;
+
+	if (Value < MIN_PULSE_WIDTH) Value = MIN_PULSE_WIDTH;
+	if (Value > MAX_PULSE_WIDTH) Value = MAX_PULSE_WIDTH;
+	if (Frames == 0) Frames = 1;
+
+	// the ramp starts from where the one before it ends
+	noInterrupts();
+	const bool waiting = (nextFrames != 0);
+	const uint16_t from = framesLeft ? target : ticks;
+	interrupts();
+	if (waiting) return false;
+
+	// divide here, so the interrupt only has to add
+	const uint16_t to = Value * TICKS_PER_US;
+	const int32_t frameStep = ((int32_t)to - from) * 256 / Frames;
+
+	// if the ramp in progress ended meanwhile, the width is where it ended, so this can start now
+	noInterrupts();
+	if (framesLeft)
+	{
+		nextStep = frameStep;
+		nextTarget = to;
+		nextFrames = Frames;
+	}
+	else
+	{
+		width = (int32_t)ticks << 8;
+		step = frameStep;
+		target = to;
+		framesLeft = Frames;
+	}
+	interrupts();
+
+	return true;
+}
+
+
+bool SharedServo::ramping()
+{
+	noInterrupts();
+	const bool moving = (framesLeft != 0);
+	interrupts();
+	return moving;
+}
+
+
+bool SharedServo::rampWaiting()
+{
+	noInterrupts();
+	const bool waiting = (nextFrames != 0);
+	interrupts();
+	return waiting;
+}
+
+
+// set timer1 to run freely at the timestamp rate, unless it already is. the capture edge and noise
+// canceler bits are kept, and the count is not touched.
+void SharedServo::TimerSetup()
+{
+#if defined(TIMER1_HW_0PS) || defined(TIMER1_ICR_0PS)
+	const byte clockSelect = (1 << CS10);    // no prescaler
+#else
+	const byte clockSelect = (1 << CS11);    // 8 prescaler
+#endif
+
+	if (TCCR1A == 0 && (TCCR1B & 0x1F) == clockSelect)
+		return;
+
+	TCCR1A = 0;
+	TCCR1B = (TCCR1B & 0xC0) | clockSelect;
+	TCCR1C = 0;
+}
+
+
+// start the frames shortly after now, with interrupts disabled
+void SharedServo::Start()
+{
+	TimerSetup();
+
+	current = MAX_SERVOS;
+	gapLeft = 0;
+	OCR1A = TCNT1 + 100 * TICKS_PER_US;
+	TIFR1 = (1 << OCF1A);           // clear a stale match
+	TIMSK1 |= (1 << OCIE1A);
+}
+
+
+// schedule the next piece of the gap, keeping each compare a safe distance inside the timer period
+inline void SharedServo::Wait(uint16_t Now)
+{
+	const uint16_t wait = (gapLeft > 0xC000) ? 0x8000 : gapLeft;
+	gapLeft -= wait;
+	OCR1A = Now + wait;
+}
+
+
+// step the ramp in progress for the next frame, ending exactly on its target, and start the one
+// waiting when it ends
+inline void SharedServo::NextFrame()
+{
+	if (!framesLeft) return;
+
+	if (--framesLeft)
+	{
+		width += step;
+		ticks = width >> 8;
+	}
+	else
+	{
+		ticks = target;
+		if (nextFrames)
+		{
+			width = (int32_t)target << 8;
+			step = nextStep;
+			target = nextTarget;
+			framesLeft = nextFrames;
+			nextFrames = 0;
+		}
+	}
+}
+
+
+// end the pulse that is on and start the next, or carry on through the gap to the next frame.
+// each edge is timed from the compare value of the edge before, not from when the interrupt ran.
+void SharedServo::CompareMatch()
+{
+	const uint16_t now = OCR1A;
+
+	if (current < MAX_SERVOS)
+	{
+		// end the pulse, and go on to the next servo
+		SharedServo &s = *slots[current];
+		*s.port &= ~s.mask;
+		current++;
+	}
+	else if (gapLeft > 0)
+	{
+		Wait(now);
+		return;
+	}
+	else
+	{
+		// the gap is over, start the next frame
+		current = 0;
+		frameTicks = 0;
+	}
+
+	// start the pulse of the next attached servo, then move its ramp on for the next frame
+	for (; current < slotCount; current++)
+	{
+		SharedServo &s = *slots[current];
+		if (s.isAttached)
+		{
+			*s.port |= s.mask;
+			OCR1A = now + s.ticks;
+			frameTicks += s.ticks;
+			s.NextFrame();
+			return;
+		}
+	}
+
+	// no more pulses this frame, wait out the rest of it
+	current = MAX_SERVOS;
+	gapLeft = FRAME_TICKS - frameTicks;
+	Wait(now);
+}
+
+
+ISR(TIMER1_COMPA_vect)        // static, global
+{
+	SharedServo::CompareMatch();
+}
+
+#else
+
+// add a ramp to a width, to start now if there is none in progress, or when the one in progress ends
+bool SharedServo::rampMicroseconds(int Value, uint16_t Frames)
+{
+	if (nextFrames) return false;
+
+	if (Value < MIN_PULSE_WIDTH) Value = MIN_PULSE_WIDTH;
+	if (Value > MAX_PULSE_WIDTH) Value = MAX_PULSE_WIDTH;
+	if (Frames == 0) Frames = 1;
+
+	const uint16_t from = framesLeft ? target : readMicroseconds();
+	const int32_t frameStep = ((int32_t)Value - from) * 256 / Frames;
+
+	if (framesLeft)
+	{
+		nextStep = frameStep;
+		nextTarget = Value;
+		nextFrames = Frames;
+	}
+	else
+	{
+		width = (int32_t)from << 8;
+		step = frameStep;
+		target = Value;
+		framesLeft = Frames;
+		frameMillis = millis();         // the first frame is one interval from now
+	}
+	return true;
+}
+
+
+bool SharedServo::ramping() { return framesLeft != 0; }
+
+
+// step the ramps for the frames since the last, as the AVR version does from the interrupt
+void SharedServo::refresh(unsigned long CurrentMillis)
+{
+	const unsigned long interval = REFRESH_INTERVAL / 1000;
+
+	while (framesLeft && CurrentMillis - frameMillis >= interval)
+	{
+		frameMillis += interval;
+		if (--framesLeft)
+		{
+			width += step;
+			Servo::writeMicroseconds(width >> 8);
+		}
+		else
+		{
+			Servo::writeMicroseconds(target);
+			if (nextFrames)
+			{
+				width = (int32_t)target << 8;
+				step = nextStep;
+				target = nextTarget;
+				framesLeft = nextFrames;
+				nextFrames = 0;
+			}
+		}
+	}
+}
+
+#endif
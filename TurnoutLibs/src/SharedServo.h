@@ -0,0 +1,206 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+Shared Servo
+
+A servo pulse driver that shares timer1 with the DCC timestamp capture.
+
+Summary:
+
+The Arduino Servo library takes over timer1: it sets its own prescaler and resets the count at the
+start of every frame, which breaks the input capture timestamps, so the decoder had to be suspended
+for the whole of a servo move. This class drives the servos from the timer1 output compare A
+interrupt instead, and never changes the count or the prescaler. The timer runs freely for both,
+and DCC commands are still decoded while the servos move. It has the same methods as the Servo
+library for attaching, detaching, and setting the position, and it can also move a servo smoothly to
+a new pulse width over a number of frames, driven by the frames themselves rather than the main loop.
+
+Example usage:
+
+		SharedServo servo;                    // create a servo, taking one of the slots in the frame
+		servo.write(90);                      // set the position in degrees, or
+		servo.writeMicroseconds(1500);        // the pulse width
+		servo.attach(ServoPin);               // start the pulses on a pin
+		servo.rampMicroseconds(2000, 50);     // move to a new width over 50 frames (one second)
+		while (servo.ramping())               // the move runs by itself, one step per frame
+			servo.refresh(millis());          // (only needed on other than AVR boards)
+		servo.detach();                       // and stop them
+
+Details:
+
+The servos are given a slot each when they are created, up to MAX_SERVOS. The slot holds a pointer
+to the servo, which keeps its own pin and pulse width, so only the servos created take memory for
+them. Every 20 ms frame, the pulses of the attached servos are sent one after another, in slot order,
+as the Servo library does.
+Each edge is scheduled by setting OCR1A to the timer count of the edge before plus the width of the
+pulse, so the pulse widths are exact to the timer tick, and don't depend on when the interrupt was
+taken. The pins are set in the interrupt handler, so an edge can be late by the time the capture
+interrupt takes to run (about 3 us, a fraction of a degree), but never accumulates an error.
+
+After the pulses, the rest of the frame is waited out with compare matches less than a timer
+period apart, since at 16 MHz a frame is several periods of the 16 bit timer.
+
+The timer is set up as the decoder sets it, at the rate of the timestamp timer (CLOCK_SCALE_FACTOR
+ticks per us) in normal mode, whichever of the two starts first. With the timer2 timestamp
+configurations, timer1 is ours alone and runs with the 8 prescaler. The bitstream only enables and
+disables its own interrupt, and the compare interrupt only schedules the next compare, so each
+leaves the other's registers alone.
+
+A ramp moves the pulse width in a straight line to a new width over a whole number of frames. The
+width is kept in 1/256 timer ticks, and the interrupt adds the step for each frame at the start of the
+servo's pulse, so the motion is as exact as the frames, whatever the main loop is doing. On the last
+frame the width is set to the new width exactly. One ramp may wait behind the one in progress, and
+starts on the frame after it ends, so a caller that keeps one ramp waiting (rampMicroseconds returns
+false when there already is one) gets continuous motion through a chain of ramps, as long as it adds
+each before the one before it is done. The step of each ramp is worked out when it is added, so the
+interrupt only adds and shifts. A write or writeMicroseconds cancels any ramps.
+
+On other than AVR boards, this is the Servo library, which does not use the timestamp timer there,
+with the ramps run in software by refresh, which works out the frames from the time in ms passed to
+it (by subtraction, so it is not upset by millis wrapping) and catches up on any it missed.
+
+*/
+
+#ifndef _SHAREDSERVO_h
+#define _SHAREDSERVO_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#if !defined(ARDUINO_ARCH_AVR)
+
+#include <Servo.h>
+
+class SharedServo : public Servo
+{
+public:
+	// move to a pulse width over a number of frames, after any ramp in progress, and run them
+	bool rampMicroseconds(int Value, uint16_t Frames);
+	bool ramping();
+	bool rampWaiting() { return nextFrames != 0; }
+	void refresh(unsigned long CurrentMillis);
+
+	// cancel any ramps, as the AVR version does
+	void write(int Value) { framesLeft = nextFrames = 0; Servo::write(Value); }
+	void writeMicroseconds(int Value) { framesLeft = nextFrames = 0; Servo::writeMicroseconds(Value); }
+
+private:
+	int32_t width = 0;                  // pulse width of the ramp in progress, in 1/256 us
+	int32_t step = 0;                   // and its change per frame
+	uint16_t target = 0;                // the width it ends on
+	uint16_t framesLeft = 0;
+	int32_t nextStep = 0;               // the ramp waiting behind it
+	uint16_t nextTarget = 0;
+	uint16_t nextFrames = 0;
+	unsigned long frameMillis = 0;      // time of the last frame stepped
+};
+
+#else
+
+#include "Bitstream.h"
+
+
+class SharedServo
+{
+public:
+	enum : byte
+	{
+		MAX_SERVOS = 8,             // pulses that fit in a frame at the maximum width
+		INVALID_SERVO = 0xFF,
+	};
+
+	// pulse widths, as for the Servo library
+	enum : uint16_t
+	{
+		MIN_PULSE_WIDTH = 544,      // us at 0 degrees
+		MAX_PULSE_WIDTH = 2400,     // us at 180 degrees
+		DEFAULT_PULSE_WIDTH = 1500,
+		REFRESH_INTERVAL = 20000,   // us per frame
+	};
+
+	SharedServo();
+
+	// start or stop the pulses on a pin. attach returns the slot, or INVALID_SERVO if there are none left.
+	byte attach(byte Pin);
+	void detach();
+	bool attached();
+
+	// set the position in degrees (or in us if at least MIN_PULSE_WIDTH), or as a pulse width in us
+	void write(int Value);
+	void writeMicroseconds(int Value);
+	int read();
+	int readMicroseconds();
+
+	// move to a pulse width in us over a number of frames, after any ramp in progress. returns false,
+	// and does nothing, if a ramp is already waiting.
+	bool rampMicroseconds(int Value, uint16_t Frames);
+	bool ramping();                                 // a ramp is in progress
+	bool rampWaiting();                             // and another is waiting behind it
+	void refresh(unsigned long CurrentMillis) {}    // the ramps run from the interrupt
+
+	// called from the compare interrupt, at each edge
+	static void CompareMatch();
+
+private:
+	// timer ticks per us, and per frame
+#if defined(TIMER1_HW_0PS) || defined(TIMER1_ICR_0PS) || defined(TIMER1_HW_8PS) || defined(TIMER1_ICR_8PS)
+	enum : uint16_t { TICKS_PER_US = CLOCK_SCALE_FACTOR };
+#else
+	enum : uint16_t { TICKS_PER_US = 2 };
+#endif
+	enum : uint32_t { FRAME_TICKS = (uint32_t)REFRESH_INTERVAL * TICKS_PER_US };
+
+	byte slot;                          // this servo's slot in the frame
+	volatile uint8_t *port = 0;         // output register and bit of the pin
+	uint8_t mask = 0;
+	uint16_t ticks = DEFAULT_PULSE_WIDTH * TICKS_PER_US;     // pulse width in timer ticks
+	bool isAttached = false;
+
+	// the ramp in progress, and the one waiting behind it. widths are in 1/256 ticks.
+	int32_t width = 0;
+	int32_t step = 0;                   // change of width per frame
+	uint16_t target = 0;                // width the ramp ends on, in ticks
+	uint16_t framesLeft = 0;
+	int32_t nextStep = 0;
+	uint16_t nextTarget = 0;
+	uint16_t nextFrames = 0;
+
+	inline void NextFrame();
+
+	static SharedServo *slots[MAX_SERVOS];
+	static byte slotCount;              // slots given out
+	static byte attachedCount;          // slots sending pulses
+	static byte current;                // slot with its pulse on, or MAX_SERVOS in the gap after the pulses
+	static uint32_t frameTicks;         // ticks of the frame used by the pulses so far
+	static uint32_t gapLeft;            // ticks of the gap still to schedule
+
+	static void TimerSetup();
+	static void Start();
+	static void Wait(uint16_t Now);
+};
+
+#endif
+
+#endif
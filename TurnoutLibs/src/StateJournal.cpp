@@ -0,0 +1,120 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "StateJournal.h"
+
+
+StateJournal::StateJournal(uint16_t StartAddress, uint16_t EndAddress)
+{
+	start = StartAddress;
+	numSlots = (EndAddress - StartAddress) / RECORD_SIZE;
+	if (numSlots > MAX_SLOTS) numSlots = MAX_SLOTS;    // for the 8 bit sequence numbers to compare
+}
+
+
+// scan the region for the valid record with the newest sequence number
+bool StateJournal::Load(byte &State)
+{
+	empty = true;
+	for (uint16_t slot = 0; slot < numSlots; slot++)
+	{
+		Record entry;
+		if (!ReadSlot(slot, entry)) continue;
+
+		if (empty || (int8_t)(entry.sequence - newest.sequence) > 0)
+		{
+			newest = entry;
+			newestSlot = slot;
+			empty = false;
+		}
+	}
+	loaded = true;
+	unwritten = 0;
+
+	if (empty) return false;
+
+	State = newest.state;
+	return true;
+}
+
+
+// queue the state for the slot after the newest. the record is written by Update.
+void StateJournal::Write(byte State)
+{
+	if (!loaded)
+	{
+		byte current;
+		Load(current);
+	}
+
+	State &= STATE_MASK;
+	if (!empty && newest.state == State) return;
+
+	// a record still being written takes the new state, its check byte not having been written yet
+	if (unwritten)
+	{
+		newest.state = State;
+		return;
+	}
+
+	newest.sequence = empty ? 0 : newest.sequence + 1;
+	newest.state = State;
+	newestSlot = empty ? 0 : (newestSlot + 1) % numSlots;
+	empty = false;
+	unwritten = RECORD_SIZE;
+}
+
+
+// write a byte of the queued record, the sequence first and the check last so that the record is only
+// valid once complete. the eeprom is left to finish each byte in its own time rather than waiting on it.
+void StateJournal::Update()
+{
+	if (!unwritten) return;
+
+#if defined(__AVR__)
+	if (!eeprom_is_ready()) return;
+#endif
+
+	const uint16_t address = start + newestSlot * RECORD_SIZE;
+	if (unwritten == RECORD_SIZE)
+		EEPROM.update(address, newest.sequence);
+	else
+		EEPROM.update(address + 1, Pack(newest));
+	unwritten--;
+}
+
+
+// the second byte of a record, the state with a check of the sequence and state that an unwritten slot
+// (all 0xFF) fails
+byte StateJournal::Pack(const Record &Entry)
+{
+	const byte check = (Entry.sequence ^ (Entry.sequence >> 4) ^ Entry.state ^ 0x05) & 0x0F;
+	return (check << 4) | Entry.state;
+}
+
+
+bool StateJournal::ReadSlot(uint16_t Slot, Record &Entry)
+{
+	const uint16_t address = start + Slot * RECORD_SIZE;
+	const byte packed = EEPROM.read(address + 1);
+	Entry.sequence = EEPROM.read(address);
+	Entry.state = packed & STATE_MASK;
+	return packed == Pack(Entry);
+}
@@ -0,0 +1,119 @@
+/*
+
+This file is part of Arduino Turnout
+Copyright (C) 2017-2018 Eric Thorstenson
+
+Arduino Turnout is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Arduino Turnout is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/*
+
+State Journal
+
+A wear levelled store in EEPROM for a small state that changes often, such as the turnout position.
+
+Summary:
+
+Each change of the state is written as a small record to the next slot of a ring of records in a
+region of EEPROM, rather than over the same byte every time. Each record carries a sequence number,
+so on startup the newest record is found and its state recovered. Each cell of the region is written
+only once for each trip round the ring, so the EEPROM lasts as many times longer as there are slots.
+
+Example usage:
+
+		StateJournal journal(512, 768);       // a journal in EEPROM addresses 512 to 767
+		byte state;
+		if (journal.Load(state))              // find the newest record, returns false if there is none
+			...                               // use the stored state
+		journal.Write(state);                 // queue a record for a new state
+		...
+		journal.Update();                     // call from the loop, writes the record a byte at a time
+
+Details:
+
+A record is two bytes: an 8 bit sequence number, then the state in the low four bits with a four bit
+check of the sequence and state in the high four, so the state is limited to 0 to 15. A slot that
+has never been written reads 0xFF in both bytes, which fails the check, as does a record that was
+only partly written when the power went (but for the 1 in 16 chance that the old check happens to
+match). The byte with the check is written last, and the record before is left as it was, so at
+worst a power cut while writing loses the newest state.
+
+Write doesn't touch the EEPROM. An AVR takes about 3.4ms to write a byte, and EEPROM.update waits
+for the write before it to finish, so writing a whole record at once would hold up the loop, and
+the DCC timestamps with it. Instead Write queues the record, and Update writes one byte of it each
+time the EEPROM is ready, so a record takes two passes of the loop and no waiting. A Write while a
+record is still queued puts the new state in that record.
+
+Load reads every slot, and takes the valid record with the newest sequence number, comparing them
+as serial numbers (so the 8 bit numbers may wrap) since all the records in the ring are within a
+ring's length of each other. That only holds for a ring of up to 128 slots, so any more of the
+region than that is left unused. Write puts the next record in the slot after the newest, with the
+next sequence number, and does nothing if the state is the same as the newest record's, so writing
+the same state over and over costs no wear. EEPROM.update skips the bytes that already hold the value.
+
+The region should be a whole number of records, and is not used by anything else. With 128 slots a
+turnout thrown a thousand times a day takes about 35 years to write each cell the 100,000 times an
+AVR EEPROM is rated for.
+
+*/
+
+#ifndef _STATEJOURNAL_h
+#define _STATEJOURNAL_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "EEPROM.h"
+
+
+class StateJournal
+{
+public:
+	StateJournal(uint16_t StartAddress, uint16_t EndAddress);
+
+	// find the newest record, returning false if there are none
+	bool Load(byte &State);
+
+	// queue a record for a state (0 to 15), unless it is already the newest
+	void Write(byte State);
+
+	// write the next byte of a queued record, if the eeprom is ready for it
+	void Update();
+
+private:
+	enum : byte { RECORD_SIZE = 2, MAX_SLOTS = 128, STATE_MASK = 0x0F };
+
+	struct Record
+	{
+		byte sequence;
+		byte state;
+	};
+
+	static byte Pack(const Record &Entry);
+	bool ReadSlot(uint16_t Slot, Record &Entry);
+
+	uint16_t start;                     // first address of the region
+	uint16_t numSlots;                  // records in the region
+
+	bool loaded = false;                // the newest record has been found
+	bool empty = true;                  // there is no valid record
+	uint16_t newestSlot = 0;            // slot and contents of the newest record
+	Record newest;
+	byte unwritten = 0;                 // bytes of the newest record still to be written
+};
+
+#endif
@@ -21,6 +21,13 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include "TurnoutBase.h"
 
 
+// the main loop, and the parts of it, when profiling (see Profiler)
+PROFILE_PROBE(profileUpdate, "update");
+PROFILE_PROBE(profileBase, "base");
+PROFILE_PROBE(profileSensors, "sensors");
+PROFILE_PROBE(profileServos, "servos");
+
+
 // ========================================================================================================
 // Public Methods
 
@@ -28,15 +35,17 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 // TurnoutMgr constructor
 TurnoutBase::TurnoutBase()
 {
+	// changed cvs are written to eeprom once they stop changing
+	const unsigned long cvQuietPeriod = 2000;    // ms
+	cv.setCommitHandler(CommitCV, cvQuietPeriod);
 }
 
 
-// check for new bitstream data, update sensors and outputs, check for
-// max number of packet errors and reset bitstream capture if necessary
+// update sensors and outputs. the DCC timestamps are processed by the derived class, which
+// passes its own handler to the decoder
 void TurnoutBase::Update()
 {
-	// process any DCC interrupts that have been timestamped
-	dcc.ProcessTimeStamps();
+	PROFILE_SCOPE(profileBase);
 
 	// do the updates to maintain flashing led and slow servo motion
 	const unsigned long currentMillis = millis();
@@ -49,6 +58,10 @@ void TurnoutBase::Update()
 
 	// update sensors
 	button.Update(currentMillis);
+
+	// write any changed cvs that have settled, and the next byte of a new position
+	cv.update(currentMillis);
+	positionJournal.Update();
 }
 
 
@@ -83,22 +96,69 @@ void TurnoutBase::InitMain()
 	index = cv.initCV(index, CV_servo3MinTravel, 90, 45, 135, false);
 	index = cv.initCV(index, CV_servo3MaxTravel, 90, 45, 135, false);
 	index = cv.initCV(index, CV_servo4MinTravel, 90, 45, 135, false);
-	cv.initCV(index, CV_servo4MaxTravel, 90, 45, 135, false);
+	index = cv.initCV(index, CV_servo4MaxTravel, 90, 45, 135, false);
+	index = cv.initCV(index, CV_AddressCount, 1, 1, 32, false);    // added after the others to keep their stored positions
+	index = cv.initCV(index, CV_servoStagger, 10, 0, 100);
+	index = cv.initCV(index, CV_servo2LowSpeed, 25, 0, 250);       // limited so unwritten eeprom loads as the default
+	index = cv.initCV(index, CV_servo2HighSpeed, 0, 0, 250);
+	index = cv.initCV(index, CV_servo3LowSpeed, 25, 0, 250);
+	index = cv.initCV(index, CV_servo3HighSpeed, 0, 0, 250);
+	index = cv.initCV(index, CV_servo4LowSpeed, 25, 0, 250);
+	index = cv.initCV(index, CV_servo4HighSpeed, 0, 0, 250);
+	cv.initCV(index, CV_servoProfile, 0, 0, 2);                     // linear, trapezoid, or s-curve (see TurnoutServo)
+
+	// the position is stored in the journal, so is left out of the cv write-back
+	cv.storeElsewhere(CV_turnoutPosition);
 
 	// load config
 	LoadConfig();
 
 	// Initialize the DCC decoder
-	byte addr = (cv.getCV(CV_AddressMSB) << 8) + cv.getCV(CV_AddressLSB);
-	dcc.SetAddress(addr);
+	SetDecoderAddress();
 
 	// get variables from cv's
 	occupancySensorSwap = cv.getCV(CV_occupancySensorSwap);
 	dccCommandSwap = cv.getCV(CV_dccCommandSwap);
 	relaySwap = cv.getCV(CV_relaySwap);
 
-	// set the current position based on the stored position
+	// set the current position based on the stored position, from the journal if it has one
+	byte storedPosition;
+	if (positionJournal.Load(storedPosition))
+		cv.setCV(CV_turnoutPosition, storedPosition);
 	position = (cv.getCV(CV_turnoutPosition) == 0) ? STRAIGHT : CURVED;
+	movePending = false;
+}
+
+
+// the position the turnout will end up in, after the current move and any pending move
+TurnoutBase::State TurnoutBase::TargetPosition()
+{
+	return movePending ? pendingPosition : position;
+}
+
+
+// hold a move if the servos are active, returns true if it was held. the latest move replaces any
+// held before it, and a move back to the position being moved to cancels the held move.
+bool TurnoutBase::HoldMove(State NewPosition, bool Rate)
+{
+	if (!servosActive) return false;
+
+	movePending = (NewPosition != position);
+	pendingPosition = NewPosition;
+	pendingRate = Rate;
+	return true;
+}
+
+
+// make the held move the current one, returns true if there was one
+bool TurnoutBase::TakePendingMove()
+{
+	if (!movePending) return false;
+
+	movePending = false;
+	position = pendingPosition;
+	servoRate = pendingRate;
+	return true;
 }
 
 
@@ -116,6 +176,7 @@ void TurnoutBase::FactoryReset(bool HardReset)
 	// do the cv reset
 	cv.resetCVs();
 	SaveConfig();
+	positionJournal.Write(cv.getCV(CV_turnoutPosition));
 }
 
 
@@ -242,6 +303,30 @@ void TurnoutBase::DCCPomHandler(unsigned int Addr, byte instType, unsigned int C
 		}
 	}
 
+	// check for and perform diagnostics commands
+	if (CV == CV_diagnostics)
+	{
+		if (Value == CV_diagnosticsReportValue)
+			DiagnosticsReport();
+		if (Value == CV_diagnosticsTelemetryValue)
+			TelemetryReport();
+		if (Value == CV_diagnosticsFlushValue)
+		{
+			cv.flush();
+			errorTimer.StartTimer(1000);
+			led.SetLED(RgbLed::BLUE, RgbLed::ON);
+		}
+		if (Value == CV_diagnosticsResetValue)
+		{
+			dcc.ResetTelemetry();
+			cv.resetStatistics();
+			PROFILE_RESET();
+			errorTimer.StartTimer(1000);
+			led.SetLED(RgbLed::BLUE, RgbLed::ON);
+		}
+		return;
+	}
+
 	// set the cv
 	if (cv.setCV(CV, Value))
 	{
@@ -256,15 +341,77 @@ void TurnoutBase::DCCPomHandler(unsigned int Addr, byte instType, unsigned int C
 		led.SetLED(RgbLed::YELLOW, RgbLed::ON);
 	}
 
-	SaveConfig();
+	// the cv is written to eeprom when the changes stop (see CVManager), but the position goes to the journal
+	if (CV == CV_turnoutPosition)
+		positionJournal.Write(cv.getCV(CV_turnoutPosition));    // the journal is what's loaded at startup
 
-	// read back values from cv manager
+	// read back values from cv manager. the address itself changes at the next reset, see SetDecoderAddress
+	SetAddressCount();
 	occupancySensorSwap = cv.getCV(CV_occupancySensorSwap);
 	dccCommandSwap = cv.getCV(CV_dccCommandSwap);
 	relaySwap = cv.getCV(CV_relaySwap);
 }
 
 
+// report the DCC timestamp queue statistics
+void TurnoutBase::DiagnosticsReport()
+{
+	const SimpleQueue::Statistics &stats = dcc.GetQueueStatistics();
+
+#ifdef _DEBUG
+	Serial.print("Timestamp queue dropped: ");
+	Serial.print(stats.dropped, DEC);
+	Serial.print("     Max depth: ");
+	Serial.println(stats.maxDepth, DEC);
+	Serial.print("Depth histogram:");
+	for (byte i = 0; i < SimpleQueue::queueSize; i++)
+	{
+		Serial.print(" ");
+		Serial.print(stats.depthHistogram[i], DEC);
+	}
+	Serial.println();
+
+	const CVManager::Statistics &cvStats = cv.getStatistics();
+	Serial.print("CV changes: ");
+	Serial.print(cvStats.changes, DEC);
+	Serial.print("     Commits: ");
+	Serial.print(cvStats.commits, DEC);
+	Serial.print("     Avoided: ");
+	Serial.print(cvStats.commitsAvoided, DEC);
+	Serial.print("     Bytes: ");
+	Serial.println(cvStats.bytesCommitted, DEC);
+#endif
+
+	// flash yellow if the queue has overrun, otherwise show blue
+	errorTimer.StartTimer(2000);
+	if (stats.dropped > 0)
+		led.SetLED(RgbLed::YELLOW, RgbLed::FLASH);
+	else
+		led.SetLED(RgbLed::BLUE, RgbLed::ON);
+}
+
+
+// report the decoder telemetry
+void TurnoutBase::TelemetryReport()
+{
+	const DCCdecoder::Telemetry &telemetry = dcc.GetTelemetry();
+
+#ifdef _DEBUG
+	dcc.PrintTelemetry();
+	PROFILE_REPORT();
+#endif
+
+	// flash yellow if there have been errors, otherwise show blue
+	const uint32_t errors = telemetry.bitErrorsLow + telemetry.bitErrorsMid + telemetry.bitErrorsHigh +
+		telemetry.packetsTooLong + telemetry.packetsTooShort + telemetry.checksumErrors;
+	errorTimer.StartTimer(2000);
+	if (errors > 0)
+		led.SetLED(RgbLed::YELLOW, RgbLed::FLASH);
+	else
+		led.SetLED(RgbLed::BLUE, RgbLed::ON);
+}
+
+
 void TurnoutBase::LoadConfig()
 {
 	const bool firstBoot = (EEPROM.read(0) == 255);    // default value for unwritten eeprom
@@ -288,18 +435,48 @@ void TurnoutBase::LoadConfig()
 
 			cv.cv[i].cvValue = configVars.CVs[i];
 		}
+
+		// reset any out of range CVs to defaults, and save the corrected config
+		if (cv.validateCVs())
+			SaveConfig();
 	}
 }
 
+// set the decoder to answer the range of addresses given by the CVs. the address is only taken from CVs
+// 1 and 9 at startup, since a new address is written by POM as two CVs sent to the old address, and
+// changing after the first would leave the second unheard.
+void TurnoutBase::SetDecoderAddress()
+{
+	decoderAddress = (cv.getCV(CV_AddressMSB) << 8) + cv.getCV(CV_AddressLSB);
+	SetAddressCount();
+}
+
+
+// set the number of addresses answered, from the address in use. this takes effect as soon as it is written.
+void TurnoutBase::SetAddressCount()
+{
+	dcc.SetAddressRange(decoderAddress, cv.getCV(CV_AddressCount));
+}
+
+
+// store the whole config now, rather than just the changed cvs when they settle
 void TurnoutBase::SaveConfig()
 {
-	// copy working CVs to our storage object
-	for (byte i = 0; i < numCVindexes; i++)
-	{
-		configVars.CVs[i] = cv.cv[i].cvValue;
+	cv.flush(true);
+}
 
-	}
 
-	// store the config
-	EEPROM.put(0, configVars);
+// write a cv to its place in the stored config struct. eeprom update skips a byte that hasn't changed.
+void TurnoutBase::CommitCV(byte Index, byte Value)
+{
+	EEPROM.update(offsetof(ConfigVars, CVs) + Index, Value);
+}
+
+
+// store the position, in the journal rather than the config so that each throw writes two bytes of
+// a different slot, a byte per pass of the loop
+void TurnoutBase::SavePosition()
+{
+	cv.setCV(CV_turnoutPosition, position);
+	positionJournal.Write(position);
 }
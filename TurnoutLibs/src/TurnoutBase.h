@@ -37,20 +37,21 @@ sensors, and the relays are provided. Two auxiliary outputs are controllable usi
 Details:
 
 DCC command processing takes place as follows. The raw bitstream is captured by the BitStream
-object. When 32 bits have been captured, a callback to the packet decoder begins the assembly
-of the DCC packet. After the packet decoder has assembled and checksummed a complete packet, a
-callback to the DCCdecoder initiates processing of the packet. Callbacks from the DCCdecoder
-trigger actions for normal accessory decoder packets, extended accessory decoder packets, and 
-programming on main packets.
+object. When enough bits have been captured, they are passed to the packet builder to continue the
+assembly of the DCC packet. After the packet builder has assembled and checksummed a complete
+packet, it is passed to the DCCdecoder for processing. The DCCdecoder then calls the handler for
+normal accessory decoder packets, extended accessory decoder packets, and programming on main
+packets. Each stage calls the next directly, see DCCdecoder.
 
 The InitMain method performs the setup for the class, including setting up the DCC packet 
 processor, reading the stored configuration from EEPROM (via the DCCdecoder lib), and getting 
 the stored position of the turnout.
 
-The Update method processes timestamps received by the BitStream object, which then sends them 
-to the DCCpacket object to be assembled into a full DCC packet. It also handles millis-related 
-updates for the LED, sensors, and timers. Packet error count per second is also checked. If it 
-exceeds a configurable max value, a reset of the bitstream object takes place.
+The Update method handles millis-related updates for the LED, sensors, and timers. The timestamps
+received by the BitStream object are processed in the Update method of the derived class, which
+passes the DCCdecoder a handler object of its own, so that the decoder calls the command handlers
+directly. Packet error count per second is also checked by the decoder. If it exceeds a
+configurable max value, a reset of the bitstream object takes place.
 
 The DCCExtCommandHandler processes an extended accessory command, using signal aspects for turning 
 the two auxilliary outputs on and off. It also provides the capability to toggle error indication on
@@ -58,6 +59,59 @@ and off. The DCCPomHandler method processes a program on main packet. It checks
 stores the data via the DCCdecoder object, and then re-reads the basic configuration for the turnout. 
 It also provides complete and partial reset via POM commands.
 
+A CV written by POM takes effect at once, but is not written to EEPROM straight away. The CVManager
+marks the changed bytes, and passes them to CommitCV to be written only once no CV has changed for
+two seconds, so a throttle sweeping a servo endpoint through dozens of values costs one EEPROM write
+of the final value instead of one per packet, and the loop isn't held up by a write for each. A
+change made in the last two seconds before the power is removed is lost. A reset writes the whole
+config first. The position CV is left out of this, being stored only in the position journal.
+
+Diagnostics are available by POM writes to CV 56, which are acted on but not stored. A value of 1
+reports the DCC timestamp queue statistics: the LED flashes yellow if timestamps have been dropped
+since the last reset of the statistics, or shows blue if not, and in debug builds the dropped count,
+maximum depth, and depth histogram are printed to serial. A value of 2 resets the statistics and the
+decoder telemetry. This shows whether activity in the main loop (servo moves, EEPROM writes) pushes
+the queue to overflow. A value of 3 reports the decoder telemetry (see DCCdecoder): the LED flashes
+yellow if there have been bit or packet errors since the last reset, or shows blue if not, and in
+debug builds the counters are printed to serial as a line of comma separated values, so the signal
+quality at each decoder on the layout can be compared. In builds with DCC_PROFILING defined, the
+stage timings of the decoder and the main loop are printed with them (see Profiler), and a value of 2
+resets them too. In debug builds, a value of 1 also prints the CV write-back counts: the changes,
+the EEPROM commits, the commits avoided by changes sharing a commit, and the bytes written. A value
+of 4 writes any changed CVs at once.
+
+Commands to move to a new position (from DCC, the button, or the occupancy sensors) can arrive while
+the servos are still moving, since the decoder runs throughout. They are not acted on at once, but
+held in a single pending slot, each replacing the one before, so only the newest position is kept.
+When the move ends, the derived class carries out the pending move straight away, from where the
+servos are, so the final position always matches the last command. A command back to the position
+being moved to just clears the slot. TargetPosition gives the position the turnout will end up in,
+which is what new commands are compared against.
+
+The decoder answers a range of consecutive output addresses, starting at the address in CVs 1 and 9.
+The number of addresses is set by CV 47, from 1 (the default) to 32, so one board can be operated
+from several addresses. The extra addresses are aliases of the first: the board has one turnout (or
+crossover) to set, and a command to any of the addresses sets it the same way. A change to CV 47
+takes effect as soon as it is written. A new address in CVs 1 and 9 takes effect at the next reset
+(or power up), since it is written by POM as two CVs, both sent to the old address, and moving to a
+new address after the first would leave the second unheard. The stored CVs are range checked when
+they are loaded, and any that are out of range (for example a CV added since the config was saved)
+are set to defaults.
+
+The servo speeds are set for each servo: CVs 35 and 36 for the first servo (the only one on a
+turnout), and CVs 68 to 73 for the low and high speeds of servos 2 to 4, in units of 100 ms for the
+whole move. CV 48 sets the time between the starts of the servos of a crossover, which all move at
+once, in units of 10 ms, so that their start-up currents don't all fall together (see XoverMgr).
+The position is saved on every throw, so rather than being written to the stored CVs it is kept in a
+journal at EEPROM 512 to 767 (see StateJournal), one two byte record after another, which spreads
+the wear over 128 slots and leaves the CV block alone. A record is written a byte per pass of the
+loop, so a throw doesn't wait on the EEPROM. The CV is still kept in memory, and is
+used for the position at startup if the journal is empty, as it is the first time a board with a
+config saved by an earlier version starts.
+
+CV 37 sets the motion profile of all the servos: 0 for linear (the default), 1 for trapezoidal, or 2
+for an S-curve, which eases the points in and out of their moves (see TurnoutServo).
+
 */
 
 #ifndef _TURNOUTBASE_h
@@ -75,9 +129,17 @@ It also provides complete and partial reset via POM commands.
 #include "OutputPin.h"
 #include "EventTimer.h"
 #include "CVManager.h"
+#include "StateJournal.h"
 #include "EEPROM.h"
 
 
+// probes timing the main loop, when profiling (see Profiler). TurnoutBase times its own updates, and
+// the derived class the whole loop, the sensors, and the servos.
+PROFILE_EXTERN(profileUpdate);
+PROFILE_EXTERN(profileSensors);
+PROFILE_EXTERN(profileServos);
+
+
 class TurnoutBase
 {
 protected:
@@ -113,6 +175,10 @@ protected:
 	void FactoryReset(bool HardReset);
 	void LoadConfig();
 	void SaveConfig();
+	void SavePosition();
+	static void CommitCV(byte Index, byte Value);
+	void SetDecoderAddress();
+	void SetAddressCount();
 
 	// Sensors and outputs
 	Button button{ ButtonPin, true };
@@ -137,6 +203,17 @@ protected:
 	bool servosActive = false;                 // flag to indicate if servos are active or not
 	byte currentServo = 0;                     // the servo that is currently in motion
 	bool servoRate = LOW;                      // rate at which the servos will be set
+	uint16_t decoderAddress = 1;               // the address in use, read from the CVs at startup
+
+	// a move requested while the servos are active is held until the move is done, the latest
+	// request replacing any before it
+	bool movePending = false;                  // a move is held
+	State pendingPosition = STRAIGHT;          // and its position and rate
+	bool pendingRate = LOW;
+
+	State TargetPosition();
+	bool HoldMove(State NewPosition, bool Rate);
+	bool TakePendingMove();
 
 	// define our available cv's  (allowable range 33-81 per 9.2.2)
 	enum CVList : byte {
@@ -146,6 +223,7 @@ protected:
 		CV_servo1MaxTravel = 34,
 		CV_servoLowSpeed = 35,
 		CV_servoHighSpeed = 36,
+		CV_servoProfile = 37,
 		CV_occupancySensorSwap = 38,
 		CV_dccCommandSwap = 39,
 		CV_relaySwap = 40,
@@ -155,6 +233,8 @@ protected:
 		CV_Aux2On = 44,
 		CV_positionIndicationToggle = 45,
 		CV_errorIndicationToggle = 46,
+		CV_AddressCount = 47,
+		CV_servoStagger = 48,
 		CV_turnoutPosition = 50,
 		CV_servo2MinTravel = 62,
 		CV_servo2MaxTravel = 63,
@@ -162,9 +242,15 @@ protected:
 		CV_servo3MaxTravel = 65,
 		CV_servo4MinTravel = 66,
 		CV_servo4MaxTravel = 67,
+		CV_servo2LowSpeed = 68,
+		CV_servo2HighSpeed = 69,
+		CV_servo3LowSpeed = 70,
+		CV_servo3HighSpeed = 71,
+		CV_servo4LowSpeed = 72,
+		CV_servo4HighSpeed = 73,
 	};
 
-	enum : byte { numCVindexes = 22 };
+	enum : byte { numCVindexes = 31 };
 	CVManager cv{ numCVindexes };
 
 	struct ConfigVars
@@ -174,6 +260,9 @@ protected:
 
 	ConfigVars configVars;
 
+	// the position is journalled in 128 slots above the config
+	StateJournal positionJournal{ 512, 768 };
+
 	// factory default settings
 	enum ResetCVs : byte {
 		CV_reset = 55,
@@ -181,6 +270,15 @@ protected:
 		CV_hardResetValue = 55,
 	};
 
+	// diagnostics commands, these are not stored
+	enum DiagnosticCVs : byte {
+		CV_diagnostics = 56,
+		CV_diagnosticsReportValue = 1,
+		CV_diagnosticsResetValue = 2,
+		CV_diagnosticsTelemetryValue = 3,
+		CV_diagnosticsFlushValue = 4,
+	};
+
 	// event handlers
 	void ErrorTimerHandler();
 	void MaxBitErrorHandler();
@@ -188,6 +286,8 @@ protected:
 	void DCCDecodingError();
 	void DCCExtCommandHandler(unsigned int Addr, unsigned int Data);
 	void DCCPomHandler(unsigned int Addr, byte instType, unsigned int CV, byte Value);
+	void DiagnosticsReport();
+	void TelemetryReport();
 };
 
 #endif
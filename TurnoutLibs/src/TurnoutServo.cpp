@@ -37,53 +37,48 @@ void TurnoutServo::Initialize(byte ExtentLow, byte ExtentHigh, bool Position)
 	extent[LOW] = ExtentLow;
     extent[HIGH] = ExtentHigh;
     positionSet = Position;
-
-    // update steps and intervals
-    ComputeSteps();
 }
 
 
 // Initialize the TurnoutServo (e.g., with values read from eeprom for extents, rates, and last position)
 void TurnoutServo::Initialize(byte ExtentLow, byte ExtentHigh, int DurationLow, int DurationHigh, bool Position)
 {
-	pinMode(servoPin, OUTPUT);
-	digitalWrite(servoPin, LOW);
-	
-	extent[LOW] = ExtentLow;
-    extent[HIGH] = ExtentHigh;
-    duration[LOW] = DurationLow;
-    duration[HIGH] = DurationHigh;
-    positionSet = Position;
-
-    // update steps and intervals
-    ComputeSteps();
+	duration[LOW] = DurationLow;
+	duration[HIGH] = DurationHigh;
+	Initialize(ExtentLow, ExtentHigh, Position);
 }
 
 
-// Update the servo position to allow slow slewing of servo
+// Update the servo position to allow slow slewing of servo. the servo moves through the steps by
+// itself, a frame at a time, as long as the next step is added before the one in progress is done.
 void TurnoutServo::Update(unsigned long CurrentMillis)
 {
     if (servoState == MOVING)
     {
-        // check if step interval for the given rate has elapsed
-        if (CurrentMillis > lastUpdate)
+        refresh(CurrentMillis);            // run the ramps, where the frames don't
+
+        if (currentStep < numSteps)
         {
-            lastUpdate = CurrentMillis + interval[rateSet];
+            if (rampWaiting()) return;     // the next step is already waiting
 
-            // if we still have steps to go in this movement
-            if (currentStep < numSteps)
+            // steps too short for a frame of their own are passed over
+            byte step = currentStep;
+            uint16_t frames;
+            do
             {
-                write(steps[positionSet][currentStep]);      // set servo to new position
-                currentStep++;
-            }
-            else
-            {
-                currentStep = 0;           // reset counter for next movement
-                servoState = READY;        // move is done, set back to ready state
-                if (servoMoveDoneHandler) servoMoveDoneHandler();    // raise event indicating servo motion is complete
-            }
+                step++;
+                frames = StepFrame(step) - StepFrame(step - 1);
+            } while (frames == 0 && step < numSteps);
+
+            if (rampMicroseconds(StepMicros(step), frames))
+                currentStep = step;
+        }
+        else if (!ramping())
+        {
+            currentStep = 0;           // reset counter for next movement
+            servoState = READY;        // move is done, set back to ready state
+            if (servoMoveDoneHandler) servoMoveDoneHandler();    // raise event indicating servo motion is complete
         }
-        return;
     }
 }
 
@@ -117,9 +112,6 @@ void TurnoutServo::SetExtent(bool Position, byte Extent)
     // set the new value
     extent[Position] = Extent;
 
-    // update steps and intervals
-    ComputeSteps();
-
 	// if we're setting the extent for the current position, adjust the servo position
 	if (Position == positionSet)
 	{
@@ -138,7 +130,10 @@ void TurnoutServo::MoveTo(bool Position, bool Rate)
 {
 	if (servoState != READY) return;   // only go to the moving state from the ready state
 
-	// update position and rate settings
+	// update position and rate settings, moving from wherever the servo is now
+	startMicros = readMicroseconds();
+	moveFrames = (uint32_t)duration[Rate] * 1000 / REFRESH_INTERVAL;
+	currentStep = 0;
 	positionSet = Position;
 	rateSet = Rate;
 	servoState = MOVING;
@@ -150,7 +145,7 @@ void TurnoutServo::StartPWM()
 	if (servoState != OFF) return;   // only go to the ready state from the off state or at the end of a move
 
 	// ensure we are sending pulses for the current position
-	write(extent[positionSet]);
+	writeMicroseconds(ExtentMicros(extent[positionSet]));
 	attach(servoPin);
 	servoState = READY;
 }
@@ -170,33 +165,84 @@ void TurnoutServo::StopPWM()
 void TurnoutServo::SetDuration(bool Position, int Duration)
 {
     duration[Position] = Duration;
+}
+
 
-    // update intervals
-    ComputeSteps();
+// Set the shape of the motion, and the number of steps it is made in
+void TurnoutServo::SetProfile(byte Profile, byte Steps)
+{
+	if (servoState == MOVING) return;    // keep the steps of a move in progress
+
+	profile = (Profile <= SCURVE) ? Profile : LINEAR;
+	numSteps = (Steps > 0) ? Steps : 1;
 }
 
 
-// compute the steps going in each direction for easy lookup in the update loop
-// set the timing interval for low and high rates (note may have small error in total elapsed time due to truncation)
-void TurnoutServo::ComputeSteps()
+// the pulse width at the end of a step of the current move. the fraction of the move done is computed
+// in fixed point (1.0 = 0x8000) from the fraction of the steps done, and eased by the motion profile.
+uint16_t TurnoutServo::StepMicros(byte Step)
 {
-    for (int i=0; i<numSteps; i++)
-    {
-        int movementRange = extent[1] - extent[0];              // total range of movement
-		int increment = ((i + 1)*movementRange) / numSteps;     // increment for each step
-        steps[0][i] = extent[1]-increment;                      // steps going from high to low
-        steps[1][i] = extent[0]+increment;                      // steps going from low to high
+	const uint16_t t = ((uint32_t)Step << 15) / numSteps;
+	const int16_t range = (int16_t)ExtentMicros(extent[positionSet]) - startMicros;
+	const int32_t offset = ((int32_t)range * Ease(t, profile) + 0x4000) >> 15;
+	return startMicros + offset;
+}
+
+
+// the frame of the move that a step ends on, the frames shared out as evenly as they go
+uint16_t TurnoutServo::StepFrame(byte Step)
+{
+	return ((uint32_t)Step * moveFrames + numSteps / 2) / numSteps;
+}
 
-#ifdef _DEBUG
-        Serial.print("low = ");
-        Serial.print(steps[0][i],DEC);
-        Serial.print("   high = ");
-        Serial.println(steps[1][i],DEC);
-#endif
-    }
 
-    interval[0]=duration[0]/numSteps;     // low rate interval
-    interval[1]=duration[1]/numSteps;     // high rate interval
+// the pulse width for an angle, to the us
+uint16_t TurnoutServo::ExtentMicros(byte Angle)
+{
+	return MIN_PULSE_WIDTH + ((uint32_t)Angle * (MAX_PULSE_WIDTH - MIN_PULSE_WIDTH) + 90) / 180;
+}
+
+
+// the fraction of the distance covered at a fraction T of the time, both with 1.0 = 0x8000
+uint16_t TurnoutServo::Ease(uint16_t T, byte Profile)
+{
+	const uint32_t one = 0x8000;
+	const uint32_t t = T;
+
+	switch (Profile)
+	{
+	case TRAPEZOID:
+	{
+		// accelerate for the first quarter of the time, coast at 4/3 of the linear speed, and
+		// slow down for the last quarter
+		if (t < one / 4)
+			return ((t * t) >> 15) * 8 / 3;
+		if (t > one * 3 / 4)
+			return one - (((one - t) * (one - t)) >> 15) * 8 / 3;
+		return (t - one / 8) * 4 / 3;
+	}
+
+	case SCURVE:
+	{
+		// t^3 (10 - 15t + 6t^2), with the speed and acceleration both zero at each end, worked out by
+		// Horner's rule in 32 bits as (((10 - (15 - 6t)t)t)t)t. the second half is the first turned
+		// about the middle, so t is at most 1/2 and each product fits: the first because 15 - 6t is
+		// even and can be halved exactly, and the rest because each is a value of the curve times t,
+		// at most 2.0. the turn also keeps the curve from stepping backwards near the end, where it is
+		// nearly flat and the rounding of the last few products would otherwise show.
+		if (t > one / 2)
+			return one - Ease(one - t, Profile);
+
+		const uint32_t half = ((15 * one - 6 * t) >> 1) * t;
+		const uint32_t poly = 10 * one - ((half + (1UL << 13)) >> 14);
+		const uint32_t t1 = (poly * t + (1UL << 14)) >> 15;
+		const uint32_t t2 = (t1 * t + (1UL << 14)) >> 15;
+		return (t2 * t + (1UL << 14)) >> 15;
+	}
+
+	default:
+		return t;
+	}
 }
 
 
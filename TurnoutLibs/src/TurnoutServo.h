@@ -34,14 +34,16 @@ Example usage:
 		TurnoutServo servo(ServoPWMPin);      // create an instance of the turnout servo
 		servo.Initialize(ExtentLow, ExtentHigh, Position);   // initialize the servo endpoints and current
 		                                                     // position.
+		servo.SetProfile(TurnoutServo::SCURVE);  // optionally ease the motion in and out
 		servo.Set(Position, Rate);               // set the servo to a position at the given rate.
 		servo.Update();                          // check and update the servo state and position.
 
 Details:
 
-The TurnoutServo object is created with a value specifying the pin used for the PWM signal. The servo 
-is further initialized with the high and low extents representing the desired limits of motion. Fast 
-and slow rates of travel may optionally be specified.
+The TurnoutServo object is created with a value specifying the pin used for the PWM signal. The pulses
+are sent by SharedServo, which shares timer1 with the DCC timestamp capture, so the decoder keeps
+running while the servo moves. The servo is further initialized with the high and low extents
+representing the desired limits of motion. Fast and slow rates of travel may optionally be specified.
 
 Servo control operates in three states - OFF, READY, and MOVING. In the OFF state, the PWM signal on the
 servo pin is disabled and the pin output is set low. In the READY state, the PWM signal is active and the 
@@ -51,14 +53,33 @@ and sets the state to READY. When the MoveTo method is called, either by the Set
 the desired position and rate are set, and the servo state is set to MOVING. After the motion is complete,
 the state reverts to READY. The StopPWM method is used to disable the PWM signal and set the state to OFF.
 
-The Update method performs the actual motion of the servo. While MOVING, when an interval has elapsed,
-the servo is commanded to the next step. After the final step, the move done handler is called, and
-the state is set back to READY.
-
-The movement steps of the servo are computed when the extents and/or duration are altered, to 
-avoid repeatedly doing so when moving the servo. The positions corresponding to a given step of
-the motion are based on the extents and the number of steps. The time interval between each step
-is based on the high or low rate duration and the number of steps.
+The motion is timed by the servo frames, not by the main loop. The move is split into steps, and
+each step is a ramp of the pulse width (see SharedServo), over the frames of the move that fall in
+it, that the frame interrupt runs by itself. The Update method keeps the next step waiting behind
+the one in progress: while MOVING, if there is no step waiting, it works out the next and adds it.
+After the final step, the move done handler is called, and the state is set back to READY. So the
+servo moves once every frame, exactly on time, even if the loop is held up (by an EEPROM write, for
+example) for as long as a step, and nothing depends on the value of millis, which may wrap. The
+move takes the high or low rate duration, to the nearest frame, with the frames shared out between
+the steps as evenly as they go; a step with no frame of its own is passed over.
+
+The position at each step of the motion is computed as the step is taken, in fixed point, so there
+are no tables of steps to keep in RAM or to recompute when the extents or durations change. The
+fraction of the steps done (with 1.0 = 0x8000) is eased by the motion profile to give the fraction
+of the distance covered, which is scaled to the distance from the pulse width the move started at to
+the width of the extent being moved to. The extents are in degrees, but the steps and the ramps
+between them are in us (about 10 to the degree), so the servo moves in steps much finer than a
+degree. SetProfile chooses the profile and the number of steps (30 by default):
+
+	LINEAR          constant speed, starting and stopping abruptly (the default).
+	TRAPEZOID       constant acceleration for the first quarter of the time and deceleration for the
+	                last, with a constant speed between, 4/3 of the linear speed.
+	SCURVE          the polynomial 6t^5 - 15t^4 + 10t^3, which starts and ends with both the speed and
+	                the acceleration at zero, for the least shock to the points and the linkage.
+
+The profiles all end exactly on the extent. The Host-sim servo-profile tool prints the trajectories
+of each profile and checks them, with the main loop running as often or as seldom as chosen, and
+reports the RAM used by a TurnoutServo.
 
 */
 
@@ -72,13 +93,22 @@ is based on the high or low rate duration and the number of steps.
 	#include "WProgram.h"
 #endif
 
-#include <Servo.h>
+#include "SharedServo.h"
 
-class TurnoutServo : public Servo
+class TurnoutServo : public SharedServo
 {
  public:
     typedef void (*ServoEventHandler)();
 
+	// motion profiles, the shape of the move from one extent to the other
+	enum MotionProfile : byte {
+		LINEAR,
+		TRAPEZOID,
+		SCURVE };
+
+	// the fraction of the distance covered at a fraction of the time, both with 1.0 = 0x8000
+	static uint16_t Ease(uint16_t T, byte Profile);
+
     TurnoutServo(byte ServoPin);
 	void Initialize(byte ExtentLow, byte ExtentHigh, bool Position);
 	void Initialize(byte ExtentLow, byte ExtentHigh, int DurationLow, int DurationHigh, bool Position);
@@ -91,6 +121,7 @@ class TurnoutServo : public Servo
 	void StartPWM();
 	void StopPWM();
 	void SetDuration(bool Position, int Duration);
+	void SetProfile(byte Profile, byte Steps = 30);
 	void SetServoMoveDoneHandler(ServoEventHandler Handler);
 
 private:
@@ -99,21 +130,23 @@ private:
 		READY,      // pwm is on, servo is ready to move
 		MOVING };   // servo motion is in progress
 
-    void ComputeSteps();
 	void MoveTo(bool Position, bool Rate);
+	uint16_t StepMicros(byte Step);
+	uint16_t StepFrame(byte Step);
+	uint16_t ExtentMicros(byte Angle);
 
 	byte servoPin;                      // pin the servo pwm signal should be sent to
-	const byte numSteps = 30;           // number of discrete increments of servo motion
-	byte steps[2][30];	                // step sequence going each direction
+	byte numSteps = 30;                 // number of discrete increments of servo motion
+	byte profile = LINEAR;              // shape of the motion
 	byte currentStep = 0;               // counter to track steps in update loop
+	uint16_t startMicros = 0;           // pulse width at the start of the move
+	uint16_t moveFrames = 0;            // servo frames the move takes
 	byte extent[2] = { 90, 90 };        // servo angle at LOW and HIGH positions
 	int duration[2] = { 2500, 0 };      // duration (ms) of movement at low and high rates (0 = no delay)
-    int interval[2] = { 0, 0 };			// time interval between each step
 
     bool positionSet = 0;               // the commanded position for the servo
 	bool rateSet = 0;                   // the commanded rate of the servo
 	ServoState servoState = OFF;        // the current state of the servo
-	unsigned long lastUpdate = 0;       // time of the last servo write
 
 	ServoEventHandler servoMoveDoneHandler = 0;     // pointer to handler for when servo motion is complete
 };
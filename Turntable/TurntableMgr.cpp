@@ -59,7 +59,7 @@ void TurntableMgr::Initialize()
 
 	#if defined(WITH_DCC)
 	// Configure and initialize the DCC packet processor
-	byte addr = (configCVs.getCV(CV_AddressMSB) << 8) + configCVs.getCV(CV_AddressLSB);
+	uint16_t addr = (configCVs.getCV(CV_AddressMSB) << 8) + configCVs.getCV(CV_AddressLSB);
 	dcc.SetAddress(addr);
 
 	// configure dcc event handlers
@@ -737,7 +737,7 @@ void TurntableMgr::DCCPomHandler(unsigned int Addr, byte instType, unsigned int
 
 	#if defined(WITH_DCC)
 	// update dcc address
-	byte addr = (configCVs.getCV(CV_AddressMSB) << 8) + configCVs.getCV(CV_AddressLSB);
+	uint16_t addr = (configCVs.getCV(CV_AddressMSB) << 8) + configCVs.getCV(CV_AddressLSB);
 	dcc.SetAddress(addr);
 	#endif
 
@@ -1,7 +1,7 @@
 
 #include "CVManager.h"
 
-CVManager::CVManager(byte num) : numCVs(num), cvStatic(new CVstatic[num]), cv(new CV[num])
+CVManager::CVManager(byte num) : numCVs(num), cvStatic(new CVstatic[num]), cv(new CV[num]), dirty(new byte[(num + 7) / 8]()), elsewhere(new byte[(num + 7) / 8]())
 {
 }
 
@@ -9,12 +9,62 @@ CVManager::~CVManager()
 {
 	delete[] cvStatic;
 	delete[] cv;
+	delete[] dirty;
+	delete[] elsewhere;
 }
 
 void CVManager::resetCVs()
 {
+	bool changed = false;
 	for (byte i = 0; i < numCVs; i++)
+	{
+		if (isStored(i) && cv[i].cvValue != cvStatic[i].cvDefault)
+		{
+			markDirty(i);
+			changed = true;
+		}
 		cv[i].cvValue = cvStatic[i].cvDefault;
+	}
+	if (changed) noteChange();
+}
+
+// reset any CVs outside their valid range to defaults, returns the number of stored cvs that were reset
+byte CVManager::validateCVs()
+{
+	byte count = 0;
+	for (byte i = 0; i < numCVs; i++)
+	{
+		if (cvStatic[i].is16bit)
+		{
+			const uint16_t value = (cv[i].cvValue << 8) + cv[i + 1].cvValue;
+			const uint16_t min = (cvStatic[i].rangeMin << 8) + cvStatic[i + 1].rangeMin;
+			const uint16_t max = (cvStatic[i].rangeMax << 8) + cvStatic[i + 1].rangeMax;
+			if (value < min || value > max)
+			{
+				cv[i].cvValue = cvStatic[i].cvDefault;
+				cv[i + 1].cvValue = cvStatic[i + 1].cvDefault;
+				if (isStored(i))
+				{
+					markDirty(i);
+					markDirty(i + 1);
+					count++;
+				}
+			}
+			i++;    // skip the low byte
+		}
+		else if (cv[i].cvValue < cvStatic[i].rangeMin || cv[i].cvValue > cvStatic[i].rangeMax)
+		{
+			cv[i].cvValue = cvStatic[i].cvDefault;
+			if (isStored(i))
+			{
+				markDirty(i);
+				count++;
+			}
+		}
+	}
+
+	if (count) noteChange();
+	return count;
 }
 
 int16_t CVManager::getCVindex(byte cvNum)
@@ -73,6 +123,7 @@ uint16_t CVManager::getCV(byte cvNum)
 		return cv[cvIndex].cvValue;
 }
 
+// set a cv, holding the change for the next commit unless the cv is stored elsewhere
 bool CVManager::setCV(byte cvNum, uint16_t value)
 {
 	const int16_t cvIndex = getCVindex(cvNum);
@@ -86,6 +137,12 @@ bool CVManager::setCV(byte cvNum, uint16_t value)
 		if (value < min || value > max) return false;
 
 		// value supplied is ok, so store it
+		if (isStored(cvIndex) && (cv[cvIndex].cvValue != highByte(value) || cv[cvIndex + 1].cvValue != lowByte(value)))
+		{
+			markDirty(cvIndex);
+			markDirty(cvIndex + 1);
+			noteChange();
+		}
 		cv[cvIndex].cvValue = highByte(value);
 		cv[cvIndex + 1].cvValue = lowByte(value);
 	}
@@ -95,9 +152,86 @@ bool CVManager::setCV(byte cvNum, uint16_t value)
 		if (value < cvStatic[cvIndex].rangeMin || value > cvStatic[cvIndex].rangeMax) return false;
 
 		// value supplied is ok, so store it
+		if (isStored(cvIndex) && cv[cvIndex].cvValue != value)
+		{
+			markDirty(cvIndex);
+			noteChange();
+		}
 		cv[cvIndex].cvValue = value;
 	}
 
 	return true;
 }
 
+// keep a cv out of the write-back. it is set and read as any other, but never passed to the commit handler.
+void CVManager::storeElsewhere(byte cvNum)
+{
+	const int16_t cvIndex = getCVindex(cvNum);
+	if (cvIndex == -1) return;
+
+	elsewhere[cvIndex / 8] |= 1 << (cvIndex % 8);
+	if (cvStatic[cvIndex].is16bit) elsewhere[(cvIndex + 1) / 8] |= 1 << ((cvIndex + 1) % 8);
+}
+
+void CVManager::setCommitHandler(CommitHandler handler, unsigned long period)
+{
+	commitHandler = handler;
+	quietPeriod = period;
+}
+
+// commit the changes once they have stopped coming, so a run of changes shares one commit
+void CVManager::update(unsigned long currentMillis)
+{
+	if (pending && (currentMillis - lastChange >= quietPeriod))
+		flush();
+}
+
+// pass the changed bytes (or all of them) to the commit handler, returns the number passed
+byte CVManager::flush(bool all)
+{
+	if (!commitHandler) return 0;
+
+	byte count = 0;
+	for (byte i = 0; i < numCVs; i++)
+	{
+		if (!isStored(i)) continue;
+		if (all || (dirty[i / 8] & (1 << (i % 8))))
+		{
+			commitHandler(i, cv[i].cvValue);
+			count++;
+		}
+	}
+
+	for (byte i = 0; i < (numCVs + 7) / 8; i++)
+		dirty[i] = 0;
+	pending = false;
+
+	if (count)
+	{
+		statistics.commits++;
+		statistics.bytesCommitted += count;
+	}
+	return count;
+}
+
+bool CVManager::isDirty() { return pending; }
+
+void CVManager::markDirty(byte index)
+{
+	dirty[index / 8] |= 1 << (index % 8);
+}
+
+bool CVManager::isStored(byte index)
+{
+	return !(elsewhere[index / 8] & (1 << (index % 8)));
+}
+
+// count a change, and restart the quiet period. a change made while another is waiting shares its commit.
+void CVManager::noteChange()
+{
+	statistics.changes++;
+	if (pending) statistics.commitsAvoided++;
+	pending = true;
+	lastChange = millis();
+}
+
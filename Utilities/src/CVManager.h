@@ -16,12 +16,32 @@ public:
 	~CVManager();
 
 	void resetCVs();
+	byte validateCVs();
 	int16_t getCVindex(byte cvNum);
 
 	byte initCV(byte index, byte cvNum, byte CVDefault, byte rangeMin = 0, byte rangeMax = 255, bool softReset = true);
 	byte initCV16(byte index, byte cvNum, uint16_t CVDefault, uint16_t rangeMin = 0, uint16_t rangeMax = 65535, bool softReset = true);
 	uint16_t getCV(byte cvNum);
 	bool setCV(byte cvNum, uint16_t value);
+	void storeElsewhere(byte cvNum);    // keep a cv out of the write-back, for one its owner stores itself
+
+	// write-back of changed cvs. a change is held in RAM, and the changed bytes are passed to the
+	// commit handler once no cv has changed for the quiet period, or when flush is called.
+	typedef void (*CommitHandler)(byte index, byte value);
+	void setCommitHandler(CommitHandler handler, unsigned long quietPeriod);
+	void update(unsigned long currentMillis);
+	byte flush(bool all = false);      // commit the changed cvs now (or all of them), returns the bytes written
+	bool isDirty();
+
+	struct Statistics
+	{
+		uint16_t changes = 0;          // cv changes held for a commit
+		uint16_t commitsAvoided = 0;   // changes that shared the commit of an earlier one
+		uint16_t commits = 0;          // commits of one or more bytes
+		uint16_t bytesCommitted = 0;   // bytes passed to the commit handler
+	};
+	const Statistics &getStatistics() { return statistics; }
+	void resetStatistics() { statistics = Statistics(); }
 	
 	struct CVstatic
 	{
@@ -44,7 +64,17 @@ public:
 	CV* cv;
 
 private:
+	void markDirty(byte index);
+	bool isStored(byte index);
+	void noteChange();
 
+	byte* dirty;                       // a bit for each cv index changed since the last commit
+	byte* elsewhere;                   // a bit for each cv index left out of the write-back
+	bool pending = false;              // some are dirty
+	unsigned long lastChange = 0;      // millis of the latest change
+	unsigned long quietPeriod = 0;
+	CommitHandler commitHandler = 0;
+	Statistics statistics;
 };
 
 #endif
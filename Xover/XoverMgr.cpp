@@ -36,14 +36,6 @@ XoverMgr::XoverMgr()
 	osAB.SetButtonPressHandler(WrapperOSAB);
 	osCD.SetButtonPressHandler(WrapperOSCD);
 
-	// configure dcc event handlers
-	dcc.SetBasicAccessoryDecoderPacketHandler(WrapperDCCAccPacket);
-	dcc.SetExtendedAccessoryDecoderPacketHandler(WrapperDCCExtPacket);
-	dcc.SetBasicAccessoryPomPacketHandler(WrapperDCCAccPomPacket);
-	dcc.SetBitstreamMaxErrorHandler(WrapperMaxBitErrors);
-	dcc.SetPacketMaxErrorHandler(WrapperMaxPacketErrors);
-	dcc.SetDecodingErrorHandler(WrapperDCCDecodingError);
-
 	// configure timer event handlers
 	errorTimer.SetTimerHandler(WrapperErrorTimer);
 	resetTimer.SetTimerHandler(WrapperResetTimer);
@@ -78,17 +70,31 @@ void XoverMgr::Initialize()
 // update sensors and outputs
 void XoverMgr::Update()
 {
+	PROFILE_SCOPE(profileUpdate);
+
+	// process any DCC interrupts that have been timestamped, passing packets to our handler
+	dcc.ProcessTimeStamps(dccHandler);
+
 	// do all the updates that TurnoutBase handles
 	TurnoutBase::Update();
 
 	// then update our sensors and servo
 	const unsigned long currentMillis = millis();
+	PROFILE_START(profileSensors);
 	osAB.Update(currentMillis);
 	osCD.Update(currentMillis);
+	PROFILE_STOP(profileSensors);
 
+	PROFILE_START(profileServos);
 	if (servosActive)
+	{
+		if (currentServo < numServos)
+			StartServos(currentMillis);
+
 		for (byte i = 0; i < numServos; i++)
 			servo[i].Update(currentMillis);
+	}
+	PROFILE_STOP(profileServos);
 }
 
 
@@ -99,15 +105,18 @@ void XoverMgr::InitMain()
 	TurnoutBase::InitMain();
 
 	// servo setup - get extents, rates, and last position from cv's
-	const int lowSpeed = cv.getCV(CV_servoLowSpeed) * 100;
-	const int highSpeed = cv.getCV(CV_servoHighSpeed) * 100;
-	servo[0].Initialize(cv.getCV(CV_servo1MinTravel), cv.getCV(CV_servo1MaxTravel), lowSpeed, highSpeed, servoState[0][position]);
-	servo[1].Initialize(cv.getCV(CV_servo2MinTravel), cv.getCV(CV_servo2MaxTravel), lowSpeed, highSpeed, servoState[1][position]);
-	servo[2].Initialize(cv.getCV(CV_servo3MinTravel), cv.getCV(CV_servo3MaxTravel), lowSpeed, highSpeed, servoState[2][position]);
-	servo[3].Initialize(cv.getCV(CV_servo4MinTravel), cv.getCV(CV_servo4MaxTravel), lowSpeed, highSpeed, servoState[3][position]);
+	servo[0].Initialize(cv.getCV(CV_servo1MinTravel), cv.getCV(CV_servo1MaxTravel),
+		cv.getCV(CV_servoLowSpeed) * 100, cv.getCV(CV_servoHighSpeed) * 100, servoState[0][position]);
+	servo[1].Initialize(cv.getCV(CV_servo2MinTravel), cv.getCV(CV_servo2MaxTravel),
+		cv.getCV(CV_servo2LowSpeed) * 100, cv.getCV(CV_servo2HighSpeed) * 100, servoState[1][position]);
+	servo[2].Initialize(cv.getCV(CV_servo3MinTravel), cv.getCV(CV_servo3MaxTravel),
+		cv.getCV(CV_servo3LowSpeed) * 100, cv.getCV(CV_servo3HighSpeed) * 100, servoState[2][position]);
+	servo[3].Initialize(cv.getCV(CV_servo4MinTravel), cv.getCV(CV_servo4MaxTravel),
+		cv.getCV(CV_servo4LowSpeed) * 100, cv.getCV(CV_servo4HighSpeed) * 100, servoState[3][position]);
 
 	// set led and relays, and begin bitstream capture
 	EndServoMove();
+	dcc.ResumeBitstream();
 
 #ifdef _DEBUG
 	Serial.println("TurnoutMgr init done.");
@@ -118,30 +127,58 @@ void XoverMgr::InitMain()
 // set the turnout to a new position
 void XoverMgr::BeginServoMove()
 {
-	// store new position to cv
-	cv.setCV(CV_turnoutPosition, position);
-	SaveConfig();
+	// store new position
+	SavePosition();
 
 	// set the led to indicate servo is in motion
 	led.SetLED((position == STRAIGHT) ? RgbLed::GREEN : RgbLed::RED, RgbLed::FLASH);
 
-	// stop the bitstream capture
-	dcc.SuspendBitstream();
-
 	// turn off the relays
 	for (byte i = 0; i < numServos; i++)
 		relay[i].SetPin(LOW);
 
-	// start pwm for current positions of all servos
+	// start pwm for current positions of all servos, with the motion profile from the cv
 	for (byte i = 0; i < numServos; i++)
+	{
+		servo[i].SetProfile(cv.getCV(CV_servoProfile));
 		servo[i].StartPWM();
+	}
 
 	// turn on servo power
 	servoPower.SetPin(HIGH);
 
-	// set the servo index to the first servo and start moving the servos in sequence
+	// start the servos moving together, each starting a stagger interval after the one before
 	servosActive = true;
 	currentServo = 0;
+	servoStagger = cv.getCV(CV_servoStagger) * 10;
+	StartServos(millis());
+}
+
+
+// start each servo whose turn has come. the servos all move at once, but their starts are spread
+// by the stagger interval so that their start-up currents don't add up on the servo supply.
+void XoverMgr::StartServos(unsigned long CurrentMillis)
+{
+	while (currentServo < numServos)
+	{
+		if (currentServo > 0 && CurrentMillis - servoStartMillis < servoStagger)
+			return;
+
+#ifdef _DEBUG
+		Serial.print("Setting servo ");
+		Serial.print(currentServo, DEC);
+		Serial.print(" to ");
+		Serial.print(servoState[currentServo][position], DEC);
+		Serial.print(" at rate ");
+		Serial.println(servoRate, DEC);
+#endif
+
+		servo[currentServo].Set(servoState[currentServo][position], servoRate);
+		servoStartMillis = CurrentMillis;
+		currentServo++;
+	}
+
+	// all started, check if they are done (a servo already in position doesn't move)
 	ServoMoveDoneHandler();
 }
 
@@ -149,6 +186,13 @@ void XoverMgr::BeginServoMove()
 // resume normal operation after servo motion is complete
 void XoverMgr::EndServoMove()
 {
+	// carry out a move requested during this one straight away, with the servos still powered
+	if (TakePendingMove())
+	{
+		BeginServoMove();
+		return;
+	}
+
 	// set the led solid for the current position
 	led.SetLED((position == STRAIGHT) ? RgbLed::GREEN : RgbLed::RED, RgbLed::ON);
 
@@ -163,9 +207,8 @@ void XoverMgr::EndServoMove()
 	for (byte i = 0; i < numServos; i++)
 		relay[i].SetPin(relayState[i][position]);
 
-	// resume the bitstream capture
+	// the move is done, the bitstream capture carried on throughout
 	servosActive = false;
-	dcc.ResumeBitstream();
 }
 
 
@@ -189,28 +232,18 @@ void XoverMgr::ResetTimerHandler()
 }
 
 
-// do things after the servo finishes moving to its new position
+// do things after a servo finishes moving to its new position, once all of them have
 void XoverMgr::ServoMoveDoneHandler()
 {
 	if (currentServo < numServos)
-	{
-#ifdef _DEBUG
-		Serial.print("Setting servo ");
-		Serial.print(currentServo, DEC);
-		Serial.print(" to ");
-		Serial.print(servoState[currentServo][position], DEC);
-		Serial.print(" at rate ");
-		Serial.println(servoRate, DEC);
-#endif
+		return;
 
-		servo[currentServo].Set(servoState[currentServo][position], servoRate);
-		currentServo++;
-	}
-	else
-	{
-		const int servoPowerOffDelay = 500;    // ms
-		servoTimer.StartTimer(servoPowerOffDelay);
-	}
+	for (byte i = 0; i < numServos; i++)
+		if (servo[i].IsMoving())
+			return;
+
+	const int servoPowerOffDelay = 500;    // ms
+	servoTimer.StartTimer(servoPowerOffDelay);
 }
 
 
@@ -223,8 +256,10 @@ void XoverMgr::ButtonEventHandler(bool ButtonState)
 		// proceed only if both occupancy sensors are inactive (i.e., sensors override button press)
 		if (osAB.SwitchState() == HIGH && osCD.SwitchState() == HIGH)
 		{
-			// toggle from current position and set new position
-			position = (State)!position;
+			// toggle from the position we are going to, and set new position
+			const State newPos = (State)!TargetPosition();
+			if (HoldMove(newPos, LOW)) return;
+			position = newPos;
 			servoRate = LOW;
 			BeginServoMove();
 		}
@@ -256,8 +291,8 @@ void XoverMgr::DCCAccCommandHandler(unsigned int Addr, unsigned int Direction)
 	State dccState = (Direction == 0) ? CURVED : STRAIGHT;
 	if (dccCommandSwap) dccState = (State)!dccState; // swap the interpretation of dcc command if needed
 
-	// if we are already in the desired position, just exit
-	if (dccState == position) return;
+	// if we are already in (or moving to) the desired position, just exit
+	if (dccState == TargetPosition()) return;
 
 #ifdef _DEBUG
 	Serial.print("Received dcc command to position ");
@@ -267,7 +302,8 @@ void XoverMgr::DCCAccCommandHandler(unsigned int Addr, unsigned int Direction)
 	// proceed only if both occupancy sensors are inactive (i.e., sensors override dcc command)
 	if (osAB.SwitchState() == HIGH && osCD.SwitchState() == HIGH)
 	{
-		// set switch state based on dcc command
+		// set switch state based on dcc command, or hold it until the current move is done
+		if (HoldMove(dccState, LOW)) return;
 		position = dccState;
 		servoRate = LOW;
 		BeginServoMove();
@@ -300,12 +336,17 @@ void XoverMgr::DCCPomHandler(unsigned int Addr, byte instType, unsigned int CV,
 	if (CV == CV_servo4MinTravel) servo[3].SetExtent(LOW, cv.getCV(CV_servo4MinTravel));
 	if (CV == CV_servo4MaxTravel) servo[3].SetExtent(HIGH, cv.getCV(CV_servo4MaxTravel));
 	
-	if (CV == CV_servoLowSpeed)
-		for (byte i = 0; i < numServos; i++)
-			servo[i].SetDuration(LOW, cv.getCV(CV_servoLowSpeed) * 100);
-	if (CV == CV_servoHighSpeed)
-		for (byte i = 0; i < numServos; i++)
-			servo[i].SetDuration(HIGH, cv.getCV(CV_servoHighSpeed) * 100);
+	if (CV == CV_servoLowSpeed) servo[0].SetDuration(LOW, cv.getCV(CV_servoLowSpeed) * 100);
+	if (CV == CV_servoHighSpeed) servo[0].SetDuration(HIGH, cv.getCV(CV_servoHighSpeed) * 100);
+
+	if (CV == CV_servo2LowSpeed) servo[1].SetDuration(LOW, cv.getCV(CV_servo2LowSpeed) * 100);
+	if (CV == CV_servo2HighSpeed) servo[1].SetDuration(HIGH, cv.getCV(CV_servo2HighSpeed) * 100);
+
+	if (CV == CV_servo3LowSpeed) servo[2].SetDuration(LOW, cv.getCV(CV_servo3LowSpeed) * 100);
+	if (CV == CV_servo3HighSpeed) servo[2].SetDuration(HIGH, cv.getCV(CV_servo3HighSpeed) * 100);
+
+	if (CV == CV_servo4LowSpeed) servo[3].SetDuration(LOW, cv.getCV(CV_servo4LowSpeed) * 100);
+	if (CV == CV_servo4HighSpeed) servo[3].SetDuration(HIGH, cv.getCV(CV_servo4HighSpeed) * 100);
 }
 
 
@@ -320,29 +361,6 @@ void XoverMgr::WrapperOSCD(bool ButtonState) { currentInstance->OSCDHandler(Butt
 void XoverMgr::WrapperServoMoveDone() { currentInstance->ServoMoveDoneHandler(); }
 
 
-// ========================================================================================================
-// dcc processor callback wrappers
-
-void XoverMgr::WrapperDCCAccPacket(int boardAddress, int outputAddress, byte activate, byte data)
-{
-	currentInstance->DCCAccCommandHandler(outputAddress, data);
-}
-
-void XoverMgr::WrapperDCCExtPacket(int boardAddress, int outputAddress, byte data)
-{
-	currentInstance->DCCExtCommandHandler(outputAddress, data);
-}
-
-void XoverMgr::WrapperDCCAccPomPacket(int boardAddress, int outputAddress, byte instructionType, int cv, byte data)
-{
-	currentInstance->DCCPomHandler(outputAddress, instructionType, cv, data);
-}
-
-void XoverMgr::WrapperMaxBitErrors(byte errorCode) { currentInstance->TurnoutBase::MaxBitErrorHandler(); }
-void XoverMgr::WrapperMaxPacketErrors(byte errorCode) { currentInstance->TurnoutBase::MaxPacketErrorHandler(); }
-void XoverMgr::WrapperDCCDecodingError(byte errorCode) { currentInstance->TurnoutBase::DCCDecodingError(); }
-
-
 // timer callback wrappers
 void XoverMgr::WrapperResetTimer() { currentInstance->ResetTimerHandler(); }
 void XoverMgr::WrapperErrorTimer() { currentInstance->ErrorTimerHandler(); }